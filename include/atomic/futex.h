@@ -1,7 +1,8 @@
 #ifndef __FMUTEX_H__
 #define __FMUTEX_H__
 #include "atomic/spinlock.h"
-#include "lib/queue.h"
+#include "lib/list.h"
+#include "lib/timer.h"
 #include "common.h"
 
 #define FUTEX_PRIVATE_FLAG 128
@@ -15,6 +16,7 @@
 
 #define FUTEX_LOCK_PI 6
 #define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAKE_BITSET 10
 #define FUTEX_WAIT_REQUEUE_PI 11
 #define FUTEX_WAIT_REQUEUE_PI_PRIVATE (FUTEX_WAIT_REQUEUE_PI | FUTEX_PRIVATE_FLAG)
 
@@ -26,9 +28,50 @@
 #define FLAGS_CLOCKRT 0x02
 #define FUTEX_BITSET_MATCH_ANY 0xffffffff
 
-struct futex {
-    struct spinlock lock; // uncessary, using p->lock is ok
-    struct Queue waiting_queue;
+// FUTEX_WAKE_OP, val3 is op:4 cmp:4 oparg:12 cmparg:12
+#define FUTEX_OP_SET 0  // uaddr2 = oparg
+#define FUTEX_OP_ADD 1  // uaddr2 += oparg
+#define FUTEX_OP_OR 2   // uaddr2 |= oparg
+#define FUTEX_OP_ANDN 3 // uaddr2 &= ~oparg
+#define FUTEX_OP_XOR 4  // uaddr2 ^= oparg
+#define FUTEX_OP_OPARG_SHIFT 8 // oparg is 1 << oparg
+
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+struct mm_struct;
+struct tcb;
+
+/*
+    futexes hash to buckets with a lock each, the number of buckets
+    follows NTCB. a waiter queues a futex_q on its own stack, nothing
+    is allocated for a futex.
+
+    a private futex is keyed by (mm, uaddr). a shared one is keyed the
+    same unless it is in a shared mapping, then by its physical address,
+    so that other processes mapping the page find the same waiters.
+*/
+struct futex_key {
+    uint64 addr;           // uaddr, or the physical address
+    struct mm_struct *mm;  // NULL : keyed by the physical address
+};
+
+struct futex_q {
+    struct list_head list; // in the chain of its bucket, empty once woken
+    struct futex_key key;
+    struct tcb *task;
+    uint32 bitset;
+    struct timer_list timer; // for a timeout
+    int timed_out;
+};
+
+struct futex_hash_bucket {
+    struct spinlock lock;
+    struct list_head chain;
 };
 
 struct robust_list {
@@ -60,11 +103,9 @@ struct robust_list_head {
     struct robust_list *list_op_pending;
 };
 
-struct futex *get_futex(uint64 uaddr, int assert);
-void futex_init(struct futex *fp, char *name);
-int futex_wait(uint64 uaddr, uint val, struct timespec *ts);
+void futex_init(void);
 int futex_wakeup(uint64 uaddr, int nr_wake);
-int futex_requeue(uint64 uaddr1, int nr_wake, uint64 uaddr2, int nr_requeue);
+void futex_exit(struct tcb *t);
 
 int do_futex(uint64 uaddr, int op, uint32 val, struct timespec *ts, uint64 uaddr2, uint32 val2, uint32 val3);
 
@@ -0,0 +1,33 @@
+#ifndef __WAIT_QUEUE_H__
+#define __WAIT_QUEUE_H__
+
+#include "atomic/spinlock.h"
+#include "lib/list.h"
+
+/*
+    wait queue of an object (pipe, socket, console, epoll ...)
+    a waiter hooks an entry on the queue, wake_up calls the func of every entry,
+    so that one waiter can sleep on many queues at the same time (poll, select, epoll)
+*/
+
+struct wait_queue_entry;
+typedef void (*wait_queue_func_t)(struct wait_queue_entry *wait);
+
+struct wait_queue_entry {
+    struct list_head list;
+    wait_queue_func_t func; // called by wake_up, holding the lock of queue
+    void *private;
+};
+
+struct wait_queue_head {
+    struct spinlock lock;
+    struct list_head head;
+};
+
+void init_waitqueue_head(struct wait_queue_head *wq, char *name);
+void init_waitqueue_entry(struct wait_queue_entry *wait, wait_queue_func_t func, void *private);
+void add_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait);
+void remove_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait);
+void wake_up(struct wait_queue_head *wq);
+
+#endif // __WAIT_QUEUE_H__
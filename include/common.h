@@ -20,7 +20,8 @@ typedef enum { FD_NONE,
                FD_PIPE,
                FD_INODE,
                FD_DEVICE,
-               FD_SOCKET } type_t;
+               FD_SOCKET,
+               FD_EPOLL } type_t;
 
 typedef unsigned int uint;
 typedef unsigned short ushort;
@@ -69,9 +70,12 @@ typedef uint64 pde_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
 // remember return to fat32_file.h
+struct file;
+struct poll_table;
 struct devsw {
     int (*read)(int, uint64, int);
     int (*write)(int, uint64, int);
+    uint (*poll)(struct file *, struct poll_table *);
 };
 extern struct devsw devsw[];
 
@@ -4,6 +4,7 @@
 struct buffer_head;
 struct bio;
 struct bio_vec;
+struct request;
 
 // #define BLOCK_SEL BLOCK_OLD
 #define BLOCK_SEL BLOCK_NEW
@@ -12,6 +13,11 @@ struct bio_vec;
 
 // b is a pointer to struct bio_vec
 void disk_rw(void *b, int write, int type);
+// queue a request and return without waiting, -1 if the device is full,
+// blk_end_request is called when it is done
+int disk_submit(struct request *rq);
+// start the requests queued by disk_submit
+void disk_kick();
 void disk_intr();
 void disk_init();
 void dma_intr(int irq);
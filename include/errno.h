@@ -42,3 +42,7 @@
 #define EPIPE 32  /* Broken pipe */
 #define EDOM 33   /* Math argument out of domain of func */
 #define ERANGE 34 /* Math result not representable */
+
+#define ENOSYS 38 /* Invalid system call number */
+
+#define ETIMEDOUT 110 /* Connection timed out */
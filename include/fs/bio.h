@@ -11,13 +11,22 @@
 #define DISK_WRITE 1 // write disk
 #define DISK_READ 0  // read disk
 
+/* configuration option */
+#define BCACHE_NBUCKET 127    // hash buckets of buffer cache
+#define BCACHE_MEM_SHIFT 6    // 1/64 of free memory at boot is used as buffer cache
+#define BCACHE_MAX_NBUF 4096  // at least NBUF buffers
+#define BCACHE_DIRTY_RATIO 4  // wake up pdflush if 1/4 of buffers are dirty
+// #define BCACHE_WRITE_THROUGH // write dirty buffer in brelse
+
 // we reserve buffer_head of xv6
 struct buffer_head {
     struct semaphore sem_lock;
     struct semaphore sem_disk_done;
     uint blockno;
     atomic_t refcnt;
-    list_head_t lru; // LRU cache list
+    list_head_t hash; // hash list of bucket, or free list
+    int bucket;       // index of bucket, -1 : unhashed
+    int referenced;   // for clock eviction
     uchar data[BSIZE];
     int valid; // has data been read from disk?
     int dirty; // dirty
@@ -25,11 +34,23 @@ struct buffer_head {
     uint dev;
 };
 
+struct bio;
+struct bio_vec;
+typedef void (*bio_end_io_t)(struct bio *);
+typedef void (*bio_vec_end_io_t)(struct bio_vec *);
+
 // similar to bio of Linux
 struct bio {
     uint bi_bdev;                // device no
     uint64 bi_rw;                // read or write
     struct list_head list_entry; // entry
+
+    // completion
+    atomic_t bi_remaining;    // bio_vec in flight
+    int bi_free;              // free bio_vec when done
+    struct semaphore bi_done; // for synchronous submit_bio
+    bio_end_io_t bi_end_io;   // for asynchronous submit_bio, called in interrupt context
+    void *bi_private;
 };
 
 // different from Linux
@@ -40,20 +61,29 @@ struct bio_vec {
     uint block_len;
     uchar *data;
     int disk;
+    struct list_head rq_list;   // in request->vecs
+    bio_vec_end_io_t bi_end_io; // NULL : signal sem_disk_done
+    void *bi_private;
 };
 // start : 2
 // len : 4
 // -> 2 3 4 5 (a series of blocks)
 
+extern struct kmem_cache *bio_vec_cachep;
+
 // xv6 origin :  buffer_head
 void binit(void);
 struct buffer_head *bread(uint, uint);
 void brelse(struct buffer_head *);
 void bwrite(struct buffer_head *);
+void bflush(int wait);
+void bsync(void);
 // bio
 void disk_rw_bio(struct buffer_head *b, int rw);
+void bio_init(struct bio *bio, uint dev, int rw);
 void init_bio(struct bio *bio_p, struct bio_vec *vec_p, struct buffer_head *b, int rw);
 void submit_bio(struct bio *bio, int free);
+void submit_bio_async(struct bio *bio, int free, bio_end_io_t end_io, void *private);
 void bio_print(struct bio *bio);
 
 #endif // __BIO_H__
\ No newline at end of file
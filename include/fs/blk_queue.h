@@ -0,0 +1,91 @@
+#ifndef __BLK_QUEUE_H__
+#define __BLK_QUEUE_H__
+
+#include "common.h"
+#include "lib/list.h"
+#include "atomic/spinlock.h"
+
+struct bio_vec;
+
+/*
+    block request queue, between submit_bio and the disk driver
+
+    submit_bio --> merge into a queued request (front/back) or make a new one
+                        |
+                        v
+               +----------------+   elevator   +----------+
+               | request_queue  | -----------> |   disk   | --> blk_end_request
+               |  sort_list     |  (dispatch   |  driver  |     (interrupt)
+               |  fifo_list     |   <= depth)  +----------+
+               +----------------+
+
+    a request covers contiguous blocks, its bio_vecs are linked by
+    vec->rq_list in block order, the driver maps every bio_vec to one
+    data descriptor (scatter-gather)
+*/
+
+/* configuration option */
+#define BLK_MAX_SEGMENTS 14  // bio_vec in one request, +2 descriptors for header and status
+#define BLK_MAX_BLOCKS 1024  // blocks in one request
+#define BLK_QUEUE_DEPTH 8    // requests in flight, BLK_QUEUE_DEPTH * (BLK_MAX_SEGMENTS + 2) <= NUM of virtio
+#define BLK_PLUG_MAX 32      // queued requests before unplugging by force
+#define BLK_READ_EXPIRE 50   // ms, for deadline elevator
+#define BLK_WRITE_EXPIRE 500 // ms, for deadline elevator
+
+// elevator
+#define ELEVATOR_NOOP 0     // arrival order
+#define ELEVATOR_SORT 1     // one-way sorted (C-LOOK)
+#define ELEVATOR_DEADLINE 2 // sorted, but serve the expired request first
+#ifndef ELEVATOR_DEFAULT
+#define ELEVATOR_DEFAULT ELEVATOR_DEADLINE // make ELEVATOR=n picks another
+#endif
+#if ELEVATOR_DEFAULT < ELEVATOR_NOOP || ELEVATOR_DEFAULT > ELEVATOR_DEADLINE
+#error "unknown ELEVATOR_DEFAULT"
+#endif
+
+struct request_queue;
+
+struct request {
+    struct request_queue *q; // NULL : not from a queue
+    struct list_head sort_list; // sorted by blockno_start (fifo order for noop)
+    struct list_head fifo_list; // arrival order
+    struct list_head vecs;      // bio_vec of this request
+    uint blockno_start;
+    uint block_len;
+    int nr_vecs;
+    int rw;
+    uint64 deadline; // ms
+};
+
+struct request_queue {
+    struct spinlock lock;
+    struct list_head sort_list;
+    struct list_head fifo_list;
+    int elevator;
+    int nr_queued;   // requests in the elevator
+    int in_flight;   // requests owned by disk driver
+    int plugged;     // nesting count of blk_start_plug
+    int dispatching; // someone is dispatching
+    int rerun;       // run again before dispatching ends
+    uint head_pos;   // block after the last dispatched request
+    uint64 nr_merges;
+};
+
+// on stack, between blk_start_plug and blk_finish_plug
+struct blk_plug {
+    struct request_queue *q;
+};
+
+void blk_queue_init(void);
+struct request_queue *blk_get_queue(uint dev);
+void blk_queue_bio_vecs(struct request_queue *q, struct list_head *vecs, int rw);
+void blk_run_queue(struct request_queue *q, int force);
+void blk_start_plug(struct blk_plug *plug, uint dev);
+void blk_finish_plug(struct blk_plug *plug);
+
+// used by disk driver
+void blk_rq_init(struct request *rq, int rw);
+void blk_rq_add_vec(struct request *rq, struct bio_vec *vec);
+void blk_end_request(struct request *rq);
+
+#endif // __BLK_QUEUE_H__
@@ -0,0 +1,90 @@
+#ifndef __EVENTPOLL_H__
+#define __EVENTPOLL_H__
+
+#include "common.h"
+#include "lib/list.h"
+#include "atomic/spinlock.h"
+#include "atomic/semaphore.h"
+#include "atomic/wait_queue.h"
+
+struct file;
+struct poll_table;
+
+/*
+    epoll, built on the wait queues of poll
+
+    epoll_ctl(ADD) polls the target file once with ep_ptable_queue_proc,
+    which hooks ep_poll_callback on every wait queue of the file. when the
+    file changes, the callback puts the epitem on rdllist and wakes the
+    sleepers of epoll_wait, so epoll_wait never scans the whole set.
+
+    locks : epmutex (global) --> ep->mtx --> whead lock --> ep->lock
+*/
+
+/* Valid opcodes to issue to sys_epoll_ctl() */
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+/* Epoll event masks, same as POLL* */
+#define EPOLLIN 0x00000001
+#define EPOLLPRI 0x00000002
+#define EPOLLOUT 0x00000004
+#define EPOLLERR 0x00000008
+#define EPOLLHUP 0x00000010
+#define EPOLLRDNORM 0x00000040
+#define EPOLLWRNORM 0x00000100
+#define EPOLLONESHOT (1U << 30)
+#define EPOLLET (1U << 31)
+
+#define EP_PRIVATE_BITS (EPOLLONESHOT | EPOLLET)
+
+#define EPOLL_CLOEXEC 02000000
+
+#define EP_MAX_EVENTS (PGSIZE / sizeof(struct epoll_event))
+// wait queues of one file, pipe/socket/console use only one
+#define EP_MAX_WAIT 2
+
+struct epoll_event {
+    uint32 events;
+    uint64 data;
+};
+
+struct eventpoll;
+struct epitem;
+
+// hook of an epitem on a wait queue of the target file
+struct eppoll_entry {
+    struct wait_queue_entry wait;
+    struct wait_queue_head *whead;
+    struct epitem *epi;
+};
+
+struct epitem {
+    struct list_head node;    // ep->items
+    struct list_head rdllink; // ep->rdllist, holding ep->lock
+    struct list_head fdlink;  // file->f_ep_links, holding epmutex
+    int ready;                // on rdllist (or being sent)
+    int fd;
+    struct file *file;
+    struct epoll_event event;
+    struct eventpoll *ep;
+    int nwait;
+    struct eppoll_entry pwqs[EP_MAX_WAIT];
+};
+
+struct eventpoll {
+    struct spinlock lock;           // protect rdllist
+    struct semaphore mtx;           // serialize epoll_ctl and the sending of events
+    struct list_head items;         // all epitem
+    struct list_head rdllist;       // ready epitem
+    struct wait_queue_head wq;      // sleepers of epoll_wait
+    struct wait_queue_head poll_wq; // pollers of the epoll file itself
+};
+
+uint ep_eventpoll_poll(struct eventpoll *ep, struct file *f, struct poll_table *pt);
+void ep_free(struct eventpoll *ep);
+void eventpoll_release(struct file *file);
+void eventpoll_init(void);
+
+#endif // __EVENTPOLL_H__
@@ -278,9 +278,9 @@ extern struct _superblock fat32_sb;
 // for bit map, starts from 0
 #define BIT_INDEX(pos, unit) (pos / unit)
 #define BIT_OFFSET(pos, unit) (pos % unit)
-#define SET_BIT(bitmap, pos) (bitmap |= (1 << pos))
-#define CLEAR_BIT(bitmap, pos) (bitmap &= ~(1 << pos))
-#define TEST_BIT(bitmap, pos) (bitmap & (1 << pos))
+#define SET_BIT(bitmap, pos) (bitmap |= (1UL << pos))
+#define CLEAR_BIT(bitmap, pos) (bitmap &= ~(1UL << pos))
+#define TEST_BIT(bitmap, pos) (bitmap & (1UL << pos))
 
 
 // FAT32 Boot Record
@@ -441,11 +441,12 @@ int fat32_boot_sector_parser(struct _superblock *, fat_bpb_t *);
 // 3. fsinfo parser
 int fat32_fsinfo_parser(struct _superblock *, fsinfo_t *);
 
-// 4. fat table -> bit map
+// 4. fat table -> bit map, chunks of FAT table are read on demand
 void fat32_fat_bitmap_init(int dev, struct _superblock *sb);
 
-// 5. alloc a valid cluster given bit map
+// 5. alloc a valid cluster given bit map, may sleep
 FAT_entry_t fat32_bitmap_alloc(struct _superblock *sb, FAT_entry_t hint);
+FAT_entry_t fat32_bitmap_alloc_extent(struct _superblock *sb, FAT_entry_t hint, uint want, uint *len);
 
 // 6. set/clear bit map given cluster number
 void fat32_bitmap_op(struct _superblock *sb, FAT_entry_t cluster, int set);
@@ -456,6 +457,6 @@ void fat32_fat_cache_set(FAT_entry_t cluster, FAT_entry_t value);
 // 8. get fat table entry given cluster number using fat table in memory
 FAT_entry_t fat32_fat_cache_get(FAT_entry_t cluster);
 
-// 9. writeback FATtable
+// 9. writeback dirty sectors of FATtable
 void fat32_fat_bitmap_writeback(int dev, struct _superblock *sb);
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "common.h"
 
 extern struct devsw devsw[];
+struct poll_table;
 
 // 1. duplicate the file
 struct file *fat32_filedup(struct file *);
@@ -17,7 +18,10 @@ int fat32_filestat(struct file *, uint64 addr);
 // 4. write the file
 ssize_t fat32_filewrite(struct file *, uint64, int n);
 
-// 5. current working directory
+// 5. poll the file
+uint fat32_filepoll(struct file *f, struct poll_table *pt);
+
+// 6. current working directory
 void fat32_getcwd(char *buf);
 void get_absolute_path(struct inode *ip, char *kbuf);
 size_t fat32_getdents(struct inode *dp, char *buf, uint32 off, size_t len);
@@ -7,9 +7,23 @@
 #include "fs/stat.h"
 #include "lib/hash.h"
 #include "fs/bio.h"
+#include "atomic/semaphore.h"
 
 struct inode;
 
+// FAT table in memory, read chunk by chunk on demand
+#define FAT_CHUNK_SECTORS 8 // at most 32, a bit of dirty for each
+#define FAT_PER_CHUNK (FAT_PER_SECTOR * FAT_CHUNK_SECTORS)
+
+struct fat_chunk {
+    FAT_entry_t *fats; // NULL : not read yet
+    uint nfree;        // free clusters in this chunk, holding sb->lock
+    uint dirty;        // dirty sectors of this chunk, bit s for sector s
+};
+
+// clusters reserved for a growing file at a time, so its chain is contiguous
+#define FAT_RSV_WINDOW 64
+
 // Oscomp
 struct fat_dirent_buf {
     uint64 d_ino;            // 索引结点号
@@ -36,6 +50,12 @@ struct fat32_sb_info {
 
     // dirty
     int dirty;
+
+    // FAT table
+    struct fat_chunk *fat_chunks;
+    uint n_fat_chunks;
+    struct semaphore fat_sem; // serialize the reading of chunks
+    int fat_dirty;            // some chunk is dirty
 };
 
 // fat32 inode information
@@ -57,6 +77,11 @@ struct fat32_inode_info {
     uint32 cluster_end; // end num
     uint64 cluster_cnt; // number of clusters
     uint32 parent_off;  // offset in parent clusters
+
+    // reservation window, clusters taken in bit map but still free in FAT
+    uint32 rsv_start;
+    uint32 rsv_len;
+    struct list_head rsv_list; // on rsv_inodes while rsv_len > 0
 };
 
 struct __dirent {
@@ -138,6 +163,10 @@ struct inode *fat32_inode_dup(struct inode *ip);
 
 // find a existed or new fat32 inode
 struct inode *fat32_inode_get(uint dev, struct inode *dp, const char *name, uint parentoff);
+struct inode *fat32_inode_get_cached(struct inode *dp, const char *name, uint parentoff, struct inode *ip);
+
+// truncate and free the unreferenced unlinked inodes
+void fat32_inode_reap_unlinked(void);
 
 // load inode from disk
 int fat32_inode_load_from_disk(struct inode *ip);
@@ -178,6 +207,8 @@ uint32 fat32_fat_travel(struct inode *ip, uint num);
 
 // allocate a new cluster
 FAT_entry_t fat32_cluster_alloc(uint dev);
+FAT_entry_t fat32_cluster_alloc_inode(struct inode *ip, uint want);
+void fat32_cluster_release_rsv(struct inode *ip);
 
 // return the next cluster number
 uint fat32_next_cluster(uint cluster_cur);
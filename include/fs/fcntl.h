@@ -70,6 +70,14 @@
 #define F_SETFL 4    /* set file->f_flags */
 #define FD_CLOEXEC 1 /* actually anything with low bit set goes */
 #define F_DUPFD_CLOEXEC 1030
+#define F_SETPIPE_SZ 1031 /* set the capacity of pipe */
+#define F_GETPIPE_SZ 1032 /* get the capacity of pipe */
+
+// splice, vmsplice and tee
+#define SPLICE_F_MOVE 1     /* move pages instead of copying */
+#define SPLICE_F_NONBLOCK 2 /* don't block on the pipe */
+#define SPLICE_F_MORE 4     /* expect more data */
+#define SPLICE_F_GIFT 8     /* pages passed in are a gift */
 
 // faccess
 #define F_OK 0           /* test existance */
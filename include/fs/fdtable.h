@@ -1,24 +1,49 @@
 #ifndef __FDTABLE_H__
 #define __FDTABLE_H__
 
+#include "common.h"
 #include "param.h"
 #include "atomic/spinlock.h"
 #include "atomic/ops.h"
 
+/*
+    file descriptor table of a process, shared by its threads and by the
+    processes cloned with CLONE_FILES (ref counts them).
+
+    the table starts with NR_OPEN_DEFAULT fds and doubles when it is full,
+    up to FDTABLE_MAX. open_fds has a bit for every fd in use, so the lowest
+    free fd is found a word at a time, next_fd skips the words known full.
+*/
+
+#define NR_OPEN_DEFAULT 64
+#define FDS_PER_WORD 64
+#define FDTABLE_MAX ROUND_UP(NOFILE, FDS_PER_WORD)
+
 struct file;
-struct fd {
-    struct file *file;
-    uint flags;
-};
 
-typedef fd fd_t;
-// descriptor table
 struct fdtable {
     atomic_t ref;
     struct spinlock lock;
-    fd_t ofile[NOFILE];
-    uint max_fds; // max fd
-    uint cur_fd;  // current fd
+    uint max_fds; // size of fd[] and of the bitmaps, a multiple of FDS_PER_WORD
+    uint next_fd; // no free fd below it
+    struct file **fd;
+    uint64 *open_fds;
+    uint64 *close_on_exec;
 };
 
-#endif // __FDTABLE_H__
\ No newline at end of file
+struct fdtable *fdtable_alloc(void);
+int fdtable_copy(struct fdtable *dst, struct fdtable *src);
+struct fdtable *fdtable_get(struct fdtable *fdt);
+void fdtable_put(struct fdtable *fdt);
+int fdtable_unshare(struct fdtable **fdtp);
+void fdtable_close_on_exec(struct fdtable *fdt);
+
+int fd_alloc(struct fdtable *fdt, struct file *f, int start, int limit, int cloexec);
+struct file *fd_get(struct fdtable *fdt, int fd);
+int fd_install(struct fdtable *fdt, int fd, struct file *f, int limit, int cloexec, struct file **oldp);
+struct file *fd_remove(struct fdtable *fdt, int fd);
+void fd_close(struct file *f);
+int fd_get_cloexec(struct fdtable *fdt, int fd);
+int fd_set_cloexec(struct fdtable *fdt, int fd, int cloexec);
+
+#endif // __FDTABLE_H__
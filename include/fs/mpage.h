@@ -19,6 +19,7 @@ struct Page_item {
 
 #define PAGE_ADJACENT(p_cur, p_nxt) ((p_cur->index + 1 == p_nxt->index) && (p_cur->pa + PGSIZE == p_nxt->pa))
 
+void mpage_init(void);
 void block_full_pages(struct inode *ip, struct bio *bio_p, uint64 src, uint64 index, uint64 cnt, int alloc);
 void fat32_rw_pages(struct inode *ip, uint64 src, uint64 index, int rw, uint64 cnt, int alloc);
 void fat32_rw_pages_batch(struct inode *ip, struct Page_entry *p_entry, int rw, int alloc);
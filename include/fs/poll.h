@@ -0,0 +1,62 @@
+#ifndef __FS_POLL_H__
+#define __FS_POLL_H__
+
+#include "common.h"
+#include "atomic/wait_queue.h"
+#include "atomic/semaphore.h"
+#include "lib/timer.h"
+
+struct file;
+struct poll_table;
+
+/*
+    f_op->poll(file, pt) returns the ready mask of file, and calls
+    poll_wait(file, whead, pt) for every queue that will be woken up
+    when the mask changes. pt == NULL (or pt->qproc == NULL) : only check.
+*/
+typedef void (*poll_queue_proc)(struct file *, struct wait_queue_head *, struct poll_table *);
+
+struct poll_table {
+    poll_queue_proc qproc;
+};
+
+static inline void poll_wait(struct file *filp, struct wait_queue_head *whead, struct poll_table *pt) {
+    if (pt && pt->qproc && whead)
+        pt->qproc(filp, whead, pt);
+}
+
+struct poll_table_entry {
+    struct file *filp;
+    struct wait_queue_entry wait;
+    struct wait_queue_head *whead;
+};
+
+#define POLL_TABLE_PAGE_ENTRIES ((PGSIZE - 2 * sizeof(void *)) / sizeof(struct poll_table_entry))
+
+struct poll_table_page {
+    struct poll_table_page *next;
+    int nr;
+    struct poll_table_entry entries[POLL_TABLE_PAGE_ENTRIES];
+};
+
+#define N_POLL_INLINE_ENTRIES 16
+#define POLL_INFINITE ((uint64)-1)
+
+// a poller (select, poll, epoll_wait) on the stack
+struct poll_wqueues {
+    struct poll_table pt;
+    struct semaphore sem; // signaled by any queue or the timer
+    struct timer_list timer;
+    int timed_out;
+    int error;
+    struct poll_table_page *table;
+    int inline_index;
+    struct poll_table_entry inline_entries[N_POLL_INLINE_ENTRIES];
+};
+
+void poll_initwait(struct poll_wqueues *pwq);
+void poll_freewait(struct poll_wqueues *pwq);
+int poll_schedule_timeout(struct poll_wqueues *pwq, uint64 expire);
+uint vfs_poll(struct file *file, struct poll_table *pt);
+
+#endif // __FS_POLL_H__
@@ -25,9 +25,10 @@ typedef struct {
     uint64 fds_bits[FD_SETSIZE / 8 / sizeof(long)];
 } fd_set;
 
-int do_select(int nfds, fd_set_bits *fds, uint64 timeout);
+// expire : absolute time in ns, POLL_INFINITE to wait forever
+int do_select(int nfds, fd_set_bits *fds, uint64 expire);
 
-int core_sys_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, uint64 timeout);
+int core_sys_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, uint64 expire);
 
 long do_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timespec *tsp, const sigset_t *sigmask, size_t sigsetsize);
 
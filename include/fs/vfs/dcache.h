@@ -0,0 +1,53 @@
+#ifndef __VFS_DCACHE_H__
+#define __VFS_DCACHE_H__
+
+#include "common.h"
+#include "lib/list.h"
+
+struct inode;
+
+/*
+    dentry cache, (parent, name) --> inode, or --> nothing (negative)
+
+    dentries live in a pool allocated at boot and are recycled with a clock,
+    never freed, so a lookup can walk a hash chain without any lock. every
+    bucket has a sequence count, odd while a writer changes the chain, and a
+    lookup that sees it change retries once, then falls back to the
+    directory scan. writers are serialized by dcache.lock.
+
+    the inode of a positive dentry is only a hint, it may have been freed.
+    the caller looks it up in the inode table with d_off before using it.
+    a hashed dentry is on the i_dentry list of its inode and the i_dchildren
+    list of its parent, so an inode drops its dentries before it is freed.
+*/
+
+#define DCACHE_NR 1024       // dentries in the pool
+#define DCACHE_NBUCKET 251   // hash buckets
+#define DNAME_INLINE_LEN 64  // longer names are not cached
+#define DCACHE_WALK_MAX 32   // a lock-free walk gives up after this many dentries
+
+// results of dcache_lookup
+#define D_MISS 0
+#define D_POSITIVE 1
+#define D_NEGATIVE 2
+
+struct dentry {
+    struct list_head d_hash; // hash chain, stale if unhashed
+    int d_bucket;            // -1 : unhashed
+    uint32 d_hashval;
+    int d_referenced;        // for the clock
+    struct inode *d_parent;
+    struct inode *d_inode;   // NULL : negative
+    struct list_head d_alias; // on d_inode->i_dentry
+    struct list_head d_child; // on d_parent->i_dchildren
+    uint d_off;              // where d_inode is in d_parent, the key in the inode table
+    char d_name[DNAME_INLINE_LEN];
+};
+
+void dcache_init(void);
+int dcache_lookup(struct inode *dp, const char *name, struct inode **ipp, uint *offp);
+void dcache_add(struct inode *dp, const char *name, struct inode *ip, uint off);
+void dcache_drop(struct inode *dp, const char *name);
+void dcache_prune_inode(struct inode *ip);
+
+#endif // __VFS_DCACHE_H__
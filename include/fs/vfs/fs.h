@@ -17,10 +17,13 @@ struct kstat;
 extern struct ftable _ftable;
 
 struct socket;
+struct eventpoll;
+struct poll_table;
 union file_type {
     struct pipe *f_pipe;   // FD_PIPE
     struct inode *f_inode; // FDINODE and FD_DEVICE
     struct socket *f_sock; // FD_SOCKET
+    struct eventpoll *f_ep; // FD_EPOLL
 };
 
 typedef enum {
@@ -48,9 +51,8 @@ struct _superblock {
     struct spinlock dirty_lock; // used to protect dirty list
     struct list_head s_dirty;   /* dirty inodes */
 
-    // FAT table -> bit map
+    // FAT table -> bit map, FAT table is in fat32_sb_info
     uint64 bit_map;
-    uint64 fat_table;
     
     union {
         struct fat32_sb_info fat32_sb_info;
@@ -78,11 +80,15 @@ struct file {
     // unsigned long f_version;
 
     int is_shm_file; // for shared memory
+
+    struct list_head f_ep_links; // epitem watching this file
 };
 
+// open files come from a slab cache, at most NFILE of them
 struct ftable {
     struct spinlock lock;
-    struct file file[NFILE];
+    struct kmem_cache *cachep;
+    int nr_files;
 };
 
 // #define NAME_MAX 10
@@ -119,6 +125,10 @@ struct index_table {
 };
 
 // abstract datas in disk
+// i_state
+#define I_RECLAIM 0x1 // taken off the lru list by the reclaimer
+#define I_FREEING 0x2 // unlinked and unreferenced, to be truncated
+
 struct inode {
     dev_t i_dev; // note: 未在磁盘中存储
     // uint32 i_ino; // 对任意给定的文件系统的唯一编号标识：由具体文件系统解释
@@ -166,7 +176,11 @@ struct inode {
     struct address_space *i_mapping; // used for page cache
     spinlock_t tree_lock;            /* and lock protecting radix tree */
 
-    struct list_head list; // to speed up inode_get
+    struct list_head list;  // hash chain of the inode table
+    struct list_head i_lru; // lru or unlinked list of the inode table, if unreferenced
+    struct list_head i_dentry;    // dentries of it, under dcache.lock
+    struct list_head i_dchildren; // dentries in it, under dcache.lock
+    int i_state;            // I_xxx, holding the inode table lock
 
     int dirty_in_parent; // need to update ??
     int create_cnt;      // for inode parent
@@ -205,6 +219,7 @@ struct file_operations {
     long (*ioctl)(struct file *self, unsigned int cmd, unsigned long arg);
     // size_t (*readdir)(struct file *self, char *buf, size_t len);
     size_t (*readdir)(struct inode *dp, char *buf, uint32 off, size_t len);
+    uint (*poll)(struct file *self, struct poll_table *pt);
 };
 
 struct inode_operations {
@@ -2,13 +2,37 @@
 #define __PIPE_H__
 
 #include "common.h"
+#include "lib/riscv.h"
 #include "atomic/spinlock.h"
 #include "atomic/semaphore.h"
 #include "lib/sbuf.h"
+#include "atomic/wait_queue.h"
 
 struct file;
+struct poll_table;
 
-#define PIPESIZE 512
+/*
+    a pipe is a ring of pipe_buffer, every pipe_buffer refers to (a part of) a page
+
+    write : append to the last buffer if it is our own page, otherwise take a new page,
+            copy the user data in spans of pages
+    splice: file -> pipe puts a reference of the page cache page into the ring,
+            pipe -> pipe moves (tee shares) the references, no data is copied
+*/
+#define PIPE_DEF_BUFFERS 16 // default capacity : 16 pages, as linux
+#define PIPE_MAX_SIZE (1 << 20) // max capacity set by F_SETPIPE_SZ
+#define PIPESIZE (PIPE_DEF_BUFFERS * PGSIZE)
+#define PIPE_BUF_ATOMIC PGSIZE // PIPE_BUF of POSIX, writes up to it are not interleaved
+
+// pipe_buffer flags
+#define PIPE_BUF_FLAG_CAN_MERGE 0x1 // private page of the pipe, writes may append to it
+
+struct pipe_buffer {
+    uint64 pa; // holds a reference of the page
+    uint offset;
+    uint len;
+    int flags;
+};
 
 // struct pipe {
 //     struct sbuf buffer;
@@ -23,18 +47,25 @@ struct file;
 
 struct pipe {
     struct spinlock lock;
-    char data[PIPESIZE];
+    struct pipe_buffer *bufs; // ring of nr_bufs (power of 2)
+    uint nr_bufs;
+    uint head;     // next buffer to fill
+    uint tail;     // next buffer to read
+    uint64 tmp_page; // a drained page kept for the next write
     uint nread;    // number of bytes read
     uint nwrite;   // number of bytes written
     int readopen;  // read fd is still open
     int writeopen; // write fd is still open
 
+    struct semaphore mutex; // held by read, write and splice, the data is copied without the spinlock
     struct semaphore read_sem;
     struct semaphore write_sem;
+    struct wait_queue_head poll_wq; // poll, select and epoll
 };
 
-#define PIPE_FULL(pi) (pi->nwrite == pi->nread + PIPESIZE)
-#define PIPE_EMPTY(pi) (pi->nread == pi->nwrite)
+#define PIPE_FULL(pi) ((pi)->head - (pi)->tail >= (pi)->nr_bufs)
+#define PIPE_EMPTY(pi) ((pi)->head == (pi)->tail)
+#define PIPE_BUF(pi, slot) (&(pi)->bufs[(slot) & ((pi)->nr_bufs - 1)])
 
 #define pipereadable(p) (p->readopen)
 #define pipewriteable(p) (p->writeopen)
@@ -44,6 +75,14 @@ int pipe_full(struct pipe *p);
 int pipe_alloc(struct file **f0, struct file **f1);
 void pipe_close(struct pipe *pi, int writable);
 int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n);
-int pipe_write(struct pipe *pi, int user_dst, uint64 addr, int n);
+int pipe_write(struct pipe *pi, int user_src, uint64 addr, int n);
+uint pipe_poll(struct pipe *pi, struct file *f, struct poll_table *pt);
+int pipe_set_size(struct pipe *pi, int size);
+int pipe_get_size(struct pipe *pi);
+
+// used by splice
+int pipe_add_buffer(struct pipe *pi, struct pipe_buffer *buf, int nonblock);
+int pipe_get_buffer(struct pipe *pi, struct pipe_buffer *buf, uint max, int nonblock);
+int pipe_splice_pipe(struct pipe *ipipe, struct pipe *opipe, uint len, int nonblock, int tee);
 
 #endif // __PIPE_H__
\ No newline at end of file
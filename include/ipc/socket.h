@@ -4,6 +4,7 @@
 #include "lib/riscv.h"
 #include "atomic/spinlock.h"
 #include "atomic/semaphore.h"
+#include "atomic/wait_queue.h"
 #include "lib/sbuf.h"
 
 #define BUFSIZE PGSIZE
@@ -26,7 +27,7 @@ struct socket {
     struct semaphore do_accept;
     int has_map;
     int used;
-    // wait_queue_head_t	wait;
+    struct wait_queue_head wait; // poll, select and epoll
 };
 
 struct socket_operations {
@@ -34,7 +35,11 @@ struct socket_operations {
     int (*write)(struct socket *, uint64, int);
 };
 
+struct file;
+struct poll_table;
+
 void free_socket(struct socket *sock);
+uint socket_poll(struct socket *sock, struct file *f, struct poll_table *pt);
 
 /* Types of sockets.  */
 enum __socket_type {
@@ -2,16 +2,31 @@
 #define __CPU_H__
 #include "common.h"
 #include "kernel/kthread.h"
+#include "atomic/spinlock.h"
+#include "lib/list.h"
 #include "param.h"
 
 struct tcb;
 
+// per-cpu run queue
+struct run_queue {
+    struct spinlock lock;
+    struct list_head rt_list;   // real-time threads, sorted by rt_priority (high first)
+    struct list_head fair_list; // fair threads, sorted by vruntime (small first)
+    int nr_running;             // number of queued threads
+    uint64 min_vruntime;        // monotonic floor of vruntime (ns)
+};
+
 // Per-CPU state
 struct thread_cpu {
     struct tcb *thread;     // The thread running on this cpu, or null.
     struct context context; // swtch() here to enter scheduler().
     int noff;               // Depth of push_off() nesting.
     int intena;             // Were interrupts enabled before push_off()?
+    struct run_queue rq;    // runnable threads of this cpu
+    int idle;               // sleeping on wfi, others send an IPI to wake it
+    uint64 idle_start;      // rdtime() when it went idle
+    uint64 idle_time;       // cycles spent in wfi
 };
 
 extern struct thread_cpu t_cpus[NCPU];
@@ -10,6 +10,7 @@ void argulong(int, unsigned long *);
 int arguint(int n, uint *ip);
 int arglong(int, long *);
 int argfd(int n, int *pfd, struct file **pf);
+void argfd_put_all(void);
 int argstr(int, char *, int);
 int argaddr(int, uint64 *);
 int arglist(uint64 argv[], int s, int n); // do not use
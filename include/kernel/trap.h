@@ -97,6 +97,10 @@ struct trapframe {
 int copyout(pagetable_t, uint64, char *, uint64);
 int copyin(pagetable_t, char *, uint64, uint64);
 int copyinstr(pagetable_t, char *, uint64, uint64);
+uint64 copy_to_user(uint64 dstva, const void *src, uint64 len);
+uint64 copy_from_user(void *dst, uint64 srcva, uint64 len);
+long strncpy_from_user(char *dst, uint64 srcva, uint64 max);
+uint64 get_user_pa(uint64 uaddr, int write);
 int either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 
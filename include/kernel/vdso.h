@@ -0,0 +1,31 @@
+#ifndef __VDSO_H__
+#define __VDSO_H__
+
+/*
+    vDSO, system calls served in user space
+
+    every process maps two pages shared by all of them
+      VVAR : vdso_data, read-only to the user, written by the kernel
+      VDSO : a small ELF shared object (vdso.S), AT_SYSINFO_EHDR points to it
+    the libc looks up __vdso_clock_gettime and friends in its dynamic
+    symbol table and calls them instead of trapping.
+*/
+
+// offsets in vdso_data, for vdso.S
+#define VDSO_FREQ 0
+#define VDSO_CLOCK_MASK 8
+
+#ifndef __ASSEMBLER__
+#include "common.h"
+
+struct vdso_data {
+    uint64 freq;       // rdtime cycles per second
+    uint64 clock_mask; // bit n : clock n is read in user space
+};
+
+void vdso_init(void);
+int vdso_map(pagetable_t pagetable);
+void vdso_unmap(pagetable_t pagetable);
+
+#endif // __ASSEMBLER__
+#endif // __VDSO_H__
@@ -43,13 +43,11 @@ static inline void zero_fd_set(uint64 nr, uint64 *fdset) {
 #define POLLPRI 0x002 /* There is urgent data to read.  */
 #define POLLOUT 0x004 /* Writing now will not block.  */
 
-#if defined __USE_XOPEN || defined __USE_XOPEN2K8
 /* These values are defined in XPG4.2.  */
 #define POLLRDNORM 0x040 /* Normal data may be read.  */
 #define POLLRDBAND 0x080 /* Priority data may be read.  */
 #define POLLWRNORM 0x100 /* Writing now will not block.  */
 #define POLLWRBAND 0x200 /* Priority data may be written.  */
-#endif
 
 #ifdef __USE_GNU
 /* These are extensions for Linux.  */
@@ -0,0 +1,48 @@
+#ifndef __RBTREE_H__
+#define __RBTREE_H__
+
+#include "common.h"
+#include "lib/list.h"
+
+/*
+    red-black tree, the nodes are embedded in the objects like list_head.
+    the caller walks down from root->rb_node to find the slot, links the
+    node there with rb_link_node, then calls rb_insert_color to rebalance.
+
+    augmented trees pass a callback that recomputes the value cached in a
+    node from the node itself and its two children, it is called for every
+    node whose subtree changed. callers pass NULL for a plain tree.
+*/
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node *rb_parent;
+    struct rb_node *rb_left;
+    struct rb_node *rb_right;
+    int rb_color;
+};
+
+struct rb_root {
+    struct rb_node *rb_node;
+};
+
+typedef void (*rb_augment_f)(struct rb_node *node);
+
+#define RB_ROOT \
+    (struct rb_root) { NULL }
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link) {
+    node->rb_parent = parent;
+    node->rb_left = node->rb_right = NULL;
+    node->rb_color = RB_RED;
+    *link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root, rb_augment_f augment);
+void rb_erase(struct rb_node *node, struct rb_root *root, rb_augment_f augment);
+void rb_augment_path(struct rb_node *node, rb_augment_f augment);
+
+#endif // __RBTREE_H__
@@ -52,6 +52,15 @@ rdtime() {
     return x;
 }
 
+// cycle counter, readable in S-mode if the SBI sets mcounteren.CY
+static inline uint64
+rdcycle() {
+    uint64 x;
+    asm volatile("rdcycle %0"
+                 : "=r"(x));
+    return x;
+}
+
 static inline void
 w_mstatus(uint64 x) {
     asm volatile("csrw mstatus, %0"
@@ -109,6 +118,14 @@ w_sip(uint64 x) {
                  : "r"(x));
 }
 
+#define SIP_SSIP (1L << 1) // software interrupt pending
+
+// stall until an enabled interrupt is pending, even with sstatus.SIE clear
+static inline void
+wfi() {
+    asm volatile("wfi");
+}
+
 // Supervisor Interrupt Enable
 #define SIE_SEIE (1L << 9) // external
 #define SIE_STIE (1L << 5) // timer
@@ -242,6 +259,11 @@ w_pmpaddr0(uint64 x) {
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// the ASID field of satp, the kernel page table runs with ASID 0
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xFFFFL
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | ((uint64)(asid) << SATP_ASID_SHIFT))
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void
@@ -375,6 +397,24 @@ sfence_vma() {
     asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space
+static inline void
+sfence_vma_asid(uint64 asid) {
+    asm volatile("sfence.vma zero, %0"
+                 :
+                 : "r"(asid)
+                 : "memory");
+}
+
+// flush the TLB entries of va in one address space
+static inline void
+sfence_vma_page(uint64 va, uint64 asid) {
+    asm volatile("sfence.vma %0, %1"
+                 :
+                 : "r"(va), "r"(asid)
+                 : "memory");
+}
+
 #endif // __ASSEMBLER__
 
 // only support 2MB superpage
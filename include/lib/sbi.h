@@ -8,28 +8,32 @@
 #define SHUTDOWN_EXT 0x08L
 #define TIMER_EXT 0x54494D45L
 #define HSM_EXT 0x48534DL
+#define IPI_EXT 0x735049L
+#define RFENCE_EXT 0x52464E43L
 
 #define SBI_SUCCESS 0
 
-#define SBI_CALL(ext, funct, arg0, arg1, arg2, arg3) ({        \
-    register uintptr_t a0 asm("a0") = (uintptr_t)(arg0);       \
-    register uintptr_t a1 asm("a1") = (uintptr_t)(arg1);       \
-    register uintptr_t a2 asm("a2") = (uintptr_t)(arg2);       \
-    register uintptr_t a3 asm("a3") = (uintptr_t)(arg3);       \
-    register uintptr_t a6 asm("a6") = (uintptr_t)(funct);      \
-    register uintptr_t a7 asm("a7") = (uintptr_t)(ext);        \
-    asm volatile("ecall"                                       \
-                 : "+r"(a0), "+r"(a1)                          \
-                 : "r"(a1), "r"(a2), "r"(a3), "r"(a6), "r"(a7) \
-                 : "memory");                                  \
-    (struct sbiret){a0, a1};                                   \
+#define SBI_CALL(ext, funct, arg0, arg1, arg2, arg3, arg4) ({           \
+    register uintptr_t a0 asm("a0") = (uintptr_t)(arg0);                 \
+    register uintptr_t a1 asm("a1") = (uintptr_t)(arg1);                 \
+    register uintptr_t a2 asm("a2") = (uintptr_t)(arg2);                 \
+    register uintptr_t a3 asm("a3") = (uintptr_t)(arg3);                 \
+    register uintptr_t a4 asm("a4") = (uintptr_t)(arg4);                 \
+    register uintptr_t a6 asm("a6") = (uintptr_t)(funct);                \
+    register uintptr_t a7 asm("a7") = (uintptr_t)(ext);                  \
+    asm volatile("ecall"                                                 \
+                 : "+r"(a0), "+r"(a1)                                    \
+                 : "r"(a1), "r"(a2), "r"(a3), "r"(a4), "r"(a6), "r"(a7) \
+                 : "memory");                                            \
+    (struct sbiret){a0, a1};                                             \
 })
 
-#define SBI_CALL_0(ext, funct) SBI_CALL(ext, funct, 0, 0, 0, 0)
-#define SBI_CALL_1(ext, funct, arg0) SBI_CALL(ext, funct, arg0, 0, 0, 0)
-#define SBI_CALL_2(ext, funct, arg0, arg1) SBI_CALL(ext, funct, arg0, arg1, 0, 0)
-#define SBI_CALL_3(ext, funct, arg0, arg1, arg2) SBI_CALL(ext, funct, arg0, arg1, arg2, 0)
-#define SBI_CALL_4(ext, funct, arg0, arg1, arg2, arg3) SBI_CALL(ext, funct, arg0, arg1, arg2, arg3)
+#define SBI_CALL_0(ext, funct) SBI_CALL(ext, funct, 0, 0, 0, 0, 0)
+#define SBI_CALL_1(ext, funct, arg0) SBI_CALL(ext, funct, arg0, 0, 0, 0, 0)
+#define SBI_CALL_2(ext, funct, arg0, arg1) SBI_CALL(ext, funct, arg0, arg1, 0, 0, 0)
+#define SBI_CALL_3(ext, funct, arg0, arg1, arg2) SBI_CALL(ext, funct, arg0, arg1, arg2, 0, 0)
+#define SBI_CALL_4(ext, funct, arg0, arg1, arg2, arg3) SBI_CALL(ext, funct, arg0, arg1, arg2, arg3, 0)
+#define SBI_CALL_5(ext, funct, arg0, arg1, arg2, arg3, arg4) SBI_CALL(ext, funct, arg0, arg1, arg2, arg3, arg4)
 
 struct sbiret {
     long error;
@@ -60,4 +64,21 @@ static inline int sbi_hart_start(uint64 hartid, uint64 start, uint64 arg) {
     return SBI_CALL_3(HSM_EXT, 0, hartid, start, arg).error;
 }
 
+// raise a supervisor software interrupt on the harts in hart_mask
+// (bit i is hart hart_mask_base + i)
+static inline int sbi_send_ipi(uint64 hart_mask, uint64 hart_mask_base) {
+    return SBI_CALL_2(IPI_EXT, 0, hart_mask, hart_mask_base).error;
+}
+
+// flush [start, start + size) from the TLB of the harts in hart_mask, size -1
+// is the whole address space. returns when they are all done
+static inline int sbi_remote_sfence_vma(uint64 hart_mask, uint64 hart_mask_base, uint64 start, uint64 size) {
+    return SBI_CALL_4(RFENCE_EXT, 1, hart_mask, hart_mask_base, start, size).error;
+}
+
+// the same, for the entries of one ASID only
+static inline int sbi_remote_sfence_vma_asid(uint64 hart_mask, uint64 hart_mask_base, uint64 start, uint64 size, uint64 asid) {
+    return SBI_CALL_5(RFENCE_EXT, 2, hart_mask, hart_mask_base, start, size, asid).error;
+}
+
 #endif // __SBI_H__
@@ -8,33 +8,63 @@
 #include "lib/riscv.h"
 #include "memory/memlayout.h"
 
-// #define SET_TIMER() sbi_legacy_set_timer(*(uint64 *)CLINT_MTIME + CLINT_INTERVAL)
-#define SET_TIMER() sbi_legacy_set_timer(rdtime() + CLINT_INTERVAL)
-#define TIME_OUT(timer_cur) (TIME2NS(rdtime()) > ((timer_cur)->expires_end))
+/*
+    timers of every cpu hang on a hierarchical wheel of its own
+
+    the wheel counts jiffies of 1ms. level n has 64 slots, each of 8^n
+    jiffies, and a timer goes to the lowest level whose range covers its
+    delay, rounded up to a slot. so adding and deleting are O(1), timers
+    are never cascaded down, and a timer far away fires at most 1/8 of
+    its delay late. a bitmap per level finds the next expiry without
+    walking the slots.
+
+    a busy cpu keeps the scheduler tick of CLINT_INTERVAL, an idle cpu
+    only wakes up for its next timer.
+*/
+
+#define TIMER_JIFFY (FREQUENCY / 1000)     // cycles in a jiffy
+#define TIMER_LVL_CLK_SHIFT 3              // a level is 8 times coarser than the one below
+#define TIMER_LVL_BITS 6
+#define TIMER_LVL_SIZE (1 << TIMER_LVL_BITS) // slots in a level
+#define TIMER_LVL_MASK (TIMER_LVL_SIZE - 1)
+#define TIMER_LVL_DEPTH 8                  // up to about 36 hours
+#define TIMER_WHEEL_SIZE (TIMER_LVL_SIZE * TIMER_LVL_DEPTH)
 
 typedef void (*timer_expire)(void *); // uint64
 
-struct timer_entry {
-    struct spinlock lock;
-    struct list_head entry;
-};
+struct timer_base;
 
 struct timer_list {
-    struct list_head list;
-    uint64 expires;
-    uint64 expires_end;
+    struct list_head list;    // in a slot of base, empty if not pending
+    struct timer_base *base;  // where it was queued last
+    uint64 expires;           // ns, as given to add_timer_atomic
+    uint64 expires_jiffy;     // when it fires
     void (*function)(void *); // uint64
     void *data;               // uint64
-    int count;                // for pdflush
-    int cycle;                // for every clock interrupt
-    int over;                 // for pselect
-    uint64 interval;          // for setitimer
+    int count;                // -1 : periodic
+    uint64 interval;          // for setitimer, -1 : period of expires (pdflush)
 };
 
-void timer_entry_init(struct timer_entry *t_entry, char *name);
+struct timer_base {
+    struct spinlock lock;
+    uint64 clk;                        // jiffies before clk are done
+    uint64 next_event;                 // cycles, programmed in the timer of this cpu
+    struct timer_list *running;        // its function is being called
+    uint64 pending[TIMER_LVL_DEPTH];   // bit i : slot i of the level is not empty
+    struct list_head vectors[TIMER_WHEEL_SIZE];
+};
+
+static inline void timer_list_init(struct timer_list *timer) {
+    INIT_LIST_HEAD(&timer->list);
+    timer->base = NULL;
+}
+
+void timer_init();
 void add_timer_atomic(struct timer_list *timer, uint64 expires, timer_expire function, void *data);
 void delete_timer_atomic(struct timer_list *timer);
-void timer_list_decrease_atomic(struct timer_entry *head);
+void delete_timer_async(struct timer_list *timer);
+void timer_tick_resume(void);
+uint64 timer_ticks(void);
 void clockintr();
 
-#endif
\ No newline at end of file
+#endif
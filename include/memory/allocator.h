@@ -13,6 +13,7 @@ void kfree(void *);
 void *kzalloc(size_t size);
 void *kmalloc(size_t size);
 void share_page(uint64 pa);
+struct page *compound_head(struct page *page);
 
 /* get available memory size */
 uint64 get_free_mem();
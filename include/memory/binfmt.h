@@ -27,6 +27,9 @@ struct binprm {
     /* interpreter */
     int interp;
 
+    /* map file-backed segments lazily from page cache */
+    int demand;
+
     /* sh interp*/
     int sh;
 
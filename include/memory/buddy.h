@@ -30,10 +30,12 @@
 #define NPAGES (((PHYSTOP)-START_MEM) / (PGSIZE))
 #define PAGES_PER_CPU (NPAGES / NCPU)
 extern struct page *pagemeta_start;
+struct kmem_cache;
 
 // page status
 #define PG_locked 0x01
 #define PG_dirty 0x02
+#define PG_slab 0x03 // bit number, owned by a kmem_cache
 
 // chage the refcnt of page (atomic)
 #define page_cache_get(page) (atomic_inc_return(&page->refcnt))
@@ -49,11 +51,23 @@ struct page {
     struct spinlock lock;
     atomic_t refcnt;
 
-    // for i-mapping
+    // for slab : number of objects in use
+    int inuse;
+
     uint64 flags;
-    struct address_space *mapping;
-    // pagecache index
-    uint64 index;
+    union {
+        struct {
+            // for i-mapping
+            struct address_space *mapping;
+            // pagecache index
+            uint64 index;
+        };
+        struct {
+            // for slab : owner cache and free objects of this page
+            struct kmem_cache *slab_cache;
+            void *freelist;
+        };
+    };
 };
 
 struct free_list {
@@ -88,6 +102,10 @@ static inline void clear_page_flags(struct page *page, uint64 flags) {
     clear_bit(flags, &page->flags);
 }
 
+static inline int PageSlab(struct page *page) {
+    return test_bit(PG_slab, &page->flags);
+}
+
 static inline uint64 page_to_pa(struct page *page) {
     return (page - pagemeta_start) * PGSIZE + START_MEM;
 }
@@ -12,6 +12,8 @@
 
 int add_to_page_cache_atomic(struct page *page, struct address_space *mapping, uint64 index);
 struct page *find_get_page_atomic(struct address_space *mapping, uint64 index, int lock);
+struct page *filemap_get_page(struct inode *ip, uint64 index);
+void filemap_set_page_dirty(struct inode *ip, uint64 index);
 uint64 max_sane_readahead(uint64 nr, uint64 read_ahead, uint64 tot_nr);
 ssize_t do_generic_file_read(struct address_space *mapping, int user_src, uint64 src, uint off, uint n);
 ssize_t do_generic_file_write(struct address_space *mapping, int user_src, uint64 src, uint off, uint n);
@@ -47,6 +47,8 @@
 //   ...
 //   USTACK_GURAD_PAGE
 //   USTACK
+//   VVAR (read-only data of the vDSO)
+//   VDSO
 //   ...
 //   TRAPFRAME (each thread has it's own trapframe)
 //   SIGRETURN
@@ -61,6 +63,10 @@
 #define USTACK (MAXVA - 512 * 10 * PGSIZE - USTACK_PAGE * PGSIZE)
 #define USTACK_GURAD_PAGE (USTACK - PGSIZE)
 
+// the vDSO finds VVAR one page below itself
+#define VVAR (USTACK + USTACK_PAGE * PGSIZE)
+#define VDSO (VVAR + PGSIZE)
+
 #define TOTAL_MEM (PHYSTOP - START_MEM)
 #define FREE_MEM (get_free_mem())
 #define USED_MEM (FREE_MEM - TOTAL_MEM)
@@ -3,19 +3,35 @@
 
 #include "common.h"
 #include "lib/list.h"
+#include "lib/rbtree.h"
 #include "atomic/semaphore.h"
 
 typedef unsigned long vm_flags_t;
 #define VM_NORESERVE 0x00200000 /* should the VM suppress accounting */
 
+// per-thread cache of the last vmas found, slot by 2MB window
+#define VMACACHE_BITS 2
+#define VMACACHE_SIZE (1 << VMACACHE_BITS)
+#define VMACACHE_HASH(addr) (((addr) >> 21) & (VMACACHE_SIZE - 1))
+
 struct vma;
 struct mm_struct {
-    struct list_head head_vma;
+    struct list_head head_vma; // sorted by address
+    struct rb_root mm_rb;      // the same vmas, by address, with the largest gap
+    uint64 vmacache_seq;       // bumped when a vma leaves, stales the vmacache of threads
     pagetable_t pagetable; // User page table
 
     paddr_t start_brk, brk; /* program break */
     struct vma *heapvma;
 
+    // collapse of 4KB pages into superpages, see memory/thp.h
+    vaddr_t thp_scan_addr;
+    uint64 thp_scan_next;
+
+    // TLB state, see memory/tlbflush.h
+    uint64 context_id; // ASID generation | ASID, 0 if it has none yet
+    uint64 cpu_mask;   // harts that ran it and may cache its entries
+
     struct semaphore mmap_sem;
     struct spinlock lock;
 };
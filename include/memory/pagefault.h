@@ -12,7 +12,8 @@
                                 || ((cause) == INSTUCTION_PAGEFAULT && (vma->perm & PERM_EXEC)))
 
 /* copy-on write */
-int cow(pte_t *pte, int level, paddr_t pa, int flags);
+struct mm_struct;
+int cow(struct mm_struct *mm, vaddr_t va, pte_t *pte, int level, paddr_t pa, int flags);
 int is_a_cow_page(int flags);
 
 int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval);
@@ -0,0 +1,80 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "common.h"
+#include "atomic/spinlock.h"
+#include "lib/list.h"
+#include "param.h"
+
+/*
+    object cache (slab) allocator on top of the buddy system
+
+    every slab is one buddy page, its metadata lives in the struct page
+    (page->slab_cache, page->freelist, page->inuse), so objects are packed
+    from the start of the page and kfree() can find the owner cache by
+    rounding the address down
+
+    +-------------------+     +-----------+    +-----------+
+    | struct kmem_cache | --> | slab page | -> | slab page | ...  (partial/free)
+    +-------------------+     +-----------+    +-----------+
+    |  cpu[0] magazine  |  <-- objects cached per cpu, under the magazine lock
+    |  cpu[1] magazine  |      only, not the cache lock
+    +-------------------+
+
+    a magazine has its own lock, only its cpu takes it but for
+    kmem_cache_destroy, which drains all of them. it comes before the
+    cache lock. new slabs are allocated holding neither, with interrupts
+    as the caller has them, kalloc may sleep to recycle memory
+*/
+
+/* configuration option */
+#define SLAB_NAME_LEN 20
+#define SLAB_MAGAZINE_SIZE 16 // objects cached per cpu
+#define SLAB_MAGAZINE_BATCH (SLAB_MAGAZINE_SIZE / 2)
+#define SLAB_FREE_LIMIT 2     // empty slabs kept by a cache before going back to buddy
+#define SLAB_MIN_SIZE 16
+#define SLAB_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_MAX_SIZE (1 << KMALLOC_MAX_SHIFT) // 2 KiB, larger requests use whole pages
+#define KMALLOC_NR_CACHES (KMALLOC_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+// per-cpu object magazine
+struct kmem_cache_cpu {
+    struct spinlock lock;
+    int avail;
+    void *objs[SLAB_MAGAZINE_SIZE];
+};
+
+struct kmem_cache {
+    char name[SLAB_NAME_LEN];
+    uint32 size;          // object size (aligned)
+    uint32 objs_per_slab; // objects in one slab page
+
+    // protect slab lists and counters
+    struct spinlock lock;
+    struct list_head slabs_partial;
+    struct list_head slabs_free;
+    int nr_free;     // number of empty slabs
+    uint64 nr_slabs; // number of slab pages owned by this cache
+
+    // for the global cache chain
+    struct list_head cache_list;
+
+    struct kmem_cache_cpu cpu[NCPU];
+};
+
+void kmem_cache_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
+void kmem_cache_destroy(struct kmem_cache *cachep);
+void *kmem_cache_alloc(struct kmem_cache *cachep);
+void *kmem_cache_zalloc(struct kmem_cache *cachep);
+void kmem_cache_free(struct kmem_cache *cachep, void *obj);
+void kmem_cache_shrink(struct kmem_cache *cachep);
+void kmem_cache_reap(void);
+
+// used by kmalloc/kfree
+int kmalloc_slab_ready(void);
+void *kmalloc_slab(size_t size);
+int kfree_slab(void *obj);
+
+#endif // __SLAB_H__
@@ -0,0 +1,24 @@
+#ifndef __THP_H__
+#define __THP_H__
+
+#include "common.h"
+
+/*
+    transparent superpages for anonymous memory (heap and private anon mmap)
+
+    a fault maps a zeroed 2MB page when the whole aligned 2MB window lies in
+    the vma and nothing is mapped in it yet. windows that were filled with
+    4KB pages are collapsed later, by a scan that runs from the timer tick
+    of the process itself.
+*/
+
+#define THP_SCAN_INTERVAL 5 // timer ticks between two scans of a mm
+#define THP_SCAN_WINDOWS 8  // 2MB windows looked at by one scan
+
+struct vma;
+struct proc;
+
+int thp_fault(pagetable_t pagetable, struct vma *vma, vaddr_t va);
+void thp_collapse_tick(struct proc *p);
+
+#endif // __THP_H__
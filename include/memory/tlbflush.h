@@ -0,0 +1,50 @@
+#ifndef __TLBFLUSH_H__
+#define __TLBFLUSH_H__
+
+#include "common.h"
+#include "param.h"
+
+/*
+    every user mm gets an ASID, so its TLB entries stay valid across traps
+    and context switches : satp is switched without sfence.vma. the ASIDs
+    are handed out from a bitmap, when it runs out a new generation starts
+    and every hart flushes its whole TLB once before it uses a new ASID
+    (the same scheme as Linux). a hart without ASIDs gets ASID 0 for all
+    mm, and the trampoline flushes the TLB around every satp switch.
+
+    a change to the page table of a live mm goes to every hart in
+    mm->cpu_mask. the unmapped ranges are gathered in a tlb_batch and the
+    pages are freed only after the flush, a range of more than
+    TLB_FLUSH_THRESHOLD pages flushes the whole ASID instead.
+*/
+
+#define TLB_FLUSH_THRESHOLD 64 // pages
+#define TLB_BATCH_PAGES 32     // pages kept in a batch before it flushes
+
+#if NCPU > 64
+#error "mm->cpu_mask holds 64 harts"
+#endif
+
+struct mm_struct;
+
+struct tlb_batch {
+    struct mm_struct *mm;
+    vaddr_t start, end; // the range to flush, start == end if none
+    int nr_pages;
+    paddr_t pages[TLB_BATCH_PAGES]; // freed after the flush
+};
+
+void asid_init(void);
+uint64 switch_mm_satp(struct mm_struct *mm);
+
+void flush_tlb_mm(struct mm_struct *mm);
+void flush_tlb_range(struct mm_struct *mm, vaddr_t start, vaddr_t end);
+void flush_tlb_page(struct mm_struct *mm, vaddr_t va);
+void local_flush_tlb_page(struct mm_struct *mm, vaddr_t va);
+
+void tlb_batch_init(struct tlb_batch *tlb, struct mm_struct *mm);
+void tlb_batch_add(struct tlb_batch *tlb, vaddr_t va, uint64 size);
+void tlb_batch_free(struct tlb_batch *tlb, paddr_t pa);
+void tlb_batch_flush(struct tlb_batch *tlb);
+
+#endif // __TLBFLUSH_H__
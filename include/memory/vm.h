@@ -17,6 +17,8 @@ uint64 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz);
 int uvmcopy(struct mm_struct *srcmm, struct mm_struct *dstmm);
 void uvmfree(struct mm_struct *mm);
 void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int on_demand);
+void mm_unmap(struct mm_struct *mm, uint64 va, uint64 npages, int do_free, int on_demand);
+void uvmprotect(struct mm_struct *mm, uint64 va, uint64 npages, int pte_perm);
 void uvmclear(pagetable_t pagetable, uint64 va);
 void freewalk(pagetable_t pagetable, int level);
 
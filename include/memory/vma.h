@@ -5,8 +5,7 @@
 #include "lib/list.h"
 #include "memory/mm.h"
 #include "lib/list.h"
-
-#define NVMA 3000
+#include "lib/rbtree.h"
 
 // mmap
 #define MAP_FILE 0
@@ -40,25 +39,27 @@ typedef enum {
 struct vma {
     vmatype type;
     struct list_head node;
+    struct rb_node rb;
+    vaddr_t rb_subtree_gap; // the largest hole before a vma in this subtree
+    struct mm_struct *vm_mm;
     vaddr_t startva;
     size_t size;
     uint32 perm;
 
-    // temp
-    int used;
-
     /* for VMA_FILE */
     // int fd;
     uint64 offset;
     struct file *vm_file;
 };
 
-extern struct vma vmas[NVMA];
 int vma_map_file(struct mm_struct *mm, uint64 va, size_t len, uint64 perm, uint64 type, off_t offset, struct file *fp);
 int vma_map(struct mm_struct *mm, uint64 va, size_t len, uint64 perm, uint64 type);
 int vmspace_unmap(struct mm_struct *mm, vaddr_t va, size_t len);
+int vmspace_msync(struct mm_struct *mm, vaddr_t va, size_t len);
 
 struct vma *find_vma_for_va(struct mm_struct *mm, vaddr_t addr);
+struct vma *find_vma_from(struct mm_struct *mm, vaddr_t addr);
+int vma_adjust(struct vma *vma, vaddr_t start, size_t size);
 vaddr_t find_mapping_space(struct mm_struct *mm, vaddr_t start, size_t size);
 int split_vma(struct mm_struct *mm, struct vma *vma, unsigned long addr, int new_below);
 int vmacopy(struct mm_struct *srcmm, struct mm_struct *dstmm);
@@ -66,7 +67,7 @@ void free_all_vmas(struct mm_struct *mm);
 void print_vma(struct list_head *head_vma);
 
 // for mmap
-void del_vma_from_vmspace(struct list_head *vma_head, struct vma *vma);
+void del_vma_from_vmspace(struct mm_struct *mm, struct vma *vma);
 void *do_mmap(vaddr_t addr, size_t length, int prot, int flags, struct file *fp, off_t offset);
 
 #endif // __VMA_H__
\ No newline at end of file
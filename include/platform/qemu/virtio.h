@@ -3,7 +3,11 @@
 
 #include "common.h"
 
+struct request;
+
 void virtio_disk_rw(void *, int, int);
+int virtio_disk_submit(struct request *);
+void virtio_disk_kick(void);
 void virtio_disk_intr(void);
 
 //
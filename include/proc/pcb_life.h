@@ -17,6 +17,7 @@
 // #define SHELL_PID 2
 
 struct file;
+struct fdtable;
 struct inode;
 struct rlimit;
 
@@ -48,7 +49,7 @@ struct proc {
     // memory management
     struct mm_struct *mm;
     // open files table
-    struct file *ofile[NOFILE];
+    struct fdtable *files;
     int max_ofile;
     int cur_ofile;
     // current directory
@@ -63,8 +64,6 @@ struct proc {
     struct thread_group *tg;
     // for clone
     pid_t ctid;
-    // thread lock
-    struct semaphore tlock;
     // ipc name space
     struct ipc_namespace *ipc_ns;
     // system V shared memory
@@ -74,6 +73,10 @@ struct proc {
     // for waitpid
     struct semaphore sem_wait_chan_parent;
     struct semaphore sem_wait_chan_self;
+    // for vfork, the child runs in the mm of parent until exec or exit
+    int vfork;                   // the parent sleeps on vfork_done
+    struct mm_struct *vfork_mm;  // own mm of child while borrowing
+    struct semaphore vfork_done;
     // for setitimer
     struct timer_list real_timer;
     // for futex
@@ -122,6 +125,7 @@ void proc_prlimit_init(struct proc *p);
 
 // ======================= the life of a process =====================
 int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid);
+void vfork_release(struct proc *p);
 void exit_wakeup(struct proc *p, struct tcb *t); // for futex
 void do_exit_group(struct proc *p);
 void do_exit(int status);
@@ -9,6 +9,7 @@
 
 #define MIN_PDFLUSH_THREADS 2
 #define MAX_PDFLUSH_THREADS 4
+#define PDFLUSH_NICE 10 // background write back
 
 struct pdflush {
     struct list_head entry;
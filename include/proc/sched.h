@@ -7,6 +7,36 @@
 struct proc;
 struct tcb;
 
+// scheduling policy
+#define SCHED_NORMAL 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+#define SCHED_BATCH 3
+#define SCHED_IDLE 5
+
+#define rt_policy(policy) ((policy) == SCHED_FIFO || (policy) == SCHED_RR)
+#define fair_policy(policy) ((policy) == SCHED_NORMAL || (policy) == SCHED_BATCH || (policy) == SCHED_IDLE)
+
+#define MAX_RT_PRIO 99
+#define MIN_RT_PRIO 1
+#define MIN_NICE -20
+#define MAX_NICE 19
+#define NICE_WIDTH 40
+
+// for setpriority/getpriority
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
+
+/* configuration option (ns) */
+#define SCHED_LATENCY_NS 6000000UL         // period in which every fair thread runs once
+#define SCHED_MIN_GRANULARITY_NS 750000UL  // minimal slice of a fair thread
+#define SCHED_RR_TIMESLICE_NS 100000000UL  // slice of SCHED_RR thread
+
+struct sched_param {
+    int sched_priority;
+};
+
 void PCB_Q_ALL_INIT(void);
 void PCB_Q_changeState(struct proc *, enum procstate);
 
@@ -18,6 +48,10 @@ void thread_wakeup(struct tcb *t);
 void thread_yield(void);
 
 int thread_sched(void);
+int thread_need_resched(void);
+void sched_fork(struct tcb *t, struct tcb *parent);
+int sched_setscheduler(struct tcb *t, int policy, int rt_priority);
+int sched_setnice(struct tcb *t, int nice);
 void thread_scheduler(void) __attribute__((noreturn));
 
 // switch to context of scheduler
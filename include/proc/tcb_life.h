@@ -15,6 +15,10 @@
 #include "common.h"
 
 #define NTCB ((NPROC) * (NTCB_PER_PROC))
+#define NR_FD_HELD 4 // fds a syscall takes with argfd at most
+
+struct futex_q;
+struct file;
 
 // thread state
 enum thread_state { TCB_UNUSED,
@@ -53,6 +57,18 @@ struct tcb {
     char name[20];
     // the state of thread
     thread_state_t state;
+    // the cpu whose run queue holds it, -1 if not queued
+    int rq_cpu;
+    // the cpu it ran on last time, -1 if never scheduled
+    int last_cpu;
+    // scheduling policy and priority
+    int policy;
+    int rt_priority; // 1 ~ 99 for SCHED_FIFO/SCHED_RR
+    int nice;        // -20 ~ 19 for fair threads
+    // cpu time accounting (ns)
+    uint64 vruntime;
+    uint64 exec_start; // rdtime() when it began to run
+    uint64 sum_exec_runtime;
     // the proc pointer it belongs to
     struct proc *p;
     // thread id, global
@@ -88,6 +104,17 @@ struct tcb {
     uint64 clear_child_tid;
     // used for nanosleep and futex
     uint64 time_out;
+    // the timer of time_out, on its stack, NULL once it woke the thread up
+    struct timer_list *sleep_timer;
+    // queued in futex_wait, on its stack
+    struct futex_q *futex_q;
+    // files argfd took for the current syscall, put when it returns
+    struct file *fd_held[NR_FD_HELD];
+    int nr_fd_held;
+
+    // the last vmas found, valid while vmacache_seq matches the mm
+    struct vma *vmacache[VMACACHE_SIZE];
+    uint64 vmacache_seq;
 };
 
 // =============================== tid management =========================
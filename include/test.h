@@ -7,4 +7,7 @@ void test_execve(void);
 
 void fat32_test_functions(void);
 
+void string_test(void);
+void string_bench(void);
+
 #endif // __TEST_H__
\ No newline at end of file
@@ -1,230 +1,467 @@
 #include "atomic/futex.h"
 #include "atomic/spinlock.h"
 #include "proc/sched.h"
+#include "proc/pcb_life.h"
+#include "proc/tcb_life.h"
+#include "memory/vma.h"
+#include "memory/allocator.h"
+#include "memory/vm.h"
+#include "memory/buddy.h"
+#include "kernel/trap.h"
+#include "lib/timer.h"
 #include "lib/list.h"
-#include "lib/queue.h"
 #include "common.h"
 #include "debug.h"
-#include "lib/hash.h"
-#include "common.h"
 
-extern struct hash_table futex_map;
+static struct futex_hash_bucket *futex_queues;
+static int futex_hashbits;
+
+void futex_init(void) {
+    // about one bucket per thread
+    for (futex_hashbits = 4; (1 << futex_hashbits) < NTCB; futex_hashbits++)
+        ;
+    futex_queues = kzalloc((1 << futex_hashbits) * sizeof(struct futex_hash_bucket));
+    if (futex_queues == NULL)
+        panic("futex_init : no memory\n");
+    for (int i = 0; i < (1 << futex_hashbits); i++) {
+        initlock(&futex_queues[i].lock, "futex_bucket");
+        INIT_LIST_HEAD(&futex_queues[i].chain);
+    }
+    Info("futex init [ok], %d buckets\n", 1 << futex_hashbits);
+}
 
-void futex_init(struct futex *fp, char *name) {
-    initlock(&fp->lock, name);
-    Queue_init(&fp->waiting_queue, name, TCB_WAIT_QUEUE);
+static struct futex_hash_bucket *hash_futex(struct futex_key *key) {
+    uint64 h = ((key->addr >> 2) ^ (uint64)key->mm) * 0x9e3779b97f4a7c15UL;
+    return &futex_queues[h >> (64 - futex_hashbits)];
 }
 
-// it is promised to be atomic
-struct futex *get_futex(uint64 uaddr, int assert) {
-    struct hash_node *node;
+static inline int match_futex(struct futex_key *a, struct futex_key *b) {
+    return a->addr == b->addr && a->mm == b->mm;
+}
 
-    node = hash_lookup(&futex_map, (void *)uaddr, NULL, 1, 0); // release it, not holding lock
-    if (node) {
-        // find it
-        return (struct futex *)(node->value);
-    } else {
-        if (assert == 1) {
-            return NULL;
+// where the pte of uaddr maps the word now, NULL if it doesn't. never faults
+static uint32 *futex_walk(struct mm_struct *mm, uint64 uaddr, int write) {
+    pte_t *pte;
+    int level = walk(mm->pagetable, uaddr, 0, 0, &pte);
+
+    if (pte == NULL || !(*pte & PTE_V) || !(*pte & PTE_U) || !(*pte & PTE_R) || (write && !(*pte & PTE_W)))
+        return NULL;
+    if (level == SUPERPAGE)
+        return (uint32 *)(PTE2PA(*pte) + (uaddr - SUPERPG_DOWN(uaddr)));
+    return (uint32 *)(PTE2PA(*pte) + (uaddr - PGROUNDDOWN(uaddr)));
+}
+
+// drop the page reference of get_futex_key
+static void put_futex_key(uint32 *kaddr) {
+    kfree((void *)page_to_pa(compound_head(pa_to_page((uint64)kaddr))));
+}
+
+// find the key of uaddr, and where the kernel reads the word
+// the page is faulted in here, not under a bucket lock. with kaddr, the page
+// is held until put_futex_key : munmap or a cow break can't free it meanwhile,
+// a caller checks with futex_walk that uaddr still maps it
+static int get_futex_key(uint64 uaddr, int op, struct futex_key *key, uint32 **kaddr, int write) {
+    struct mm_struct *mm = proc_current()->mm;
+    uint64 pa;
+
+    if (uaddr % sizeof(uint32))
+        return -EINVAL;
+    for (;;) {
+        if ((pa = get_user_pa(uaddr, write)) == 0)
+            return -EFAULT;
+        if (kaddr == NULL)
+            break;
+        // munmap frees the page holding mm->lock
+        acquire(&mm->lock);
+        if ((*kaddr = futex_walk(mm, uaddr, write)) != NULL) {
+            share_page((uint64)*kaddr);
+            pa = (uint64)*kaddr;
+            release(&mm->lock);
+            break;
         }
-        // create it
-        struct futex *fp = (struct futex *)kzalloc(sizeof(struct futex));
-        if (fp == NULL) {
-            printf("mm : %d\n", get_free_mem());
-        panic("get_futex : no free space\n");
+        release(&mm->lock);
+    }
+
+    key->addr = uaddr;
+    key->mm = mm;
+    if (!(op & FUTEX_PRIVATE_FLAG)) {
+        struct vma *vma = find_vma_for_va(mm, uaddr);
+        if (vma && (vma->perm & PERM_SHARED)) {
+            key->addr = pa;
+            key->mm = NULL;
         }
-        futex_init(fp, "futex");
-        hash_insert(&futex_map, (void *)uaddr, (void *)fp, 0); // not holding lock
-        return fp;
     }
+    return 0;
 }
 
-// remember to release its memory
-void futex_free(uint64 uaddr) {
-    hash_delete(&futex_map, (void *)uaddr, 0, 1); // not holding lock, release lock
-    // printfGreen("mm ++: %d\n", get_free_mem());
+// lock both buckets, in address order
+static void double_lock_hb(struct futex_hash_bucket *hb1, struct futex_hash_bucket *hb2) {
+    if (hb1 > hb2) {
+        struct futex_hash_bucket *tmp = hb1;
+        hb1 = hb2;
+        hb2 = tmp;
+    }
+    acquire(&hb1->lock);
+    if (hb1 != hb2)
+        acquire(&hb2->lock);
 }
 
-int futex_wait(uint64 uaddr, uint val, struct timespec *ts) {
-    uint u_val;
-    struct proc *p = proc_current();
+static void double_unlock_hb(struct futex_hash_bucket *hb1, struct futex_hash_bucket *hb2) {
+    release(&hb1->lock);
+    if (hb1 != hb2)
+        release(&hb2->lock);
+}
 
-    acquire(&p->lock);
-    if (copyin(p->mm->pagetable, (char *)&u_val, uaddr, sizeof(uint)) < 0) {
-        release(&p->lock);
-        return -1;
+// lock the bucket of q, its key changes when it is requeued
+static struct futex_hash_bucket *futex_q_lock(struct futex_q *q) {
+    for (;;) {
+        struct futex_hash_bucket *hb = hash_futex(&q->key);
+        acquire(&hb->lock);
+        if (hb == hash_futex(&q->key))
+            return hb;
+        release(&hb->lock);
     }
+}
 
-    if (u_val == val) {
-        struct futex *fp = get_futex(uaddr, 0); // without assert
-        struct tcb *t = thread_current();
+// holding the lock of the bucket of q
+// q is on the stack of its task, don't touch it once the task runs
+static void futex_wake_q(struct futex_q *q) {
+    struct tcb *t = q->task;
 
-        acquire(&t->lock);
-        TCB_Q_changeState(t, TCB_SLEEPING);
-        Queue_push_back(&fp->waiting_queue, t);
+    list_del_reinit(&q->list);
+    acquire(&t->lock);
+    // t->futex_q is cleared by futex_exit, t is being freed
+    if (t->state == TCB_SLEEPING && t->futex_q == q)
+        TCB_Q_changeState(t, TCB_RUNNABLE);
+    release(&t->lock);
+}
 
-        release(&p->lock);
-        if (ts != NULL) {
-            t->time_out = TIMESEPC2NS((*ts));
-        }
-        t->wait_chan_entry = &fp->waiting_queue; // !!!!!
+static void futex_timeout(void *data) {
+    struct futex_q *q = (struct futex_q *)data;
+    struct futex_hash_bucket *hb = futex_q_lock(q);
 
-#ifdef __DEBUG_FUTEX__
-        printfYELLOW("futex wait sleep, fp : %x, tid : %d, timeout : %d ns (%d s), uaddr %x\n", fp, t->tid, t->time_out, t->time_out / 1000 / 1000 / 1000, uaddr);
-#endif
-        int ret = thread_sched();
-        release(&t->lock);
+    if (!list_empty(&q->list)) {
+        q->timed_out = 1;
+        futex_wake_q(q);
+    }
+    release(&hb->lock);
+}
+
+// ns : relative timeout, 0 : none
+static int futex_wait(uint64 uaddr, int op, uint32 val, uint64 ns, uint32 bitset) {
+    struct tcb *t = thread_current();
+    struct futex_hash_bucket *hb;
+    struct futex_q q;
+    uint32 *kaddr;
+    int ret;
+
+    if (bitset == 0)
+        return -EINVAL;
+again:
+    if ((ret = get_futex_key(uaddr, op, &q.key, &kaddr, 0)) < 0)
+        return ret;
+    q.task = t;
+    q.bitset = bitset;
+    q.timed_out = 0;
+    INIT_LIST_HEAD(&q.list);
+
+    hb = hash_futex(&q.key);
+    acquire(&hb->lock);
+    // a cow break moved the word, the old copy never changes again
+    if (futex_walk(t->p->mm, uaddr, 0) != kaddr) {
+        release(&hb->lock);
+        put_futex_key(kaddr);
+        goto again;
+    }
+    // a waker changes the word before it takes the bucket lock
+    if (__atomic_load_n(kaddr, __ATOMIC_ACQUIRE) != val) {
+        release(&hb->lock);
+        put_futex_key(kaddr);
+        return -EAGAIN;
+    }
+    put_futex_key(kaddr);
+    list_add_tail(&q.list, &hb->chain);
+    timer_list_init(&q.timer);
+    if (ns) {
+        q.timer.count = 1; // only once
+        add_timer_atomic(&q.timer, ns, futex_timeout, &q);
+    }
 
 #ifdef __DEBUG_FUTEX__
-        if (ts != NULL) {
-            if (ret)
-                printfMAGENTA("futex wait wakeup, tid : %d, after time out wakeup, uaddr %x\n", t->tid, uaddr);
-            else
-                printfBlue("futex wait wakeup, tid : %d, before time out wakeup, uaddr %x\n", t->tid, uaddr);
-        }
+    printfYELLOW("futex wait sleep, tid : %d, timeout : %d ns, uaddr %x\n", t->tid, ns, uaddr);
 #endif
-        if (ts != NULL)
-            return ret ? -1 : 0;
-        else
-            return 0;
+    acquire(&t->lock);
+    t->futex_q = &q;
+    TCB_Q_changeState(t, TCB_SLEEPING);
+    release(&hb->lock);
+    thread_sched();
+    t->futex_q = NULL;
+    release(&t->lock);
+
+    if (ns)
+        delete_timer_atomic(&q.timer);
+    hb = futex_q_lock(&q);
+    if (!list_empty(&q.list)) {
+        // still queued : woken up by a signal, see thread_wakeup
+        list_del_reinit(&q.list);
+        ret = -EINTR;
     } else {
-        release(&p->lock);
-        return 0;
+        ret = q.timed_out ? -ETIMEDOUT : 0;
     }
+    release(&hb->lock);
+
+#ifdef __DEBUG_FUTEX__
+    printfBlue("futex wait wakeup, tid : %d, ret : %d, uaddr %x\n", t->tid, ret, uaddr);
+#endif
+    return ret;
 }
 
-int futex_wakeup(uint64 uaddr, int nr_wake) {
-    struct proc *p = proc_current();
-    acquire(&p->lock);
+// t is freed while it waits, by do_exit_group, holding t->lock
+void futex_exit(struct tcb *t) {
+    struct futex_q *q = t->futex_q;
+    struct futex_hash_bucket *hb;
+
+    // nobody wakes t up from now on, see futex_wake_q
+    t->futex_q = NULL;
+    // the bucket lock is taken before t->lock
+    release(&t->lock);
+    hb = futex_q_lock(q);
+    if (!list_empty(&q->list))
+        list_del_reinit(&q->list);
+    release(&hb->lock);
+    // q is on the stack of t, wait for its timeout to return
+    delete_timer_atomic(&q->timer);
+    acquire(&t->lock);
+}
 
-    // ========atomic=========
-    struct futex *fp = get_futex(uaddr, 1); // with assert
-    if (fp == NULL) {
-        release(&p->lock);
-        return 0;
+// holding hb->lock
+static int __futex_wake(struct futex_hash_bucket *hb, struct futex_key *key, int nr_wake, uint32 bitset) {
+    struct futex_q *q, *tmp;
+    int ret = 0;
+
+    list_for_each_entry_safe(q, tmp, &hb->chain, list) {
+        if (ret >= nr_wake)
+            break;
+        if (match_futex(&q->key, key) && (q->bitset & bitset)) {
+            futex_wake_q(q);
+            ret++;
+        }
     }
+    return ret;
+}
 
-    struct tcb *t = NULL;
-    int ret = 0;
+static int futex_wake(uint64 uaddr, int op, int nr_wake, uint32 bitset) {
+    struct futex_hash_bucket *hb;
+    struct futex_key key;
+    int ret;
+
+    if (bitset == 0)
+        return -EINVAL;
+    if ((ret = get_futex_key(uaddr, op, &key, NULL, 0)) < 0)
+        return ret;
+    hb = hash_futex(&key);
+    acquire(&hb->lock);
+    ret = __futex_wake(hb, &key, nr_wake, bitset);
+    release(&hb->lock);
+    return ret;
+}
 
-    while (!Queue_isempty(&fp->waiting_queue) && ret < nr_wake) {
-        t = (struct tcb *)Queue_provide_atomic(&fp->waiting_queue, 1); // remove it
+// wake up at most one thread waiting on the tid word of an exiting thread
+int futex_wakeup(uint64 uaddr, int nr_wake) {
+    return futex_wake(uaddr, 0, nr_wake, FUTEX_BITSET_MATCH_ANY);
+}
 
-        if (t == NULL)
-            panic("futex wakeup : no waiting queue");
-        if (t->state != TCB_SLEEPING) {
-            printf("%s\n", fp->waiting_queue.name);
-            printf("%s\n", t->state);
-            panic("futex wakeup : this thread is not sleeping");
+// wake up nr_wake threads on uaddr1, move at most nr_requeue of the rest to uaddr2
+// cmpval : FUTEX_CMP_REQUEUE only, uaddr1 must still hold it
+static int futex_requeue(uint64 uaddr1, int op, int nr_wake, uint64 uaddr2, int nr_requeue, uint32 *cmpval) {
+    struct futex_hash_bucket *hb1, *hb2;
+    struct futex_key key1, key2;
+    struct futex_q *q, *tmp;
+    uint32 *kaddr1;
+    int ret, woken = 0, requeued = 0;
+
+    if (nr_wake < 0 || nr_requeue < 0)
+        return -EINVAL;
+again:
+    if ((ret = get_futex_key(uaddr1, op, &key1, cmpval ? &kaddr1 : NULL, 0)) < 0)
+        return ret;
+    if ((ret = get_futex_key(uaddr2, op, &key2, NULL, 0)) < 0)
+        goto out;
+    hb1 = hash_futex(&key1);
+    hb2 = hash_futex(&key2);
+
+    double_lock_hb(hb1, hb2);
+    if (cmpval) {
+        if (futex_walk(proc_current()->mm, uaddr1, 0) != kaddr1) {
+            double_unlock_hb(hb1, hb2);
+            put_futex_key(kaddr1);
+            goto again;
+        }
+        if (__atomic_load_n(kaddr1, __ATOMIC_ACQUIRE) != *cmpval) {
+            double_unlock_hb(hb1, hb2);
+            ret = -EAGAIN;
+            goto out;
         }
-        acquire(&t->lock);
-        ASSERT(t->wait_chan_entry != NULL);
-        t->wait_chan_entry = NULL;
-        TCB_Q_changeState(t, TCB_RUNNABLE);
-#ifdef __DEBUG_FUTEX__
-        printfGreen("tid : %d futex wakeup tid : %d, uaddr : %x\n", thread_current()->tid, t->tid, uaddr);
-#endif
-        release(&t->lock);
-        ret++;
     }
-
-    if (Queue_isempty_atomic(&fp->waiting_queue)) {
-#ifdef __DEBUG_FUTEX__
-        printf("wakeup futex free, fp : %x, uaddr : %x\n", fp, uaddr);
-#endif
-        futex_free(uaddr); // !!! avoid memory leak
+    list_for_each_entry_safe(q, tmp, &hb1->chain, list) {
+        if (!match_futex(&q->key, &key1))
+            continue;
+        if (woken < nr_wake) {
+            futex_wake_q(q);
+            woken++;
+        } else if (requeued < nr_requeue) {
+            q->key = key2;
+            if (hb1 != hb2)
+                list_move_tail(&q->list, &hb2->chain);
+            requeued++;
+        } else {
+            break;
+        }
     }
-
-    // ==========atomic==========
-    release(&p->lock);
+    double_unlock_hb(hb1, hb2);
+    ret = woken + requeued;
+out:
+    if (cmpval)
+        put_futex_key(kaddr1);
     return ret;
 }
 
-// 唤醒最多nr_wake个在uaddr1队列上等待的线程，其余的线程阻塞在uaddr2的队列
-int futex_requeue(uint64 uaddr1, int nr_wake, uint64 uaddr2, int nr_requeue) {
-    futex_wakeup(uaddr1, nr_wake);
-    // int nr_wake1 = futex_wakeup(uaddr1, nr_wake);
-    // #ifdef __DEBUG_FUTEX__
-    // printfRed("futex_requeue : has wakeup %d threads in uaddr1 : %x\n", nr_wake1, uaddr1); // debug
-    // #endif
-
-    struct proc *p = proc_current();
+// do the op of val3 on *kaddr atomically, return the old value
+static int futex_atomic_op(uint32 *kaddr, uint32 encoded_op, uint32 *oldval) {
+    int op = (encoded_op >> 28) & 7;
+    int oparg = (int)(encoded_op << 8) >> 20; // sign extended
+    uint32 old;
 
-    acquire(&p->lock);
-    // ==========atomic=========
-    struct futex *fp_old = get_futex(uaddr1, 1); // with assert
-    if (fp_old == NULL) {
-        release(&p->lock);
-        return 0;
+    if (encoded_op & (FUTEX_OP_OPARG_SHIFT << 28)) {
+        if (oparg < 0 || oparg > 31)
+            return -EINVAL;
+        oparg = 1 << oparg;
+    }
+    switch (op) {
+    case FUTEX_OP_SET: old = __atomic_exchange_n(kaddr, oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_ADD: old = __atomic_fetch_add(kaddr, oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_OR: old = __atomic_fetch_or(kaddr, oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_ANDN: old = __atomic_fetch_and(kaddr, ~oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_XOR: old = __atomic_fetch_xor(kaddr, oparg, __ATOMIC_SEQ_CST); break;
+    default:
+        return -ENOSYS;
     }
+    *oldval = old;
+    return 0;
+}
 
-    struct futex *fp_new = get_futex(uaddr2, 0); // without assert
-    if (fp_new == NULL) {
-        panic("not tested\n");
+static int futex_op_cmp(uint32 encoded_op, uint32 oldval) {
+    int cmp = (encoded_op >> 24) & 15;
+    int cmparg = (int)(encoded_op << 20) >> 20; // sign extended
+    int old = (int)oldval;
+
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ: return old == cmparg;
+    case FUTEX_OP_CMP_NE: return old != cmparg;
+    case FUTEX_OP_CMP_LT: return old < cmparg;
+    case FUTEX_OP_CMP_LE: return old <= cmparg;
+    case FUTEX_OP_CMP_GT: return old > cmparg;
+    case FUTEX_OP_CMP_GE: return old >= cmparg;
+    default:
+        return -ENOSYS;
     }
-    struct tcb *t = NULL;
-    int ret = 0;
+}
 
-    while (!Queue_isempty_atomic(&fp_old->waiting_queue) && ret < nr_requeue) {
-        t = (struct tcb *)Queue_provide_atomic(&fp_old->waiting_queue, 1); // remove it
-        if (t == NULL)
-            panic("futex requeue : no waiting queue") ;
-        if (t->state != TCB_SLEEPING) {
-            printf("%s\n", fp_old->waiting_queue.name);
-            printf("%s\n", t->state);
-            panic("futex requeue : this thread is not sleeping");
-        }
-        Queue_push_back_atomic(&fp_new->waiting_queue, (void *)t); // move the rest of threads to new queue
-        ret++;
-#ifdef __DEBUG_FUTEX__
-        printfGreen("tid : %d futex requeue tid : %d from uaddr1 : %x to uaddr2 : %x\n", thread_current()->tid, t->tid, uaddr1, uaddr2);
-#endif
+// change uaddr2 by encoded_op, wake up nr_wake threads on uaddr1,
+// and nr_wake2 on uaddr2 if its old value passes the compare
+static int futex_wake_op(uint64 uaddr1, int op, int nr_wake, uint64 uaddr2, int nr_wake2, uint32 encoded_op) {
+    struct futex_hash_bucket *hb1, *hb2;
+    struct futex_key key1, key2;
+    uint32 *kaddr2, oldval;
+    int ret, cmp;
+
+    if ((ret = get_futex_key(uaddr1, op, &key1, NULL, 0)) < 0)
+        return ret;
+again:
+    if ((ret = get_futex_key(uaddr2, op, &key2, &kaddr2, 1)) < 0)
+        return ret;
+    hb1 = hash_futex(&key1);
+    hb2 = hash_futex(&key2);
+
+    double_lock_hb(hb1, hb2);
+    // a cow break or munmap took the page from uaddr2, don't write it
+    if (futex_walk(proc_current()->mm, uaddr2, 1) != kaddr2) {
+        double_unlock_hb(hb1, hb2);
+        put_futex_key(kaddr2);
+        goto again;
     }
-    if (Queue_isempty_atomic(&fp_old->waiting_queue)) {
-#ifdef __DEBUG_FUTEX__
-        printf("requeue futex free, fp : %x, uaddr : %x\n", fp_old, uaddr1);
-#endif
-        futex_free(uaddr1); // !!! avoid memory leak
+    if ((ret = futex_atomic_op(kaddr2, encoded_op, &oldval)) < 0) {
+        double_unlock_hb(hb1, hb2);
+        goto out;
     }
-
-    // ========atomic========
-    release(&p->lock);
-
+    ret = __futex_wake(hb1, &key1, nr_wake, FUTEX_BITSET_MATCH_ANY);
+    if ((cmp = futex_op_cmp(encoded_op, oldval)) < 0) {
+        double_unlock_hb(hb1, hb2);
+        ret = cmp;
+        goto out;
+    }
+    if (cmp)
+        ret += __futex_wake(hb2, &key2, nr_wake2, FUTEX_BITSET_MATCH_ANY);
+    double_unlock_hb(hb1, hb2);
+out:
+    put_futex_key(kaddr2);
     return ret;
 }
 
-// #ifdef __DEBUG_FUTEX__
-// static char *futex_cmd[] = {
-//     [FUTEX_WAIT] "futex_wait",
-//     [FUTEX_WAKE] "futex_wake",
-//     [FUTEX_REQUEUE] "futex_requeue"};
-// #endif
+// relative ns of the timeout of a wait, 0 : none
+// FUTEX_WAIT has a relative timeout, FUTEX_WAIT_BITSET an absolute one
+static int futex_timeout_ns(int cmd, struct timespec *ts, uint64 *ns) {
+    uint64 t;
+
+    *ns = 0;
+    if (ts == NULL)
+        return 0;
+    if (ts->ts_nsec >= 1000000000)
+        return -EINVAL;
+    t = TIMESEPC2NS((*ts));
+    if (cmd == FUTEX_WAIT_BITSET) {
+        uint64 time = rdtime();
+        uint64 now = time / FREQUENCY * 1000000000 + time % FREQUENCY * 1000000000 / FREQUENCY;
+        if (t <= now)
+            return -ETIMEDOUT;
+        t -= now;
+    }
+    // a zero relative timeout still expires
+    *ns = t ? t : 1;
+    return 0;
+}
 
 int do_futex(uint64 uaddr, int op, uint32 val, struct timespec *ts,
              uint64 uaddr2, uint32 val2, uint32 val3) {
     int cmd = op & FUTEX_CMD_MASK;
+    uint64 ns;
+    int ret;
 
-    int ret = -1;
     switch (cmd) {
     case FUTEX_WAIT:
-        ret = futex_wait(uaddr, val, ts);
-        break;
+        val3 = FUTEX_BITSET_MATCH_ANY;
+        // fall through
+    case FUTEX_WAIT_BITSET:
+        if ((ret = futex_timeout_ns(cmd, ts, &ns)) < 0)
+            return ret;
+        return futex_wait(uaddr, op, val, ns, val3);
 
     case FUTEX_WAKE:
-        ret = futex_wakeup(uaddr, val);
-        break;
+        val3 = FUTEX_BITSET_MATCH_ANY;
+        // fall through
+    case FUTEX_WAKE_BITSET:
+        return futex_wake(uaddr, op, val, val3);
 
     case FUTEX_REQUEUE:
-        ret = futex_requeue(uaddr, val, uaddr2, val2); // must use val2 as a limit of requeue
-        break;
+        return futex_requeue(uaddr, op, val, uaddr2, val2, NULL);
+
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(uaddr, op, val, uaddr2, val2, &val3);
+
+    case FUTEX_WAKE_OP:
+        return futex_wake_op(uaddr, op, val, uaddr2, val2, val3);
 
     default:
-        panic("do_futex : error\n");
-        break;
+        return -ENOSYS;
     }
-
-    // #ifdef __DEBUG_FUTEX__
-    //         printfMAGENTA("futex, futex_cmd : %s, retval %d\n",futex_cmd[cmd], ret);
-    // #endif
-    return ret;
-}
\ No newline at end of file
+}
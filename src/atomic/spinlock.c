@@ -35,7 +35,7 @@ char *blacklist[DEBUG_LOCK_BLACKLIST] = {
     "proc_0",
     "proc_1",
     // "proc_2",
-    "timer_entry",
+    "timer_base",
     "cons",
 };
 
@@ -0,0 +1,40 @@
+#include "common.h"
+#include "atomic/spinlock.h"
+#include "atomic/wait_queue.h"
+#include "lib/list.h"
+#include "debug.h"
+
+void init_waitqueue_head(struct wait_queue_head *wq, char *name) {
+    initlock(&wq->lock, name);
+    INIT_LIST_HEAD(&wq->head);
+}
+
+void init_waitqueue_entry(struct wait_queue_entry *wait, wait_queue_func_t func, void *private) {
+    INIT_LIST_HEAD(&wait->list);
+    wait->func = func;
+    wait->private = private;
+}
+
+void add_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait) {
+    acquire(&wq->lock);
+    list_add_tail(&wait->list, &wq->head);
+    release(&wq->lock);
+}
+
+// after it returns, wait->func is not running and will never be called
+void remove_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait) {
+    acquire(&wq->lock);
+    list_del_reinit(&wait->list);
+    release(&wq->lock);
+}
+
+// may be called in interrupt context
+void wake_up(struct wait_queue_head *wq) {
+    struct wait_queue_entry *wait = NULL;
+
+    acquire(&wq->lock);
+    list_for_each_entry(wait, &wq->head, list) {
+        wait->func(wait);
+    }
+    release(&wq->lock);
+}
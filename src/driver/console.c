@@ -23,8 +23,11 @@
 #include "ipc/signal.h"
 #include "atomic/cond.h"
 #include "atomic/semaphore.h"
+#include "atomic/wait_queue.h"
 #include "kernel/trap.h"
 #include "fs/stat.h"
+#include "fs/poll.h"
+#include "lib/poll.h"
 #include "debug.h"
 
 #include "termios.h"
@@ -71,6 +74,7 @@ struct console {
 
     struct semaphore sem_r;
     struct semaphore sem_w;
+    struct wait_queue_head poll_wq; // poll, select and epoll
 } cons;
 
 //
@@ -169,6 +173,7 @@ void consoleintr(char c) {
             cons.buf[cons.e++ % INPUT_BUF_SIZE] = c;
             cons.w = cons.e;
             sema_signal(&cons.sem_r);
+            wake_up(&cons.poll_wq);
         }
         release(&cons.lock);
         return;
@@ -207,6 +212,7 @@ void consoleintr(char c) {
                 // has arrived.
                 cons.w = cons.e;
                 sema_signal(&cons.sem_r);
+                wake_up(&cons.poll_wq);
             }
         }
         break;
@@ -215,9 +221,22 @@ void consoleintr(char c) {
     release(&cons.lock);
 }
 
+// output never blocks, input is ready once a line (or a char in raw mode) arrives
+uint consolepoll(struct file *f, struct poll_table *pt) {
+    uint mask = POLLOUT | POLLWRNORM;
+
+    poll_wait(f, &cons.poll_wq, pt);
+    acquire(&cons.lock);
+    if (cons.r != cons.w)
+        mask |= POLLIN | POLLRDNORM;
+    release(&cons.lock);
+    return mask;
+}
+
 void consoleinit(void) {
     initlock(&cons.lock, "cons");
     sema_init(&cons.sem_r, 0, "cons_sema_r");
+    init_waitqueue_head(&cons.poll_wq, "cons_poll");
     cons.e = cons.w = cons.r = 0;
 
     uartinit();
@@ -226,6 +245,7 @@ void consoleinit(void) {
     // to consoleread and consolewrite.
     devsw[CONSOLE].read = consoleread;
     devsw[CONSOLE].write = consolewrite;
+    devsw[CONSOLE].poll = consolepoll;
     Info("uart and console init [ok]\n");
 }
 
@@ -5,32 +5,137 @@
 #include "fs/bio.h"
 #include "lib/list.h"
 #include "memory/allocator.h"
-#include "driver/disk.h"
+#include "memory/slab.h"
+#include "fs/blk_queue.h"
+#include "proc/pdflush.h"
 #include "debug.h"
 
 // int hit;
 // int total; // debug
 
-struct {
+struct bcache_bucket {
     struct spinlock lock;
-    struct buffer_head buf[NBUF];
-    list_head_t head;
+    struct list_head head;
+};
+
+struct {
+    // protect hash list, bucket index and refcnt of buffers in this bucket
+    struct bcache_bucket buckets[BCACHE_NBUCKET];
+
+    // unhashed buffers, never used or lost a race in bget
+    struct spinlock free_lock;
+    struct list_head free_list;
+
+    struct buffer_head **bufs; // for the clock
+    int nbuf;
+    atomic_t clock_hand;
+    atomic_t nr_dirty;
+    atomic_t flushing; // a flush work has been given to pdflush
 } bcache;
 
+// object cache of buffer_head
+static struct kmem_cache *buffer_head_cachep;
+// object cache of bio_vec
+struct kmem_cache *bio_vec_cachep;
+
+static inline int bcache_hash(uint dev, uint blockno) {
+    return (dev * 31 + blockno) % BCACHE_NBUCKET;
+}
+
+// size the cache using free memory at boot
+static int bcache_size(void) {
+    uint64 nbuf = (get_free_mem() >> BCACHE_MEM_SHIFT) / sizeof(struct buffer_head);
+    return MIN(MAX(nbuf, NBUF), BCACHE_MAX_NBUF);
+}
+
 void binit(void) {
     struct buffer_head *b;
 
-    initlock(&bcache.lock, "bcache");
+    for (int i = 0; i < BCACHE_NBUCKET; i++) {
+        initlock(&bcache.buckets[i].lock, "bcache");
+        INIT_LIST_HEAD(&bcache.buckets[i].head);
+    }
+    initlock(&bcache.free_lock, "bcache");
+    INIT_LIST_HEAD(&bcache.free_list);
+    atomic_set(&bcache.clock_hand, 0);
+    atomic_set(&bcache.nr_dirty, 0);
+    atomic_set(&bcache.flushing, 0);
 
-    INIT_LIST_HEAD(&bcache.head);
-    for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    buffer_head_cachep = kmem_cache_create("buffer_head", sizeof(struct buffer_head));
+    ASSERT(buffer_head_cachep != NULL);
+    bcache.nbuf = bcache_size();
+    bcache.bufs = (struct buffer_head **)kmalloc(bcache.nbuf * sizeof(struct buffer_head *));
+    ASSERT(bcache.bufs != NULL);
+    for (int i = 0; i < bcache.nbuf; i++) {
+        if ((b = (struct buffer_head *)kmem_cache_zalloc(buffer_head_cachep)) == NULL)
+            panic("binit : no free memory\n");
         sema_init(&b->sem_lock, 1, "buffer");
         sema_init(&b->sem_disk_done, 0, "buffer_disk_done");
-        list_add(&b->lru, &bcache.head);
+        b->bucket = -1;
+        list_add(&b->hash, &bcache.free_list);
+        bcache.bufs[i] = b;
     }
+
+    bio_vec_cachep = kmem_cache_create("bio_vec", sizeof(struct bio_vec));
+    ASSERT(bio_vec_cachep != NULL);
     Info("========= Information of block buffer cache ==========\n");
-    Info("number of block buffer cache : %d\n", NBUF);
+    Info("number of block buffer cache : %d\n", bcache.nbuf);
     Info("block buffer cache init [ok]\n");
+    blk_queue_init();
+}
+
+// holding the lock of bucket
+static struct buffer_head *bcache_lookup(struct bcache_bucket *bkt, uint dev, uint blockno) {
+    struct buffer_head *b;
+    list_for_each_entry(b, &bkt->head, hash) {
+        if (b->dev == dev && b->blockno == blockno)
+            return b;
+    }
+    return NULL;
+}
+
+// take an unhashed buffer from free list, or evict a clean, unused buffer by clock.
+// the buffer returned is unhashed with refcnt 1
+static struct buffer_head *bcache_evict(void) {
+    struct buffer_head *b = NULL;
+
+    acquire(&bcache.free_lock);
+    if (!list_empty(&bcache.free_list)) {
+        b = list_first_entry(&bcache.free_list, struct buffer_head, hash);
+        list_del_reinit(&b->hash);
+        atomic_set(&b->refcnt, 1);
+        release(&bcache.free_lock);
+        return b;
+    }
+    release(&bcache.free_lock);
+
+    // two rounds, the first may only clear the referenced bit
+    for (int i = 0; i < 2 * bcache.nbuf; i++) {
+        // atomic_inc_return returns the old value
+        b = bcache.bufs[(uint)atomic_inc_return(&bcache.clock_hand) % bcache.nbuf];
+        int idx = b->bucket;
+        if (idx < 0 || atomic_read(&b->refcnt) != 0 || b->dirty)
+            continue;
+
+        struct bcache_bucket *bkt = &bcache.buckets[idx];
+        acquire(&bkt->lock);
+        // check again, it may have changed
+        if (b->bucket != idx || atomic_read(&b->refcnt) != 0 || b->dirty) {
+            release(&bkt->lock);
+            continue;
+        }
+        if (b->referenced) {
+            b->referenced = 0;
+            release(&bkt->lock);
+            continue;
+        }
+        list_del_reinit(&b->hash);
+        b->bucket = -1;
+        atomic_set(&b->refcnt, 1);
+        release(&bkt->lock);
+        return b;
+    }
+    return NULL;
 }
 
 // Look through buffer cache for block on device dev.
@@ -38,35 +143,66 @@ void binit(void) {
 // In either case, return locked buffer.
 static struct buffer_head *bget(uint dev, uint blockno) {
     struct buffer_head *b;
+    struct buffer_head *victim;
+    int idx = bcache_hash(dev, blockno);
+    struct bcache_bucket *bkt = &bcache.buckets[idx];
 
-    acquire(&bcache.lock);
     // total++;// debug
-
     // Is the block already cached?
-    list_for_each_entry(b, &bcache.head, lru) {
-        if (b->dev == dev && b->blockno == blockno) {
-            atomic_inc_return(&b->refcnt);
-            release(&bcache.lock);
-            sema_wait(&b->sem_lock);
-            // printfRed("hit : %d/%d\n",++hit, total);// debug
-            return b;
-        }
+    acquire(&bkt->lock);
+    if ((b = bcache_lookup(bkt, dev, blockno)) != NULL) {
+        atomic_inc_return(&b->refcnt);
+        release(&bkt->lock);
+        sema_wait(&b->sem_lock);
+        // printfRed("hit : %d/%d\n",++hit, total);// debug
+        return b;
     }
+    release(&bkt->lock);
 
     // Not cached.
-    // Recycle the least recently used (LRU) unused buffer.
-    list_for_each_entry_reverse(b, &bcache.head, lru) {
-        if (atomic_read(&b->refcnt) == 0) {
-            b->dev = dev;
-            b->blockno = blockno;
-            b->valid = 0;
-            atomic_set(&b->refcnt, 1);
-            release(&bcache.lock);
-            sema_wait(&b->sem_lock);
-            return b;
-        }
+    if ((victim = bcache_evict()) == NULL) {
+        // all buffers are dirty or in use, write back and try again
+        bflush(1);
+        if ((victim = bcache_evict()) == NULL)
+            panic("bget: no buffers");
+    }
+
+    acquire(&bkt->lock);
+    if ((b = bcache_lookup(bkt, dev, blockno)) != NULL) {
+        // someone else has read it in, give the victim back
+        atomic_inc_return(&b->refcnt);
+        release(&bkt->lock);
+
+        atomic_set(&victim->refcnt, 0);
+        acquire(&bcache.free_lock);
+        list_add(&victim->hash, &bcache.free_list);
+        release(&bcache.free_lock);
+
+        sema_wait(&b->sem_lock);
+        return b;
     }
-    panic("bget: no buffers");
+    b = victim;
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->referenced = 0;
+    b->bucket = idx;
+    list_add(&b->hash, &bkt->head);
+    release(&bkt->lock);
+
+    sema_wait(&b->sem_lock);
+    return b;
+}
+
+// drop a reference, not holding b->sem_lock
+static void bput(struct buffer_head *b) {
+    struct bcache_bucket *bkt = &bcache.buckets[b->bucket];
+    acquire(&bkt->lock);
+    // atomic_dec_return returns the old value
+    int ref = atomic_dec_return(&b->refcnt);
+    ASSERT(ref > 0);
+    b->referenced = 1;
+    release(&bkt->lock);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -84,35 +220,156 @@ struct buffer_head *bread(uint dev, uint blockno) {
 }
 
 // Write b's contents to disk.  Must be locked.
+// b is only marked dirty, bflush writes it back : on the periodic
+// write-back, when too many are dirty (woken by brelse), on sync and
+// in bget when no clean buffer is left
 void bwrite(struct buffer_head *b) {
-    b->dirty = 1;
+    if (b->dirty == 0) {
+        b->dirty = 1;
+        atomic_inc_return(&bcache.nr_dirty);
+    }
+}
+
+static inline void bclean(struct buffer_head *b) {
+    b->dirty = 0;
+    atomic_dec_return(&bcache.nr_dirty);
 }
 
 // buffer write back
 void bwback(struct buffer_head *b) {
     if (b->dirty == 1) {
         disk_rw_bio(b, DISK_WRITE);
-        b->dirty = 0;
+        bclean(b);
     }
 }
 
+static void bflush_work(uint64 arg) {
+    bflush(0);
+    atomic_set(&bcache.flushing, 0);
+}
+
+// wake up pdflush, if there are too many dirty buffers
+static void bflush_wakeup(void) {
+    if (atomic_read(&bcache.nr_dirty) < bcache.nbuf / BCACHE_DIRTY_RATIO)
+        return;
+    if (atomic_inc_return(&bcache.flushing) != 0)
+        return;
+    if (pdflush_operation(bflush_work, 0) < 0)
+        atomic_set(&bcache.flushing, 0);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void brelse(struct buffer_head *b) {
-    if (b->dirty == 1) {
-        disk_rw_bio(b, DISK_WRITE);
-        b->dirty = 0;
-    }
+#ifdef BCACHE_WRITE_THROUGH
+    bwback(b);
+#endif
+    sema_signal(&b->sem_lock);
+    bput(b);
+    bflush_wakeup();
+}
+
+struct bflush_req {
+    struct bio bio;
+    struct bio_vec vec;
+    struct buffer_head *b;
+    struct semaphore *done; // NULL : nobody waits
+};
+
+// interrupt context
+static void bflush_end_io(struct bio *bio) {
+    struct bflush_req *req = (struct bflush_req *)bio->bi_private;
+    struct buffer_head *b = req->b;
+    bclean(b);
     sema_signal(&b->sem_lock);
+    bput(b);
+    if (req->done != NULL)
+        sema_signal(req->done);
+    kfree(req);
+}
+
+// write back dirty buffers that nobody uses, the device queue is kept full.
+// buffers in use are written by the next flush.
+// wait : wait for the writes to finish
+void bflush(int wait) {
+    struct blk_plug plug;
+    struct semaphore done;
+    struct buffer_head *b;
+    int plugged = 0;
+    int issued = 0;
 
-    acquire(&bcache.lock);
-    atomic_dec_return(&b->refcnt);
-    if (atomic_read(&b->refcnt) == 0) {
-        list_del(&b->lru);
-        list_add(&b->lru, &bcache.head);
+    sema_init(&done, 0, "bflush_done");
+    for (int i = 0; i < bcache.nbuf; i++) {
+        b = bcache.bufs[i];
+        int idx = b->bucket;
+        if (idx < 0 || !b->dirty || atomic_read(&b->refcnt) != 0)
+            continue;
+
+        // grab a reference
+        struct bcache_bucket *bkt = &bcache.buckets[idx];
+        acquire(&bkt->lock);
+        if (b->bucket != idx || !b->dirty || atomic_read(&b->refcnt) != 0) {
+            release(&bkt->lock);
+            continue;
+        }
+        atomic_inc_return(&b->refcnt);
+        release(&bkt->lock);
+
+        sema_wait(&b->sem_lock);
+        struct bflush_req *req;
+        if (!b->dirty || (req = (struct bflush_req *)kmalloc(sizeof(struct bflush_req))) == NULL) {
+            // written by others, or no memory
+            bwback(b);
+            sema_signal(&b->sem_lock);
+            bput(b);
+            continue;
+        }
+        if (!plugged) {
+            blk_start_plug(&plug, b->dev);
+            plugged = 1;
+        }
+        // b->sem_lock is released by bflush_end_io
+        req->b = b;
+        req->done = wait ? &done : NULL;
+        init_bio(&req->bio, &req->vec, b, DISK_WRITE);
+        submit_bio_async(&req->bio, 0, bflush_end_io, req);
+        issued++;
     }
+    if (plugged)
+        blk_finish_plug(&plug);
 
-    release(&bcache.lock);
+    if (!wait)
+        return;
+    while (issued-- > 0)
+        sema_wait(&done);
+}
+
+// write back all dirty buffers and wait
+// the ones in use are written after their users release them,
+// the caller must not hold any buffer
+void bsync(void) {
+    struct buffer_head *b;
+
+    bflush(1);
+    for (int i = 0; i < bcache.nbuf; i++) {
+        b = bcache.bufs[i];
+        int idx = b->bucket;
+        if (idx < 0 || !b->dirty)
+            continue;
+
+        struct bcache_bucket *bkt = &bcache.buckets[idx];
+        acquire(&bkt->lock);
+        if (b->bucket != idx || !b->dirty) {
+            release(&bkt->lock);
+            continue;
+        }
+        atomic_inc_return(&b->refcnt);
+        release(&bkt->lock);
+
+        sema_wait(&b->sem_lock);
+        bwback(b);
+        sema_signal(&b->sem_lock);
+        bput(b);
+    }
 }
 
 // rw : DISK_READ or DISK_WRITE
@@ -123,13 +380,22 @@ void disk_rw_bio(struct buffer_head *b, int rw) {
     submit_bio(&bio_new, 0);
 }
 
+void bio_init(struct bio *bio, uint dev, int rw) {
+    INIT_LIST_HEAD(&bio->list_entry);
+    bio->bi_rw = rw;
+    bio->bi_bdev = dev;
+    atomic_set(&bio->bi_remaining, 0);
+    bio->bi_free = 0;
+    sema_init(&bio->bi_done, 0, "bio_done");
+    bio->bi_end_io = NULL;
+    bio->bi_private = NULL;
+}
+
 // we use data in stack, so we don't need to kalloc and free
 // init_bio only used in bread and bwrite, that is buffer cache
 void init_bio(struct bio *bio_p, struct bio_vec *vec_p, struct buffer_head *b, int rw) {
     // bio
-    INIT_LIST_HEAD(&bio_p->list_entry);
-    bio_p->bi_rw = rw;
-    bio_p->bi_bdev = b->dev;
+    bio_init(bio_p, b->dev, rw);
 
     // bio_vec
     sema_init(&vec_p->sem_disk_done, 0, "bio_disk_done"); // vec_p ！！！
@@ -138,25 +404,86 @@ void init_bio(struct bio *bio_p, struct bio_vec *vec_p, struct buffer_head *b, i
     vec_p->block_len = 1;
     vec_p->data = b->data;
     vec_p->disk = b->disk;
+    INIT_LIST_HEAD(&vec_p->rq_list);
+    vec_p->bi_end_io = NULL;
+    vec_p->bi_private = NULL;
 
     // join bio_vec to bio (don't forget it)
     list_add_tail(&vec_p->list, &bio_p->list_entry);
     // bug like this : list_add_tail(&bio_p->list_entr, &vec_p->list);
 }
 
-// read or write
-// free bio_vec, if necessary
-void submit_bio(struct bio *bio, int free) {
+static void bio_free_vecs(struct bio *bio) {
     struct bio_vec *vec_cur = NULL;
     struct bio_vec *vec_tmp = NULL;
     list_for_each_entry_safe(vec_cur, vec_tmp, &bio->list_entry, list) {
-        // virtio_disk_rw((void *)vec_cur, bio->bi_rw, BLOCK_SEL);
-        disk_rw((void *)vec_cur, bio->bi_rw, BLOCK_SEL);
-        if (free) {
-            kfree(vec_cur);
-            // printfGreen("submit_bio, mm ++: %d pages\n", get_free_mem() / PGSIZE);
-        }
+        list_del(&vec_cur->list);
+        kmem_cache_free(bio_vec_cachep, vec_cur);
+    }
+}
+
+// called by disk driver in interrupt context
+static void bio_vec_end_io(struct bio_vec *vec) {
+    struct bio *bio = (struct bio *)vec->bi_private;
+    // atomic_dec_return returns the old value
+    if (atomic_dec_return(&bio->bi_remaining) != 1)
+        return;
+
+    // the last bio_vec of this bio
+    if (bio->bi_end_io == NULL) {
+        sema_signal(&bio->bi_done);
+        return;
+    }
+    if (bio->bi_free)
+        bio_free_vecs(bio);
+    bio->bi_end_io(bio);
+}
+
+// queue all bio_vec of bio to the request queue at once
+static void __submit_bio(struct bio *bio) {
+    struct bio_vec *vec_cur = NULL;
+    int cnt = 0;
+    list_for_each_entry(vec_cur, &bio->list_entry, list) {
+        vec_cur->bi_end_io = bio_vec_end_io;
+        vec_cur->bi_private = bio;
+        cnt++;
+    }
+    ASSERT(cnt > 0);
+    atomic_set(&bio->bi_remaining, cnt);
+    blk_queue_bio_vecs(blk_get_queue(bio->bi_bdev), &bio->list_entry, bio->bi_rw);
+}
+
+// read or write, wait until all bio_vec are done
+// free bio_vec, if necessary
+void submit_bio(struct bio *bio, int free) {
+    if (list_empty(&bio->list_entry))
+        return;
+    bio->bi_free = free;
+    bio->bi_end_io = NULL;
+    sema_init(&bio->bi_done, 0, "bio_done");
+    __submit_bio(bio);
+    // someone is waiting, don't hold it back even if the queue is plugged
+    blk_run_queue(blk_get_queue(bio->bi_bdev), 1);
+    sema_wait(&bio->bi_done);
+    if (free) {
+        bio_free_vecs(bio);
+        // printfGreen("submit_bio, mm ++: %d pages\n", get_free_mem() / PGSIZE);
+    }
+}
+
+// read or write, return without waiting
+// end_io is called in interrupt context after all bio_vec are done (and freed, if necessary),
+// bio must stay valid until then
+void submit_bio_async(struct bio *bio, int free, bio_end_io_t end_io, void *private) {
+    ASSERT(end_io != NULL);
+    bio->bi_free = free;
+    bio->bi_end_io = end_io;
+    bio->bi_private = private;
+    if (list_empty(&bio->list_entry)) {
+        end_io(bio);
+        return;
     }
+    __submit_bio(bio);
 }
 
 // debug
@@ -0,0 +1,272 @@
+#include "common.h"
+#include "param.h"
+#include "atomic/spinlock.h"
+#include "lib/riscv.h"
+#include "lib/list.h"
+#include "fs/bio.h"
+#include "fs/blk_queue.h"
+#include "memory/slab.h"
+#include "driver/disk.h"
+#include "debug.h"
+
+// we have only one disk
+static struct request_queue disk_queue;
+
+// object cache of request
+static struct kmem_cache *request_cachep;
+
+static inline uint64 blk_now_ms(void) {
+    return TIME2MS(r_time());
+}
+
+static inline uint rq_end(struct request *rq) {
+    return rq->blockno_start + rq->block_len;
+}
+
+static inline uint vec_end(struct bio_vec *vec) {
+    return vec->blockno_start + vec->block_len;
+}
+
+void blk_queue_init(void) {
+    struct request_queue *q = &disk_queue;
+    initlock(&q->lock, "blk_queue");
+    INIT_LIST_HEAD(&q->sort_list);
+    INIT_LIST_HEAD(&q->fifo_list);
+    q->elevator = ELEVATOR_DEFAULT;
+    q->nr_queued = 0;
+    q->in_flight = 0;
+    q->plugged = 0;
+    q->dispatching = 0;
+    q->rerun = 0;
+    q->head_pos = 0;
+    q->nr_merges = 0;
+
+    request_cachep = kmem_cache_create("request", sizeof(struct request));
+    ASSERT(request_cachep != NULL);
+    Info("block request queue init [ok]\n");
+}
+
+struct request_queue *blk_get_queue(uint dev) {
+    return &disk_queue;
+}
+
+void blk_rq_init(struct request *rq, int rw) {
+    rq->q = NULL;
+    INIT_LIST_HEAD(&rq->sort_list);
+    INIT_LIST_HEAD(&rq->fifo_list);
+    INIT_LIST_HEAD(&rq->vecs);
+    rq->blockno_start = 0;
+    rq->block_len = 0;
+    rq->nr_vecs = 0;
+    rq->rw = rw;
+    rq->deadline = 0;
+}
+
+// append vec to the back of rq
+void blk_rq_add_vec(struct request *rq, struct bio_vec *vec) {
+    if (rq->nr_vecs == 0)
+        rq->blockno_start = vec->blockno_start;
+    else
+        ASSERT(rq_end(rq) == vec->blockno_start);
+    list_add_tail(&vec->rq_list, &rq->vecs);
+    rq->block_len += vec->block_len;
+    rq->nr_vecs++;
+}
+
+// ========== elevator, holding q->lock ==========
+
+static void elv_add_request(struct request_queue *q, struct request *rq) {
+    struct request *pos = NULL;
+    list_add_tail(&rq->fifo_list, &q->fifo_list);
+    if (q->elevator == ELEVATOR_NOOP) {
+        list_add_tail(&rq->sort_list, &q->sort_list);
+    } else {
+        // insert before the first request behind it
+        list_for_each_entry(pos, &q->sort_list, sort_list) {
+            if (pos->blockno_start > rq->blockno_start)
+                break;
+        }
+        list_add_tail(&rq->sort_list, &pos->sort_list);
+    }
+    q->nr_queued++;
+}
+
+static void elv_remove_request(struct request_queue *q, struct request *rq) {
+    list_del_reinit(&rq->sort_list);
+    list_del_reinit(&rq->fifo_list);
+    q->nr_queued--;
+}
+
+static struct request *elv_next_request(struct request_queue *q) {
+    struct request *rq = NULL;
+    if (list_empty(&q->sort_list))
+        return NULL;
+
+    if (q->elevator == ELEVATOR_NOOP)
+        return list_first_entry(&q->sort_list, struct request, sort_list);
+
+    if (q->elevator == ELEVATOR_DEADLINE) {
+        uint64 now = blk_now_ms();
+        list_for_each_entry(rq, &q->fifo_list, fifo_list) {
+            if (rq->deadline <= now)
+                return rq;
+        }
+    }
+
+    // C-LOOK : the first request after the head, or wrap around
+    list_for_each_entry(rq, &q->sort_list, sort_list) {
+        if (rq->blockno_start >= q->head_pos)
+            return rq;
+    }
+    return list_first_entry(&q->sort_list, struct request, sort_list);
+}
+
+// try to merge vec into a queued request
+static int elv_merge(struct request_queue *q, struct bio_vec *vec, int rw) {
+    struct request *rq = NULL;
+    list_for_each_entry(rq, &q->sort_list, sort_list) {
+        if (rq->rw != rw || rq->nr_vecs >= BLK_MAX_SEGMENTS || rq->block_len + vec->block_len > BLK_MAX_BLOCKS)
+            continue;
+        if (rq_end(rq) == vec->blockno_start) {
+            // back merge
+            list_add_tail(&vec->rq_list, &rq->vecs);
+        } else if (vec_end(vec) == rq->blockno_start) {
+            // front merge, order of sort_list does not change
+            list_add(&vec->rq_list, &rq->vecs);
+            rq->blockno_start = vec->blockno_start;
+        } else {
+            continue;
+        }
+        rq->block_len += vec->block_len;
+        rq->nr_vecs++;
+        q->nr_merges++;
+        return 1;
+    }
+    return 0;
+}
+
+// ========== request queue ==========
+
+// put a list of bio_vec (linked by vec->list) into the queue
+void blk_queue_bio_vecs(struct request_queue *q, struct list_head *vecs, int rw) {
+    struct bio_vec *vec = NULL;
+    struct request *rq = NULL;
+    uint64 expire = blk_now_ms() + (rw == DISK_READ ? BLK_READ_EXPIRE : BLK_WRITE_EXPIRE);
+
+    acquire(&q->lock);
+    list_for_each_entry(vec, vecs, list) {
+        if (elv_merge(q, vec, rw))
+            continue;
+
+        // allocate without q->lock, kmem_cache_alloc may reclaim memory
+        release(&q->lock);
+        if ((rq = kmem_cache_alloc(request_cachep)) == NULL)
+            panic("blk_queue_bio_vecs : no free memory\n");
+        blk_rq_init(rq, rw);
+        rq->q = q;
+        rq->deadline = expire;
+        blk_rq_add_vec(rq, vec);
+        acquire(&q->lock);
+        elv_add_request(q, rq);
+    }
+    int force = q->nr_queued >= BLK_PLUG_MAX;
+    release(&q->lock);
+
+    blk_run_queue(q, force);
+}
+
+// dispatch requests to disk driver, until the queue is empty or the device is full
+// force : run even if the queue is plugged
+void blk_run_queue(struct request_queue *q, int force) {
+    struct request *rq = NULL;
+
+    acquire(&q->lock);
+    if (q->plugged > 0 && !force) {
+        release(&q->lock);
+        return;
+    }
+    if (q->dispatching) {
+        // let the dispatcher look again
+        q->rerun = 1;
+        release(&q->lock);
+        return;
+    }
+    q->dispatching = 1;
+    do {
+        q->rerun = 0;
+        while (q->in_flight < BLK_QUEUE_DEPTH && (rq = elv_next_request(q)) != NULL) {
+            elv_remove_request(q, rq);
+            q->in_flight++;
+            q->head_pos = rq_end(rq);
+
+            // polled driver completes the request before return
+            release(&q->lock);
+            int ret = disk_submit(rq);
+            acquire(&q->lock);
+
+            if (ret < 0) {
+                // no room in the device, retry when some request is done
+                q->in_flight--;
+                elv_add_request(q, rq);
+                break;
+            }
+        }
+    } while (q->rerun);
+    q->dispatching = 0;
+    int kick = q->in_flight > 0;
+    release(&q->lock);
+
+    // notify the device once for the whole batch
+    if (kick)
+        disk_kick();
+}
+
+// called by disk driver, not holding the lock of driver
+void blk_end_request(struct request *rq) {
+    struct request_queue *q = rq->q;
+    struct bio_vec *vec = NULL;
+    struct bio_vec *vec_tmp = NULL;
+
+    // vec may be freed by bi_end_io
+    list_for_each_entry_safe(vec, vec_tmp, &rq->vecs, rq_list) {
+        list_del_reinit(&vec->rq_list);
+        vec->disk = 0; // disk is done with buf
+        if (vec->bi_end_io != NULL)
+            vec->bi_end_io(vec);
+        else
+            sema_signal(&vec->sem_disk_done);
+    }
+
+    if (q == NULL) {
+        // a request of disk_rw, outside the queue. the slot it leaves in
+        // the device may be what a queued request is waiting for
+        blk_run_queue(blk_get_queue(ROOTDEV), 1);
+        return;
+    }
+
+    acquire(&q->lock);
+    q->in_flight--;
+    release(&q->lock);
+    kmem_cache_free(request_cachep, rq);
+
+    // the device is busy already, plugging makes no sense
+    blk_run_queue(q, 1);
+}
+
+// hold back dispatching, so that requests from a batch of bios can be merged
+// waiting for a bio while plugged is fine, submit_bio and the completion run the queue by force
+void blk_start_plug(struct blk_plug *plug, uint dev) {
+    plug->q = blk_get_queue(dev);
+    acquire(&plug->q->lock);
+    plug->q->plugged++;
+    release(&plug->q->lock);
+}
+
+void blk_finish_plug(struct blk_plug *plug) {
+    struct request_queue *q = plug->q;
+    acquire(&q->lock);
+    ASSERT(q->plugged > 0);
+    q->plugged--;
+    release(&q->lock);
+    blk_run_queue(q, 0);
+}
@@ -0,0 +1,422 @@
+#include "common.h"
+#include "kernel/syscall.h"
+#include "kernel/trap.h"
+#include "atomic/spinlock.h"
+#include "atomic/semaphore.h"
+#include "atomic/wait_queue.h"
+#include "proc/pcb_life.h"
+#include "fs/vfs/fs.h"
+#include "fs/fdtable.h"
+#include "fs/vfs/ops.h"
+#include "fs/poll.h"
+#include "fs/eventpoll.h"
+#include "lib/poll.h"
+#include "lib/riscv.h"
+#include "memory/allocator.h"
+#include "debug.h"
+#include "errno.h"
+
+// protect file->f_ep_links, and keep an epitem alive between ep_free/eventpoll_release/epoll_ctl
+static struct semaphore epmutex;
+
+// used by ep_insert to hook an epitem on the queues of the target file
+struct ep_pqueue {
+    struct poll_table pt;
+    struct epitem *epi;
+};
+
+extern int fdalloc(struct file *f);
+
+void eventpoll_init(void) {
+    sema_init(&epmutex, 1, "epmutex");
+    Info("eventpoll init [ok]\n");
+}
+
+// called by wake_up of a queue of the target file, holding the lock of that queue
+static void ep_poll_callback(struct wait_queue_entry *wait) {
+    struct eppoll_entry *pwq = container_of(wait, struct eppoll_entry, wait);
+    struct epitem *epi = pwq->epi;
+    struct eventpoll *ep = epi->ep;
+
+    acquire(&ep->lock);
+    // disabled by EPOLLONESHOT
+    if (!(epi->event.events & ~EP_PRIVATE_BITS)) {
+        release(&ep->lock);
+        return;
+    }
+    if (!epi->ready) {
+        epi->ready = 1;
+        list_add_tail(&epi->rdllink, &ep->rdllist);
+    }
+    release(&ep->lock);
+
+    wake_up(&ep->wq);
+    wake_up(&ep->poll_wq);
+}
+
+static void ep_ptable_queue_proc(struct file *file, struct wait_queue_head *whead, struct poll_table *pt) {
+    struct ep_pqueue *epq = container_of(pt, struct ep_pqueue, pt);
+    struct epitem *epi = epq->epi;
+    struct eppoll_entry *pwq;
+
+    if (epi->nwait < 0)
+        return;
+    if (epi->nwait == EP_MAX_WAIT) {
+        Warn("epoll : too many wait queues of a file\n");
+        epi->nwait = -1;
+        return;
+    }
+    pwq = &epi->pwqs[epi->nwait++];
+    pwq->whead = whead;
+    pwq->epi = epi;
+    init_waitqueue_entry(&pwq->wait, ep_poll_callback, NULL);
+    add_wait_queue(whead, &pwq->wait);
+}
+
+static void ep_unregister_pollwait(struct epitem *epi) {
+    for (int i = 0; i < epi->nwait; i++)
+        remove_wait_queue(epi->pwqs[i].whead, &epi->pwqs[i].wait);
+    epi->nwait = 0;
+}
+
+static struct epitem *ep_find(struct eventpoll *ep, struct file *file, int fd) {
+    struct epitem *epi;
+    list_for_each_entry(epi, &ep->items, node) {
+        if (epi->file == file && epi->fd == fd)
+            return epi;
+    }
+    return NULL;
+}
+
+// holding epmutex and ep->mtx
+static int ep_insert(struct eventpoll *ep, struct epoll_event *event, struct file *tfile, int fd) {
+    struct epitem *epi;
+    struct ep_pqueue epq;
+    uint revents;
+
+    if ((epi = kzalloc(sizeof(struct epitem))) == NULL)
+        return -ENOMEM;
+    INIT_LIST_HEAD(&epi->node);
+    INIT_LIST_HEAD(&epi->rdllink);
+    INIT_LIST_HEAD(&epi->fdlink);
+    epi->ep = ep;
+    epi->file = tfile;
+    epi->fd = fd;
+    epi->event = *event;
+    epi->ready = 0;
+    epi->nwait = 0;
+
+    epq.epi = epi;
+    epq.pt.qproc = ep_ptable_queue_proc;
+    revents = vfs_poll(tfile, &epq.pt);
+    if (epi->nwait < 0) {
+        ep_unregister_pollwait(epi);
+        kfree(epi);
+        return -ENOMEM;
+    }
+
+    list_add_tail(&epi->fdlink, &tfile->f_ep_links);
+    list_add_tail(&epi->node, &ep->items);
+
+    acquire(&ep->lock);
+    if ((revents & event->events) && !epi->ready) {
+        epi->ready = 1;
+        list_add_tail(&epi->rdllink, &ep->rdllist);
+    }
+    release(&ep->lock);
+    if (epi->ready) {
+        wake_up(&ep->wq);
+        wake_up(&ep->poll_wq);
+    }
+    return 0;
+}
+
+// holding epmutex and ep->mtx
+static void ep_remove(struct eventpoll *ep, struct epitem *epi) {
+    // no callback runs on epi after this
+    ep_unregister_pollwait(epi);
+
+    list_del_reinit(&epi->fdlink);
+    list_del_reinit(&epi->node);
+
+    acquire(&ep->lock);
+    if (epi->ready)
+        list_del_reinit(&epi->rdllink);
+    release(&ep->lock);
+
+    kfree(epi);
+}
+
+// holding epmutex and ep->mtx
+static int ep_modify(struct eventpoll *ep, struct epitem *epi, struct epoll_event *event) {
+    uint revents;
+
+    acquire(&ep->lock);
+    epi->event = *event;
+    release(&ep->lock);
+
+    revents = vfs_poll(epi->file, NULL);
+
+    acquire(&ep->lock);
+    if ((revents & event->events) && !epi->ready) {
+        epi->ready = 1;
+        list_add_tail(&epi->rdllink, &ep->rdllist);
+    }
+    release(&ep->lock);
+    if (epi->ready) {
+        wake_up(&ep->wq);
+        wake_up(&ep->poll_wq);
+    }
+    return 0;
+}
+
+// move ready events to user, holding ep->mtx
+// a level-triggered item goes back to rdllist, so the next epoll_wait polls it again
+static int ep_send_events(struct eventpoll *ep, uint64 uevents, int maxevents) {
+    struct proc *p = proc_current();
+    struct list_head txlist;
+    struct epitem *epi;
+    struct epoll_event ev;
+    int cnt = 0;
+
+    INIT_LIST_HEAD(&txlist);
+    acquire(&ep->lock);
+    // epi->ready stays 1 on txlist, so that callbacks leave it alone
+    list_splice(&ep->rdllist, &txlist);
+    INIT_LIST_HEAD(&ep->rdllist);
+    release(&ep->lock);
+
+    while (cnt < maxevents && !list_empty(&txlist)) {
+        epi = list_first_entry(&txlist, struct epitem, rdllink);
+        acquire(&ep->lock);
+        list_del_reinit(&epi->rdllink);
+        epi->ready = 0;
+        release(&ep->lock);
+
+        uint revents = vfs_poll(epi->file, NULL) & epi->event.events;
+        if (!revents)
+            continue;
+
+        ev.events = revents;
+        ev.data = epi->event.data;
+        if (copyout(p->mm->pagetable, uevents + cnt * sizeof(struct epoll_event), (char *)&ev, sizeof(ev)) < 0) {
+            // put it back, so the event is not lost
+            acquire(&ep->lock);
+            if (!epi->ready) {
+                epi->ready = 1;
+                list_add_tail(&epi->rdllink, &ep->rdllist);
+            }
+            release(&ep->lock);
+            if (cnt == 0)
+                cnt = -EFAULT;
+            break;
+        }
+        cnt++;
+
+        acquire(&ep->lock);
+        if (epi->event.events & EPOLLONESHOT) {
+            epi->event.events &= EP_PRIVATE_BITS;
+        } else if (!(epi->event.events & EPOLLET) && !epi->ready) {
+            epi->ready = 1;
+            list_add_tail(&epi->rdllink, &ep->rdllist);
+        }
+        release(&ep->lock);
+    }
+
+    // not sent, keep them ready
+    acquire(&ep->lock);
+    list_splice(&txlist, &ep->rdllist);
+    release(&ep->lock);
+    return cnt;
+}
+
+uint ep_eventpoll_poll(struct eventpoll *ep, struct file *f, struct poll_table *pt) {
+    uint mask = 0;
+
+    // the table holds f, ep is not freed before the poller unhooks
+    poll_wait(f, &ep->poll_wq, pt);
+    acquire(&ep->lock);
+    if (!list_empty(&ep->rdllist))
+        mask |= POLLIN | POLLRDNORM;
+    release(&ep->lock);
+    return mask;
+}
+
+// the last reference of the epoll file is gone
+void ep_free(struct eventpoll *ep) {
+    struct epitem *epi, *tmp;
+
+    sema_wait(&epmutex);
+    sema_wait(&ep->mtx);
+    list_for_each_entry_safe(epi, tmp, &ep->items, node) {
+        ep_remove(ep, epi);
+    }
+    sema_signal(&ep->mtx);
+    sema_signal(&epmutex);
+    kfree(ep);
+}
+
+// the last reference of a watched file is gone, remove it from all epoll sets
+void eventpoll_release(struct file *file) {
+    struct epitem *epi;
+
+    sema_wait(&epmutex);
+    while (!list_empty(&file->f_ep_links)) {
+        epi = list_first_entry(&file->f_ep_links, struct epitem, fdlink);
+        struct eventpoll *ep = epi->ep;
+        sema_wait(&ep->mtx);
+        ep_remove(ep, epi);
+        sema_signal(&ep->mtx);
+    }
+    sema_signal(&epmutex);
+}
+
+static struct eventpoll *ep_alloc(void) {
+    struct eventpoll *ep;
+
+    if ((ep = kzalloc(sizeof(struct eventpoll))) == NULL)
+        return NULL;
+    initlock(&ep->lock, "eventpoll");
+    sema_init(&ep->mtx, 1, "ep_mtx");
+    INIT_LIST_HEAD(&ep->items);
+    INIT_LIST_HEAD(&ep->rdllist);
+    init_waitqueue_head(&ep->wq, "ep_wq");
+    init_waitqueue_head(&ep->poll_wq, "ep_poll_wq");
+    return ep;
+}
+
+// int epoll_create1(int flags);
+uint64 sys_epoll_create1(void) {
+    int flags;
+    struct eventpoll *ep;
+    struct file *f;
+    int fd;
+
+    argint(0, &flags);
+    if (flags & ~EPOLL_CLOEXEC)
+        return -EINVAL;
+
+    if ((ep = ep_alloc()) == NULL)
+        return -ENOMEM;
+    if ((f = filealloc(FAT32)) == NULL) {
+        kfree(ep);
+        return -ENFILE;
+    }
+    f->f_type = FD_EPOLL;
+    f->f_tp.f_ep = ep;
+    f->f_flags = O_RDONLY;
+    if ((fd = fdalloc(f)) < 0) {
+        generic_fileclose(f);
+        return -EMFILE;
+    }
+    if (flags & EPOLL_CLOEXEC)
+        fd_set_cloexec(proc_current()->files, fd, 1);
+    return fd;
+}
+
+// int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+uint64 sys_epoll_ctl(void) {
+    int epfd, op, fd;
+    uint64 uevent;
+    struct file *file, *tfile;
+    struct eventpoll *ep;
+    struct epitem *epi;
+    struct epoll_event event;
+    int error;
+
+    if (argfd(0, &epfd, &file) < 0)
+        return -EBADF;
+    argint(1, &op);
+    if (argfd(2, &fd, &tfile) < 0)
+        return -EBADF;
+    argaddr(3, &uevent);
+
+    if (op != EPOLL_CTL_DEL && copyin(proc_current()->mm->pagetable, (char *)&event, uevent, sizeof(event)) < 0)
+        return -EFAULT;
+    if (file->f_type != FD_EPOLL || file == tfile)
+        return -EINVAL;
+    // nested epoll may make a loop of callbacks
+    if (tfile->f_type == FD_EPOLL)
+        return -EINVAL;
+
+    ep = file->f_tp.f_ep;
+    sema_wait(&epmutex);
+    sema_wait(&ep->mtx);
+    epi = ep_find(ep, tfile, fd);
+    error = -EINVAL;
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        if (epi == NULL) {
+            event.events |= EPOLLERR | EPOLLHUP;
+            error = ep_insert(ep, &event, tfile, fd);
+        } else {
+            error = -EEXIST;
+        }
+        break;
+    case EPOLL_CTL_DEL:
+        if (epi != NULL) {
+            ep_remove(ep, epi);
+            error = 0;
+        } else {
+            error = -ENOENT;
+        }
+        break;
+    case EPOLL_CTL_MOD:
+        if (epi != NULL) {
+            event.events |= EPOLLERR | EPOLLHUP;
+            error = ep_modify(ep, epi, &event);
+        } else {
+            error = -ENOENT;
+        }
+        break;
+    }
+    sema_signal(&ep->mtx);
+    sema_signal(&epmutex);
+    return error;
+}
+
+// int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask);
+uint64 sys_epoll_pwait(void) {
+    int epfd, maxevents, timeout;
+    uint64 uevents;
+    struct file *file;
+    struct eventpoll *ep;
+    struct poll_wqueues table;
+    uint64 expire;
+    int res;
+
+    if (argfd(0, &epfd, &file) < 0)
+        return -EBADF;
+    argaddr(1, &uevents);
+    argint(2, &maxevents);
+    argint(3, &timeout);
+    // sigmask is ignored
+
+    if (maxevents <= 0)
+        return -EINVAL;
+    // the rest stay ready for the next call
+    if (maxevents > EP_MAX_EVENTS)
+        maxevents = EP_MAX_EVENTS;
+    if (file->f_type != FD_EPOLL)
+        return -EINVAL;
+    ep = file->f_tp.f_ep;
+
+    expire = timeout < 0 ? POLL_INFINITE : TIME2NS(rdtime()) + (uint64)timeout * 1000000;
+
+    // hook on ep->wq before looking at rdllist, no wakeup is lost
+    poll_initwait(&table);
+    poll_wait(NULL, &ep->wq, &table.pt);
+    for (;;) {
+        sema_wait(&ep->mtx);
+        res = ep_send_events(ep, uevents, maxevents);
+        sema_signal(&ep->mtx);
+        if (res != 0 || timeout == 0 || table.error)
+            break;
+        if (!poll_schedule_timeout(&table, expire))
+            break;
+    }
+    poll_freewait(&table);
+    if (res == 0 && table.error)
+        res = table.error;
+    return res;
+}
@@ -33,14 +33,7 @@ int fat32_fs_mount(int dev, struct _superblock *sb) {
     brelse(bp);
 
     Info("======= BIT MAP and FAT TABLE ======\n");
-    // FAT table -> bit map
-    int n = DIV_ROUND_UP((FAT_CLUSTER_MAX >> 3), PGSIZE); // ÷ 8
-    sb->bit_map = fat32_page_alloc(n);
-    Info("bit map : %d pages\n", n);
-    n = DIV_ROUND_UP((FAT_CLUSTER_MAX << 2), PGSIZE); // x 4
-    sb->fat_table = fat32_page_alloc(n);
-    Info("fat table : %d pages\n", n);
-
+    // FAT table -> bit map, on demand
     fat32_fat_bitmap_init(ROOTDEV, sb);
 
     /* 调用fat32_root_entry_init，获取到root根目录的fat_entry*/
@@ -166,95 +159,105 @@ int fat32_boot_sector_parser(struct _superblock *sb, fat_bpb_t *fat_bpb) {
     return 0;
 }
 
-// fat table -> bitmap
-// init the fat table in memory
+// FAT table -> bit map
+// FAT table in memory is split into chunks of FAT_CHUNK_SECTORS sectors,
+// a chunk is read at its first use, so mount reads nothing of FAT.
 void fat32_fat_bitmap_init(int dev, struct _superblock *sb) {
+    struct fat32_sb_info *info = &sb->fat32_sb_info;
+
+    info->n_fat_chunks = DIV_ROUND_UP(FAT_CLUSTER_MAX + 1, FAT_PER_CHUNK);
+    info->fat_chunks = (struct fat_chunk *)kzalloc(info->n_fat_chunks * sizeof(struct fat_chunk));
+    if (info->fat_chunks == NULL)
+        panic("fat32_fat_bitmap_init : no memory\n");
+    // a bit for every entry of every chunk, the tail beyond FAT_CLUSTER_MAX is never free
+    int n = DIV_ROUND_UP(info->n_fat_chunks * (FAT_PER_CHUNK >> 3), PGSIZE); // ÷ 8
+    sb->bit_map = fat32_page_alloc(n);
+    Info("bit map : %d pages, fat table : %d chunks\n", n, info->n_fat_chunks);
+    sema_init(&info->fat_sem, 1, "fat32_fat_sem");
+}
+
+// read chunk ci of FAT table, fill its bits in bit map
+static void fat32_fat_chunk_read(struct _superblock *sb, uint ci) {
+    struct fat32_sb_info *info = &sb->fat32_sb_info;
+    struct fat_chunk *chunk = &info->fat_chunks[ci];
     struct buffer_head *bp;
-    int c = 0;
-    // cluster 0 and cluster 1 is reserved, cluster 2 belongs to root
-    int sec = FAT_BASE;
-    uint64 map_mini = 0;
-    int map_mini_size = sizeof(map_mini) << 3; // * 8
-    uint64 *map = (uint64 *)sb->bit_map;
-    FAT_entry_t *fat_table = (FAT_entry_t *)sb->fat_table;
-    while (c < FAT_CLUSTER_MAX) {
-        bp = bread(fat32_sb.s_dev, sec);
-        FAT_entry_t *fats = (FAT_entry_t *)(bp->data);
-        for (int s = 0; s < FAT_PER_SECTOR; s++) {
-            int idx = BIT_INDEX(c, map_mini_size);
-            int off = BIT_OFFSET(c, map_mini_size);
-            if (fats[s] != FREE_MASK) {
-                SET_BIT(map_mini, off);   // set to
-                fat_table[c] = fats[s];   // copy fat table to memory
-            } else {
-                CLEAR_BIT(map_mini, off); // set to 0
-            }
-            c++;
-            int save_flag = (off + 1 == map_mini_size);
-            if (save_flag) {
-                map[idx] = map_mini;
-            }
-            if (c > FAT_CLUSTER_MAX) {
-                brelse(bp);
-                if (!save_flag) {
-                    // remember to save the last map_mini
-                    map[idx] = map_mini;
-                }
-                return;
-            }
-        }
-        sec++;
+    FAT_entry_t *fats;
+    uint64 *map = (uint64 *)sb->bit_map + ci * (FAT_PER_CHUNK >> 6);
+    uint nfree = 0;
+
+    if ((fats = (FAT_entry_t *)kzalloc(FAT_PER_CHUNK * sizeof(FAT_entry_t))) == NULL)
+        panic("fat32_fat_chunk_read : no memory\n");
+    for (int s = 0; s < FAT_CHUNK_SECTORS; s++) {
+        uint sec = ci * FAT_CHUNK_SECTORS + s;
+        if (sec >= info->n_sectors_fat)
+            break;
+        bp = bread(sb->s_dev, FAT_BASE + sec);
+        memmove(fats + s * FAT_PER_SECTOR, bp->data, BSIZE);
         brelse(bp);
     }
-    panic("fat32_fat_bitmap_init : can't reach here\n");
+
+    acquire(&sb->lock);
+    FAT_entry_t c = ci * FAT_PER_CHUNK;
+    for (int w = 0; w < (FAT_PER_CHUNK >> 6); w++) {
+        uint64 word = 0;
+        for (int b = 0; b < 64; b++, c++) {
+            // cluster 0 and cluster 1 is reserved
+            if (c < 2 || c > FAT_CLUSTER_MAX || fats[c % FAT_PER_CHUNK] != FREE_MASK)
+                word |= 1UL << b;
+            else
+                nfree++;
+        }
+        map[w] = word;
+    }
+    chunk->nfree = nfree;
+    __sync_synchronize();
+    chunk->fats = fats;
+    release(&sb->lock);
 }
 
+// the chunk of cluster, read it if it is not in memory
+// chunks are never dropped, so it never sleeps once the chunk is in memory
+static struct fat_chunk *fat32_fat_chunk(struct _superblock *sb, FAT_entry_t cluster) {
+    uint ci = cluster / FAT_PER_CHUNK;
+    struct fat_chunk *chunk = &sb->fat32_sb_info.fat_chunks[ci];
+
+    if (chunk->fats == NULL) {
+        sema_wait(&sb->fat32_sb_info.fat_sem);
+        if (chunk->fats == NULL)
+            fat32_fat_chunk_read(sb, ci);
+        sema_signal(&sb->fat32_sb_info.fat_sem);
+    }
+    return chunk;
+}
+
+// write the dirty sectors of FAT table back, through the buffer cache
+// NOTE : we don't update fat region 2 (it is unnecessary)
 void fat32_fat_bitmap_writeback(int dev, struct _superblock *sb) {
+    struct fat32_sb_info *info = &sb->fat32_sb_info;
     struct buffer_head *bp;
-    int c = 0;
-    // cluster 0 and cluster 1 is reserved, cluster 2 belongs to root
-    int sec = FAT_BASE;
-    // uint64 map_mini = 0;
-    // int map_mini_size = sizeof(map_mini) << 3; // * 8
-    // uint64 *map = (uint64 *)sb->bit_map;
-    FAT_entry_t *fat_table = (FAT_entry_t *)sb->fat_table;
-    while (c < FAT_CLUSTER_MAX) {
-        bp = bread(fat32_sb.s_dev, sec);
-        FAT_entry_t *fats = (FAT_entry_t *)(bp->data);
-        for (int s = 0; s < FAT_PER_SECTOR; s++) {
-            // int idx = BIT_INDEX(c, map_mini_size);
-            // int off = BIT_OFFSET(c, map_mini_size);
-            fats[s] = fat_table[c];
-            // if (fats[s] != FREE_MASK) {
-            //     SET_BIT(map_mini, off);   // set to
-            //     fat_table[c] = fats[s];   // copy fat table to memory
-            // } else {
-            //     CLEAR_BIT(map_mini, off); // set to 0
-            // }
-            c++;
-            // int save_flag = (off + 1 == map_mini_size);
-            // if (save_flag) {
-            //     map[idx] = map_mini;
-            // }
-            if (c > FAT_CLUSTER_MAX) {
-                bwrite(bp);
-                brelse(bp);
-                // if (!save_flag) {
-                //     // remember to save the last map_mini
-                //     map[idx] = map_mini;
-                // }
-                return;
-            }
+
+    if (info->fat_chunks == NULL || !__sync_lock_test_and_set(&info->fat_dirty, 0))
+        return;
+    for (uint ci = 0; ci < info->n_fat_chunks; ci++) {
+        struct fat_chunk *chunk = &info->fat_chunks[ci];
+        if (chunk->dirty == 0)
+            continue;
+        // a store after this marks the sector dirty again
+        uint dirty = __sync_fetch_and_and(&chunk->dirty, 0);
+        for (int s = 0; s < FAT_CHUNK_SECTORS; s++) {
+            if (!(dirty & (1U << s)))
+                continue;
+            bp = bread(dev, FAT_BASE + ci * FAT_CHUNK_SECTORS + s);
+            memmove(bp->data, chunk->fats + s * FAT_PER_SECTOR, BSIZE);
+            bwrite(bp);
+            brelse(bp);
         }
-        sec++;
-        bwrite(bp);
-        brelse(bp);
     }
-    panic("fat32_fat_bitmap_writeback : can't reach here\n");
 }
 
 // called not holding lock
 void fat32_bitmap_op(struct _superblock *sb, FAT_entry_t cluster, int set) {
+    struct fat_chunk *chunk = fat32_fat_chunk(sb, cluster);
     acquire(&sb->lock);
     uint64 map_mini = 0;
     int map_mini_size = sizeof(map_mini) << 3; // * 8
@@ -262,46 +265,89 @@ void fat32_bitmap_op(struct _superblock *sb, FAT_entry_t cluster, int set) {
     int idx = BIT_INDEX(cluster, map_mini_size);
     int off = BIT_OFFSET(cluster, map_mini_size);
     map_mini = map[idx];
-    ASSERT(TEST_BIT(map_mini, off));
-    if (set)
+    // set a free one, or clear a used one
+    ASSERT(!TEST_BIT(map_mini, off) == !!set);
+    if (set) {
         SET_BIT(map_mini, off);
-    else
+        chunk->nfree--;
+    } else {
         CLEAR_BIT(map_mini, off);
+        chunk->nfree++;
+    }
     map[idx] = map_mini; // don't forget it
     release(&sb->lock);
 }
 
-FAT_entry_t fat32_bitmap_alloc(struct _superblock *sb, FAT_entry_t hint) {
-    // using hint speed up
-    uint64 map_mini = 0;
-    int map_mini_size = sizeof(map_mini) << 3; // * 8
+// a mask of n bits from bit 0, 0 < n <= 64
+#define RUN_MASK(n) ((n) == 64 ? ~0UL : (1UL << (n)) - 1)
+
+// find a run of free clusters from hint, a word of bit map at a time.
+// the run starts at the first free cluster after hint, and is no longer
+// than want, *len is set to its length. the clusters are marked in bit map,
+// but not in FAT table. chunks not in memory are read on the way, so it may
+// sleep. called not holding lock.
+FAT_entry_t fat32_bitmap_alloc_extent(struct _superblock *sb, FAT_entry_t hint, uint want, uint *len) {
+    struct fat32_sb_info *info = &sb->fat32_sb_info;
     uint64 *map = (uint64 *)sb->bit_map;
-    FAT_entry_t c = hint;
-    // cluster 0 and cluster 1 is reserved, cluster 2 is for root
-    int idx = BIT_INDEX(hint, map_mini_size);
-    int off_init = BIT_OFFSET(hint, map_mini_size);
+    const uint wpc = FAT_PER_CHUNK >> 6; // words per chunk
+    const uint nword = info->n_fat_chunks * wpc;
+    if (hint > FAT_CLUSTER_MAX)
+        hint = 2;
+    uint ci = hint / FAT_PER_CHUNK;
     // idx is similar to cluster
     // off is similar to FAT entry in cluster
-    while (c < FAT_CLUSTER_MAX) {
-        map_mini = map[idx];
-        for (int off = off_init; off < map_mini_size; off++) {
-            if (!TEST_BIT(map_mini, off)) {
-                SET_BIT(map_mini, off);
-                map[idx] = map_mini; // don't forget it
-                return c;
-            }
-            c++;
-            if (c > FAT_CLUSTER_MAX) {
-                return 0;
+    uint idx = hint >> 6;
+    uint64 mask = ~0UL << (hint & 63);
+
+    ASSERT(want > 0);
+    // the chunk of hint twice, since the search starts in the middle of it
+    for (uint n = 0; n <= info->n_fat_chunks; n++, ci = (ci + 1) % info->n_fat_chunks) {
+        struct fat_chunk *chunk = fat32_fat_chunk(sb, ci * FAT_PER_CHUNK);
+        uint end = (ci + 1) * wpc;
+
+        acquire(&sb->lock);
+        for (; chunk->nfree && idx < end; idx++, mask = ~0UL) {
+            uint64 free = ~map[idx] & mask;
+            if (free == 0)
+                continue;
+            int off = __builtin_ctzl(free);
+            FAT_entry_t start = (idx << 6) + off;
+            uint got = 0;
+            // extend the run, into the next chunk only if it is in memory
+            for (;;) {
+                uint64 used = map[idx] >> off;
+                uint run = MIN(used ? __builtin_ctzl(used) : 64 - off, want - got);
+                if (run == 0)
+                    break;
+                map[idx] |= RUN_MASK(run) << off;
+                info->fat_chunks[idx / wpc].nfree -= run;
+                got += run;
+                if (got == want || off + run < 64 || ++idx == nword)
+                    break;
+                if (idx % wpc == 0 && info->fat_chunks[idx / wpc].fats == NULL)
+                    break;
+                off = 0;
             }
+            release(&sb->lock);
+            *len = got;
+            return start;
         }
-        off_init = 0;
-        idx++;
+        release(&sb->lock);
+        idx = end % nword;
+        mask = ~0UL;
     }
+    *len = 0;
     return 0;
 }
 
-// called holding lock
+// find a free cluster from hint, called not holding lock
+FAT_entry_t fat32_bitmap_alloc(struct _superblock *sb, FAT_entry_t hint) {
+    uint len;
+    return fat32_bitmap_alloc_extent(sb, hint, 1, &len);
+}
+
+// called not holding sb->lock, may sleep to read the chunk
+// the caller owns cluster, it is marked in bit map
 void fat32_fat_cache_set(FAT_entry_t cluster, FAT_entry_t value) {
     if (!(cluster >= 2 && cluster <= FAT_CLUSTER_MAX)) {
         printfRed("cluster : %d(%x)\n", cluster, cluster);
@@ -311,24 +357,28 @@ void fat32_fat_cache_set(FAT_entry_t cluster, FAT_entry_t value) {
         printfRed("value : %d(%x)\n", value, value);
         panic("fat32_fat_cache_set, value error\n");
     }
-    FAT_entry_t *fats = (FAT_entry_t *)fat32_sb.fat_table;
+    ASSERT(!holding(&fat32_sb.lock));
+    struct fat_chunk *chunk = fat32_fat_chunk(&fat32_sb, cluster);
+    uint off = cluster % FAT_PER_CHUNK;
     // FAT_entry_t old_value = fats[cluster];
-    fats[cluster] = value;
+    chunk->fats[off] = value;
     // printfMAGENTA("cluster : %x, %x -> %x\n", cluster, old_value, fats[cluster]);
+    __sync_fetch_and_or(&chunk->dirty, 1U << (off / FAT_PER_SECTOR));
+    fat32_sb.fat32_sb_info.fat_dirty = 1;
 }
 
-// called holding lock
+// called not holding lock, may sleep to read the chunk
 FAT_entry_t fat32_fat_cache_get(FAT_entry_t cluster) {
     if (!(cluster >= 2 && cluster <= FAT_CLUSTER_MAX)) {
         printfRed("cluster_cur : %d(%x)\n", cluster, cluster);
         panic("fat32_fat_cache_get, cluster_cur error\n");
     }
-    FAT_entry_t *fats = (FAT_entry_t *)fat32_sb.fat_table;
-    FAT_entry_t fat_next = fats[cluster];
+    struct fat_chunk *chunk = fat32_fat_chunk(&fat32_sb, cluster);
+    FAT_entry_t fat_next = chunk->fats[cluster % FAT_PER_CHUNK];
 
     if (fat_next == 0) {
         printfRed("cluster_cur : %d(%x)\n", cluster, cluster);
         panic("fat32_fat_cache_get, fat_next error\n");
     }
     return fat_next;
-}
\ No newline at end of file
+}
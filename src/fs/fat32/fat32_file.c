@@ -15,6 +15,11 @@
 #include "fs/fat/fat32_stack.h"
 #include "fs/fat/fat32_file.h"
 #include "memory/allocator.h"
+#include "memory/slab.h"
+#include "fs/poll.h"
+#include "fs/eventpoll.h"
+#include "lib/poll.h"
+#include "ipc/socket.h"
 
 extern uint64 socket_write(struct socket *sock, vaddr_t addr, int len);
 extern uint64 socket_read(struct socket *sock, vaddr_t addr, int len);
@@ -25,6 +30,8 @@ int pid_debug_2 = 11;
 // #define _O_WRITE             (O_WRONLY | O_RDWR | O_CREATE |)
 void fileinit(void) {
     initlock(&_ftable.lock, "_ftable");
+    _ftable.cachep = kmem_cache_create("file", sizeof(struct file));
+    _ftable.nr_files = 0;
 }
 
 // Increment ref count for file f.
@@ -116,6 +123,26 @@ ssize_t fat32_fileread(struct file *f, uint64 addr, int n) {
     return r;
 }
 
+// Poll file f, hook the poller on the wait queues of f.
+// 语义：返回文件 f 当前可读写的状态（POLLIN / POLLOUT ...）
+uint fat32_filepoll(struct file *f, struct poll_table *pt) {
+    switch (f->f_type) {
+    case FD_PIPE:
+        return pipe_poll(f->f_tp.f_pipe, f, pt);
+    case FD_DEVICE:
+        if (f->f_major < 0 || f->f_major >= NDEV || !devsw[f->f_major].poll)
+            return DEFAULT_POLLMASK;
+        return devsw[f->f_major].poll(f, pt);
+    case FD_SOCKET:
+        return socket_poll(f->f_tp.f_sock, f, pt);
+    case FD_EPOLL:
+        return ep_eventpoll_poll(f->f_tp.f_ep, f, pt);
+    default:
+        // regular file never blocks
+        return DEFAULT_POLLMASK;
+    }
+}
+
 // Write to file f.
 // addr is a user virtual address.
 // 语义：写文件 f ，从 f->f_pos开始，把用户空间 addr 起始的 n 个字节的内容写入文件 f
@@ -171,7 +198,7 @@ ssize_t fat32_filewrite(struct file *f, uint64 addr, int n) {
             }
             i += r;
         }
-        ret = (i == n ? n : -1);
+        ret = (i == n ? n : (r < 0 ? r : -1));
 
         // debug!!!
         // if (ret < 0)
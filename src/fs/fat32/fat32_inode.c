@@ -2,6 +2,7 @@
 #include "debug.h"
 #include "atomic/spinlock.h"
 #include "memory/allocator.h"
+#include "memory/slab.h"
 #include "proc/pcb_life.h"
 #include "fs/bio.h"
 #include "fs/stat.h"
@@ -18,8 +19,10 @@
 #include "memory/filemap.h"
 #include "lib/radix-tree.h"
 #include "memory/writeback.h"
+#include "proc/pdflush.h"
 #include "lib/list.h"
 #include "atomic/semaphore.h"
+#include "fs/vfs/dcache.h"
 
 // debug
 // int cache_cnt;
@@ -31,35 +34,227 @@ extern struct inode_operations fat32_iop;
 
 struct _superblock fat32_sb;
 
+#define INODE_NBUCKET 251     // buckets of the inode table
+#define INODE_RECLAIM_BATCH 8 // inodes reclaimed at most by one fat32_inode_get
+#define INODE_DIR_HASH_NR 200 // buckets of the name hash of a directory
+
+struct inode_bucket {
+    spinlock_t lock; // the chain, and ref of the inodes on it
+    struct list_head head;
+};
+
+// in-memory inodes, hashed by (dev, parent, parent_off) and allocated on demand
+// an unreferenced inode stays hashed on the lru list, and is freed when there
+// are more than NINODE inodes or memory is short
+// an unreferenced unlinked inode is unhashed and truncated by pdflush
+// every inode holds a reference of its parent
+// lock order : bucket lock --> inode_table.lock
 struct inode_table_t {
-    spinlock_t lock;
-    // struct semaphore lock;
-    struct list_head entry;           // free list
-    struct inode inode_entry[NINODE]; // array
+    spinlock_t lock;           // lru, unlinked, i_state and the counters
+    struct list_head lru;      // unreferenced inodes, the oldest first
+    struct list_head unlinked; // unreferenced inodes with i_nlink == 0
+    int nr_inodes;
+    int nr_unused;
+    struct kmem_cache *cachep;
+    struct inode_bucket buckets[INODE_NBUCKET];
 } inode_table;
 
 // init the global inode table
 void inode_table_init() {
-    INIT_LIST_HEAD(&inode_table.entry);
-    struct inode *entry;
     initlock(&inode_table.lock, "inode_table"); // !!!!
-    // sema_init(&inode_table.lock, 1, "inode_table_lock");
-    for (entry = inode_table.inode_entry; entry < &inode_table.inode_entry[NINODE]; entry++) {
-        memset(entry, 0, sizeof(struct inode));
-        sema_init(&entry->i_sem, 1, "inode_entry_sem");
-        sema_init(&entry->i_read_lock, 1, "read_lock");
-        // sema_init(&entry->i_writeback_lock, 1, "i_writeback_lock");
-        initlock(&entry->i_lock, "inode_entry_lock");
-        initlock(&entry->tree_lock, "inode_radix_tree_lock");
-        INIT_LIST_HEAD(&entry->dirty_list);
-        INIT_LIST_HEAD(&entry->list); // !!! to speed up inode_get
-        list_add_tail(&entry->list, &inode_table.entry);
-    }
+    INIT_LIST_HEAD(&inode_table.lru);
+    INIT_LIST_HEAD(&inode_table.unlinked);
+    inode_table.nr_inodes = 0;
+    inode_table.nr_unused = 0;
+    for (int i = 0; i < INODE_NBUCKET; i++) {
+        initlock(&inode_table.buckets[i].lock, "inode_bucket");
+        INIT_LIST_HEAD(&inode_table.buckets[i].head);
+    }
+    if ((inode_table.cachep = kmem_cache_create("inode", sizeof(struct inode))) == NULL)
+        panic("inode_table_init : no inode cache\n");
     Info("========= Information of inode table ==========\n");
-    Info("number of inode : %d\n", NINODE);
+    Info("number of cached inode : %d, buckets : %d\n", NINODE, INODE_NBUCKET);
     Info("inode table init [ok]\n");
 }
 
+static inline struct inode_bucket *inode_bucket(uint dev, struct inode *dp, uint parentoff) {
+    uint64 h = ((uint64)dp >> 4) * 31 + (uint64)parentoff * 0x9e3779b1 + dev;
+    return &inode_table.buckets[h % INODE_NBUCKET];
+}
+
+// the key never changes while ip is hashed
+static inline struct inode_bucket *ip_bucket(struct inode *ip) {
+    return inode_bucket(ip->i_dev, ip->parent, ip->fat32_i.parent_off);
+}
+
+// holding the bucket lock of ip
+static void __inode_hold(struct inode *ip) {
+    if (ip->ref++ == 0) {
+        acquire(&inode_table.lock);
+        if (!list_empty(&ip->i_lru) && !(ip->i_state & I_FREEING)) {
+            list_del_reinit(&ip->i_lru);
+            inode_table.nr_unused--;
+        }
+        release(&inode_table.lock);
+    }
+}
+
+static void fat32_inode_reap(uint64 unused);
+
+// queue an unlinked inode to be truncated, holding inode_table.lock
+static int __inode_queue_unlinked(struct inode *ip) {
+    int first = list_empty(&inode_table.unlinked);
+    ip->i_state |= I_FREEING;
+    if (list_empty(&ip->i_lru))
+        list_add_tail(&ip->i_lru, &inode_table.unlinked);
+    return first;
+}
+
+// a new inode for (dev, dp, parentoff), not hashed
+static struct inode *inode_new(uint dev, struct inode *dp, uint parentoff) {
+    struct inode *ip;
+    if ((ip = kmem_cache_zalloc(inode_table.cachep)) == NULL)
+        return NULL;
+    sema_init(&ip->i_sem, 1, "inode_entry_sem");
+    sema_init(&ip->i_read_lock, 1, "read_lock");
+    // sema_init(&ip->i_writeback_lock, 1, "i_writeback_lock");
+    initlock(&ip->i_lock, "inode_entry_lock");
+    initlock(&ip->tree_lock, "inode_radix_tree_lock");
+    INIT_LIST_HEAD(&ip->dirty_list);
+    INIT_LIST_HEAD(&ip->list);
+    INIT_LIST_HEAD(&ip->i_lru);
+    INIT_LIST_HEAD(&ip->fat32_i.rsv_list);
+    INIT_LIST_HEAD(&ip->i_dentry);
+    INIT_LIST_HEAD(&ip->i_dchildren);
+    ip->i_dev = dev;
+    ip->parent = dp;
+    ip->fat32_i.parent_off = parentoff;
+    return ip;
+}
+
+// the last step of an inode, unhashed, unreferenced and clean
+static void inode_free(struct inode *ip) {
+    struct inode *dp = ip->parent;
+
+    dcache_prune_inode(ip);
+    fat32_i_mapping_destroy(ip);
+    fat32_inode_hash_destroy(ip);
+    fat32_free_index_table(ip);
+    // a writer may not have closed it through fd_close, e.g. a mapping
+    fat32_cluster_release_rsv(ip);
+    kmem_cache_free(inode_table.cachep, ip);
+    __sync_fetch_and_sub(&inode_table.nr_inodes, 1);
+    fat32_inode_put(dp);
+}
+
+// free at most nr unreferenced clean inodes, the oldest first
+// return the number of inodes freed
+static int fat32_inode_reclaim(int nr) {
+    int freed = 0, scan = inode_table.nr_unused;
+    struct inode_bucket *b;
+    struct inode *ip;
+
+    while (freed < nr && scan-- > 0) {
+        acquire(&inode_table.lock);
+        if (list_empty(&inode_table.lru)) {
+            release(&inode_table.lock);
+            break;
+        }
+        ip = list_first_entry(&inode_table.lru, struct inode, i_lru);
+        list_del_reinit(&ip->i_lru);
+        inode_table.nr_unused--;
+        ip->i_state |= I_RECLAIM; // nobody else frees it
+        release(&inode_table.lock);
+
+        b = ip_bucket(ip);
+        acquire(&b->lock);
+        if (ip->ref > 0) {
+            // got again, it is not on the lru any more
+            ip->i_state &= ~I_RECLAIM;
+            release(&b->lock);
+            continue;
+        }
+        if (ip->i_nlink == 0) {
+            int wake;
+            list_del_reinit(&ip->list);
+            acquire(&inode_table.lock);
+            ip->i_state &= ~I_RECLAIM;
+            wake = __inode_queue_unlinked(ip);
+            release(&inode_table.lock);
+            release(&b->lock);
+            if (wake)
+                pdflush_operation(fat32_inode_reap, 0);
+            continue;
+        }
+        if (!list_empty_atomic(&ip->dirty_list, &ip->i_lock)) {
+            // dirty, wait for writeback
+            acquire(&inode_table.lock);
+            ip->i_state &= ~I_RECLAIM;
+            list_add_tail(&ip->i_lru, &inode_table.lru);
+            inode_table.nr_unused++;
+            release(&inode_table.lock);
+            release(&b->lock);
+            continue;
+        }
+        list_del_reinit(&ip->list);
+        ip->i_state &= ~I_RECLAIM;
+        release(&b->lock);
+
+        inode_free(ip);
+        freed++;
+    }
+    return freed;
+}
+
+// truncate and free the unlinked inodes, run by pdflush
+// also called every writeback cycle, in case no pdflush was free
+static void fat32_inode_reap(uint64 unused) {
+    struct inode_bucket *b;
+    struct inode *ip;
+
+    for (;;) {
+        acquire(&inode_table.lock);
+        if (list_empty(&inode_table.unlinked)) {
+            release(&inode_table.lock);
+            break;
+        }
+        ip = list_first_entry(&inode_table.unlinked, struct inode, i_lru);
+        list_del_reinit(&ip->i_lru);
+        release(&inode_table.lock);
+
+        // the data is gone, drop the dirty pages instead of writing them back
+        // writeback_inodes syncs an inode with i_sem and a reference held
+        sema_wait(&ip->i_sem);
+        acquire(&fat32_sb.dirty_lock);
+        list_del_reinit(&ip->dirty_list);
+        release(&fat32_sb.dirty_lock);
+
+        b = ip_bucket(ip);
+        acquire(&b->lock);
+        if (ip->ref > 0) {
+            // pinned by writeback, the last put queues it again
+            release(&b->lock);
+            sema_signal(&ip->i_sem);
+            continue;
+        }
+        // it may be queued again by a put after we took it
+        acquire(&inode_table.lock);
+        list_del_reinit(&ip->i_lru);
+        release(&inode_table.lock);
+        release(&b->lock);
+
+        fat32_i_mapping_destroy(ip);
+        if (ip->valid)
+            fat32_inode_trunc(ip);
+        sema_signal(&ip->i_sem);
+        inode_free(ip);
+    }
+}
+
+void fat32_inode_reap_unlinked(void) {
+    fat32_inode_reap(0);
+}
+
 // caller must pass a valid pointer !
 static uint8 __inode_update_to_fatdev(struct inode *ip) {
     uint8 DIR_Dev;
@@ -142,6 +337,14 @@ struct inode *fat32_root_inode_init(struct _superblock *sb) {
     // dirty and dirty_list
     INIT_LIST_HEAD(&root_ip->dirty_list);
 
+    // not in the inode table
+    INIT_LIST_HEAD(&root_ip->list);
+    INIT_LIST_HEAD(&root_ip->i_lru);
+    INIT_LIST_HEAD(&root_ip->fat32_i.rsv_list);
+    INIT_LIST_HEAD(&root_ip->i_dentry);
+    INIT_LIST_HEAD(&root_ip->i_dchildren);
+    root_ip->i_state = 0;
+
     // is dirty in parent ?
     root_ip->dirty_in_parent = 0;
 
@@ -199,15 +402,47 @@ uint fat32_next_cluster(uint cluster_cur) {
     return fat_next;
 }
 
-// allocate a free cluster
+// inodes holding a reservation window, under fat32_sb.lock
+static LIST_HEAD(rsv_inodes);
+
+// holding fat32_sb.lock, take the window away from fi, return its length
+static uint rsv_detach(struct fat32_inode_info *fi, FAT_entry_t *start) {
+    uint len = fi->rsv_len;
+
+    *start = fi->rsv_start;
+    fi->rsv_len = 0;
+    list_del_reinit(&fi->rsv_list);
+    return len;
+}
+
+static void rsv_free(FAT_entry_t start, uint len) {
+    for (uint i = 0; i < len; i++)
+        fat32_bitmap_op(&fat32_sb, start + i, 0);
+}
+
+// the bit map is full, but free_count still counts the windows of other
+// inodes : give all of them back. return the number of clusters freed
+static uint fat32_rsv_reclaim(void) {
+    FAT_entry_t start;
+    uint len, n = 0;
+
+    for (;;) {
+        acquire(&fat32_sb.lock);
+        if (list_empty(&rsv_inodes)) {
+            release(&fat32_sb.lock);
+            return n;
+        }
+        len = rsv_detach(list_first_entry(&rsv_inodes, struct fat32_inode_info, rsv_list), &start);
+        release(&fat32_sb.lock);
+        rsv_free(start, len);
+        n += len;
+    }
+}
+
+// allocate a free cluster, 0 if the disk is full
 FAT_entry_t fat32_cluster_alloc(uint dev) {
     // sema_wait(&fat32_sb.sem);
-    acquire(&fat32_sb.lock);
-    if (!fat32_sb.fat32_sb_info.free_count) {
-        panic("no disk space!!!\n");
-    }
-    FAT_entry_t free_num = fat32_sb.fat32_sb_info.nxt_free;
-    fat32_sb.fat32_sb_info.free_count--;
+    FAT_entry_t free_num;
     // if(fat32_sb.fat32_sb_info.free_count%1000==0) {
     // printfRed("free num --: %d\n", fat32_sb.fat32_sb_info.free_count);
     // }
@@ -218,17 +453,25 @@ FAT_entry_t fat32_cluster_alloc(uint dev) {
     // }
     int hint;
     FAT_entry_t fat_next;
-retry:
+    acquire(&fat32_sb.lock);
     hint = fat32_sb.fat32_sb_info.hint_valid ? fat32_sb.fat32_sb_info.nxt_free : 0;
+    release(&fat32_sb.lock);
     // fat_next = fat32_fat_alloc(hint);
+    // it reads the chunks of FAT on the way, not holding lock
     fat_next = fat32_bitmap_alloc(&fat32_sb, hint);
+    // the rest may be in the reservation windows of open files
+    if (fat_next == 0 && fat32_rsv_reclaim() > 0)
+        fat_next = fat32_bitmap_alloc(&fat32_sb, hint);
+    if (fat_next == 0)
+        return 0;
+    acquire(&fat32_sb.lock);
+    ASSERT(fat32_sb.fat32_sb_info.free_count > 0);
+    fat32_sb.fat32_sb_info.free_count--;
     fat32_sb.fat32_sb_info.nxt_free = fat_next + 1; // !!!
     if (fat32_sb.fat32_sb_info.nxt_free >= FAT_CLUSTER_MAX) {
         fat32_sb.fat32_sb_info.nxt_free = 3;
     }
     fat32_sb.fat32_sb_info.hint_valid = 1; // using hint!
-    if (fat_next == 0)
-        goto retry;
 
     free_num = fat_next;                                              // bug !!! 
     // printfRed("fat cluster : %x\n", free_num); // debug!
@@ -265,9 +508,10 @@ retry:
 
     fat32_sb.fat32_sb_info.dirty = 1; // sync in put
     // sema_signal(&fat32_sb.sem);
+    release(&fat32_sb.lock);
 
+    // the cluster is ours in bit map, no lock for its FAT entry
     fat32_fat_cache_set(free_num, EOC);
-    release(&fat32_sb.lock);
 
     // fat32_fat_set(free_num, EOC);// don't forget it
 
@@ -276,6 +520,57 @@ retry:
     return free_num;
 }
 
+// allocate the next cluster of ip from its reservation window, 0 if the disk is full.
+// if the window is used up, a new one of MAX(want, FAT_RSV_WINDOW) clusters
+// is taken right after the end of file, so the chain stays contiguous.
+// want : the number of clusters the caller is going to append
+// caller holds ip->lock, the window itself is under fat32_sb.lock, as
+// fat32_rsv_reclaim takes it away from any inode
+FAT_entry_t fat32_cluster_alloc_inode(struct inode *ip, uint want) {
+    struct fat32_inode_info *fi = &ip->fat32_i;
+    FAT_entry_t c, start;
+    uint len;
+
+    acquire(&fat32_sb.lock);
+    if (fi->rsv_len == 0) {
+        FAT_entry_t hint = fi->cluster_end ? fi->cluster_end + 1 : fat32_sb.fat32_sb_info.nxt_free;
+        release(&fat32_sb.lock);
+        start = fat32_bitmap_alloc_extent(&fat32_sb, hint, MAX(want, FAT_RSV_WINDOW), &len);
+        // short of space, no new window beyond what is wanted
+        if (len == 0 && fat32_rsv_reclaim() > 0)
+            start = fat32_bitmap_alloc_extent(&fat32_sb, hint, want, &len);
+        if (len == 0)
+            return 0;
+        acquire(&fat32_sb.lock);
+        // only the holder of ip->lock fills the window
+        ASSERT(fi->rsv_len == 0);
+        fi->rsv_start = start;
+        fi->rsv_len = len;
+        list_add_tail(&fi->rsv_list, &rsv_inodes);
+    }
+    c = fi->rsv_start++;
+    if (--fi->rsv_len == 0)
+        list_del_reinit(&fi->rsv_list);
+
+    ASSERT(fat32_sb.fat32_sb_info.free_count > 0);
+    fat32_sb.fat32_sb_info.free_count--;
+    fat32_sb.fat32_sb_info.dirty = 1; // sync in put
+    release(&fat32_sb.lock);
+    fat32_fat_cache_set(c, EOC);
+    return c;
+}
+
+// give the unused reservation window of ip back to bit map
+void fat32_cluster_release_rsv(struct inode *ip) {
+    FAT_entry_t start;
+    uint len;
+
+    acquire(&fat32_sb.lock);
+    len = rsv_detach(&ip->fat32_i, &start);
+    release(&fat32_sb.lock);
+    rsv_free(start, len);
+}
+
 // it is not useful for comp test
 void fat32_update_fsinfo(uint dev) {
     sema_wait(&fat32_sb.sem);
@@ -366,7 +661,12 @@ uint32 fat32_cursor_to_offset(struct inode *ip, uint off, FAT_entry_t *c_start,
         *c_start = ip->fat32_i.cluster_end;
     }
     while (C_NUM_off > ip->fat32_i.cluster_cnt) {
-        FAT_entry_t fat_new = fat32_cluster_alloc(ROOTDEV);
+        FAT_entry_t fat_new = fat32_cluster_alloc_inode(ip, C_NUM_off - ip->fat32_i.cluster_cnt);
+        if (fat_new == 0) {
+            // the disk is full, nothing to read or write at off
+            *c_start = EOC;
+            break;
+        }
         // fat32_fat_set(*c_start, fat_new);
         fat32_fat_cache_set(*c_start, fat_new);// using fat table in memory
         *c_start = fat_new;
@@ -504,6 +804,10 @@ ssize_t fat32_inode_write(struct inode *ip, int user_src, uint64 src, uint off,
     int fileSize = ip->i_size;
     if (off + n < off)
         return -1;
+    // clusters are allocated at write back, fail now if the disk can't hold them
+    uint64 need = CEIL_DIVIDE((uint64)off + n, ip->i_sb->cluster_size);
+    if (need > ip->fat32_i.cluster_cnt && need - ip->fat32_i.cluster_cnt > READ_ONCE(fat32_sb.fat32_sb_info.free_count))
+        return -ENOSPC;
 
     // init the i_mapping
     if (ip->i_mapping == NULL) {
@@ -547,72 +851,67 @@ ssize_t fat32_inode_write(struct inode *ip, int user_src, uint64 src, uint off,
 
 // duplicate
 struct inode *fat32_inode_dup(struct inode *ip) {
-    // sema_wait(&inode_table.lock);
-    acquire(&inode_table.lock);
-    ip->ref++;
-    // sema_signal(&inode_table.lock);
-    release(&inode_table.lock);
+    struct inode_bucket *b = ip_bucket(ip);
+    acquire(&b->lock);
+    __inode_hold(ip);
+    release(&b->lock);
     return ip;
 }
-// TODO():等待合并
+
+// holding the lock of b
+static struct inode *__inode_find(struct inode_bucket *b, uint dev, struct inode *dp, uint parentoff, const char *name) {
+    struct inode *ip;
+    list_for_each_entry(ip, &b->head, list) {
+        if (ip->i_dev == dev && ip->parent == dp && ip->fat32_i.parent_off == parentoff && ip->i_nlink != 0 && !strcmp(ip->fat32_i.fname, name))
+            return ip;
+    }
+    return NULL;
+}
+
+// take a reference of ip found in the dentry cache, if it is still (dp, name) at parentoff
+// ip is not touched before it is found in the table, it may have been freed
+struct inode *fat32_inode_get_cached(struct inode *dp, const char *name, uint parentoff, struct inode *ip) {
+    struct inode_bucket *b = inode_bucket(dp->i_dev, dp, parentoff);
+    struct inode *cur;
+    acquire(&b->lock);
+    cur = __inode_find(b, dp->i_dev, dp, parentoff, name);
+    if (cur == ip && cur != NULL)
+        __inode_hold(ip);
+    else
+        ip = NULL;
+    release(&b->lock);
+    return ip;
+}
+
 // get a inode , move it from disk to memory
+// NULL if there is no memory for it
 struct inode *fat32_inode_get(uint dev, struct inode *dp, const char *name, uint parentoff) {
-    // int get_cnt = 0;// debug
-    struct inode *ip = NULL, *empty = NULL;
-    acquire(&inode_table.lock);
-    // sema_wait(&inode_table.lock);
+    struct inode_bucket *b = inode_bucket(dev, dp, parentoff);
+    struct inode *ip = NULL;
 
     // Is the fat32 inode already in the table?
-    empty = 0;
-    // ===== using array =====
-    for (ip = inode_table.inode_entry; ip < &inode_table.inode_entry[NINODE]; ip++) {
-        // get_cnt++;
-        if (ip->ref > 0 && ip->i_nlink == 0) {
-            fat32_inode_lock(ip);
-            release(&inode_table.lock);
-            // sema_signal(&inode_table.lock);
-            fat32_inode_trunc(ip);
-            fat32_inode_unlock(ip);
-            acquire(&inode_table.lock);
-            ip->ref = 0;
-        }
-        if (ip->ref > 0 && ip->i_dev == dev && ip->parent == dp && ip->fat32_i.parent_off == parentoff && ip->i_nlink != 0 && !strcmp(ip->fat32_i.fname, name)) {
-            // bug : i_nlink!!
-            ip->ref++;
-            release(&inode_table.lock);
-            // sema_signal(&inode_table.lock);
-            // printfMAGENTA("inode get, hit : %d\n", get_cnt);// debug
-            return ip;
-        }
-        // bug !!!
-        if (!list_empty(&ip->dirty_list)) {
-            continue;
-        }
-        if (empty == 0 && ip->ref == 0) // Remember empty slot.
-            empty = ip;
+    acquire(&b->lock);
+    if ((ip = __inode_find(b, dev, dp, parentoff, name)) != NULL) {
+        __inode_hold(ip);
+        release(&b->lock);
+        return ip;
     }
-    // ===== using list =====
-    // struct inode* ip_cur = NULL;
-    // struct inode* ip_tmp = NULL;
-    // list_for_each_entry_safe(ip_cur, ip_tmp, &inode_table.entry, list) {
+    release(&b->lock);
 
-    //     list_del_reinit(&ip_cur->list);
-    // }
-    // printfBlue("inode get, not hit : %d\n", get_cnt);// debug
-    // Recycle an fat32 entry.
-    if (empty == 0) {
-        printf("mm : %d\n", get_free_mem());
-        panic("fat32_inode_get: no space");
+    // keep about NINODE inodes, the table grows if all of them are in use
+    if (inode_table.nr_inodes >= NINODE)
+        fat32_inode_reclaim(INODE_RECLAIM_BATCH);
+    if ((ip = inode_new(dev, dp, parentoff)) == NULL) {
+        fat32_inode_reclaim(inode_table.nr_unused);
+        if ((ip = inode_new(dev, dp, parentoff)) == NULL)
+            return NULL;
     }
 
     // init the inode pointer
-    ip = empty;
     ip->i_sb = &fat32_sb;
-    ip->i_dev = dev;
     // ip->i_ino = inum;
     ip->ref = 1;
     ip->valid = 0;
-    ip->fat32_i.parent_off = parentoff; // very important!!!
     ip->i_op = get_inodeops[FAT32]();
     ip->fs_type = FAT32;
 
@@ -622,11 +921,6 @@ struct inode *fat32_inode_get(uint dev, struct inode *dp, const char *name, uint
     // speed up dirlookup using hint
     ip->off_hint = 0;
 
-    if (!list_empty(&ip->dirty_list)) {
-        panic("fat32_inode_get : get dirty inode\n");
-    }
-    // ASSERT(list_empty(&ip->dirty_list));
-
     // i_mapping set NULL (bug!!)
     ip->i_mapping = NULL;
 
@@ -641,8 +935,20 @@ struct inode *fat32_inode_get(uint dev, struct inode *dp, const char *name, uint
     ip->create_cnt = 0;
     ip->create_first = 0;
 
-    release(&inode_table.lock);
-    // sema_signal(&inode_table.lock);
+    acquire(&b->lock);
+    struct inode *raced = __inode_find(b, dev, dp, parentoff, name);
+    if (raced != NULL) {
+        __inode_hold(raced);
+        release(&b->lock);
+        kmem_cache_free(inode_table.cachep, ip);
+        return raced;
+    }
+    list_add(&ip->list, &b->head);
+    release(&b->lock);
+    __sync_fetch_and_add(&inode_table.nr_inodes, 1);
+
+    // the parent stays in memory as long as its children
+    fat32_inode_dup(dp);
 
     // printfGreen("get new, filename : %s\n", ip->fat32_i.fname); // debug
     // printfGreen("mm: %d pages\n", get_free_mem()/4096); 
@@ -672,6 +978,7 @@ int fat32_fcb_copy(struct inode *dp, struct inode *ip) {
     ASSERT(nwrite == fcb_char_len);
 
     kfree(fcb_char);
+    dcache_drop(dp, ip->fat32_i.fname);
 
     return 0;
 }
@@ -869,35 +1176,38 @@ void fat32_inode_unlock(struct inode *ip) {
 //     }
 // }
 
+// drop a reference
+// an unreferenced inode goes on the lru list, or is truncated by pdflush if unlinked
 void fat32_inode_put(struct inode *ip) {
-    // int put_parent = 0;
-    // int unlock_parent = 0;
-    acquire(&inode_table.lock);
-    if (ip->valid && ip->i_nlink == 0) {
-        // sema_wait(&ip->i_writeback_lock);
-        // destory hash table
-        fat32_inode_hash_destroy(ip);
-
-        // write back dirty pages of inode
-        fat32_i_mapping_writeback(ip);
-        // list_del_reinit(&ip->dirty_list);// !!!
-
-        // destory i_mapping
-        fat32_i_mapping_destroy(ip);
-        // sema_signal(&ip->i_writeback_lock);
-
-        // // truncate inode
-        // fat32_inode_lock(ip);
-        // release(&inode_table.lock);
-        // fat32_inode_trunc(ip);
+    struct inode_bucket *b = ip_bucket(ip);
+    int wake = 0;
 
-        // fat32_inode_unlock(ip);
-        // acquire(&inode_table.lock);
-        // ip->ref = 0;
-        // printfRed("unlink, filename : %s\n", ip->fat32_i.fname);// debug
-        // printfRed("mm: %d pages\n", get_free_mem()/4096);
+    acquire(&b->lock);
+    if (ip->ref <= 0) {
+        release(&b->lock);
+        Warn("fat32_inode_put : %s, ref %d", ip->fat32_i.fname, ip->ref);
+        return;
+    }
+    // the root is not in the table
+    if (--ip->ref > 0 || ip->parent == ip) {
+        release(&b->lock);
+        return;
+    }
+    acquire(&inode_table.lock);
+    if (ip->i_state & I_RECLAIM) {
+        // the reclaimer decides, it sees i_nlink
+    } else if (ip->i_nlink == 0) {
+        list_del_reinit(&ip->list);
+        wake = __inode_queue_unlinked(ip);
+    } else if (list_empty(&ip->i_lru)) {
+        list_add_tail(&ip->i_lru, &inode_table.lru);
+        inode_table.nr_unused++;
     }
     release(&inode_table.lock);
+    release(&b->lock);
+
+    if (wake)
+        pdflush_operation(fat32_inode_reap, 0);
 }
 
 // unlock and put
@@ -911,6 +1221,8 @@ void fat32_inode_unlock_put(struct inode *ip) {
 void fat32_inode_trunc(struct inode *ip) {
     FAT_entry_t iter_c_n = ip->fat32_i.cluster_start;
 
+    fat32_cluster_release_rsv(ip);
+
     uint32 l_num = 1;
     // truncate the fat chain
     while (!ISEOF(iter_c_n)) {
@@ -919,8 +1231,8 @@ void fat32_inode_trunc(struct inode *ip) {
         FAT_entry_t fat_next = fat32_ctl_index_table(ip, l_num + 1, 0); // lookup;
         // fat32_fat_set(iter_c_n, FREE_MASK);                             // bug like this : fat32_fat_set(iter_c_n, EOC);
         fat32_fat_cache_set(iter_c_n, FREE_MASK);// using fat table in memory
+        // the cluster may be allocated again from here on, don't touch it
         fat32_bitmap_op(&fat32_sb, iter_c_n, 0);// clear
-        fat32_fat_cache_set(iter_c_n, FREE_MASK);// set to FREE
         iter_c_n = fat_next;
         l_num++;
     }
@@ -1183,11 +1495,17 @@ struct inode *fat32_inode_alloc(struct inode *dp, const char *name, uint16 type)
     // printfMAGENTA("fcb_char, mm-- : %d pages\n", get_free_mem() / 4096);
 
     int fcb_cnt = fat32_fcb_init(dp, (const uchar *)name, type, (char *)fcb_char);
+    if (fcb_cnt < 0) {
+        kfree(fcb_char);
+        return 0;
+    }
     uint offset = fat32_dir_fcb_insert_offset(dp, fcb_cnt); // unit is 32Bytes
     uint tot = fat32_inode_write(dp, 0, (uint64)fcb_char, offset * sizeof(dirent_l_t), fcb_cnt * sizeof(dirent_l_t));
     kfree(fcb_char);
 
-    ASSERT(tot == fcb_cnt * sizeof(dirent_l_t));
+    // no space for the dirents
+    if (tot != fcb_cnt * sizeof(dirent_l_t))
+        return 0;
 
     struct inode *ip_new;
 
@@ -1203,8 +1521,10 @@ struct inode *fat32_inode_alloc(struct inode *dp, const char *name, uint16 type)
         // printfGreen("alloc : insert : %s\n", name); //debug
     }
 
-    ip_new = fat32_inode_get(dp->i_dev, dp, name, off);
+    if ((ip_new = fat32_inode_get(dp->i_dev, dp, name, off)) == NULL)
+        return 0;
     ip_new->parent = dp;
+    dcache_add(dp, name, ip_new, off);
     dp->off_hint = off + 1; // don't use off, but the next one
 
 #ifdef __DEBUG_INODE__
@@ -1215,6 +1535,7 @@ struct inode *fat32_inode_alloc(struct inode *dp, const char *name, uint16 type)
 
 // fcb init
 // 为 long_name 初始化若干个 dirent_l_t 和一个dirent_s_t，写入 fcb_char中，返回需要的 fcb 总数
+// -ENOSPC if there is no cluster for the file
 int fat32_fcb_init(struct inode *ip_parent, const uchar *long_name, uint16 type, char *fcb_char) {
     uchar attr;
     dirent_s_t dirent_s_cur;
@@ -1293,7 +1614,8 @@ int fat32_fcb_init(struct inode *ip_parent, const uchar *long_name, uint16 type,
         // 设备文件不需要分配磁盘块
         first_c = 0; // for debug; should be zero
     } else {
-        first_c = fat32_cluster_alloc(ip_parent->i_dev);
+        if ((first_c = fat32_cluster_alloc(ip_parent->i_dev)) == 0)
+            return -ENOSPC;
     }
 
     dirent_s_cur.DIR_FstClusHI = DIR_FIRST_HIGH(first_c);
@@ -1460,6 +1782,7 @@ int fat32_fcb_delete(struct inode *dp, struct inode *ip) {
     ASSERT(tot == (long_dir_len + 1) * sizeof(dirent_l_t));
 
     hash_delete(dp->i_hash, (void *)ip->fat32_i.fname, 0, 1); // not holding lock, release it
+    dcache_add(dp, ip->fat32_i.fname, NULL, 0);                   // negative
     return 0;
 }
 
@@ -1489,7 +1812,7 @@ void fat32_inode_hash_init(struct inode *dp) {
     }
     dp->i_hash->lock = INIT_SPINLOCK(inode_hash_table);
     dp->i_hash->type = INODE_MAP;
-    dp->i_hash->size = NINODE;
+    dp->i_hash->size = INODE_DIR_HASH_NR;
     hash_table_entry_init(dp->i_hash);
 }
 
@@ -1531,8 +1854,8 @@ struct inode *fat32_inode_hash_lookup(struct inode *dp, const char *name) {
         release(&dp->i_hash->lock);
         if (cache != NULL) {
             // printfBlue("hit : name %s, ino, %d, off, %x\n", name ,cache->ino, cache->off);
-            ip_search = fat32_inode_get(dp->i_dev, dp, name, off);
-            ip_search->parent = dp;
+            if ((ip_search = fat32_inode_get(dp->i_dev, dp, name, off)) != NULL)
+                ip_search->parent = dp;
         }
 
         return ip_search;
@@ -1582,7 +1905,7 @@ int fat32_get_block(struct inode *ip, struct bio *bio_p, uint off, uint n, int a
         int first_sector = FirstSectorofCluster(iter_c_n);
 
         if (vec_cur == NULL || !CLUSTER_ADJACENT(vec_cur, first_sector)) {
-            if ((vec_cur = (struct bio_vec *)kzalloc(sizeof(struct bio_vec))) == NULL) {
+            if ((vec_cur = (struct bio_vec *)kmem_cache_zalloc(bio_vec_cachep)) == NULL) {
                 panic("fat_get_block : no free memory\n");
             }
             // printfMAGENTA("fat32_get_block: bio_vec alloc, mm-- : %d pages\n", get_free_mem() / 4096);
@@ -1615,7 +1938,10 @@ int fat32_get_block(struct inode *ip, struct bio *bio_p, uint off, uint n, int a
             // FAT_entry_t next = fat32_next_cluster(iter_c_n);
             FAT_entry_t next = fat32_ctl_index_table(ip, l_num + 1, 0); // lookup
             if (ISEOF(next)) {
-                FAT_entry_t fat_new = fat32_cluster_alloc(ROOTDEV);
+                // the rest of this write in one extent if possible
+                FAT_entry_t fat_new = fat32_cluster_alloc_inode(ip, CEIL_DIVIDE(tot_s_n - cur_s_n, b_per_c_n));
+                if (fat_new == 0)
+                    break; // the disk is full
                 // fat32_fat_set(iter_c_n, fat_new);
                 fat32_fat_cache_set(iter_c_n, fat_new);
                 // printfRed("fat cluster : %x, value : %x\n",iter_c_n, fat32_next_cluster(iter_c_n));// debug!!
@@ -1655,6 +1981,8 @@ void fat32_i_mapping_destroy(struct inode *ip) {
     struct radix_tree_node *node;
     node = mapping->page_tree.rnode;
     if (!node) {
+        kfree(mapping);
+        ip->i_mapping = NULL;
         release(&ip->tree_lock); // !!!
         return;
     }
@@ -1700,15 +2028,10 @@ void fat32_i_mapping_writeback(struct inode *ip) {
     // atomic !!!
     // sema_wait(&ip->i_sem); // !!!! bug , must acquire this lock
     if (!list_empty_atomic(&ip->dirty_list, &ip->i_lock)) {
-        // release(&inode_table.lock);
-
-
-        release(&inode_table.lock);
         int ret = sync_inode(ip);
-        acquire(&inode_table.lock);
 
         // remove inode from dity list
-        // acquire(&ip->i_sb->dirty_lock);
+        acquire(&ip->i_sb->dirty_lock);
         if (ret == 0) {
             list_del_reinit(&ip->dirty_list);
             ip->i_writeback = 0;
@@ -1716,7 +2039,7 @@ void fat32_i_mapping_writeback(struct inode *ip) {
             printfCYAN("file %s has written back\n", ip->fat32_i.fname);
 #endif
         }
-        // release(&ip->i_sb->dirty_lock);
+        release(&ip->i_sb->dirty_lock);
     }
     // sema_signal(&ip->i_sem);
 }
@@ -1857,8 +2180,8 @@ void fat32_inode_dirlookup_handler(struct trav_control *tc) {
             *tc->poff = tc->off;
 
         struct inode *ip_search;
-        ip_search = fat32_inode_get(tc->dp->i_dev, tc->dp, tc->name_search, tc->off);
-        ip_search->parent = tc->dp;
+        if ((ip_search = fat32_inode_get(tc->dp->i_dev, tc->dp, tc->name_search, tc->off)) != NULL)
+            ip_search->parent = tc->dp;
 
         // save hint
         tc->dp->off_hint = tc->off + 1;
@@ -1946,95 +2269,46 @@ void fat32_find_same_name_cnt_handler(struct trav_control *tc) {
 void alloc_fail(void) {
     printfGreen("mm: %d pages before alloc fail\n", get_free_mem()/4096);
 
-    acquire(&inode_table.lock);
-    struct inode *ip = NULL;
-
-    for (ip = inode_table.inode_entry; ip < &inode_table.inode_entry[NINODE]; ip++) {
-        if (ip->ref) {
-            // printfBlue("file name : %s recycle, ref : %d\n", ip->fat32_i.fname, ip->ref);
-
-            // release(&inode_table.lock);
-            // sema_wait(&ip->i_writeback_lock);
-            // ==== atomic ====
-            // write back dirty pages of inode
-            // fat32_i_mapping_writeback(ip);
+    // unused inodes first
+    fat32_inode_reclaim(inode_table.nr_unused);
 
+    struct inode *ip = NULL;
+    for (int i = 0; i < INODE_NBUCKET; i++) {
+        struct inode_bucket *b = &inode_table.buckets[i];
+        acquire(&b->lock);
+        list_for_each_entry(ip, &b->head, list) {
             // destory i_mapping
             if (list_empty_atomic(&ip->dirty_list, &ip->i_lock)) {
                 fat32_i_mapping_destroy(ip);
             }
-            // acquire(&inode_table.lock);
 
             // destory hash table
             fat32_inode_hash_destroy(ip);
 
             // // free index table
             // fat32_free_index_table(ip);
-
-            // sema_signal(&ip->i_writeback_lock);
-            // ==== atomic ====
         }
+        release(&b->lock);
     }
     if (list_empty_atomic(&fat32_sb.root->dirty_list, &fat32_sb.root->i_lock)) {
         fat32_i_mapping_destroy(fat32_sb.root);
     }
     fat32_inode_hash_destroy(fat32_sb.root);
-    // // free index table
-    // fat32_free_index_table(ip);
 
     printfGreen("mm: %d pages after alloc fail\n", get_free_mem()/4096);
-
-    release(&inode_table.lock);
-
-
 }
 
 void shutdown_writeback(void) {
     printfGreen("mm: %d pages before writeback\n", get_free_mem()/4096);
 
-    acquire(&inode_table.lock);
-    struct inode *ip = NULL;
-
-    for (ip = inode_table.inode_entry; ip < &inode_table.inode_entry[NINODE]; ip++) {
-        if (ip->ref) {
-            // printfBlue("file name : %s recycle, ref : %d\n", ip->fat32_i.fname, ip->ref);
-
-            // release(&inode_table.lock);
-            // sema_wait(&ip->i_writeback_lock);
-            // ==== atomic ====
-            // write back dirty pages of inode
-            fat32_i_mapping_writeback(ip);
-
-            // destory i_mapping
-            // if (list_empty_atomic(&ip->dirty_list, &ip->i_lock)) {
-            fat32_i_mapping_destroy(ip);
-            // }
-            // acquire(&inode_table.lock);
-
-            // destory hash table
-            fat32_inode_hash_destroy(ip);
-
-            // // free index table
-            fat32_free_index_table(ip);
-
-            // sema_signal(&ip->i_writeback_lock);
-            // ==== atomic ====
-        }
-    }
-    // if (list_empty_atomic(&fat32_sb.root->dirty_list, &fat32_sb.root->i_lock)) {
-    fat32_i_mapping_writeback(fat32_sb.root);
-
-    fat32_i_mapping_destroy(fat32_sb.root);
-    // }
-    fat32_inode_hash_destroy(fat32_sb.root);
-
-    fat32_free_index_table(fat32_sb.root);
-    // // free index table
-    // fat32_free_index_table(ip);
+    // dirty inodes, the root included, are all on s_dirty
+    writeback_inodes(0);
+    fat32_inode_reap(0);
 
     printfGreen("mm: %d pages after writeback\n", get_free_mem()/4096);
-    release(&inode_table.lock);
     fat32_fat_bitmap_writeback(ROOTDEV, &fat32_sb);
+    // write is deferred by the buffer cache
+    bsync();
 
 }
 
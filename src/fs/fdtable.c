@@ -0,0 +1,284 @@
+#include "common.h"
+#include "errno.h"
+#include "fs/fdtable.h"
+#include "fs/vfs/fs.h"
+#include "fs/vfs/ops.h"
+#include "fs/fat/fat32_mem.h"
+#include "fs/fcntl.h"
+#include "memory/allocator.h"
+#include "debug.h"
+
+#define FD_WORDS(nr) ((nr) / FDS_PER_WORD)
+#define FD_BIT(fd) (1UL << ((fd) % FDS_PER_WORD))
+
+// one block : fd[max_fds], open_fds and close_on_exec
+static void *fdarray_alloc(uint max_fds) {
+    return kzalloc(max_fds * sizeof(struct file *) + 2 * FD_WORDS(max_fds) * sizeof(uint64));
+}
+
+static void fdtable_set_array(struct fdtable *fdt, void *array, uint max_fds) {
+    fdt->fd = array;
+    fdt->open_fds = (uint64 *)(fdt->fd + max_fds);
+    fdt->close_on_exec = fdt->open_fds + FD_WORDS(max_fds);
+    fdt->max_fds = max_fds;
+}
+
+struct fdtable *fdtable_alloc(void) {
+    struct fdtable *fdt;
+    void *array;
+
+    if ((fdt = kzalloc(sizeof(struct fdtable))) == NULL)
+        return NULL;
+    if ((array = fdarray_alloc(NR_OPEN_DEFAULT)) == NULL) {
+        kfree(fdt);
+        return NULL;
+    }
+    atomic_set(&fdt->ref, 1);
+    initlock(&fdt->lock, "fdtable");
+    fdtable_set_array(fdt, array, NR_OPEN_DEFAULT);
+    fdt->next_fd = 0;
+    return fdt;
+}
+
+// grow fdt to hold fd nr, holding fdt->lock, which is dropped to allocate
+static int fdtable_expand(struct fdtable *fdt, uint nr) {
+    uint max = fdt->max_fds;
+    void *array, *old;
+
+    if (nr >= FDTABLE_MAX)
+        return -EMFILE;
+    while (max <= nr)
+        max *= 2;
+    max = MIN(max, FDTABLE_MAX);
+
+    release(&fdt->lock);
+    array = fdarray_alloc(max);
+    acquire(&fdt->lock);
+    if (array == NULL)
+        return -ENOMEM;
+    if (fdt->max_fds > nr) {
+        // grown by another thread meanwhile
+        kfree(array);
+        return 0;
+    }
+
+    old = fdt->fd;
+    memmove(array, fdt->fd, fdt->max_fds * sizeof(struct file *));
+    memmove((struct file **)array + max, fdt->open_fds, FD_WORDS(fdt->max_fds) * sizeof(uint64));
+    memmove((uint64 *)((struct file **)array + max) + FD_WORDS(max), fdt->close_on_exec, FD_WORDS(fdt->max_fds) * sizeof(uint64));
+    fdtable_set_array(fdt, array, max);
+    kfree(old);
+    return 0;
+}
+
+// the lowest fd >= start not in use, fdt->max_fds if all are
+static uint find_next_free_fd(struct fdtable *fdt, uint start) {
+    for (uint i = FD_WORDS(start); i < FD_WORDS(fdt->max_fds); i++) {
+        uint64 used = fdt->open_fds[i];
+        if (i == FD_WORDS(start))
+            used |= FD_BIT(start) - 1;
+        if (~used)
+            return i * FDS_PER_WORD + __builtin_ctzl(~used);
+    }
+    return fdt->max_fds;
+}
+
+static inline void __fd_set(struct fdtable *fdt, int fd, struct file *f, int cloexec) {
+    fdt->fd[fd] = f;
+    fdt->open_fds[FD_WORDS(fd)] |= FD_BIT(fd);
+    if (cloexec)
+        fdt->close_on_exec[FD_WORDS(fd)] |= FD_BIT(fd);
+    else
+        fdt->close_on_exec[FD_WORDS(fd)] &= ~FD_BIT(fd);
+}
+
+static inline void __fd_clear(struct fdtable *fdt, int fd) {
+    fdt->fd[fd] = NULL;
+    fdt->open_fds[FD_WORDS(fd)] &= ~FD_BIT(fd);
+    fdt->close_on_exec[FD_WORDS(fd)] &= ~FD_BIT(fd);
+    if (fd < fdt->next_fd)
+        fdt->next_fd = fd;
+}
+
+// the lowest free fd >= start and < limit for f
+// takes over the file reference from caller on success
+int fd_alloc(struct fdtable *fdt, struct file *f, int start, int limit, int cloexec) {
+    uint fd;
+    int ret;
+
+    limit = MIN(limit, FDTABLE_MAX);
+    acquire(&fdt->lock);
+    for (;;) {
+        fd = find_next_free_fd(fdt, MAX(start, fdt->next_fd));
+        if (fd >= limit) {
+            release(&fdt->lock);
+            return -EMFILE;
+        }
+        if (fd < fdt->max_fds)
+            break;
+        if ((ret = fdtable_expand(fdt, fd)) < 0) {
+            release(&fdt->lock);
+            return ret;
+        }
+    }
+    __fd_set(fdt, fd, f, cloexec);
+    if (start <= fdt->next_fd)
+        fdt->next_fd = fd + 1;
+    release(&fdt->lock);
+    return fd;
+}
+
+// the file at fd with a reference, a close from another thread can't free
+// it under the caller. put it with generic_fileclose
+struct file *fd_get(struct fdtable *fdt, int fd) {
+    struct file *f = NULL;
+
+    acquire(&fdt->lock);
+    if (fd >= 0 && fd < fdt->max_fds && (f = fdt->fd[fd]) != NULL)
+        f->f_op->dup(f);
+    release(&fdt->lock);
+    return f;
+}
+
+// put f at fd, for dup2 and dup3. the file that was at fd is returned in
+// *oldp for the caller to close, replacing it is atomic
+int fd_install(struct fdtable *fdt, int fd, struct file *f, int limit, int cloexec, struct file **oldp) {
+    int ret;
+
+    if (fd < 0 || fd >= MIN(limit, FDTABLE_MAX))
+        return -EBADF;
+    acquire(&fdt->lock);
+    while (fd >= fdt->max_fds) {
+        if ((ret = fdtable_expand(fdt, fd)) < 0) {
+            release(&fdt->lock);
+            return ret;
+        }
+    }
+    *oldp = fdt->fd[fd];
+    __fd_set(fdt, fd, f, cloexec);
+    release(&fdt->lock);
+    return 0;
+}
+
+// take fd out, the caller closes the file returned
+struct file *fd_remove(struct fdtable *fdt, int fd) {
+    struct file *f = NULL;
+
+    acquire(&fdt->lock);
+    if (fd >= 0 && fd < fdt->max_fds && (f = fdt->fd[fd]) != NULL)
+        __fd_clear(fdt, fd);
+    release(&fdt->lock);
+    return f;
+}
+
+int fd_get_cloexec(struct fdtable *fdt, int fd) {
+    int ret = -EBADF;
+
+    acquire(&fdt->lock);
+    if (fd >= 0 && fd < fdt->max_fds && fdt->fd[fd] != NULL)
+        ret = (fdt->close_on_exec[FD_WORDS(fd)] & FD_BIT(fd)) ? 1 : 0;
+    release(&fdt->lock);
+    return ret;
+}
+
+int fd_set_cloexec(struct fdtable *fdt, int fd, int cloexec) {
+    int ret = -EBADF;
+
+    acquire(&fdt->lock);
+    if (fd >= 0 && fd < fdt->max_fds && fdt->fd[fd] != NULL) {
+        __fd_set(fdt, fd, fdt->fd[fd], cloexec);
+        ret = 0;
+    }
+    release(&fdt->lock);
+    return ret;
+}
+
+// dst is a new empty table, copy src into it with every file duplicated (fork)
+int fdtable_copy(struct fdtable *dst, struct fdtable *src) {
+    void *array;
+    uint max;
+
+    // dst is private to the caller, only src needs its lock
+    acquire(&src->lock);
+    while ((max = src->max_fds) > dst->max_fds) {
+        release(&src->lock);
+        if ((array = fdarray_alloc(max)) == NULL)
+            return -ENOMEM;
+        kfree(dst->fd);
+        fdtable_set_array(dst, array, max);
+        acquire(&src->lock);
+    }
+    for (int fd = 0; fd < src->max_fds; fd++) {
+        struct file *f = src->fd[fd];
+        if (f != NULL)
+            __fd_set(dst, fd, f->f_op->dup(f), src->close_on_exec[FD_WORDS(fd)] & FD_BIT(fd));
+    }
+    dst->next_fd = src->next_fd;
+    release(&src->lock);
+    return 0;
+}
+
+// close a file taken out of a fd table, the caller may sleep
+void fd_close(struct file *f) {
+    struct inode *ip = f->f_tp.f_inode;
+
+    if (f->f_type == FD_INODE && F_WRITEABLE(f) && ip->fs_type == FAT32) {
+        // give back the clusters reserved for appending
+        ip->i_op->ilock(ip);
+        fat32_cluster_release_rsv(ip);
+        ip->i_op->iunlock(ip);
+    }
+    generic_fileclose(f);
+}
+
+struct fdtable *fdtable_get(struct fdtable *fdt) {
+    atomic_inc_return(&fdt->ref);
+    return fdt;
+}
+
+// the last user closes all the files
+void fdtable_put(struct fdtable *fdt) {
+    // atomic_dec_return returns the old value
+    if (atomic_dec_return(&fdt->ref) != 1)
+        return;
+    // nobody else can see it now
+    for (int fd = 0; fd < fdt->max_fds; fd++) {
+        if (fdt->fd[fd] != NULL)
+            fd_close(fdt->fd[fd]);
+    }
+    kfree(fdt->fd);
+    kfree(fdt);
+}
+
+// give the caller a private copy if *fdtp is shared, before exec
+int fdtable_unshare(struct fdtable **fdtp) {
+    struct fdtable *fdt = *fdtp, *new;
+
+    if (atomic_read(&fdt->ref) == 1)
+        return 0;
+    if ((new = fdtable_alloc()) == NULL)
+        return -ENOMEM;
+    if (fdtable_copy(new, fdt) < 0) {
+        fdtable_put(new);
+        return -ENOMEM;
+    }
+    *fdtp = new;
+    fdtable_put(fdt);
+    return 0;
+}
+
+// close the fds marked close-on-exec
+void fdtable_close_on_exec(struct fdtable *fdt) {
+    struct file *f;
+
+    for (int fd = 0; fd < fdt->max_fds; fd++) {
+        acquire(&fdt->lock);
+        if (!(fdt->close_on_exec[FD_WORDS(fd)] & FD_BIT(fd)) || (f = fdt->fd[fd]) == NULL) {
+            release(&fdt->lock);
+            continue;
+        }
+        __fd_clear(fdt, fd);
+        release(&fdt->lock);
+        fd_close(f);
+    }
+}
@@ -31,14 +31,22 @@ int sync_inode(struct inode *ip) {
 void writeback_inodes(uint64 nr_to_write) {
     // nr_to_write is not important
     struct inode *ip_cur = NULL;
-    struct inode *ip_tmp = NULL;
+    LIST_HEAD(todo);
 
+    // an inode may be freed once it leaves the dirty list, so hold a
+    // reference while writing it, and take the next one from the head
     acquire(&fat32_sb.dirty_lock);
-    list_for_each_entry_safe(ip_cur, ip_tmp, &fat32_sb.s_dirty, dirty_list) {
+    list_splice(&fat32_sb.s_dirty, &todo);
+    INIT_LIST_HEAD(&fat32_sb.s_dirty);
+    while (!list_empty(&todo)) {
+        ip_cur = list_first_entry(&todo, struct inode, dirty_list);
+        list_move_tail(&ip_cur->dirty_list, &fat32_sb.s_dirty);
+        ip_cur->i_op->idup(ip_cur);
         release(&fat32_sb.dirty_lock);
 
         sema_wait(&ip_cur->i_sem);// important ??? maybe
-        int ret = sync_inode(ip_cur);
+        // an unlinked inode is dropped by fat32_inode_reap, not written
+        int ret = ip_cur->i_nlink ? sync_inode(ip_cur) : -1;
         sema_signal(&ip_cur->i_sem);
 
         acquire(&fat32_sb.dirty_lock);
@@ -46,6 +54,9 @@ void writeback_inodes(uint64 nr_to_write) {
             list_del_reinit(&ip_cur->dirty_list);
             ip_cur->i_writeback = 0;
         }
+        release(&fat32_sb.dirty_lock);
+        ip_cur->i_op->iput(ip_cur);
+        acquire(&fat32_sb.dirty_lock);
     }
     release(&fat32_sb.dirty_lock);
 }
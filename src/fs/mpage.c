@@ -1,5 +1,6 @@
 #include "memory/filemap.h"
 #include "memory/allocator.h"
+#include "memory/slab.h"
 #include "memory/buddy.h"
 #include "lib/riscv.h"
 #include "lib/radix-tree.h"
@@ -11,6 +12,14 @@
 #include "debug.h"
 #include "proc/pcb_life.h"
 
+// object cache of page list item
+static struct kmem_cache *page_item_cachep;
+
+void mpage_init(void) {
+    page_item_cachep = kmem_cache_create("Page_item", sizeof(struct Page_item));
+    ASSERT(page_item_cachep != NULL);
+}
+
 // index : page index
 // cnt : page count
 void block_full_pages(struct inode *ip, struct bio *bio_p, uint64 src, uint64 index, uint64 cnt, int alloc) {
@@ -21,8 +30,8 @@ void block_full_pages(struct inode *ip, struct bio *bio_p, uint64 src, uint64 in
 
     // pay attention to alloc!!!
     int blocks_n = fat32_get_block(ip, bio_p, off, n, alloc);
-    if (alloc == 1) // it is ok, if only read
-        ASSERT(blocks_n * bsize == n);
+    if (alloc == 1 && blocks_n * bsize != n) // it is ok, if only read
+        Warn("no disk space, %d bytes of %s are lost", n - blocks_n * bsize, ip->fat32_i.fname);
 
     // copy bio_vec into dst
     struct bio_vec *vec_cur = NULL;
@@ -37,9 +46,7 @@ void fat32_rw_pages(struct inode *ip, uint64 src, uint64 index, int rw, uint64 c
     struct bio bio_cur;
 
     // init bio
-    INIT_LIST_HEAD(&bio_cur.list_entry);
-    bio_cur.bi_rw = rw;
-    bio_cur.bi_bdev = ip->i_dev;
+    bio_init(&bio_cur, ip->i_dev, rw);
 
     // fill bio with bio_vec
     // block_full_pages(ip, &bio_cur, page_list, index, cnt, alloc);
@@ -97,7 +104,7 @@ void page_list_free(struct Page_entry *p_entry) {
     struct Page_item *p_cur = NULL;
     struct Page_item *p_tmp = NULL;
     list_for_each_entry_safe(p_cur, p_tmp, &p_entry->entry, list) {
-        kfree(p_cur);
+        kmem_cache_free(page_item_cachep, p_cur);
     }
 }
 
@@ -157,7 +164,7 @@ uint64 mpage_readpages(struct inode *ip, uint64 index, uint64 cnt, int read_from
                 }
 
                 // page list item :
-                if ((p_item = (struct Page_item *)kzalloc(sizeof(struct Page_item))) == NULL) {
+                if ((p_item = (struct Page_item *)kmem_cache_zalloc(page_item_cachep)) == NULL) {
                     panic("mpage_readpages, p_item, : no enough memory\n");
                 }
                 // printfMAGENTA("mpage_readpages: Page_item alloc, mm-- : %d pages\n", get_free_mem() / 4096);
@@ -226,7 +233,7 @@ void mpage_writepage(struct inode *ip, int alloc) {
 void page_list_add(void *entry, void *item, uint64 index, void *node) {
     struct Page_entry *p_entry = (struct Page_entry *)entry;
     struct Page_item *p_item = NULL;
-    if ((p_item = (struct Page_item *)kzalloc(sizeof(struct Page_item))) == NULL) {
+    if ((p_item = (struct Page_item *)kmem_cache_zalloc(page_item_cachep)) == NULL) {
         panic("mpage_readpages, page_list_add, : no enough memory\n");
     }
 
@@ -0,0 +1,120 @@
+#include "common.h"
+#include "atomic/wait_queue.h"
+#include "atomic/semaphore.h"
+#include "fs/poll.h"
+#include "fs/vfs/fs.h"
+#include "fs/vfs/ops.h"
+#include "lib/poll.h"
+#include "lib/timer.h"
+#include "lib/riscv.h"
+#include "memory/allocator.h"
+#include "debug.h"
+#include "errno.h"
+
+// called by wake_up of a queue the poller is on
+static void pollwake(struct wait_queue_entry *wait) {
+    struct poll_wqueues *pwq = wait->private;
+    sema_signal(&pwq->sem);
+}
+
+// called by the timer interrupt
+static void poll_timeout(void *data) {
+    struct poll_wqueues *pwq = data;
+    pwq->timed_out = 1;
+    sema_signal(&pwq->sem);
+}
+
+static struct poll_table_entry *poll_get_entry(struct poll_wqueues *pwq) {
+    struct poll_table_page *table = pwq->table;
+
+    if (pwq->inline_index < N_POLL_INLINE_ENTRIES)
+        return pwq->inline_entries + pwq->inline_index++;
+
+    if (table == NULL || table->nr == POLL_TABLE_PAGE_ENTRIES) {
+        struct poll_table_page *new_table;
+        if ((new_table = kmalloc(sizeof(struct poll_table_page))) == NULL) {
+            pwq->error = -ENOMEM;
+            return NULL;
+        }
+        new_table->nr = 0;
+        new_table->next = table;
+        pwq->table = new_table;
+        table = new_table;
+    }
+    return table->entries + table->nr++;
+}
+
+// hook the poller on whead
+static void __pollwait(struct file *filp, struct wait_queue_head *whead, struct poll_table *pt) {
+    struct poll_wqueues *pwq = container_of(pt, struct poll_wqueues, pt);
+    struct poll_table_entry *entry = poll_get_entry(pwq);
+    if (entry == NULL)
+        return;
+    // whead lives in the file, keep it until poll_freewait
+    entry->filp = filp ? filp->f_op->dup(filp) : NULL;
+    entry->whead = whead;
+    init_waitqueue_entry(&entry->wait, pollwake, pwq);
+    add_wait_queue(whead, &entry->wait);
+}
+
+void poll_initwait(struct poll_wqueues *pwq) {
+    pwq->pt.qproc = __pollwait;
+    sema_init(&pwq->sem, 0, "poll_sem");
+    timer_list_init(&pwq->timer);
+    pwq->timer.count = 0;
+    pwq->timer.interval = 0;
+    pwq->timed_out = 0;
+    pwq->error = 0;
+    pwq->table = NULL;
+    pwq->inline_index = 0;
+}
+
+static void free_poll_entry(struct poll_table_entry *entry) {
+    remove_wait_queue(entry->whead, &entry->wait);
+    if (entry->filp)
+        generic_fileclose(entry->filp);
+}
+
+void poll_freewait(struct poll_wqueues *pwq) {
+    struct poll_table_page *p = pwq->table;
+    int i;
+
+    for (i = 0; i < pwq->inline_index; i++)
+        free_poll_entry(pwq->inline_entries + i);
+    while (p) {
+        struct poll_table_page *old;
+        for (i = 0; i < p->nr; i++)
+            free_poll_entry(p->entries + i);
+        old = p;
+        p = p->next;
+        kfree(old);
+    }
+    pwq->table = NULL;
+    pwq->inline_index = 0;
+}
+
+// sleep until a queue fires or expire (ns of rdtime, POLL_INFINITE : never)
+// return 0 if timed out
+int poll_schedule_timeout(struct poll_wqueues *pwq, uint64 expire) {
+    if (expire != POLL_INFINITE) {
+        uint64 now = TIME2NS(rdtime());
+        if (now >= expire) {
+            pwq->timed_out = 1;
+            return 0;
+        }
+        add_timer_atomic(&pwq->timer, expire - now, poll_timeout, pwq);
+    }
+
+    sema_wait(&pwq->sem);
+
+    if (expire != POLL_INFINITE)
+        delete_timer_atomic(&pwq->timer);
+    return !pwq->timed_out;
+}
+
+// regular files are always ready
+uint vfs_poll(struct file *file, struct poll_table *pt) {
+    if (file->f_op->poll == NULL)
+        return DEFAULT_POLLMASK;
+    return file->f_op->poll(file, pt);
+}
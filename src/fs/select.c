@@ -1,25 +1,42 @@
 #include "common.h"
 #include "kernel/syscall.h"
 #include "fs/select.h"
+#include "fs/poll.h"
+#include "fs/vfs/fs.h"
+#include "fs/fdtable.h"
+#include "fs/vfs/ops.h"
 #include "ipc/signal.h"
 #include "proc/tcb_life.h"
 #include "proc/pcb_life.h"
 #include "lib/poll.h"
+#include "lib/riscv.h"
 #include "errno.h"
 #include "memory/allocator.h"
 #include "debug.h"
-#include "ipc/pipe.h"
-#include "proc/pcb_life.h"
-#include "driver/console.h"
 
-extern struct cond cond_ticks;
+// timespec (relative) to the absolute expire time in ns, NULL : wait forever
+static inline uint64 ts2expire(struct timespec *ts) {
+    return ts ? TIME2NS(rdtime()) + TIMESEPC2NS((*ts)) : POLL_INFINITE;
+}
 
-int do_select(int nfds, fd_set_bits *fds, uint64 timeout) {
-    int retval;
+static inline int poll_expired(uint64 expire) {
+    return expire != POLL_INFINITE && TIME2NS(rdtime()) >= expire;
+}
 
-    uint64 time_now = TIME2NS(rdtime());
+// poll every fd in fds, sleep on their wait queues until one is ready or expire
+// the poller is hooked on the queues in the first pass only, later passes just check
+int do_select(int nfds, fd_set_bits *fds, uint64 expire) {
+    struct poll_wqueues table;
+    struct poll_table *wait;
     struct proc *p = proc_current();
-    retval = 0;
+    int retval = 0;
+    int timed_out = poll_expired(expire);
+
+    poll_initwait(&table);
+    wait = &table.pt;
+    if (timed_out)
+        wait->qproc = NULL;
+
     for (;;) {
         uint64 *rinp, *routp, *rexp, *inp, *outp, *exp;
 
@@ -45,37 +62,30 @@ int do_select(int nfds, fd_set_bits *fds, uint64 timeout) {
                 i += __NFDBITS;
                 continue;
             }
-            for (int j = 0; j < __NFDBITS; ++j, ++i, bit <<= 1) {
-                // 			int fput_needed;
-                if (i >= nfds) {
-                    panic("i>=nfds : not tested\n");
-                    break;
-                }
+            for (int j = 0; j < __NFDBITS && i < nfds; ++j, ++i, bit <<= 1) {
+                uint mask;
                 if (!(bit & all_bits))
                     continue;
-                file = p->ofile[i];
-                if (file) {
-                    switch (file->f_type) {
-                    case FD_INODE:
-                        break;
-                    case FD_PIPE: {
-                    }
-                    default:
-                        Warn("TYPE is %d", file->f_type);
-                        panic("this type not tested\n");
-                    }
-                    if (in & bit) {
-                        res_in |= bit;
-                        retval++;
-                    }
-                    if (out & bit) {
-                        res_out |= bit;
-                        retval++;
-                    }
-                    if (ex & bit) {
-                        res_ex |= bit;
-                        retval++;
-                    }
+                if ((file = fd_get(p->files, i)) == NULL) {
+                    retval = -EBADF;
+                    goto out;
+                }
+                mask = vfs_poll(file, wait);
+                generic_fileclose(file);
+                if ((mask & POLLIN_SET) && (in & bit)) {
+                    res_in |= bit;
+                    retval++;
+                    wait->qproc = NULL;
+                }
+                if ((mask & POLLOUT_SET) && (out & bit)) {
+                    res_out |= bit;
+                    retval++;
+                    wait->qproc = NULL;
+                }
+                if ((mask & POLLEX_SET) && (ex & bit)) {
+                    res_ex |= bit;
+                    retval++;
+                    wait->qproc = NULL;
                 }
             }
             if (res_in)
@@ -85,61 +95,51 @@ int do_select(int nfds, fd_set_bits *fds, uint64 timeout) {
             if (res_ex)
                 *rexp = res_ex;
         }
+        wait->qproc = NULL;
 
-        // 	wait = NULL;
-        if (retval || (TIME2NS(rdtime()) > time_now + timeout)) {
-            // printf("ready\n");
-            // printfGreen("select , pid : %d exit\n", proc_current()->pid);// debug
+        if (retval || timed_out || table.error)
             break;
-        } else {
-            // TODO : set a waiting queue
-        }
+
+        // sleep until a queue fires or the timer expires
+        if (!poll_schedule_timeout(&table, expire))
+            timed_out = 1;
     }
 
+out:
+    poll_freewait(&table);
+    if (retval == 0 && table.error)
+        retval = table.error;
     return retval;
 }
 
-int core_sys_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, uint64 timeout) {
+// readfds, writefds and exceptfds are in kernel, NULL if not given
+int core_sys_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, uint64 expire) {
     fd_set_bits fds;
     void *bits;
     int ret;
-    // 	int ret, max_fds;
     uint32 size;
-    // 	struct fdtable *fdt;
-    // 	/* Allocate small arguments on the stack to save memory and be faster */
+    /* Allocate small arguments on the stack to save memory and be faster */
     long stack_fds[SELECT_STACK_ALLOC / sizeof(long)];
 
-    ret = -EINVAL;
-    if (nfds > NOFILE) {
-        panic("nfds > NOFILE, not tested\n");
-    }
-
-    // 	if (nfds < 0)
-    // 		goto out_nofds;
-
-    // 	/* max_fds can increase, so grab it once to avoid race */
-    // 	rcu_read_lock();
-    // 	fdt = files_fdtable(current->files);
-    // 	max_fds = fdt->max_fds;
-    // 	rcu_read_unlock();
-    // 	if (nfds > max_fds)
-    // 		nfds = max_fds;
+    if (nfds < 0)
+        return -EINVAL;
+    // no fd above the limit of the process, the bitmaps stay small
+    if (nfds > proc_current()->max_ofile)
+        nfds = proc_current()->max_ofile;
+    if (nfds > FD_SETSIZE)
+        nfds = FD_SETSIZE;
 
     /*
      * We need 6 bitmaps (in/out/ex for both incoming and outgoing),
      * since we used fdset we need to allocate memory in units of
      * long-words.
      */
-
     size = FDS_BYTES(nfds);
     bits = stack_fds;
     if (size > sizeof(stack_fds) / 6) {
         /* Not enough space in on-stack array; must use kmalloc */
-        ret = -ENOMEM;
-        bits = kmalloc(6 * size);
-        if (!bits)
-            panic("no memory\n");
-        // goto out_nofds;
+        if ((bits = kmalloc(6 * size)) == NULL)
+            return -ENOMEM;
     }
     fds.in = bits;
     fds.out = bits + size;
@@ -148,97 +148,39 @@ int core_sys_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptf
     fds.res_out = bits + 4 * size;
     fds.res_ex = bits + 5 * size;
 
-    // if ((ret = get_fd_set(nfds, readfds, fds.in)) || (ret = get_fd_set(nfds, writefds, fds.out)) || (ret = get_fd_set(nfds, exceptfds, fds.ex)))
-    // 	// goto out;
-    // 	panic("core_sys_select : get_fd_set error\n");
-    // copy_fd_set(nfds, fds.in, readfds);
-    // copy_fd_set(nfds, fds.out, writefds);
-    // copy_fd_set(nfds, fds.ex, exceptfds);
-    fds.in = (uint64 *)readfds;
-    fds.out = (uint64 *)writefds;
-    fds.ex = (uint64 *)exceptfds;
+#define GET_FD_SET(set, kset) \
+    if (set)                  \
+        memmove(kset, (set)->fds_bits, size); \
+    else                      \
+        zero_fd_set(nfds, kset)
+    GET_FD_SET(readfds, fds.in);
+    GET_FD_SET(writefds, fds.out);
+    GET_FD_SET(exceptfds, fds.ex);
+#undef GET_FD_SET
     zero_fd_set(nfds, fds.res_in);
     zero_fd_set(nfds, fds.res_out);
     zero_fd_set(nfds, fds.res_ex);
 
-    ret = do_select(nfds, &fds, timeout);
-    if (ret < 0) {
-        panic("ret < 0, not tested\n");
-    }
-    // 	if (ret < 0)
-    // 		goto out;
-    // 	if (!ret) {
-    // 		ret = -ERESTARTNOHAND;
-    // 		if (signal_pending(current))
-    // 			goto out;
-    // 		ret = 0;
-    // 	}
-    // if (set_fd_set(nfds, readfds, fds.res_in) || set_fd_set(nfds, writefds, fds.res_out) || set_fd_set(nfds, exceptfds, fds.res_ex))
-    //     // ret = -EFAULT;
-    // 	panic("core_sys_select : set_fd_set error\n");
-    return ret;
-
-    // out:
-    // 	if (bits != stack_fds)
-    // 		kfree(bits);
-    // out_nofds:
-    // 	return ret;
-}
+    ret = do_select(nfds, &fds, expire);
+    if (ret < 0)
+        goto out;
 
-int poll_select_copy_remaining(uint64 timeout, void *p, int timeval, int ret) {
-    // 	struct timespec rts;
-    // 	struct timeval rtv;
+    if (readfds)
+        memmove(readfds->fds_bits, fds.res_in, size);
+    if (writefds)
+        memmove(writefds->fds_bits, fds.res_out, size);
+    if (exceptfds)
+        memmove(exceptfds->fds_bits, fds.res_ex, size);
 
-    // 	if (!p)
-    // 		return ret;
-
-    // 	if (current->personality & STICKY_TIMEOUTS)
-    // 		goto sticky;
-
-    // 	/* No update for zero timeout */
-    // 	if (!end_time->tv_sec && !end_time->tv_nsec)
-    // 		return ret;
-
-    // 	ktime_get_ts(&rts);
-    // 	rts = timespec_sub(*end_time, rts);
-    // 	if (rts.tv_sec < 0)
-    // 		rts.tv_sec = rts.tv_nsec = 0;
-
-    // 	if (timeval) {
-    // 		rtv.tv_sec = rts.tv_sec;
-    // 		rtv.tv_usec = rts.tv_nsec / NSEC_PER_USEC;
-
-    // 		if (!copy_to_user(p, &rtv, sizeof(rtv)))
-    // 			return ret;
-
-    // 	} else if (!copy_to_user(p, &rts, sizeof(rts)))
-    // 		return ret;
-
-    // 	/*
-    // 	 * If an application puts its timeval in read-only memory, we
-    // 	 * don't want the Linux-specific update to the timeval to
-    // 	 * cause a fault after the select has completed
-    // 	 * successfully. However, because we're not updating the
-    // 	 * timeval, we can't restart the system call.
-    // 	 */
-
-    // sticky:
-    // 	if (ret == -ERESTARTNOHAND)
-    // 		ret = -EINTR;
-    // 	return ret;
-    return 0;
+out:
+    if (bits != stack_fds)
+        kfree(bits);
+    return ret;
 }
 
 long do_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timespec *tsp, const sigset_t *sigmask, size_t sigsetsize) {
-    int ret;
-
-    uint64 time_out = (tsp != NULL ? TIMESEPC2NS((*tsp)) : 0);
-
-    ret = core_sys_select(nfds, readfds, writefds, exceptfds, time_out);
-
-    // if ()
-
-    return ret;
+    // sigmask is not supported yet
+    return core_sys_select(nfds, readfds, writefds, exceptfds, ts2expire(tsp));
 }
 
 // select, pselect, FD_CLR, FD_ISSET, FD_SET, FD_ZERO - synchronous I/O multiplexing
@@ -246,204 +188,119 @@ long do_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
 uint64 sys_pselect6(void) {
     int nfds;
     uint64 readfds_addr, writefds_addr, exceptfds_addr, timeout_addr;
-    // uint64 sigmask_addr;
     fd_set readfds, writefds, exceptfds;
     struct timespec timeout;
-    // sigset_t sigmask;
     argint(0, &nfds);
     argaddr(1, &readfds_addr);
     argaddr(2, &writefds_addr);
     argaddr(3, &exceptfds_addr);
     argaddr(4, &timeout_addr);
-    // argaddr(5, &sigmask_addr);
     struct proc *p = proc_current();
 
-    if (readfds_addr && (copyin(p->mm->pagetable, (char *)&readfds, readfds_addr, sizeof(readfds))) < 0) return -1;
-    if (writefds_addr && (copyin(p->mm->pagetable, (char *)&writefds, writefds_addr, sizeof(writefds))) < 0) return -1;
-    if (exceptfds_addr && (copyin(p->mm->pagetable, (char *)&exceptfds, exceptfds_addr, sizeof(exceptfds)) < 0)) return -1;
+    if (readfds_addr && (copyin(p->mm->pagetable, (char *)&readfds, readfds_addr, sizeof(readfds))) < 0) return -EFAULT;
+    if (writefds_addr && (copyin(p->mm->pagetable, (char *)&writefds, writefds_addr, sizeof(writefds))) < 0) return -EFAULT;
+    if (exceptfds_addr && (copyin(p->mm->pagetable, (char *)&exceptfds, exceptfds_addr, sizeof(exceptfds)) < 0)) return -EFAULT;
+    if (timeout_addr && copyin(p->mm->pagetable, (char *)&timeout, timeout_addr, sizeof(timeout)) < 0) return -EFAULT;
 
-    if (timeout_addr) {
-        if (copyin(p->mm->pagetable, (char *)&timeout, timeout_addr, sizeof(timeout)) < 0) return -1;
-        // panic("timeout not tested\n");
-    }
-    uint64 time_out = (timeout_addr != 0 ? TIMESEPC2NS(timeout) : 0);
-    // printfRed("time_out : %ld\n", time_out);
-
-    // size_t sigsetsize = 0;
-    // if (sigmask_addr) {
-    //     if (copyin(p->mm->pagetable, (char *)&sigmask, sigmask_addr, sizeof(sigmask)) < 0) return -1;
-    // }
-    // int ret = do_pselect(nfds, &readfds, &writefds, &exceptfds, timeout_addr ? &timeout : NULL, &sigmask, sigsetsize);
-
-    int ret = 0;
-
-    struct file *fp;
-    while (1) {
-        if (readfds_addr) {
-            for (int i = 0; i < nfds; i++) {
-                fp = p->ofile[i];
-                if (fp) {
-                    switch (fp->f_type) {
-                    case FD_INODE:
-                        break;
-                    case FD_PIPE: {
-                        if (!pipereadable(fp->f_tp.f_pipe) || pipe_empty(fp->f_tp.f_pipe)) {
-                            FD_CLR(i, &readfds);
-                            break;
-                        }
-                    }
-                    case FD_DEVICE:
-                    case FD_SOCKET: {
-                        ret++;
-                        break;
-                    }
-                    default:
-                        Warn("TYPE is %d", fp->f_type);
-                        panic("this type not tested\n");
-                    }
-                }
-            }
-        }
+    int ret = do_pselect(nfds, readfds_addr ? &readfds : NULL, writefds_addr ? &writefds : NULL,
+                         exceptfds_addr ? &exceptfds : NULL, timeout_addr ? &timeout : NULL, NULL, 0);
+    if (ret < 0)
+        return ret;
 
-        if (writefds_addr) {
-            for (int i = 0; i < nfds; i++) {
-                fp = p->ofile[i];
-                if (fp) {
-                    switch (fp->f_type) {
-                    case FD_INODE:
-                        break;
-                    case FD_PIPE: {
-                        if (!pipewriteable(fp->f_tp.f_pipe) || pipe_full(fp->f_tp.f_pipe)) {
-                            FD_CLR(i, &writefds);
-                            break;
-                        }
-                    }
-                    case FD_DEVICE:
-                    case FD_SOCKET: {
-                        ret++;
-                        break;
-                    }
-                    default:
-                        Warn("TYPE is %d", fp->f_type);
-                        panic("this type not tested\n");
-                    }
-                }
-            }
-        }
+    if (readfds_addr && (copyout(p->mm->pagetable, readfds_addr, (char *)&readfds, sizeof(readfds)) < 0)) return -EFAULT;
+    if (writefds_addr && (copyout(p->mm->pagetable, writefds_addr, (char *)&writefds, sizeof(writefds)) < 0)) return -EFAULT;
+    if (exceptfds_addr && (copyout(p->mm->pagetable, exceptfds_addr, (char *)&exceptfds, sizeof(exceptfds)) < 0)) return -EFAULT;
+
+    return ret;
+}
+
+// fill revents of every pollfd, sleep until one is ready or expire
+static int do_poll(struct pollfd *pfds, int nfds, uint64 expire) {
+    struct poll_wqueues table;
+    struct poll_table *wait;
+    struct proc *p = proc_current();
+    int count = 0;
+    int timed_out = poll_expired(expire);
+
+    poll_initwait(&table);
+    wait = &table.pt;
+    if (timed_out)
+        wait->qproc = NULL;
 
-        if (exceptfds_addr) {
-            for (int i = 0; i < nfds; i++) {
-                FD_CLR(i, &exceptfds);
+    for (;;) {
+        for (int i = 0; i < nfds; i++) {
+            struct pollfd *pfd = pfds + i;
+            struct file *file;
+            uint mask;
+
+            pfd->revents = 0;
+            // negative fd is ignored
+            if (pfd->fd < 0)
+                continue;
+            if ((file = fd_get(p->files, pfd->fd)) == NULL) {
+                mask = POLLNVAL;
+            } else {
+                // POLLERR and POLLHUP are always reported
+                mask = vfs_poll(file, wait) & (pfd->events | POLLERR | POLLHUP);
+                generic_fileclose(file);
+            }
+            if (mask) {
+                pfd->revents = mask;
+                count++;
+                wait->qproc = NULL;
             }
         }
+        wait->qproc = NULL;
 
-        // timeout
-        // 	wait = NULL;
-        uint64 time_now = TIME2NS(rdtime());
-        if (ret || (TIME2NS(rdtime()) > time_now + time_out)) {
-            // printf("ready\n");
-            // printfGreen("select , pid : %d exit\n", proc_current()->pid);// debug
+        if (count || timed_out || table.error)
             break;
-        } else {
-            // acquire(&cond_ticks.waiting_queue.lock);
-            // struct tcb* t = thread_current();
-            // t->time_out = time_out;
-            // cond_wait(&cond_ticks, &cond_ticks.waiting_queue.lock);
-            // release(&cond_ticks.waiting_queue.lock);
-            // break;
-        }
-    }
-
-    if (readfds_addr && (copyout(p->mm->pagetable, readfds_addr, (char *)&readfds, sizeof(readfds)) < 0)) return -1;
-    if (writefds_addr && (copyout(p->mm->pagetable, writefds_addr, (char *)&writefds, sizeof(writefds)) < 0)) return -1;
-    if (exceptfds_addr && (copyout(p->mm->pagetable, exceptfds_addr, (char *)&exceptfds, sizeof(exceptfds)) < 0)) return -1;
-
-    return ret;
-}
 
+        if (!poll_schedule_timeout(&table, expire))
+            timed_out = 1;
+    }
 
-#define TICK_GRANULARITY 10L // ms
-#define SEC2TICK(sec) ((sec)*1000 / TICK_GRANULARITY)
-#define MS2TICK(ms) ((ms) / TICK_GRANULARITY)
-#define US2TICK(us) ((us)*TICK_GRANULARITY / 1000)
-#define NS2TICK(ns) ((ns) / 1000 / 1000 / TICK_GRANULARITY)
-static inline uint64 ts2ticks(struct timespec *ts) {
-    return ts ? SEC2TICK(ts->ts_sec) + NS2TICK(ts->ts_nsec) : 0;
+    poll_freewait(&table);
+    if (count == 0 && table.error)
+        count = table.error;
+    return count;
 }
 
+// int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask);
 uint64 sys_ppoll(void) {
     uint64 pfdaddr;
     int nfds;
     uint64 tsaddr;
     uint64 sigmaskaddr;
     struct proc *p = proc_current();
+    struct pollfd stack_pfds[POLL_STACK_ALLOC / sizeof(struct pollfd)];
+    struct pollfd *pfds = stack_pfds;
+    struct timespec ts;
+    int ret;
 
     argaddr(0, &pfdaddr);
     argint(1, &nfds);
     argaddr(2, &tsaddr);
     argaddr(3, &sigmaskaddr);
+    // sigmask is not supported yet
 
-    ASSERT(nfds == 1);
-    // printf("ts addr is %#lx\n", tsaddr);
-
-    struct pollfd pfd;
-
-    if (copyin(p->mm->pagetable, (char *)&pfd, pfdaddr, sizeof(pfd)) < 0)
-        return -1;
-
-    ASSERT(pfd.events == POLLIN);
-    ASSERT(pfd.fd == 0);
-
-    struct file *f;
-    f = p->ofile[pfd.fd];
-
-    // TODO
-    // argfd(, pfd.fd, , f);
-
-    struct timespec ts;
+    if (nfds < 0 || nfds > p->max_ofile)
+        return -EINVAL;
     if (tsaddr && copyin(p->mm->pagetable, (char *)&ts, tsaddr, sizeof(struct timespec)) < 0)
-        return -1;
-
-    // uint64 timeout = TIMESEPC2NS(ts);
-    uint64 timeout = tsaddr ? ts2ticks(&ts) : -1;
-
-    while (1) {
-        switch (f->f_type) {
-        case FD_DEVICE:
-            if (consoleready()) goto ret;
-            break;
-        case FD_PIPE:
-            return 1;
-        default:
-            panic("error");
-        }
+        return -EFAULT;
 
-        if (timeout == -1) continue;
-
-        // uint64 time_now = TIME2NS(rdtime());
-        // if ((TIME2NS(rdtime()) > time_now + timeout)) {
-        //     // printf("ready\n");
-        //     // printfGreen("select , pid : %d exit\n", proc_current()->pid);// debug
-        //     break;
-        // }
-
-        if (timeout) {
-            // Log("hit");
-            extern struct cond cond_ticks;
-            acquire(&cond_ticks.waiting_queue.lock);
-            cond_wait(&cond_ticks, &cond_ticks.waiting_queue.lock);
-            release(&cond_ticks.waiting_queue.lock);
-            timeout--;
-        } else {
-            break;
-        }
+    if (nfds > NELEM(stack_pfds) && (pfds = kmalloc(nfds * sizeof(struct pollfd))) == NULL)
+        return -ENOMEM;
+    if (copyin(p->mm->pagetable, (char *)pfds, pfdaddr, nfds * sizeof(struct pollfd)) < 0) {
+        ret = -EFAULT;
+        goto out;
     }
-ret:
-    if (timeout == 0) return 0;
 
-    pfd.revents = pfd.events;
-    if (copyout(p->mm->pagetable, pfdaddr, (char *)&pfd, sizeof(pfd)) < 0)
-        return -1;
+    ret = do_poll(pfds, nfds, ts2expire(tsaddr ? &ts : NULL));
+    if (ret >= 0 && copyout(p->mm->pagetable, pfdaddr, (char *)pfds, nfds * sizeof(struct pollfd)) < 0)
+        ret = -EFAULT;
 
-    return 1;
-}
\ No newline at end of file
+out:
+    if (pfds != stack_pfds)
+        kfree(pfds);
+    return ret;
+}
@@ -0,0 +1,227 @@
+#include "common.h"
+#include "kernel/syscall.h"
+#include "kernel/trap.h"
+#include "proc/pcb_life.h"
+#include "fs/vfs/fs.h"
+#include "fs/fcntl.h"
+#include "fs/uio.h"
+#include "fs/fat/fat32_mem.h"
+#include "ipc/pipe.h"
+#include "memory/allocator.h"
+#include "memory/buddy.h"
+#include "memory/filemap.h"
+#include "debug.h"
+#include "errno.h"
+
+#define SPLICE_MAX_LEN 0x7ffff000 // as linux MAX_RW_COUNT
+#define VMSPLICE_MAX_SEGS 1024    // IOV_MAX
+
+// the position to splice from/to, *uoff if given, or f->f_pos
+static int splice_get_pos(struct file *f, uint64 uoff, off_t *pos) {
+    if (uoff == 0) {
+        *pos = f->f_pos;
+        return 0;
+    }
+    if (copyin(proc_current()->mm->pagetable, (char *)pos, uoff, sizeof(off_t)) < 0)
+        return -EFAULT;
+    return *pos < 0 ? -EINVAL : 0;
+}
+
+static int splice_put_pos(struct file *f, uint64 uoff, off_t pos) {
+    if (uoff == 0) {
+        f->f_pos = pos;
+        return 0;
+    }
+    if (copyout(proc_current()->mm->pagetable, uoff, (char *)&pos, sizeof(off_t)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+// file -> pipe, put references of the page cache pages into the pipe
+static long splice_file_to_pipe(struct file *in, off_t *ppos, struct pipe *opipe, uint64 len, int nonblock) {
+    struct inode *ip = in->f_tp.f_inode;
+    struct pipe_buffer buf;
+    struct page *page;
+    long done = 0;
+    int ret;
+
+    while (done < len) {
+        off_t pos = *ppos;
+        uint chunk;
+
+        fat32_inode_lock(ip);
+        if (pos >= ip->i_size) {
+            fat32_inode_unlock(ip);
+            break;
+        }
+        chunk = MIN(PGSIZE - (pos & (PGSIZE - 1)), len - done);
+        chunk = MIN(chunk, ip->i_size - pos);
+        if ((page = filemap_get_page(ip, pos >> PGSHIFT)) != NULL)
+            share_page(page_to_pa(page));
+        fat32_inode_unlock(ip);
+        if (page == NULL)
+            break;
+
+        buf.pa = page_to_pa(page);
+        buf.offset = pos & (PGSIZE - 1);
+        buf.len = chunk;
+        buf.flags = 0; // shared with the page cache, never append to it
+        // block only if nothing is moved
+        if ((ret = pipe_add_buffer(opipe, &buf, nonblock || done > 0)) < 0) {
+            kfree((void *)buf.pa);
+            if (done == 0)
+                return ret;
+            break;
+        }
+        done += chunk;
+        *ppos += chunk;
+    }
+    return done;
+}
+
+// pipe -> file, write the pages of the pipe into the file
+static long splice_pipe_to_file(struct pipe *ipipe, struct file *out, off_t *ppos, uint64 len, int nonblock) {
+    struct inode *ip = out->f_tp.f_inode;
+    struct pipe_buffer buf;
+    long done = 0;
+    int ret;
+
+    while (done < len) {
+        if ((ret = pipe_get_buffer(ipipe, &buf, MIN(len - done, PGSIZE), nonblock || done > 0)) <= 0) {
+            if (done == 0)
+                return ret;
+            break;
+        }
+        ip->i_op->ilock(ip);
+        ret = ip->i_op->iwrite(ip, 0, buf.pa + buf.offset, *ppos, buf.len);
+        ip->i_op->iunlock(ip);
+        kfree((void *)buf.pa);
+
+        if (ret > 0) {
+            done += ret;
+            *ppos += ret;
+        }
+        if (ret != buf.len) {
+            if (done == 0)
+                return -EIO;
+            break;
+        }
+    }
+    return done;
+}
+
+// ssize_t splice(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len, unsigned int flags);
+uint64 sys_splice(void) {
+    int flags;
+    uint64 off_in, off_out, len;
+    struct file *in, *out;
+    off_t pos;
+    long ret;
+
+    if (argfd(0, 0, &in) < 0 || argfd(2, 0, &out) < 0)
+        return -EBADF;
+    argaddr(1, &off_in);
+    argaddr(3, &off_out);
+    argaddr(4, &len);
+    argint(5, &flags);
+    if (!F_READABLE(in) || !F_WRITEABLE(out))
+        return -EBADF;
+    if (len == 0)
+        return 0;
+    len = MIN(len, SPLICE_MAX_LEN);
+    int nonblock = flags & SPLICE_F_NONBLOCK;
+
+    if (in->f_type == FD_PIPE && out->f_type == FD_PIPE) {
+        if (off_in || off_out)
+            return -ESPIPE;
+        return pipe_splice_pipe(in->f_tp.f_pipe, out->f_tp.f_pipe, len, nonblock, 0);
+    }
+
+    if (in->f_type == FD_INODE && out->f_type == FD_PIPE) {
+        if (off_out)
+            return -ESPIPE;
+        // only fat32 has the page cache
+        if (in->f_tp.f_inode->fs_type != FAT32 || S_ISDIR(in->f_tp.f_inode->i_mode))
+            return -EINVAL;
+        if ((ret = splice_get_pos(in, off_in, &pos)) < 0)
+            return ret;
+        if ((ret = splice_file_to_pipe(in, &pos, out->f_tp.f_pipe, len, nonblock)) > 0)
+            if (splice_put_pos(in, off_in, pos) < 0)
+                return -EFAULT;
+        return ret;
+    }
+
+    if (in->f_type == FD_PIPE && out->f_type == FD_INODE) {
+        if (off_in)
+            return -ESPIPE;
+        if (S_ISDIR(out->f_tp.f_inode->i_mode))
+            return -EINVAL;
+        if ((ret = splice_get_pos(out, off_out, &pos)) < 0)
+            return ret;
+        if ((ret = splice_pipe_to_file(in->f_tp.f_pipe, out, &pos, len, nonblock)) > 0)
+            if (splice_put_pos(out, off_out, pos) < 0)
+                return -EFAULT;
+        return ret;
+    }
+
+    // one of them must be a pipe, sockets and devices are not supported
+    return -EINVAL;
+}
+
+// ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+uint64 sys_tee(void) {
+    int flags;
+    uint64 len;
+    struct file *in, *out;
+
+    if (argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+        return -EBADF;
+    argaddr(2, &len);
+    argint(3, &flags);
+    if (in->f_type != FD_PIPE || out->f_type != FD_PIPE)
+        return -EINVAL;
+    if (!F_READABLE(in) || !F_WRITEABLE(out))
+        return -EBADF;
+    if (len == 0)
+        return 0;
+    return pipe_splice_pipe(in->f_tp.f_pipe, out->f_tp.f_pipe, MIN(len, SPLICE_MAX_LEN), flags & SPLICE_F_NONBLOCK, 1);
+}
+
+// ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs, unsigned int flags);
+// user pages are copied in (out) by the bulk path of pipe, not gifted
+uint64 sys_vmsplice(void) {
+    int nr_segs, flags;
+    uint64 uiov;
+    struct file *f;
+    struct iovec iov;
+    struct proc *p = proc_current();
+    long done = 0;
+    int ret;
+
+    if (argfd(0, 0, &f) < 0)
+        return -EBADF;
+    argaddr(1, &uiov);
+    argint(2, &nr_segs);
+    argint(3, &flags);
+    if (f->f_type != FD_PIPE)
+        return -EBADF;
+    if (nr_segs < 0 || nr_segs > VMSPLICE_MAX_SEGS)
+        return -EINVAL;
+
+    for (int i = 0; i < nr_segs; i++) {
+        if (copyin(p->mm->pagetable, (char *)&iov, uiov + i * sizeof(struct iovec), sizeof(struct iovec)) < 0)
+            return done ? done : -EFAULT;
+        if (iov.iov_len == 0)
+            continue;
+        if (F_WRITEABLE(f))
+            ret = pipe_write(f->f_tp.f_pipe, 1, (uint64)iov.iov_base, iov.iov_len);
+        else
+            ret = pipe_read(f->f_tp.f_pipe, 1, (uint64)iov.iov_base, iov.iov_len);
+        if (ret < 0)
+            return done ? done : ret;
+        done += ret;
+        if (ret < iov.iov_len)
+            break;
+    }
+    return done;
+}
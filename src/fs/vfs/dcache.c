@@ -0,0 +1,204 @@
+#include "common.h"
+#include "atomic/spinlock.h"
+#include "atomic/ops.h"
+#include "memory/allocator.h"
+#include "fs/vfs/dcache.h"
+#include "fs/vfs/fs.h"
+#include "debug.h"
+
+struct dcache_bucket {
+    uint seq; // odd : a writer is changing the chain
+    struct list_head head;
+};
+
+struct {
+    struct spinlock lock; // serialize writers
+    struct dcache_bucket buckets[DCACHE_NBUCKET];
+    struct dentry *pool;
+    int hand; // the clock
+} dcache;
+
+// hash (parent, name), set *len to the length of name
+static uint32 dcache_hash(struct inode *dp, const char *name, int *len) {
+    uint32 h = (uint32)((uint64)dp >> 4) * 0x9e3779b1;
+    const char *s = name;
+    while (*s)
+        h = (h ^ (uchar)*s++) * 16777619;
+    *len = s - name;
+    return h;
+}
+
+void dcache_init(void) {
+    initlock(&dcache.lock, "dcache");
+    for (int i = 0; i < DCACHE_NBUCKET; i++) {
+        dcache.buckets[i].seq = 0;
+        INIT_LIST_HEAD(&dcache.buckets[i].head);
+    }
+    if ((dcache.pool = kzalloc(DCACHE_NR * sizeof(struct dentry))) == NULL)
+        panic("dcache_init : no memory\n");
+    for (int i = 0; i < DCACHE_NR; i++) {
+        INIT_LIST_HEAD(&dcache.pool[i].d_hash);
+        INIT_LIST_HEAD(&dcache.pool[i].d_alias);
+        INIT_LIST_HEAD(&dcache.pool[i].d_child);
+        dcache.pool[i].d_bucket = -1;
+    }
+    dcache.hand = 0;
+    Info("dcache init [ok], %d dentries\n", DCACHE_NR);
+}
+
+static inline void write_seqbegin(struct dcache_bucket *b) {
+    b->seq++;
+    __sync_synchronize();
+}
+
+static inline void write_seqend(struct dcache_bucket *b) {
+    __sync_synchronize();
+    b->seq++;
+}
+
+// holding dcache.lock
+static struct dentry *__dcache_find(struct dcache_bucket *b, struct inode *dp, const char *name, uint32 h) {
+    struct dentry *d;
+    list_for_each_entry(d, &b->head, d_hash) {
+        if (d->d_hashval == h && d->d_parent == dp && strncmp(d->d_name, name, DNAME_INLINE_LEN) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+// holding dcache.lock
+// the next pointer of d is kept valid, a lock-free walk may be standing on it
+static void __dcache_unhash(struct dentry *d) {
+    struct dcache_bucket *b;
+    if (d->d_bucket < 0)
+        return;
+    b = &dcache.buckets[d->d_bucket];
+    write_seqbegin(b);
+    __list_del_entry(&d->d_hash);
+    d->d_bucket = -1;
+    write_seqend(b);
+    list_del_reinit(&d->d_alias);
+    list_del_reinit(&d->d_child);
+    d->d_parent = NULL;
+    d->d_inode = NULL;
+}
+
+// take a dentry with the clock, holding dcache.lock
+static struct dentry *__dcache_alloc(void) {
+    for (;;) {
+        struct dentry *d = &dcache.pool[dcache.hand];
+        dcache.hand = (dcache.hand + 1) % DCACHE_NR;
+        if (d->d_referenced) {
+            d->d_referenced = 0;
+            continue;
+        }
+        __dcache_unhash(d);
+        return d;
+    }
+}
+
+// lock-free lookup of (dp, name)
+// D_POSITIVE : *ipp is the inode, not referenced, at *offp in dp
+// D_NEGATIVE : name is not in dp
+// D_MISS : not cached, or the chain kept changing
+int dcache_lookup(struct inode *dp, const char *name, struct inode **ipp, uint *offp) {
+    int len;
+    uint32 h = dcache_hash(dp, name, &len);
+    struct dcache_bucket *b = &dcache.buckets[h % DCACHE_NBUCKET];
+
+    if (len >= DNAME_INLINE_LEN)
+        return D_MISS;
+    for (int retry = 0; retry < 2; retry++) {
+        uint seq = READ_ONCE(b->seq);
+        struct dentry *found = NULL;
+        struct inode *ip = NULL;
+        uint off = 0;
+        struct list_head *pos;
+        int steps = 0;
+
+        if (seq & 1)
+            continue;
+        __sync_synchronize();
+        for (pos = READ_ONCE(b->head.next); pos != &b->head && steps < DCACHE_WALK_MAX; pos = READ_ONCE(pos->next), steps++) {
+            struct dentry *d = list_entry(pos, struct dentry, d_hash);
+            if (d->d_hashval == h && d->d_parent == dp && strncmp(d->d_name, name, DNAME_INLINE_LEN) == 0) {
+                ip = d->d_inode;
+                off = d->d_off;
+                found = d;
+                break;
+            }
+        }
+        __sync_synchronize();
+        if (READ_ONCE(b->seq) != seq || (found == NULL && pos != &b->head))
+            continue;
+        if (found == NULL)
+            return D_MISS;
+        found->d_referenced = 1;
+        *ipp = ip;
+        *offp = off;
+        return ip ? D_POSITIVE : D_NEGATIVE;
+    }
+    return D_MISS;
+}
+
+// cache (dp, name) --> ip at off, ip == NULL for a negative dentry
+// caller holds the lock of dp, so the directory does not change
+void dcache_add(struct inode *dp, const char *name, struct inode *ip, uint off) {
+    int len;
+    uint32 h = dcache_hash(dp, name, &len);
+    int bi = h % DCACHE_NBUCKET;
+    struct dcache_bucket *b = &dcache.buckets[bi];
+    struct dentry *d;
+
+    if (len >= DNAME_INLINE_LEN)
+        return;
+    acquire(&dcache.lock);
+    if ((d = __dcache_find(b, dp, name, h)) != NULL) {
+        write_seqbegin(b);
+        d->d_inode = ip;
+        d->d_off = off;
+        write_seqend(b);
+        list_del_reinit(&d->d_alias);
+    } else {
+        d = __dcache_alloc();
+        // not hashed yet, nobody can see it
+        d->d_hashval = h;
+        d->d_parent = dp;
+        d->d_inode = ip;
+        d->d_off = off;
+        memmove(d->d_name, name, len + 1);
+        write_seqbegin(b);
+        list_add(&d->d_hash, &b->head);
+        d->d_bucket = bi;
+        write_seqend(b);
+        list_add(&d->d_child, &dp->i_dchildren);
+    }
+    if (ip)
+        list_add(&d->d_alias, &ip->i_dentry);
+    d->d_referenced = 1;
+    release(&dcache.lock);
+}
+
+// forget (dp, name)
+void dcache_drop(struct inode *dp, const char *name) {
+    int len;
+    uint32 h = dcache_hash(dp, name, &len);
+    struct dentry *d;
+
+    if (len >= DNAME_INLINE_LEN)
+        return;
+    acquire(&dcache.lock);
+    if ((d = __dcache_find(&dcache.buckets[h % DCACHE_NBUCKET], dp, name, h)) != NULL)
+        __dcache_unhash(d);
+    release(&dcache.lock);
+}
+
+// forget the dentries of ip and those in ip, before the inode is reused
+void dcache_prune_inode(struct inode *ip) {
+    acquire(&dcache.lock);
+    while (!list_empty(&ip->i_dentry))
+        __dcache_unhash(list_first_entry(&ip->i_dentry, struct dentry, d_alias));
+    while (!list_empty(&ip->i_dchildren))
+        __dcache_unhash(list_first_entry(&ip->i_dchildren, struct dentry, d_child));
+    release(&dcache.lock);
+}
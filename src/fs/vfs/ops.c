@@ -4,10 +4,13 @@
 #include "fs/fcntl.h"
 #include "fs/vfs/fs.h"
 #include "fs/vfs/ops.h"
+#include "fs/vfs/dcache.h"
 #include "fs/fat/fat32_file.h"
 #include "fs/fat/fat32_mem.h"
 #include "fs/ext2/ext2_file.h"
 #include "ipc/socket.h"
+#include "fs/eventpoll.h"
+#include "memory/slab.h"
 
 struct devsw devsw[NDEV];
 struct ftable _ftable;
@@ -15,7 +18,7 @@ struct ftable _ftable;
 // == file layer ==
 struct file *filealloc(fs_t type) {
     // Allocate a file structure.
-    // 语义：从内存中的 _ftable 中寻找一个空闲的 file 项，并返回指向该 file 的指针
+    // 语义：从 _ftable 的 slab cache 中分配一个 file 项，并返回指向该 file 的指针
     ASSERT(type == FAT32);
     if (type < 0) {
         // error: ilegal file system type
@@ -23,19 +26,25 @@ struct file *filealloc(fs_t type) {
     }
     struct file *f;
     acquire(&_ftable.lock);
-    for (f = _ftable.file; f < _ftable.file + NFILE; f++) {
-        if (f->f_count == 0) {
-            f->f_count = 1;
-            // ASSERT(proc_current()->cwd->fs_type == FAT32);
-            // f->f_op = get_fileops[proc_current()->cwd->fs_type]();
-            f->f_op = get_fileops[type]();
-
-            release(&_ftable.lock);
-            return f;
-        }
+    if (_ftable.nr_files >= NFILE) {
+        release(&_ftable.lock);
+        return 0;
     }
+    _ftable.nr_files++;
     release(&_ftable.lock);
-    return 0;
+
+    if ((f = kmem_cache_zalloc(_ftable.cachep)) == NULL) {
+        acquire(&_ftable.lock);
+        _ftable.nr_files--;
+        release(&_ftable.lock);
+        return 0;
+    }
+    f->f_count = 1;
+    // ASSERT(proc_current()->cwd->fs_type == FAT32);
+    // f->f_op = get_fileops[proc_current()->cwd->fs_type]();
+    f->f_op = get_fileops[type]();
+    INIT_LIST_HEAD(&f->f_ep_links);
+    return f;
 }
 
 void generic_fileclose(struct file *f) {
@@ -48,14 +57,20 @@ void generic_fileclose(struct file *f) {
     acquire(&_ftable.lock);
     if (f->f_count < 1)
         panic("generic_fileclose");
+    if (f->f_count == 1 && !list_empty(&f->f_ep_links)) {
+        // drop it from the epoll sets watching it, before f is reused
+        release(&_ftable.lock);
+        eventpoll_release(f);
+        acquire(&_ftable.lock);
+    }
     if (--f->f_count > 0) {
         release(&_ftable.lock);
         return;
     }
     ff = *f;
-    f->f_count = 0;
-    f->f_type = FD_NONE;
+    _ftable.nr_files--;
     release(&_ftable.lock);
+    kmem_cache_free(_ftable.cachep, f);
 
     if (ff.f_type == FD_PIPE) {
         int wrable = F_WRITEABLE(&ff);
@@ -65,6 +80,8 @@ void generic_fileclose(struct file *f) {
         ff.f_tp.f_inode->i_op->iput(ff.f_tp.f_inode);
     } else if (ff.f_type == FD_SOCKET) {
         free_socket(ff.f_tp.f_sock);
+    } else if (ff.f_type == FD_EPOLL) {
+        ep_free(ff.f_tp.f_ep);
     }
 }
 
@@ -76,6 +93,7 @@ static inline const struct file_operations *get_fat32_fileops(void) {
         .write = fat32_filewrite,
         .fstat = fat32_filestat,
         .readdir = fat32_getdents,
+        .poll = fat32_filepoll,
     };
 
     return &fops_instance;
@@ -150,10 +168,24 @@ static struct inode *inode_namex(char *path, int nameeparent, char *name) {
         // printf("path:%s name:%s\n",path,name);
         // printf("namex: ip : %s ",ip->fat32_i.fname);
         // printf("sem.value %d\n",ip->i_sem.value);
-        ip->i_op->ilock(ip);
         // printf("namex: LOCK 1 ok!\n");
         // printf("2\n");
         // printf("name %s i_mode 0x%x\n",ip->fat32_i.fname, ip->i_mode);
+        // fast path, the dentry cache without the lock of ip
+        if (!(nameeparent && *path == '\0') && ip->valid && S_ISDIR(ip->i_mode) && strcmp(name, ".") && strcmp(name, "..")) {
+            uint off;
+            int res = dcache_lookup(ip, name, &next, &off);
+            if (res == D_NEGATIVE) {
+                ip->i_op->iput(ip);
+                return 0;
+            }
+            if (res == D_POSITIVE && (next = fat32_inode_get_cached(ip, name, off, next)) != NULL) {
+                ip->i_op->iput(ip);
+                ip = next;
+                continue;
+            }
+        }
+        ip->i_op->ilock(ip);
         if (!S_ISDIR(ip->i_mode)) {
             ip->i_op->iunlock_put(ip);
             // printf("3\n");
@@ -172,12 +204,14 @@ static struct inode *inode_namex(char *path, int nameeparent, char *name) {
         //     return 0;
         // }
 
-        if (strncmp(name, "..", 2) == 0) {
+        if (strcmp(name, "..") == 0) {
             next = fat32_inode_dup(ip->parent);
-        } else if (strncmp(name, ".", 1) == 0) {
+        } else if (strcmp(name, ".") == 0) {
             next = fat32_inode_dup(ip);
         } else {
-            if ((next = fat32_inode_dirlookup(ip, name, 0)) == 0) {
+            next = fat32_inode_dirlookup(ip, name, 0);
+            dcache_add(ip, name, next, next ? next->fat32_i.parent_off : 0);
+            if (next == 0) {
                 fat32_inode_unlock_put(ip);
                 return 0;
             }
@@ -185,11 +219,9 @@ static struct inode *inode_namex(char *path, int nameeparent, char *name) {
 
         // printf("dirlook up ok!\n");
 
-        ip->i_op->iunlock(ip);
+        // next holds its parent
+        ip->i_op->iunlock_put(ip);
         // printf("ip %s sem.value: %d  unlocked~\n",ip->fat32_i.fname, ip->i_sem.value);
-        // if (likely(*path != '\0')) {
-        //     ip->i_op->iput(ip);
-        // }
         ip = next;
     }
     // printf("inode_namex got ip!\n");
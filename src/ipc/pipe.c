@@ -13,6 +13,20 @@
 #include "lib/sbuf.h"
 #include "debug.h"
 #include "errno.h"
+#include "fs/poll.h"
+#include "lib/poll.h"
+#include "memory/buddy.h"
+
+// drop the page of a drained buffer, a private one is kept for the next write
+static void pipe_buf_release(struct pipe *pi, struct pipe_buffer *buf) {
+    uint64 pa = buf->pa;
+
+    buf->pa = 0;
+    if (pi->tmp_page == 0 && (buf->flags & PIPE_BUF_FLAG_CAN_MERGE) && atomic_read(&pa_to_page(pa)->refcnt) == 1)
+        pi->tmp_page = pa;
+    else
+        kfree((void *)pa);
+}
 
 int pipe_alloc(struct file **f0, struct file **f1) {
     struct pipe *pi;
@@ -21,16 +35,23 @@ int pipe_alloc(struct file **f0, struct file **f1) {
     *f0 = *f1 = 0;
     if ((*f0 = filealloc(type)) == 0 || (*f1 = filealloc(type)) == 0)
         goto bad;
-    if ((pi = (struct pipe *)kalloc()) == 0)
+    if ((pi = (struct pipe *)kzalloc(sizeof(struct pipe))) == 0)
+        goto bad;
+    if ((pi->bufs = kzalloc(PIPE_DEF_BUFFERS * sizeof(struct pipe_buffer))) == 0)
         goto bad;
+    pi->nr_bufs = PIPE_DEF_BUFFERS;
+    pi->head = pi->tail = 0;
+    pi->tmp_page = 0;
     pi->readopen = 1;
     pi->writeopen = 1;
     pi->nwrite = 0;
     pi->nread = 0;
     initlock(&pi->lock, "pipe");
 
+    sema_init(&pi->mutex, 1, "pipe_mutex");
     sema_init(&pi->read_sem, 0, "read_sem");
     sema_init(&pi->write_sem, 0, "write_sem");
+    init_waitqueue_head(&pi->poll_wq, "pipe_poll");
 
     (*f0)->f_type = FD_PIPE;
     (*f0)->f_flags = O_RDONLY;
@@ -41,8 +62,11 @@ int pipe_alloc(struct file **f0, struct file **f1) {
     return 0;
 
 bad:
-    if (pi)
+    if (pi) {
+        if (pi->bufs)
+            kfree(pi->bufs);
         kfree((char *)pi);
+    }
     if (*f0)
         generic_fileclose(*f0);
     if (*f1)
@@ -50,6 +74,15 @@ bad:
     return -EMFILE;
 }
 
+static void pipe_free(struct pipe *pi) {
+    for (uint slot = pi->tail; slot != pi->head; slot++)
+        kfree((void *)PIPE_BUF(pi, slot)->pa);
+    if (pi->tmp_page)
+        kfree((void *)pi->tmp_page);
+    kfree(pi->bufs);
+    kfree((char *)pi);
+}
+
 void pipe_close(struct pipe *pi, int writable) {
     acquire(&pi->lock);
     if (writable) {
@@ -59,75 +92,374 @@ void pipe_close(struct pipe *pi, int writable) {
         pi->readopen = 0;
         sema_signal(&pi->write_sem);
     }
+    wake_up(&pi->poll_wq);
     if (pi->readopen == 0 && pi->writeopen == 0) {
         release(&pi->lock);
-        kfree((char *)pi);
+        pipe_free(pi);
     } else
         release(&pi->lock);
 }
 
-int pipe_write(struct pipe *pi, int user_dst, uint64 addr, int n) {
+static inline void pipe_wakeup_readers(struct pipe *pi) {
+    sema_signal(&pi->read_sem);
+    wake_up(&pi->poll_wq);
+}
+
+static inline void pipe_wakeup_writers(struct pipe *pi) {
+    sema_signal(&pi->write_sem);
+    wake_up(&pi->poll_wq);
+}
+
+// n bytes fit without waiting : in a free buffer, or after the data of
+// the last page, if it is ours. n <= PGSIZE, 0 : a free buffer is needed
+static int pipe_has_room(struct pipe *pi, int n) {
+    struct pipe_buffer *buf;
+
+    if (!PIPE_FULL(pi))
+        return 1;
+    buf = PIPE_BUF(pi, pi->head - 1);
+    return n > 0 && (buf->flags & PIPE_BUF_FLAG_CAN_MERGE) && buf->offset + buf->len + n <= PGSIZE;
+}
+
+// wait for room for n bytes (see pipe_has_room), holding pi->mutex
+// return 0 if there is room, or -errno
+static int pipe_wait_writable(struct pipe *pi, int nonblock, int n) {
+    struct proc *pr = proc_current();
+
+    while (1) {
+        if (pi->readopen == 0)
+            return -EPIPE;
+        if (proc_killed(pr))
+            return -EINTR;
+        if (pipe_has_room(pi, n))
+            return 0;
+        if (nonblock)
+            return -EAGAIN;
+        pipe_wakeup_readers(pi);
+        sema_signal(&pi->mutex);
+        sema_wait(&pi->write_sem);
+        sema_wait(&pi->mutex);
+    }
+}
+
+// wait for data, holding pi->mutex
+// return 1 if there is data, 0 if all writers are gone, or -errno
+static int pipe_wait_readable(struct pipe *pi, int nonblock) {
+    struct proc *pr = proc_current();
+
+    while (PIPE_EMPTY(pi)) {
+        if (pi->writeopen == 0)
+            return 0;
+        if (proc_killed(pr))
+            return -EINTR;
+        if (nonblock)
+            return -EAGAIN;
+        sema_signal(&pi->mutex);
+        sema_wait(&pi->read_sem);
+        sema_wait(&pi->mutex);
+    }
+    return 1;
+}
+
+// copy in spans of pages, pi->mutex (not the spinlock) is held, so copyin may fault
+int pipe_write(struct pipe *pi, int user_src, uint64 addr, int n) {
     int i = 0;
     struct proc *pr = proc_current();
+    struct pipe_buffer *buf;
 
-    acquire(&pi->lock);
+    sema_wait(&pi->mutex);
+    // wait for room for all of a small write first, pi->mutex is dropped
+    // while waiting and other writers could get in the middle of it
+    if (n <= PIPE_BUF_ATOMIC && pipe_wait_writable(pi, 0, n) < 0) {
+        sema_signal(&pi->mutex);
+        return -1;
+    }
     while (i < n) {
         if (pi->readopen == 0 || proc_killed(pr)) {
-            release(&pi->lock);
-            return -1;
+            i = -1;
+            break;
+        }
+        // append to the last page
+        if (!PIPE_EMPTY(pi)) {
+            buf = PIPE_BUF(pi, pi->head - 1);
+            uint off = buf->offset + buf->len;
+            if ((buf->flags & PIPE_BUF_FLAG_CAN_MERGE) && off < PGSIZE) {
+                int chunk = MIN(n - i, PGSIZE - off);
+                if (either_copyin((void *)(buf->pa + off), user_src, addr + i, chunk) == -1)
+                    break;
+                acquire(&pi->lock);
+                buf->len += chunk;
+                pi->nwrite += chunk;
+                release(&pi->lock);
+                i += chunk;
+                continue;
+            }
         }
-        if (PIPE_FULL(pi)) {
-            sema_signal(&pi->read_sem);
-            release(&pi->lock);
-            sema_wait(&pi->write_sem);
-            acquire(&pi->lock);
-        } else {
-            char ch;
-            if (either_copyin(&ch, user_dst, addr + i, 1) == -1)
-                break;
-            pi->data[pi->nwrite++ % PIPESIZE] = ch;
-            i++;
-            // int write_idx = pi->nwrite % PIPESIZE;
-            // int read_idx = pi->nwrite % PIPESIZE;
-            // int cpy_len = PIPESIZE - (write_idx - read_idx);
-            // if (either_copyin(pi->data + write_idx, user_dst, addr + cpy_len, cpy_len) == -1)
-            //     break;
-            // pi->nwrite += cpy_len;
-            // i+= cpy_len;
+
+        if (pipe_wait_writable(pi, 0, 0) < 0) {
+            i = -1;
+            break;
+        }
+
+        // fill a new page
+        uint64 pa = pi->tmp_page;
+        pi->tmp_page = 0;
+        if (pa == 0 && (pa = (uint64)kalloc()) == 0) {
+            if (i == 0)
+                i = -1;
+            break;
+        }
+        int chunk = MIN(n - i, PGSIZE);
+        if (either_copyin((void *)pa, user_src, addr + i, chunk) == -1) {
+            pi->tmp_page = pa;
+            break;
         }
+        acquire(&pi->lock);
+        buf = PIPE_BUF(pi, pi->head);
+        buf->pa = pa;
+        buf->offset = 0;
+        buf->len = chunk;
+        buf->flags = PIPE_BUF_FLAG_CAN_MERGE;
+        pi->head++;
+        pi->nwrite += chunk;
+        release(&pi->lock);
+        i += chunk;
     }
-    sema_signal(&pi->read_sem);
-    release(&pi->lock);
+    pipe_wakeup_readers(pi);
+    sema_signal(&pi->mutex);
 
     return i;
 }
 
 int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n) {
-    int i;
-    struct proc *pr = proc_current();
-    char ch;
+    int i = 0;
+    struct pipe_buffer *buf;
 
-    acquire(&pi->lock);
-    while (PIPE_EMPTY(pi) && pi->writeopen) {
-        if (proc_killed(pr)) {
-            release(&pi->lock);
-            return -1;
+    sema_wait(&pi->mutex);
+    if (pipe_wait_readable(pi, 0) < 0) {
+        sema_signal(&pi->mutex);
+        return -1;
+    }
+    while (i < n && !PIPE_EMPTY(pi)) {
+        buf = PIPE_BUF(pi, pi->tail);
+        int chunk = MIN(n - i, buf->len);
+        if (either_copyout(user_dst, addr + i, (void *)(buf->pa + buf->offset), chunk) == -1)
+            break;
+        acquire(&pi->lock);
+        buf->offset += chunk;
+        buf->len -= chunk;
+        pi->nread += chunk;
+        if (buf->len == 0) {
+            pi->tail++;
+            pipe_buf_release(pi, buf);
         }
         release(&pi->lock);
-        sema_wait(&pi->read_sem);
+        i += chunk;
+    }
+    pipe_wakeup_writers(pi);
+    sema_signal(&pi->mutex);
+    return i;
+}
+
+uint pipe_poll(struct pipe *pi, struct file *f, struct poll_table *pt) {
+    uint mask = 0;
+
+    poll_wait(f, &pi->poll_wq, pt);
+
+    acquire(&pi->lock);
+    if (F_READABLE(f)) {
+        if (!PIPE_EMPTY(pi))
+            mask |= POLLIN | POLLRDNORM;
+        if (!pi->writeopen)
+            mask |= POLLHUP;
+    }
+    if (F_WRITEABLE(f)) {
+        if (!PIPE_FULL(pi))
+            mask |= POLLOUT | POLLWRNORM;
+        if (!pi->readopen)
+            mask |= POLLERR;
+    }
+    release(&pi->lock);
+    return mask;
+}
+
+// F_SETPIPE_SZ, the capacity is rounded up to a power of 2 pages
+int pipe_set_size(struct pipe *pi, int size) {
+    struct pipe_buffer *bufs, *old;
+    uint nr = 1, cnt;
+
+    if (size <= 0)
+        return -EINVAL;
+    if (size > PIPE_MAX_SIZE)
+        return -EPERM;
+    while (nr * PGSIZE < size)
+        nr <<= 1;
+    if ((bufs = kzalloc(nr * sizeof(struct pipe_buffer))) == NULL)
+        return -ENOMEM;
+
+    sema_wait(&pi->mutex);
+    acquire(&pi->lock);
+    cnt = pi->head - pi->tail;
+    if (cnt > nr) {
+        release(&pi->lock);
+        sema_signal(&pi->mutex);
+        kfree(bufs);
+        return -EBUSY;
+    }
+    for (uint k = 0; k < cnt; k++)
+        bufs[k] = *PIPE_BUF(pi, pi->tail + k);
+    old = pi->bufs;
+    pi->bufs = bufs;
+    pi->nr_bufs = nr;
+    pi->tail = 0;
+    pi->head = cnt;
+    release(&pi->lock);
+    pipe_wakeup_writers(pi);
+    sema_signal(&pi->mutex);
+
+    kfree(old);
+    return nr * PGSIZE;
+}
+
+int pipe_get_size(struct pipe *pi) {
+    return pi->nr_bufs * PGSIZE;
+}
+
+// put buf at the head, the pipe takes over the page reference of buf
+int pipe_add_buffer(struct pipe *pi, struct pipe_buffer *buf, int nonblock) {
+    int ret;
+
+    sema_wait(&pi->mutex);
+    if ((ret = pipe_wait_writable(pi, nonblock, 0)) == 0) {
         acquire(&pi->lock);
+        *PIPE_BUF(pi, pi->head) = *buf;
+        pi->head++;
+        pi->nwrite += buf->len;
+        release(&pi->lock);
+        pipe_wakeup_readers(pi);
     }
-    for (i = 0; i < n; i++) {
-        if (PIPE_EMPTY(pi))
-            break;
-        ch = pi->data[pi->nread % PIPESIZE];
-        if (either_copyout(user_dst, addr + i, &ch, 1) == -1)
-            break;
-        ++pi->nread;
+    sema_signal(&pi->mutex);
+    return ret;
+}
+
+// take at most max bytes of the tail buffer, the caller owns the page reference of buf
+// return the length, 0 if all writers are gone, or -errno
+int pipe_get_buffer(struct pipe *pi, struct pipe_buffer *buf, uint max, int nonblock) {
+    struct pipe_buffer *tbuf;
+    int ret;
+
+    sema_wait(&pi->mutex);
+    if ((ret = pipe_wait_readable(pi, nonblock)) <= 0) {
+        sema_signal(&pi->mutex);
+        return ret;
     }
-    sema_signal(&pi->write_sem);
+    acquire(&pi->lock);
+    tbuf = PIPE_BUF(pi, pi->tail);
+    *buf = *tbuf;
+    if (tbuf->len <= max) {
+        tbuf->pa = 0;
+        pi->tail++;
+    } else {
+        // split it, both halves refer to the page
+        share_page(tbuf->pa);
+        buf->len = max;
+        buf->flags = 0;
+        tbuf->offset += max;
+        tbuf->len -= max;
+        tbuf->flags &= ~PIPE_BUF_FLAG_CAN_MERGE;
+    }
+    pi->nread += buf->len;
+    ret = buf->len;
     release(&pi->lock);
-    return i;
+    pipe_wakeup_writers(pi);
+    sema_signal(&pi->mutex);
+    return ret;
+}
+
+// lock two pipes in the order of address
+static void pipe_double_lock(struct pipe *a, struct pipe *b) {
+    if (a > b) {
+        struct pipe *t = a;
+        a = b;
+        b = t;
+    }
+    sema_wait(&a->mutex);
+    sema_wait(&b->mutex);
+    acquire(&a->lock);
+    acquire(&b->lock);
+}
+
+static void pipe_double_unlock(struct pipe *a, struct pipe *b) {
+    release(&a->lock);
+    release(&b->lock);
+    sema_signal(&a->mutex);
+    sema_signal(&b->mutex);
+}
+
+// move (tee : share) at most len bytes of buffers from ipipe to opipe, no data is copied
+// return the length, 0 if all writers of ipipe are gone, or -errno
+int pipe_splice_pipe(struct pipe *ipipe, struct pipe *opipe, uint len, int nonblock, int tee) {
+    struct pipe_buffer *ibuf, *obuf;
+    int ret;
+
+    if (ipipe == opipe)
+        return -EINVAL;
+
+    while (1) {
+        sema_wait(&ipipe->mutex);
+        ret = pipe_wait_readable(ipipe, nonblock);
+        sema_signal(&ipipe->mutex);
+        if (ret <= 0)
+            return ret;
+
+        sema_wait(&opipe->mutex);
+        ret = pipe_wait_writable(opipe, nonblock, 0);
+        sema_signal(&opipe->mutex);
+        if (ret < 0)
+            return ret;
+
+        pipe_double_lock(ipipe, opipe);
+        ret = 0;
+        for (uint slot = ipipe->tail; ret < len && slot != ipipe->head && !PIPE_FULL(opipe) && opipe->readopen;) {
+            ibuf = PIPE_BUF(ipipe, slot);
+            obuf = PIPE_BUF(opipe, opipe->head);
+            uint chunk = MIN(len - ret, ibuf->len);
+
+            *obuf = *ibuf;
+            if (tee || chunk < ibuf->len) {
+                share_page(ibuf->pa);
+                obuf->len = chunk;
+                obuf->flags = 0;
+                ibuf->flags &= ~PIPE_BUF_FLAG_CAN_MERGE;
+                if (tee) {
+                    slot++;
+                } else {
+                    ibuf->offset += chunk;
+                    ibuf->len -= chunk;
+                    ipipe->nread += chunk;
+                }
+            } else {
+                ibuf->pa = 0;
+                slot = ++ipipe->tail;
+                ipipe->nread += chunk;
+            }
+            opipe->head++;
+            opipe->nwrite += chunk;
+            ret += chunk;
+        }
+        int broken = !opipe->readopen;
+        pipe_double_unlock(ipipe, opipe);
+
+        if (ret > 0) {
+            pipe_wakeup_readers(opipe);
+            if (!tee)
+                pipe_wakeup_writers(ipipe);
+            return ret;
+        }
+        if (broken)
+            return -EPIPE;
+        // raced with another reader or writer, try again
+    }
 }
 
 // int pipe_alloc(struct file **f0, struct file **f1) {
@@ -225,14 +557,14 @@ int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n) {
 // }
 int pipe_empty(struct pipe *p) {
     acquire(&p->lock);
-    int ret = (p->nread == p->nwrite);
+    int ret = PIPE_EMPTY(p);
     release(&p->lock);
     return ret;
 }
 
 int pipe_full(struct pipe *p) {
     acquire(&p->lock);
-    int ret = ((p->nread + PIPESIZE) == p->nwrite);
+    int ret = PIPE_FULL(p);
     release(&p->lock);
     return ret;
 }
@@ -6,8 +6,11 @@
 #include "proc/tcb_life.h"
 #include "kernel/trap.h"
 #include "fs/vfs/ops.h"
+#include "fs/fdtable.h"
 #include "ipc/socket.h"
 #include "atomic/spinlock.h"
+#include "fs/poll.h"
+#include "lib/poll.h"
 #include "syscall_gen/syscall_num.h"
 #include <stdarg.h>
 
@@ -253,6 +256,7 @@ uint64 sys_accept(void) {
 static void do_connect(struct socket *src_sock, struct socket *dst_sock) {
     list_add_tail(&src_sock->node, &dst_sock->pending);
     sema_signal(&dst_sock->do_accept);
+    wake_up(&dst_sock->wait);
     return;
 }
 
@@ -308,6 +312,7 @@ struct socket *alloc_socket() {
             memset(&socket_table[i], 0, sizeof(struct socket));
             socket_table[i].used = 1;
             INIT_LIST_HEAD(&socket_table[i].pending);
+            init_waitqueue_head(&socket_table[i].wait, "socket_wait");
             release(&socket_table_lock);
             return &socket_table[i];
         }
@@ -322,6 +327,7 @@ void free_socket(struct socket *sock) {
     //     sbuf_free(&sock->sbuf);
     // }
     sock->used = 0;
+    wake_up(&sock->wait);
     if (free_mapping(sock->src_port) < 0) {
         // Warn("free failed");
     }
@@ -355,7 +361,8 @@ uint64 sys_socket(void) {
     fp->f_type = FD_SOCKET;
     fp->f_tp.f_sock = sock;
     fp->f_count = 1;
-    fp->f_flags |= (type & SOCK_CLOEXEC) ? FD_CLOEXEC : 0;
+    if (type & SOCK_CLOEXEC)
+        fd_set_cloexec(proc_current()->files, fd, 1);
     fp->f_flags |= (type & SOCK_NONBLOCK) ? O_NONBLOCK : 0;
     info_socket(SYS_socket, fd, sock, type);
 
@@ -422,6 +429,8 @@ uint64 socket_write(struct socket *sock, vaddr_t addr, int len) {
         }
         ret++;
     }
+    if (ret > 0)
+        wake_up(&sock->wait);
 
     return ret;
 }
@@ -447,9 +456,31 @@ uint64 socket_read(struct socket *sock, vaddr_t addr, int len) {
         }
         ret++;
     }
+    if (ret > 0)
+        wake_up(&sock->wait);
 
     return ret;
 }
+
+// readable : a pending connection or data in sbuf, writable : room in sbuf
+uint socket_poll(struct socket *sock, struct file *f, struct poll_table *pt) {
+    uint mask = 0;
+
+    poll_wait(f, &sock->wait, pt);
+    if (sock->used == 0)
+        return POLLHUP;
+    if (sock->do_accept.value > 0)
+        mask |= POLLIN | POLLRDNORM;
+    if (sock->sbuf.type == NONE) {
+        mask |= POLLOUT | POLLWRNORM;
+    } else {
+        if (!sbuf_empty(&sock->sbuf))
+            mask |= POLLIN | POLLRDNORM;
+        if (!sbuf_full(&sock->sbuf))
+            mask |= POLLOUT | POLLWRNORM;
+    }
+    return mask;
+}
 //    ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
 //                   const struct sockaddr *dest_addr, socklen_t addrlen);
 uint64 sys_sendto(void) {
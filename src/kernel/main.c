@@ -13,9 +13,11 @@
 void printfinit(void);
 void consoleinit(void);
 void timer_init();
+void vdso_init(void);
 void trapinithart(void);
 void kvminit(void);
 void kvminithart(void);
+void asid_init(void);
 void plicinit(void);
 void plicinithart(void);
 void virtio_disk_init(void);
@@ -23,10 +25,14 @@ void binit(void);
 void fileinit(void);
 void vmas_init();
 void mm_init();
+void kmem_cache_init(void);
+void mpage_init(void);
 void userinit(void);
 void proc_init();
 void inode_table_init(void);
+void dcache_init(void);
 void hash_tables_init(void);
+void futex_init(void);
 void hartinit();
 void pdflush_init();
 void page_writeback_timer_init(void);
@@ -34,6 +40,7 @@ void disk_init(void);
 void null_zero_dev_init();
 void dma_init(void);
 void init_socket_table();
+void eventpoll_init(void);
 
 volatile static int started = 0;
 __attribute__((aligned(16))) char stack0[4096 * NCPU];
@@ -77,12 +84,20 @@ void main(uint64 hartid) {
         
         //========== physical memory management ==========
         mm_init();
+        //========== slab allocator ==========
+        kmem_cache_init();
         //========== VMA management ==========
         vmas_init();
 
         //========== kernel virtual memory ==========
         kvminit();     // create kernel page table
         kvminithart(); // turn on paging
+        asid_init();
+
+#ifdef __STRING_BENCH__
+        string_test();
+        string_bench();
+#endif
 
         // ========= Proc management and Thread management =======
         proc_init(); // process table
@@ -90,6 +105,7 @@ void main(uint64 hartid) {
 
         // ========== timer init ==========
         timer_init();
+        vdso_init();
 
         // !!! Note: trapinithart can be called after timer_init
         // Trap
@@ -101,14 +117,18 @@ void main(uint64 hartid) {
 
         // =========== File System ==========
         binit();
+        mpage_init();
         fileinit();
+        dcache_init();
         inode_table_init();
 
         //========== socket ==========
         init_socket_table();
+        eventpoll_init();
 
         //========== global map ==========
         hash_tables_init();
+        futex_init();
 
 
         Info("========= Block device ==========\n");
@@ -128,7 +148,7 @@ void main(uint64 hartid) {
         
 #endif
         userinit();
-        // pdflush kernel thread
+        // pdflush kernel thread, started in init_ret after mount
         // pdflush_init();
         __sync_synchronize();
 
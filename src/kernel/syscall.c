@@ -17,10 +17,9 @@ extern atomic_t pages_cnt;
 // Fetch the uint64 at addr from the current process.
 #define INSTACK(addr) ((addr) >= USTACK && (addr) + sizeof(uint64) < USTACK + USTACK_PAGE * PGSIZE)
 int fetchaddr(vaddr_t addr, uint64 *ip) {
-    struct proc *p = proc_current();
     // if ((addr >= p->mm->brk || addr + sizeof(uint64) > p->mm->brk) && !INSTACK(addr)) // both tests needed, in case of overflow
     //     return -1;
-    if (copyin(p->mm->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
+    if (copy_from_user(ip, addr, sizeof(*ip)) != 0)
         return -1;
     return 0;
 }
@@ -28,10 +27,10 @@ int fetchaddr(vaddr_t addr, uint64 *ip) {
 // Fetch the nul-terminated string at addr from the current process.
 // Returns length of string, not including nul, or -1 for error.
 int fetchstr(uint64 addr, char *buf, int max) {
-    struct proc *p = proc_current();
-    if (copyinstr(p->mm->pagetable, buf, addr, max) < 0)
+    long len = strncpy_from_user(buf, addr, max);
+    if (len < 0 || len == max)
         return -1;
-    return strlen(buf);
+    return len;
 }
 
 uint64 argraw(int n) {
@@ -303,6 +302,12 @@ static struct syscall_info info[] = {
     [SYS_sched_getscheduler] { "sched_getscheduler", 3, "ddp" },
     [SYS_sched_getparam] { "sched_getparam", 2, "dp" },
     [SYS_sched_setscheduler] { "sched_setscheduler", 3, "ddp" },
+    [SYS_sched_setparam] { "sched_setparam", 2, "dp" },
+    [SYS_sched_get_priority_max] { "sched_get_priority_max", 1, "d" },
+    [SYS_sched_get_priority_min] { "sched_get_priority_min", 1, "d" },
+    [SYS_sched_rr_get_interval] { "sched_rr_get_interval", 2, "dp" },
+    [SYS_setpriority] { "setpriority", 3, "ddd" },
+    [SYS_getpriority] { "getpriority", 2, "dd" },
     [SYS_clock_getres] { "clock_getres", 2, "dp" },
     [SYS_nanosleep] { "nanosleep", 2, "pp" },
     [SYS_futex] { "futex", 6, "pddppd" },
@@ -470,6 +475,7 @@ void syscall(void) {
         // int pages_before = atomic_read(&pages_cnt);
         // uint64 time_before = rdtime();
         t->trapframe->a0 = syscalls[num]();
+        argfd_put_all();
         // uint64 time_after = rdtime();
         // int pages_after = atomic_read(&pages_cnt);
         // syscall_mm[num] += (pages_after - pages_before);
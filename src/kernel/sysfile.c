@@ -27,34 +27,40 @@
 #include "fs/uio.h"
 #include "kernel/syscall.h"
 #include "fs/ioctl.h"
+#include "fs/fdtable.h"
 
-#define FILE2FD(f, proc) (((char *)(f) - (char *)(proc)->ofile) / sizeof(struct file))
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
-// 它是线程安全的
+// 它是线程安全的 : the file is held until the syscall returns (argfd_put_all)
 int argfd(int n, int *pfd, struct file **pf) {
     int fd;
     struct file *f;
-    struct proc *p = proc_current();
+    struct tcb *t = thread_current();
     argint(n, &fd);
-    if (fd < 0 || fd >= NOFILE)
-        return -1;
 
-    // in case another thread writes after the current thead reads
-    sema_wait(&p->tlock);
-    if ((f = proc_current()->ofile[fd]) == 0) {
-        sema_signal(&p->tlock);
+    if (t->nr_fd_held == NR_FD_HELD) {
+        Warn("argfd: too many files held");
+        return -1;
+    }
+    if ((f = fd_get(proc_current()->files, fd)) == 0) {
         return -1;
-    } else {
-        if (pfd)
-            *pfd = fd;
-        if (pf)
-            *pf = f;
     }
-    sema_signal(&p->tlock);
+    t->fd_held[t->nr_fd_held++] = f;
+    if (pfd)
+        *pfd = fd;
+    if (pf)
+        *pf = f;
     return 0;
 }
 
+// drop the files argfd held for the syscall
+void argfd_put_all(void) {
+    struct tcb *t = thread_current();
+
+    while (t->nr_fd_held > 0)
+        generic_fileclose(t->fd_held[--t->nr_fd_held]);
+}
+
 static inline int __namecmp(const char *s, const char *t) {
     return strncmp(s, t, MAXPATH);
 }
@@ -63,20 +69,8 @@ static inline int __namecmp(const char *s, const char *t) {
 // Takes over file reference from caller on success.
 // 它是线程安全的
 int fdalloc(struct file *f) {
-    int fd;
     struct proc *p = proc_current();
-
-    sema_wait(&p->tlock);
-    // for (fd = 0; fd < NOFILE; fd++) {
-    for (fd = 0; fd < p->max_ofile; fd++) {
-        if (p->ofile[fd] == 0) {
-            p->ofile[fd] = f;
-            sema_signal(&p->tlock);
-            return fd;
-        }
-    }
-    sema_signal(&p->tlock);
-    return -1;
+    return fd_alloc(p->files, f, 0, p->max_ofile, 0);
 }
 
 // return ip without ip->lock held
@@ -108,7 +102,7 @@ static struct inode *find_inode(char *path, int dirfd, char *name) {
         // path为相对于 dirfd目录的路径
         struct file *f;
         // acquire(&p->tlock);
-        if (dirfd < 0 || dirfd >= NOFILE || (f = p->ofile[dirfd]) == 0) {
+        if ((f = fd_get(p->files, dirfd)) == 0) {
             // release(&p->tlock);
             // printf("about to leave find_inode!\n");
             return 0;
@@ -120,10 +114,12 @@ static struct inode *find_inode(char *path, int dirfd, char *name) {
             // release(&p->tlock);
 
             p->cwd = oldcwd;
+            generic_fileclose(f);
             // printf("about to leave find_inode!\n");
             return 0;
         }
         p->cwd = oldcwd;
+        generic_fileclose(f);
         // release(&p->tlock);
     }
 
@@ -137,8 +133,9 @@ int assist_openat(struct inode *ip, int flags, int omode, struct file **fp) {
     // ASSERT(ip->fs_type == FAT32);
     struct file *f;
     int fd;
+    struct proc *p = proc_current();
 
-    if ((f = filealloc(ip->fs_type)) == 0 || (fd = fdalloc(f)) < 0) {
+    if ((f = filealloc(ip->fs_type)) == 0 || (fd = fd_alloc(p->files, f, 0, p->max_ofile, flags & O_CLOEXEC)) < 0) {
         if (f)
             generic_fileclose(f);
         ip->i_op->iunlock_put(ip);
@@ -371,6 +368,7 @@ static uint64 do_renameat2(struct inode *ip, int newdirfd, char *newpath, int fl
         } else {
             // 删除, 然后创建
             ASSERT(newip->parent->i_sem.value > 0);
+            newip->parent->i_op->idup(newip->parent); // put by __unlink
             newip->parent->i_op->ilock(newip->parent);
             // assist_unlink(newip);    // error! do not use this
             __unlink(newip->parent, newip);
@@ -387,6 +385,7 @@ static uint64 do_renameat2(struct inode *ip, int newdirfd, char *newpath, int fl
         } else {
             // 删除，然后创建
             ASSERT(newip->parent->i_sem.value > 0);
+            newip->parent->i_op->idup(newip->parent); // put by __unlink
             newip->parent->i_op->ilock(newip->parent);
             // assist_unlink(newip);    // error! do not use this
             __unlink(newip->parent, newip);
@@ -414,7 +413,7 @@ create:
 
     // 2. 删除原目录项entry（不删除文件数据）
     ASSERT(ip->parent->i_op);
-    parent = ip->parent;
+    parent = ip->parent->i_op->idup(ip->parent);
     ASSERT(parent->i_sem.value > 0);
     parent->i_op->ilock(parent);
     parent->i_op->ientrydelete(parent, ip);
@@ -424,9 +423,14 @@ create:
     return 0;
 }
 
-static int assist_dupfd(struct file *f) {
+// the lowest free fd >= start for f
+static int assist_dupfd(struct file *f, int start, int cloexec) {
+    struct proc *p = proc_current();
     int newfd;
-    if ((newfd = fdalloc(f)) > 0) {
+    if (start < 0) {
+        return -EINVAL;
+    }
+    if ((newfd = fd_alloc(p->files, f, start, p->max_ofile, cloexec)) >= 0) {
         f->f_op->dup(f);
     }
     return newfd;
@@ -442,29 +446,25 @@ static int assist_dupfd(struct file *f) {
 // return ret;
 // }
 
-// 不做参数检查
 // 一定返回 newfd
-static int assist_setfd(struct file *f, int oldfd, int newfd) {
+static int assist_setfd(struct file *f, int oldfd, int newfd, int cloexec) {
     struct proc *p = proc_current();
+    struct file *old = NULL;
+    int ret;
     if (oldfd == newfd) {
         // do nothing
         return EINVAL;
         // return newfd;
     }
-    sema_wait(&p->tlock); // 可以修改为粒度小一些的锁;可以往_file结构里加锁，或者fdtable
-    if (p->ofile[newfd] == 0) {
-        // not used, great!
-        p->ofile[newfd] = f;
-        sema_signal(&p->tlock);
-    } else {
-        // close and reuse
-        // two steps must be atomic!
-        generic_fileclose(p->ofile[newfd]);
-        p->ofile[newfd] = f;
-        sema_signal(&p->tlock);
-    }
     // fat32_filedup(f);
     f->f_op->dup(f);
+    // replacing newfd is atomic, the old file is closed after
+    if ((ret = fd_install(p->files, newfd, f, p->max_ofile, cloexec, &old)) < 0) {
+        generic_fileclose(f);
+        return ret;
+    }
+    if (old)
+        fd_close(old);
     return newfd;
 }
 
@@ -481,21 +481,23 @@ static int assist_setflag(struct file *f, int flag) {
     return -1;
 }
 
-static uint64 do_fcntl(struct file *f, int cmd) {
+static uint64 do_fcntl(struct file *f, int fd, int cmd) {
     int ret, arg;
     switch (cmd) {
     case F_DUPFD:
-        ret = assist_dupfd(f);
+        argint(2, &arg);
+        ret = assist_dupfd(f, arg, 0);
         break;
 
     case F_GETFD:
-        // ret = assist_getfd(f);
-        ret = f->f_flags;
+        ret = fd_get_cloexec(proc_current()->files, fd);
+        if (ret > 0)
+            ret = FD_CLOEXEC;
         break;
 
     case F_SETFD:
-        ret = 0;
-        // f->f_flags |= FD_CLOEXEC;
+        argint(2, &arg);
+        ret = fd_set_cloexec(proc_current()->files, fd, arg & FD_CLOEXEC);
         break;
 
     case F_GETFL:
@@ -511,10 +513,20 @@ static uint64 do_fcntl(struct file *f, int cmd) {
         break;
 
     case F_DUPFD_CLOEXEC:
-        ret = assist_dupfd(f);
-        // if (ret >= 0) {
-        //     proc_current()->ofile[ret]->f_flags |= FD_CLOEXEC;
-        // }
+        argint(2, &arg);
+        ret = assist_dupfd(f, arg, 1);
+        break;
+
+    case F_SETPIPE_SZ:
+        if (f->f_type != FD_PIPE || argint(2, &arg) < 0) {
+            ret = -EBADF;
+        } else {
+            ret = pipe_set_size(f->f_tp.f_pipe, arg);
+        }
+        break;
+
+    case F_GETPIPE_SZ:
+        ret = (f->f_type == FD_PIPE) ? pipe_get_size(f->f_tp.f_pipe) : -EBADF;
         break;
     default:
         ret = 0;
@@ -589,7 +601,7 @@ uint64 sys_dup(void) {
     if (argfd(0, 0, &f) < 0)
         return -1;
     if ((fd = fdalloc(f)) < 0)
-        return -EMFILE;
+        return fd;
 
     // fat32_filedup(f);
     ASSERT(f->f_op);
@@ -613,13 +625,12 @@ uint64 sys_dup3(void) {
         return -1;
     }
     argint(1, &newfd);
-    if (newfd < 0 || newfd >= NOFILE) {
-        return -1;
-    }
     argint(2, &flags);
-    ASSERT(flags == 0);
+    if (flags & ~O_CLOEXEC) {
+        return -EINVAL;
+    }
 
-    newfd = assist_setfd(f, oldfd, newfd);
+    newfd = assist_setfd(f, oldfd, newfd, flags & O_CLOEXEC);
     return newfd;
 }
 
@@ -707,10 +718,10 @@ uint64 sys_close(void) {
     int fd;
     struct file *f;
 
-    if (argfd(0, &fd, &f) < 0) {
+    argint(0, &fd);
+    if ((f = fd_remove(proc_current()->files, fd)) == NULL) {
         return -1;
     }
-    proc_current()->ofile[fd] = 0;
 
 #ifdef __DEBUG_FS__
     printfCYAN("close : filename : %s, pid %d, fd = %d\n", f->f_tp.f_inode->fat32_i.fname, proc_current()->pid, fd);
@@ -719,7 +730,7 @@ uint64 sys_close(void) {
     // debug ！！！
     // printfCYAN("close begin: filename : %s, pid %d, fd = %d\n", f->f_tp.f_inode->fat32_i.fname, proc_current()->pid, fd);
 
-    generic_fileclose(f);
+    fd_close(f);
 
     // debug ！！！
     // printfCYAN("close end: filename : %s, pid %d, fd = %d\n", f->f_tp.f_inode->fat32_i.fname, proc_current()->pid, fd);
@@ -1122,6 +1133,7 @@ uint64 sys_chdir(void) {
     }
 
     ip->i_op->iunlock(ip);
+    p->cwd->i_op->iput(p->cwd);
     p->cwd = ip;
     return 0;
 }
@@ -1144,15 +1156,15 @@ uint64 sys_pipe2(void) {
     fd0 = -1;
     if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) { // 给当前进程分配两个文件描述符，代指那两个管道文件
         if (fd0 >= 0)
-            p->ofile[fd0] = 0;
+            fd_remove(p->files, fd0);
         generic_fileclose(rf);
         generic_fileclose(wf);
         return -EMFILE;
     }
     if (copyout(p->mm->pagetable, fdarray, (char *)&fd0, sizeof(fd0)) < 0
         || copyout(p->mm->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
-        p->ofile[fd0] = 0;
-        p->ofile[fd1] = 0;
+        fd_remove(p->files, fd0);
+        fd_remove(p->files, fd1);
         generic_fileclose(rf);
         generic_fileclose(wf);
         return -1;
@@ -1346,12 +1358,12 @@ uint64 sys_lseek(void) {
 // 返回值：成功执行，返回值依赖于cmd。错误，则返回-1。
 uint64 sys_fcntl(void) {
     struct file *f;
-    int cmd;
-    if (argfd(0, 0, &f) < 0) {
+    int fd, cmd;
+    if (argfd(0, &fd, &f) < 0) {
         return -1;
     }
     argint(1, &cmd);
-    return do_fcntl(f, cmd);
+    return do_fcntl(f, fd, cmd);
 }
 
 // 功能：检查进程实际用户ID和实际组ID对文件的访问权限；
@@ -1834,12 +1846,30 @@ uint64 sys_pwrite64(void) {
 // synchronize cached writes to persistent storage
 // void sync(void);
 uint64 sys_sync(void) {
+    fat32_fat_bitmap_writeback(ROOTDEV, &fat32_sb);
+    bsync();
     return 0;
 }
 
 // synchronize a file's in-core state with storage device
 // int fsync(int fd);
 uint64 sys_fsync(void) {
+    struct file *f;
+    struct inode *ip;
+
+    if (argfd(0, 0, &f) < 0)
+        return -EBADF;
+    if (f->f_type != FD_INODE)
+        return -EINVAL;
+    ip = f->f_tp.f_inode;
+    if (ip->fs_type == FAT32) {
+        // the clusters reserved for appending are not part of the file
+        ip->i_op->ilock(ip);
+        fat32_cluster_release_rsv(ip);
+        ip->i_op->iunlock(ip);
+        fat32_fat_bitmap_writeback(ROOTDEV, &fat32_sb);
+    }
+    bsync();
     return 0;
 }
 
@@ -12,14 +12,15 @@
 #include "kernel/syscall.h"
 #include "lib/ctype.h"
 #include "lib/timer.h"
+#include "kernel/cpu.h"
 #include "lib/resource.h"
 #include "debug.h"
 #include "ipc/signal.h"
 #include "memory/vm.h"
 #include "memory/allocator.h"
+#include "memory/vma.h"
 #include "kernel/syscall.h"
 
-extern atomic_t ticks;
 extern struct cond cond_ticks;
 
 struct tms {
@@ -70,7 +71,7 @@ uint64 sys_times(void) {
     if (either_copyout(1, addr, &tms_buf, sizeof(tms_buf)) == -1)
         return -1;
 
-    return atomic_read(&ticks);
+    return timer_ticks();
 }
 /*
  * 功能：打印系统信息；
@@ -190,6 +191,21 @@ struct sysinfo {
     // char _f[20-2*sizeof(long)-sizeof(int)]; /* Padding to 64 bytes */
 };
 
+// int getcpu(unsigned *cpu, unsigned *node, void *unused);
+uint64 sys_getcpu(void) {
+    uint64 cpu_addr, node_addr;
+    uint cpu = cpuid(), node = 0;
+    argaddr(0, &cpu_addr);
+    argaddr(1, &node_addr);
+
+    pagetable_t pagetable = proc_current()->mm->pagetable;
+    if (cpu_addr && copyout(pagetable, cpu_addr, (char *)&cpu, sizeof(cpu)) < 0)
+        return -EFAULT;
+    if (node_addr && copyout(pagetable, node_addr, (char *)&node, sizeof(node)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
 // int sysinfo(struct sysinfo *info);
 uint64 sys_sysinfo(void) {
     uint64 info;
@@ -740,8 +756,19 @@ uint64 sys_umask(void) {
     return 0x777;
 }
 
+//    int msync(void *addr, size_t length, int flags);
 uint64 sys_msync(void) {
-    return 0;
+    vaddr_t addr;
+    size_t length;
+    struct mm_struct *mm = proc_current()->mm;
+    int ret;
+
+    argaddr(0, &addr);
+    argulong(1, &length);
+    acquire(&mm->lock);
+    ret = vmspace_msync(mm, addr, length);
+    release(&mm->lock);
+    return ret < 0 ? -EINVAL : 0;
 }
 uint64 sys_readlinkat(void) {
     return 0;
@@ -12,6 +12,7 @@
 #include "atomic/cond.h"
 #include "ipc/signal.h"
 #include "proc/tcb_life.h"
+#include "proc/sched.h"
 #include "atomic/futex.h"
 #include "common.h"
 #include "kernel/syscall.h"
@@ -20,8 +21,6 @@
 
 #define ROOT_UID 0
 
-extern atomic_t ticks;
-extern struct spinlock tickslock;
 /*
  * 功能：获取进程ID；
  * 输入：系统调用ID；
@@ -302,7 +301,7 @@ uint64 sys_print_pgtable(void) {
 // since start.
 uint64
 sys_uptime(void) {
-    return atomic_read(&ticks);
+    return timer_ticks();
 }
 
 // getuid() returns the real user ID of the calling process.
@@ -527,15 +526,14 @@ uint64 sys_futex() {
     struct proc *p = proc_current();
     int cmd = futex_op & FUTEX_CMD_MASK;
     // ktime_t t;
-    if (timeout_addr && (cmd == FUTEX_WAIT
+    if (timeout_addr && (cmd == FUTEX_WAIT || cmd == FUTEX_WAIT_BITSET
                          // cmd == FUTEX_LOCK_PI ||
-                         // cmd == FUTEX_WAIT_BITSET ||
                          // cmd == FUTEX_WAIT_REQUEUE_PI
                          )) {
         // if (unlikely(should_fail_futex(!(futex_op & FUTEX_PRIVATE_FLAG))))
         //     return -1;
         if (copyin(p->mm->pagetable, (char *)&timeout, timeout_addr, sizeof(struct timespec)) < 0) {
-            return -1;
+            return -EFAULT;
         }
         // if (!timespec64_valid(&timeout))
         //     return -1;
@@ -622,8 +620,85 @@ uint64 sys_setsid(void) {
 uint64 sys_gettid(void) {
     return proc_current()->pid;
 }
+// the target of sched_* and *priority : 0 means the calling thread,
+// otherwise all threads of process pid
+static int sched_apply(int pid, int (*fn)(struct tcb *, int, int), int arg0, int arg1) {
+    if (pid == 0)
+        return fn(thread_current(), arg0, arg1);
+
+    struct proc *p = find_get_pid(pid);
+    if (p == NULL)
+        return -ESRCH;
+    struct tcb *t_cur = NULL;
+    int ret = 0;
+    acquire(&p->tg->lock);
+    list_for_each_entry(t_cur, &p->tg->threads, threads) {
+        if (fn(t_cur, arg0, arg1) < 0) {
+            ret = -EINVAL;
+            break;
+        }
+    }
+    release(&p->tg->lock);
+    return ret;
+}
+
+static struct tcb *sched_find(int pid) {
+    if (pid == 0)
+        return thread_current();
+    struct proc *p = find_get_pid(pid);
+    return p != NULL ? p->tg->group_leader : NULL;
+}
+
+static int __sched_setscheduler(struct tcb *t, int policy, int prio) {
+    return sched_setscheduler(t, policy, prio);
+}
+
+static int __sched_setparam(struct tcb *t, int prio, int unused) {
+    return sched_setscheduler(t, t->policy, prio);
+}
+
+static int __sched_setnice(struct tcb *t, int nice, int unused) {
+    return sched_setnice(t, nice);
+}
+
+// int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param);
 uint64 sys_sched_setscheduler(void) {
-    return 0;
+    int pid, policy;
+    uint64 param_addr;
+    struct sched_param param;
+    argint(0, &pid);
+    argint(1, &policy);
+    argaddr(2, &param_addr);
+    if (pid < 0 || param_addr == 0)
+        return -EINVAL;
+    if (copyin(proc_current()->mm->pagetable, (char *)&param, param_addr, sizeof(param)) < 0)
+        return -EFAULT;
+    if (!rt_policy(policy) && !fair_policy(policy))
+        return -EINVAL;
+
+    int ret = sched_apply(pid, __sched_setscheduler, policy, param.sched_priority);
+    // the new policy may give up the cpu
+    if (ret == 0 && thread_need_resched())
+        thread_yield();
+    return ret;
+}
+
+// int sched_setparam(pid_t pid, const struct sched_param *param);
+uint64 sys_sched_setparam(void) {
+    int pid;
+    uint64 param_addr;
+    struct sched_param param;
+    argint(0, &pid);
+    argaddr(1, &param_addr);
+    if (pid < 0 || param_addr == 0)
+        return -EINVAL;
+    if (copyin(proc_current()->mm->pagetable, (char *)&param, param_addr, sizeof(param)) < 0)
+        return -EFAULT;
+
+    int ret = sched_apply(pid, __sched_setparam, param.sched_priority, 0);
+    if (ret == 0 && thread_need_resched())
+        thread_yield();
+    return ret;
 }
 uint64 sys_sched_getaffinity(void) {
     return 0;
@@ -631,12 +706,95 @@ uint64 sys_sched_getaffinity(void) {
 uint64 sys_sched_setaffinity(void) {
     return 0;
 }
+// int sched_getscheduler(pid_t pid);
 uint64 sys_sched_getscheduler(void) {
-    return 0;
+    int pid;
+    argint(0, &pid);
+    struct tcb *t;
+    if (pid < 0)
+        return -EINVAL;
+    if ((t = sched_find(pid)) == NULL)
+        return -ESRCH;
+    return t->policy;
 }
+
+// int sched_getparam(pid_t pid, struct sched_param *param);
 uint64 sys_sched_getparam(void) {
+    int pid;
+    uint64 param_addr;
+    argint(0, &pid);
+    argaddr(1, &param_addr);
+    struct tcb *t;
+    if (pid < 0 || param_addr == 0)
+        return -EINVAL;
+    if ((t = sched_find(pid)) == NULL)
+        return -ESRCH;
+    struct sched_param param = {.sched_priority = t->rt_priority};
+    if (copyout(proc_current()->mm->pagetable, param_addr, (char *)&param, sizeof(param)) < 0)
+        return -EFAULT;
     return 0;
 }
+
+// int sched_get_priority_max(int policy);
+uint64 sys_sched_get_priority_max(void) {
+    int policy;
+    argint(0, &policy);
+    if (rt_policy(policy))
+        return MAX_RT_PRIO;
+    return fair_policy(policy) ? 0 : -EINVAL;
+}
+
+// int sched_get_priority_min(int policy);
+uint64 sys_sched_get_priority_min(void) {
+    int policy;
+    argint(0, &policy);
+    if (rt_policy(policy))
+        return MIN_RT_PRIO;
+    return fair_policy(policy) ? 0 : -EINVAL;
+}
+
+// int sched_rr_get_interval(pid_t pid, struct timespec *tp);
+uint64 sys_sched_rr_get_interval(void) {
+    int pid;
+    uint64 tp_addr;
+    argint(0, &pid);
+    argaddr(1, &tp_addr);
+    struct tcb *t;
+    if ((t = sched_find(pid)) == NULL)
+        return -ESRCH;
+    uint64 slice_ns = t->policy == SCHED_RR ? SCHED_RR_TIMESLICE_NS : (t->policy == SCHED_FIFO ? 0 : SCHED_LATENCY_NS);
+    struct timespec ts = {.ts_sec = slice_ns / NSEC_PER_SEC, .ts_nsec = slice_ns % NSEC_PER_SEC};
+    if (copyout(proc_current()->mm->pagetable, tp_addr, (char *)&ts, sizeof(ts)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+// int setpriority(int which, id_t who, int prio);
+uint64 sys_setpriority(void) {
+    int which, who, prio;
+    argint(0, &which);
+    argint(1, &who);
+    argint(2, &prio);
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+    if (who < 0)
+        return -ESRCH;
+    return sched_apply(who, __sched_setnice, prio, 0);
+}
+
+// int getpriority(int which, id_t who);
+// like Linux, return 20 - nice, the libc converts it back
+uint64 sys_getpriority(void) {
+    int which, who;
+    argint(0, &which);
+    argint(1, &who);
+    struct tcb *t;
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+    if (who < 0 || (t = sched_find(who)) == NULL)
+        return -ESRCH;
+    return 20 - t->nice;
+}
 uint64 sys_membarrier(void) {
     return 0;
 }
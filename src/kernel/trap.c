@@ -21,6 +21,8 @@
 #include "lib/timer.h"
 #include "kernel/syscall.h"
 #include "memory/pagefault.h"
+#include "memory/thp.h"
+#include "memory/tlbflush.h"
 
 int print_tf_flag;
 
@@ -44,7 +46,7 @@ void trapinithart(void) {
     w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
     // uint64 time = rdtime();
     // printf("time = %d\n",time);
-    SET_TIMER();
+    timer_tick_resume();
     Info("cpu %d, timer is enable !!!\n", cpuid());
 }
 
@@ -138,6 +140,20 @@ void killproc(struct proc *p) {
     proc_sendsignal_all_thread(p, SIGKILL, 1);
 }
 
+// a bad access of t, e.g. to a page mprotect took : SIGSEGV if t handles it,
+// the default action kills the process
+static void segv(struct tcb *t) {
+    __sighandler_t handler = t->sig->action[SIGSEGV - 1].sa_handler;
+    siginfo_t info;
+
+    if (handler == SIG_DFL || handler == SIG_IGN) {
+        killproc(t->p);
+        return;
+    }
+    signal_info_init(SIGSEGV, &info, 1);
+    signal_send(&info, t);
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -197,7 +213,7 @@ void thread_usertrap(void) {
         // }
         if (ISPAGEFAULT(cause)) {
             if (pagefault(cause, p->mm->pagetable, r_stval()) < 0) {
-                killproc(p);
+                segv(thread_current());
             }
         } else {
             killproc(p);
@@ -210,8 +226,11 @@ void thread_usertrap(void) {
     // if (thread_killed(t))
     //     do_exit(-1);
 
-    // give up the CPU if this is a timer interrupt.
     if (which_dev == 2)
+        thp_collapse_tick(p);
+
+    // give up the CPU if this is a timer interrupt.
+    if (which_dev == 2 && thread_need_resched())
         thread_yield();
 
     // handle the signal
@@ -269,10 +288,10 @@ void thread_usertrapret() {
     w_sepc(t->trapframe->epc);
 
     // tell trampoline.S the user page table to switch to.
-    uint64 satp = MAKE_SATP(p->mm->pagetable);
+    uint64 satp = switch_mm_satp(p->mm);
 
-    // write thread idx into sscratch
-    w_sscratch(t->tidx);
+    // write the trapframe of thread into sscratch
+    w_sscratch(THREAD_TRAPFRAME(t->tidx));
 
     // jump to userret in trampoline.S at the top of memory, which
     // switches to the user page table, restores user registers,
@@ -301,7 +320,7 @@ void kerneltrap() {
     }
 
     // give up the CPU if this is a timer interrupt.
-    if (which_dev == 2 && thread_current() != 0 && thread_current()->state == TCB_RUNNING)
+    if (which_dev == 2 && thread_current() != 0 && thread_current()->state == TCB_RUNNING && thread_need_resched())
         thread_yield();
 
     // the yield() may have caused some traps to occur,
@@ -313,6 +332,7 @@ void kerneltrap() {
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
+// 3 if software interrupt (IPI),
 // 1 if other device,
 // 0 if not recognized.
 
@@ -353,18 +373,16 @@ int devintr() {
         return 1;
 
     } else if (scause == 0x8000000000000005L) {
-#if defined(SIFIVE_U) || defined(SIFIVE_B)
-        if (cpuid() == 1) { // bugs: can't be 0 when based on sifive_u
-            clockintr();
-        }
-#else
-        if (cpuid() == 0) { // QEMU : cpuid is 0
-            clockintr();
-        }
-#endif
-        SET_TIMER();
+        // every hart runs its own timers and programs its next event
+        clockintr();
 
         return 2;
+    } else if (scause == 0x8000000000000001L) {
+        // IPI from another hart, sent to wake this one from wfi
+        // the scheduler loop finds the new thread itself
+        w_sip(r_sip() & ~SIP_SSIP);
+
+        return 3;
     } else {
         return 0;
     }
@@ -0,0 +1,38 @@
+#include "common.h"
+#include "lib/riscv.h"
+#include "memory/memlayout.h"
+#include "memory/vm.h"
+#include "kernel/vdso.h"
+#include "debug.h"
+
+extern char vdso_start[]; // vdso.S
+
+// vdso_data, the same physical page in every process
+__attribute__((aligned(PGSIZE))) static char vvar_page[PGSIZE];
+
+void vdso_init(void) {
+    struct vdso_data *vd = (struct vdso_data *)vvar_page;
+
+    vd->freq = FREQUENCY;
+    // sys_clock_gettime reads rdtime for these, the cpu time clocks stay in the kernel
+    vd->clock_mask = (1UL << CLOCK_REALTIME) | (1UL << CLOCK_MONOTONIC)
+                     | (1UL << CLOCK_MONOTONIC_RAW) | (1UL << CLOCK_REALTIME_COARSE)
+                     | (1UL << CLOCK_MONOTONIC_COARSE) | (1UL << CLOCK_BOOTTIME);
+    Info("vdso init [ok]\n");
+}
+
+// map VVAR and VDSO, with PTE_U
+int vdso_map(pagetable_t pagetable) {
+    if (mappages(pagetable, VVAR, PGSIZE, (uint64)vvar_page, PTE_R | PTE_U, 0) < 0)
+        return -1;
+    if (mappages(pagetable, VDSO, PGSIZE, (uint64)vdso_start, PTE_R | PTE_X | PTE_U, 0) < 0) {
+        uvmunmap(pagetable, VVAR, 1, 0, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void vdso_unmap(pagetable_t pagetable) {
+    uvmunmap(pagetable, VVAR, 1, 0, 0);
+    uvmunmap(pagetable, VDSO, 1, 0, 0);
+}
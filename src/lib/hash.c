@@ -1,6 +1,6 @@
 #include "memory/allocator.h"
+#include "memory/slab.h"
 #include "atomic/spinlock.h"
-#include "atomic/futex.h"
 #include "lib/hash.h"
 #include "debug.h"
 
@@ -11,10 +11,9 @@ struct hash_table pid_map = {.lock = INIT_SPINLOCK(pid_hash_table),
 struct hash_table tid_map = {.lock = INIT_SPINLOCK(tid_hash_table),
                              .type = TID_MAP,
                              .size = NTCB};
-struct hash_table futex_map = {.lock = INIT_SPINLOCK(futex_hash_table),
-                               .type = FUTEX_MAP,
-                               .size = FUTEX_NUM};
-struct futex;
+
+// object cache of hash node
+static struct kmem_cache *hash_node_cachep;
 
 // find the table entry given the table，type and key
 struct hash_entry *hash_get_entry(struct hash_table *table, void *key, int holding) {
@@ -29,9 +28,6 @@ struct hash_entry *hash_get_entry(struct hash_table *table, void *key, int holdi
         break;
         // hash_val = *(int *)key % table->size;
         // break;
-    case FUTEX_MAP:
-        hash_val = (uint64)key % table->size;
-        break;
     case INODE_MAP:
         hash_val = hash_str((char *)key) % table->size;
         break;
@@ -72,13 +68,13 @@ void hash_insert(struct hash_table *table, void *key, void *value, int holding)
 
     struct hash_node *node_new;
     if (node == NULL) {
-        node_new = (struct hash_node *)kmalloc(sizeof(struct hash_node));
+        node_new = (struct hash_node *)kmem_cache_alloc(hash_node_cachep);
         hash_assign(node_new, key, table->type);
         node_new->value = value;
         INIT_LIST_HEAD(&node_new->list);
         list_add_tail(&node_new->list, &(entry->list));
     } else {
-        if (table->type == INODE_MAP || table->type == FUTEX_MAP) {
+        if (table->type == INODE_MAP) {
             kfree(node->value); // !!!
         }
         node->value = value;
@@ -93,15 +89,11 @@ void hash_delete(struct hash_table *table, void *key, int holding, int release)
     if (node != NULL) {
         list_del_reinit(&node->list);
 
-        if (table->type == INODE_MAP || table->type == FUTEX_MAP) {
-            // if(table->type == FUTEX_MAP) {
-            //     struct futex* fp = (struct futex*)(node->value);
-            //     release(&fp->lock);
-            // }
+        if (table->type == INODE_MAP) {
             kfree(node->value); // !!!
             // printfGreen("hash_delete : node->value, mm ++: %d pages\n", get_free_mem() / 4096);
         }
-        kfree(node);
+        kmem_cache_free(hash_node_cachep, node);
         // printfGreen("hash_delete : node, mm ++: %d pages\n", get_free_mem() / 4096);
     } else {
         // printfRed("hash delete : this key doesn't existed\n");
@@ -119,9 +111,9 @@ void hash_destroy(struct hash_table *table, int free) {
     struct hash_node *node_tmp = NULL;
     for (int i = 0; i < table->size; i++) {
         list_for_each_entry_safe(node_cur, node_tmp, &table->hash_head[i].list, list) {
-            if (table->type == INODE_MAP || table->type == FUTEX_MAP)
+            if (table->type == INODE_MAP)
                 kfree(node_cur->value); // !!!
-            kfree(node_cur);    
+            kmem_cache_free(hash_node_cachep, node_cur);
         }
     }
     release(&table->lock);
@@ -152,8 +144,6 @@ uint64 hash_val(struct hash_node *node, enum hash_type type) {
     case IPC_IDX_MAP:
         hash_val = node->key_id;
         break;
-    case FUTEX_MAP:
-        hash_val = (uint64)node->key_p;
     case INODE_MAP:
         hash_val = hash_str(node->key_name);
         break;
@@ -172,9 +162,6 @@ uint64 hash_bool(struct hash_node *node, void *key, enum hash_type type) {
     case IPC_IDX_MAP:
         ret = (node->key_id == *(int *)key);
         break;
-    case FUTEX_MAP:
-        ret = ((uint64)node->key_p == (uint64)key);
-        break;
     case INODE_MAP:
         ret = (hash_str(node->key_name) == hash_str((char *)key));
         break;
@@ -192,9 +179,6 @@ void hash_assign(struct hash_node *node, void *key, enum hash_type type) {
     case IPC_IDX_MAP:
         node->key_id = *(int *)key;
         break;
-    case FUTEX_MAP:
-        node->key_p = key;
-        break;
     case INODE_MAP:
         safestrcpy(node->key_name, (char *)key, strlen((char *)key));
         break;
@@ -217,13 +201,13 @@ void hash_table_entry_init(struct hash_table *table) {
 #define MAP_SIZE(map) (sizeof(map) + sizeof(map.hash_head))
 // init all global hash tables
 void hash_tables_init() {
+    hash_node_cachep = kmem_cache_create("hash_node", sizeof(struct hash_node));
+    ASSERT(hash_node_cachep != NULL);
     hash_table_entry_init(&pid_map);
     hash_table_entry_init(&tid_map);
-    hash_table_entry_init(&futex_map);
     Info("========= Information of global hash table ==========\n");
     Info("pid_map size : %d B\n", MAP_SIZE(pid_map));
     Info("tid_map size : %d B\n", MAP_SIZE(tid_map));
-    Info("futex_map size : %d B\n", MAP_SIZE(futex_map));
     Info("hash table, size = %d\n", sizeof(struct hash_table));
     Info("hash node, size = %d\n", sizeof(struct hash_node));
     Info("global hash table init [ok]\n");
@@ -0,0 +1,203 @@
+#include "lib/rbtree.h"
+
+static inline int rb_is_black(struct rb_node *node) {
+    // nil leaves are black
+    return node == NULL || node->rb_color == RB_BLACK;
+}
+
+// replace old with new under parent
+static inline void __rb_change_child(struct rb_node *old, struct rb_node *new, struct rb_node *parent, struct rb_root *root) {
+    if (parent == NULL)
+        root->rb_node = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+}
+
+// a rotation keeps the set of nodes under the top, only x and y change
+static void __rb_rotate_left(struct rb_node *x, struct rb_root *root, rb_augment_f augment) {
+    struct rb_node *y = x->rb_right;
+
+    x->rb_right = y->rb_left;
+    if (y->rb_left)
+        y->rb_left->rb_parent = x;
+    y->rb_parent = x->rb_parent;
+    __rb_change_child(x, y, x->rb_parent, root);
+    y->rb_left = x;
+    x->rb_parent = y;
+    if (augment) {
+        augment(x);
+        augment(y);
+    }
+}
+
+static void __rb_rotate_right(struct rb_node *x, struct rb_root *root, rb_augment_f augment) {
+    struct rb_node *y = x->rb_left;
+
+    x->rb_left = y->rb_right;
+    if (y->rb_right)
+        y->rb_right->rb_parent = x;
+    y->rb_parent = x->rb_parent;
+    __rb_change_child(x, y, x->rb_parent, root);
+    y->rb_right = x;
+    x->rb_parent = y;
+    if (augment) {
+        augment(x);
+        augment(y);
+    }
+}
+
+// recompute node and all its ancestors
+void rb_augment_path(struct rb_node *node, rb_augment_f augment) {
+    for (; node != NULL; node = node->rb_parent)
+        augment(node);
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root, rb_augment_f augment) {
+    struct rb_node *parent, *gparent, *uncle;
+
+    if (augment)
+        rb_augment_path(node, augment);
+    while ((parent = node->rb_parent) != NULL && parent->rb_color == RB_RED) {
+        // a red parent is never the root
+        gparent = parent->rb_parent;
+        if (parent == gparent->rb_left) {
+            uncle = gparent->rb_right;
+            if (!rb_is_black(uncle)) {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_right) {
+                __rb_rotate_left(parent, root, augment);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            __rb_rotate_right(gparent, root, augment);
+        } else {
+            uncle = gparent->rb_left;
+            if (!rb_is_black(uncle)) {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_left) {
+                __rb_rotate_right(parent, root, augment);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            __rb_rotate_left(gparent, root, augment);
+        }
+    }
+    root->rb_node->rb_color = RB_BLACK;
+}
+
+// node took the place of a black node and is one black short, parent is its parent
+static void __rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root, rb_augment_f augment) {
+    struct rb_node *sibling;
+
+    while (node != root->rb_node && rb_is_black(node)) {
+        if (node == parent->rb_left) {
+            sibling = parent->rb_right;
+            if (!rb_is_black(sibling)) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                __rb_rotate_left(parent, root, augment);
+                sibling = parent->rb_right;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_right)) {
+                sibling->rb_left->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                __rb_rotate_right(sibling, root, augment);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_right->rb_color = RB_BLACK;
+            __rb_rotate_left(parent, root, augment);
+        } else {
+            sibling = parent->rb_left;
+            if (!rb_is_black(sibling)) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                __rb_rotate_right(parent, root, augment);
+                sibling = parent->rb_left;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_left)) {
+                sibling->rb_right->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                __rb_rotate_left(sibling, root, augment);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_left->rb_color = RB_BLACK;
+            __rb_rotate_right(parent, root, augment);
+        }
+        node = root->rb_node;
+        break;
+    }
+    if (node)
+        node->rb_color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root, rb_augment_f augment) {
+    struct rb_node *child, *parent, *succ;
+    int color;
+
+    if (node->rb_left == NULL || node->rb_right == NULL) {
+        child = node->rb_left ? node->rb_left : node->rb_right;
+        parent = node->rb_parent;
+        color = node->rb_color;
+        if (child)
+            child->rb_parent = parent;
+        __rb_change_child(node, child, parent, root);
+    } else {
+        // the successor takes the place and the color of node
+        succ = node->rb_right;
+        while (succ->rb_left)
+            succ = succ->rb_left;
+        color = succ->rb_color;
+        child = succ->rb_right;
+        if (succ->rb_parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->rb_parent;
+            parent->rb_left = child;
+            if (child)
+                child->rb_parent = parent;
+            succ->rb_right = node->rb_right;
+            node->rb_right->rb_parent = succ;
+        }
+        succ->rb_left = node->rb_left;
+        node->rb_left->rb_parent = succ;
+        succ->rb_parent = node->rb_parent;
+        __rb_change_child(node, succ, node->rb_parent, root);
+        succ->rb_color = node->rb_color;
+    }
+
+    // succ, if any, is on the path from parent to the root
+    if (augment)
+        rb_augment_path(parent, augment);
+    if (color == RB_BLACK)
+        __rb_erase_color(child, parent, root, augment);
+}
@@ -1,21 +1,72 @@
 #include "common.h"
 #include "debug.h"
 
-void *
+/*
+    word-wide string kernels, every page zeroing, cow copy and page cache copy comes here
+
+    head : bytes until dst is 8-byte aligned
+    body : 64 bytes (8 words) per iteration, then a word per iteration
+    tail : the remaining bytes
+    misaligned src is read in aligned words and shifted (no misaligned load, it traps on some harts)
+*/
+
+#define WSIZE sizeof(uint64)
+#define WMASK (WSIZE - 1)
+#define BLKSIZE (8 * WSIZE)
+
+// keep gcc from turning the byte loops into calls to ourselves
+#define __string_kernel __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+__string_kernel void *
 memset(void *dst, int c, uint n) {
-    char *cdst = (char *)dst;
-    int i;
-    for (i = 0; i < n; i++) {
-        cdst[i] = c;
+    uchar *d = (uchar *)dst;
+
+    while (n > 0 && ((uint64)d & WMASK)) {
+        *d++ = c;
+        n--;
+    }
+    if (n >= WSIZE) {
+        uint64 w = (uchar)c;
+        uint64 *wd = (uint64 *)d;
+        w |= w << 8;
+        w |= w << 16;
+        w |= w << 32;
+        for (; n >= BLKSIZE; n -= BLKSIZE, wd += 8) {
+            wd[0] = w;
+            wd[1] = w;
+            wd[2] = w;
+            wd[3] = w;
+            wd[4] = w;
+            wd[5] = w;
+            wd[6] = w;
+            wd[7] = w;
+        }
+        for (; n >= WSIZE; n -= WSIZE)
+            *wd++ = w;
+        d = (uchar *)wd;
     }
+    while (n-- > 0)
+        *d++ = c;
     return dst;
 }
 
-int memcmp(const void *v1, const void *v2, uint n) {
+__string_kernel int
+memcmp(const void *v1, const void *v2, uint n) {
     const uchar *s1, *s2;
 
     s1 = v1;
     s2 = v2;
+    // skip the equal words, then find the byte
+    if ((((uint64)s1 ^ (uint64)s2) & WMASK) == 0) {
+        while (n > 0 && ((uint64)s1 & WMASK)) {
+            if (*s1 != *s2)
+                return *s1 - *s2;
+            s1++, s2++, n--;
+        }
+        while (n >= WSIZE && *(const uint64 *)s1 == *(const uint64 *)s2) {
+            s1 += WSIZE, s2 += WSIZE, n -= WSIZE;
+        }
+    }
     while (n-- > 0) {
         if (*s1 != *s2)
             return *s1 - *s2;
@@ -25,30 +76,83 @@ int memcmp(const void *v1, const void *v2, uint n) {
     return 0;
 }
 
+// forward copy, overlapping is fine only if dst <= src
+__string_kernel static void
+__memcpy_fwd(uchar *d, const uchar *s, uint n) {
+    while (n > 0 && ((uint64)d & WMASK)) {
+        *d++ = *s++;
+        n--;
+    }
+    if (n >= WSIZE) {
+        uint64 *wd = (uint64 *)d;
+        uint off = (uint64)s & WMASK;
+        if (off == 0) {
+            const uint64 *ws = (const uint64 *)s;
+            for (; n >= BLKSIZE; n -= BLKSIZE, wd += 8, ws += 8) {
+                uint64 t0 = ws[0], t1 = ws[1], t2 = ws[2], t3 = ws[3];
+                uint64 t4 = ws[4], t5 = ws[5], t6 = ws[6], t7 = ws[7];
+                wd[0] = t0;
+                wd[1] = t1;
+                wd[2] = t2;
+                wd[3] = t3;
+                wd[4] = t4;
+                wd[5] = t5;
+                wd[6] = t6;
+                wd[7] = t7;
+            }
+            for (; n >= WSIZE; n -= WSIZE)
+                *wd++ = *ws++;
+            s = (const uchar *)ws;
+        } else {
+            // little endian : low bytes of the output word come from prev
+            uint sh = off * 8;
+            const uint64 *ws = (const uint64 *)(s - off);
+            uint64 prev = ws[0];
+            for (; n >= WSIZE; n -= WSIZE, s += WSIZE) {
+                uint64 next = *++ws;
+                *wd++ = (prev >> sh) | (next << (64 - sh));
+                prev = next;
+            }
+        }
+        d = (uchar *)wd;
+    }
+    while (n-- > 0)
+        *d++ = *s++;
+}
+
+// backward copy for dst > src, words only if they are aligned alike
+__string_kernel static void
+__memcpy_bwd(uchar *d, const uchar *s, uint n) {
+    d += n;
+    s += n;
+    if ((((uint64)d ^ (uint64)s) & WMASK) == 0) {
+        while (n > 0 && ((uint64)d & WMASK)) {
+            *--d = *--s;
+            n--;
+        }
+        uint64 *wd = (uint64 *)d;
+        const uint64 *ws = (const uint64 *)s;
+        for (; n >= WSIZE; n -= WSIZE)
+            *--wd = *--ws;
+        d = (uchar *)wd;
+        s = (const uchar *)ws;
+    }
+    while (n-- > 0)
+        *--d = *--s;
+}
+
 void *
 memmove(void *dst, const void *src, uint n) {
-    const char *s;
-    char *d;
+    const uchar *s = src;
+    uchar *d = dst;
 
-    if (n == 0)
+    if (n == 0 || s == d)
         return dst;
 
-    s = src;
-    d = dst;
-    if (s < d && s + n > d) {
-        s += n;
-        d += n;
-        while (n-- > 0) {
-            *--d = *--s;
-        }
-
-    } else
-        while (n-- > 0) {
-            if (*d == 0x88200000 || *s == 0x88200000) {
-                Log("ready\n");
-            }
-            *d++ = *s++;
-        }
+    if (s < d && s + n > d)
+        __memcpy_bwd(d, s, n);
+    else
+        __memcpy_fwd(d, s, n);
 
     return dst;
 }
@@ -2,89 +2,276 @@
 #include "lib/riscv.h"
 #include "lib/list.h"
 #include "memory/memlayout.h"
+#include "kernel/cpu.h"
 #include "atomic/cond.h"
 #include "atomic/ops.h"
 #include "debug.h"
 
-struct timer_entry timer_head;
-struct spinlock tickslock;
 struct cond cond_ticks;
-atomic_t ticks;
+struct timer_base timer_bases[NCPU];
+
+#define LVL_SHIFT(n) ((n)*TIMER_LVL_CLK_SHIFT)
+#define LVL_GRAN(n) (1UL << LVL_SHIFT(n))
+// delays below LVL_START(n + 1) fit in level n
+#define LVL_START(n) ((uint64)(TIMER_LVL_SIZE - 1) << LVL_SHIFT((n)-1))
+#define WHEEL_TIMEOUT_MAX (LVL_START(TIMER_LVL_DEPTH) - 1)
+#define NO_EXPIRY ((uint64)-1)
 
 void timer_init() {
-    atomic_set(&ticks, 0);
     cond_init(&cond_ticks, "cond_ticks");
-    timer_entry_init(&timer_head, "timer_entry");
+    for (int i = 0; i < NCPU; i++) {
+        struct timer_base *base = &timer_bases[i];
+        initlock(&base->lock, "timer_base");
+        base->clk = rdtime() / TIMER_JIFFY;
+        base->next_event = NO_EXPIRY;
+        base->running = NULL;
+        for (int lvl = 0; lvl < TIMER_LVL_DEPTH; lvl++)
+            base->pending[lvl] = 0;
+        for (int j = 0; j < TIMER_WHEEL_SIZE; j++)
+            INIT_LIST_HEAD(&base->vectors[j]);
+    }
     Info("timer init [ok]\n");
 }
 
-void timer_entry_init(struct timer_entry *t_entry, char *name) {
-    initlock(&t_entry->lock, name);
-    INIT_LIST_HEAD(&t_entry->entry);
+// clock interrupts since boot, as the periodic tick used to count them
+uint64 timer_ticks(void) {
+    return rdtime() / CLINT_INTERVAL;
+}
+
+static inline uint64 ns_to_cycles(uint64 ns) {
+    // FREQUENCY is not a whole number of MHz on every board
+    return ns / 1000 * (FREQUENCY / 1000) / 1000;
+}
+
+// holding base->lock
+static void __enqueue_timer(struct timer_base *base, struct timer_list *timer) {
+    uint64 expires = timer->expires_jiffy, delta;
+    int lvl, idx;
+
+    if (expires < base->clk)
+        expires = base->clk;
+    delta = expires - base->clk;
+    for (lvl = 0; lvl < TIMER_LVL_DEPTH - 1 && delta >= LVL_START(lvl + 1); lvl++)
+        ;
+    if (delta > WHEEL_TIMEOUT_MAX)
+        expires = base->clk + WHEEL_TIMEOUT_MAX;
+    // round up to the slot, never fire early
+    idx = ((expires + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl)) & TIMER_LVL_MASK;
+    list_add_tail(&timer->list, &base->vectors[lvl * TIMER_LVL_SIZE + idx]);
+    base->pending[lvl] |= 1UL << idx;
+    timer->base = base;
+}
+
+// holding base->lock, timer is pending on base
+static void __detach_timer(struct timer_base *base, struct timer_list *timer) {
+    struct list_head *next = timer->list.next;
+    list_del_reinit(&timer->list);
+    // timer was the last one if next is a slot head
+    if (next >= base->vectors && next < base->vectors + TIMER_WHEEL_SIZE && list_empty(next)) {
+        int i = next - base->vectors;
+        base->pending[i / TIMER_LVL_SIZE] &= ~(1UL << (i % TIMER_LVL_SIZE));
+    }
+}
+
+// the first jiffy with a non-empty slot, holding base->lock
+static uint64 __next_expiry(struct timer_base *base) {
+    uint64 clk = base->clk, next = NO_EXPIRY;
+
+    for (int lvl = 0; lvl < TIMER_LVL_DEPTH; lvl++) {
+        uint64 pending = base->pending[lvl];
+        if (pending) {
+            // rotate the bitmap so that bit 0 is the slot of clk
+            int pos = clk & TIMER_LVL_MASK;
+            uint64 rot = pos ? (pending >> pos) | (pending << (TIMER_LVL_SIZE - pos)) : pending;
+            uint64 expires = (clk + __builtin_ctzl(rot)) << LVL_SHIFT(lvl);
+            next = MIN(next, expires);
+        }
+        // clk of the next level, rounded up
+        clk = (clk >> TIMER_LVL_CLK_SHIFT) + ((clk & ((1 << TIMER_LVL_CLK_SHIFT) - 1)) != 0);
+    }
+    return next;
+}
+
+// move the slots of base->clk to expired, holding base->lock
+static void __collect_expired(struct timer_base *base, struct list_head *expired) {
+    uint64 clk = base->clk;
+
+    for (int lvl = 0; lvl < TIMER_LVL_DEPTH; lvl++) {
+        int idx = clk & TIMER_LVL_MASK;
+        if (base->pending[lvl] & (1UL << idx)) {
+            struct list_head *vec = &base->vectors[lvl * TIMER_LVL_SIZE + idx];
+            base->pending[lvl] &= ~(1UL << idx);
+            list_splice(vec, expired->prev);
+            INIT_LIST_HEAD(vec);
+        }
+        // the slots of a higher level only turn every 8 jiffies of this one
+        if (clk & ((1 << TIMER_LVL_CLK_SHIFT) - 1))
+            break;
+        clk >>= TIMER_LVL_CLK_SHIFT;
+    }
+}
+
+// program the timer of this cpu, holding base->lock
+// keep the tick while a thread runs, the scheduler needs it
+static void __program_next_event(struct timer_base *base) {
+    uint64 next = __next_expiry(base);
+    uint64 when = next == NO_EXPIRY ? NO_EXPIRY : next * TIMER_JIFFY;
+
+    if (t_mycpu()->thread != NULL)
+        when = MIN(when, rdtime() + CLINT_INTERVAL);
+    base->next_event = when;
+    sbi_legacy_set_timer(when);
+}
+
+// lock the base timer was queued on, NULL if it never was
+static struct timer_base *lock_timer_base(struct timer_list *timer) {
+    for (;;) {
+        struct timer_base *base = READ_ONCE(timer->base);
+        if (base == NULL)
+            return NULL;
+        acquire(&base->lock);
+        if (timer->base == base)
+            return base;
+        release(&base->lock);
+    }
 }
 
 // expires : ns!!!
+// (re)start timer on this cpu, a pending timer is moved
 void add_timer_atomic(struct timer_list *timer, uint64 expires, timer_expire function, void *data) {
+    struct timer_base *base, *old;
+    uint64 now, deadline;
+
+    push_off();
+    if ((old = lock_timer_base(timer)) != NULL) {
+        if (!list_empty(&timer->list))
+            __detach_timer(old, timer);
+        // its function is running on another cpu, stay there
+        // so that a periodic timer is not queued twice
+        if (old->running == timer) {
+            base = old;
+        } else {
+            release(&old->lock);
+            old = NULL;
+        }
+    }
+    if (old == NULL) {
+        base = &timer_bases[cpuid()];
+        acquire(&base->lock);
+    }
+
+    now = rdtime();
+    deadline = now + ns_to_cycles(expires);
     timer->data = data;
-    timer->expires_end = expires + TIME2NS(rdtime());
     timer->expires = expires;
     timer->function = function;
-    // bug!!!
-    if (!list_empty(&timer->list)) {
-        return;
-    }
+    timer->expires_jiffy = (deadline + TIMER_JIFFY - 1) / TIMER_JIFFY;
 
-    acquire(&timer_head.lock);
-    list_add_tail(&timer->list, &timer_head.entry);
-    release(&timer_head.lock);
+    // catch up with the time an idle cpu slept through
+    if (base->clk < now / TIMER_JIFFY)
+        base->clk = MIN(now / TIMER_JIFFY, __next_expiry(base));
+    __enqueue_timer(base, timer);
+    if (base == &timer_bases[cpuid()] && timer->expires_jiffy * TIMER_JIFFY < base->next_event) {
+        base->next_event = timer->expires_jiffy * TIMER_JIFFY;
+        sbi_legacy_set_timer(base->next_event);
+    }
+    release(&base->lock);
+    pop_off();
 }
 
+// stop timer, and wait for its function if it is running
 void delete_timer_atomic(struct timer_list *timer) {
-    acquire(&timer_head.lock);
-    list_del_reinit(&timer->list);
-    release(&timer_head.lock);
-}
+    struct timer_base *base;
 
-void timer_list_decrease_atomic(struct timer_entry *head) {
-    struct timer_list *timer_cur;
-    struct timer_list *timer_tmp;
-
-    acquire(&head->lock);
-    list_for_each_entry_safe(timer_cur, timer_tmp, &head->entry, list) {
-        // special for pselect6
-        // if (timer_cur->cycle == -1) {
-        //     // wakeup every clock interrupt, don't care expire
-        //     timer_cur->over = TIME_OUT(timer_cur);
-        //     timer_cur->function(timer_cur->data);
-        //     list_del_reinit(&timer_cur->list);
-        //     continue;
-        // }
-        // uint64 time_now_ns = TIME2NS(rdtime());
-        // if (time_now_ns > timer_cur->expires_end) {
-        if (TIME_OUT(timer_cur)) {
-            timer_cur->function(timer_cur->data);
-            if (timer_cur->count == -1) {
-                // if(timer_cur->interval)
-                if (timer_cur->interval == -1)
-                    // special for pdflush
-                    timer_cur->expires_end = timer_cur->expires + TIME2NS(rdtime());
-                else
-                    // special for setitimer
-                    timer_cur->expires_end = timer_cur->interval + TIME2NS(rdtime());
-            } else {
-                list_del_reinit(&timer_cur->list);
-                timer_cur->expires_end = 0;
-                timer_cur->expires = 0;
-            }
+    push_off();
+    if ((base = lock_timer_base(timer)) != NULL) {
+        if (!list_empty(&timer->list))
+            __detach_timer(base, timer);
+        while (base->running == timer) {
+            release(&base->lock);
+            while (READ_ONCE(base->running) == timer)
+                ;
+            acquire(&base->lock);
         }
+        // a periodic timer is queued again after its function
+        if (!list_empty(&timer->list))
+            __detach_timer(base, timer);
+        release(&base->lock);
     }
-    release(&head->lock);
+    pop_off();
 }
 
+// stop timer, not waiting for its function
+// for a caller holding a lock the function takes
+void delete_timer_async(struct timer_list *timer) {
+    struct timer_base *base;
+
+    push_off();
+    if ((base = lock_timer_base(timer)) != NULL) {
+        if (!list_empty(&timer->list))
+            __detach_timer(base, timer);
+        release(&base->lock);
+    }
+    pop_off();
+}
+
+// the scheduler is about to run a thread, bring the tick back
+// interrupts are off
+void timer_tick_resume(void) {
+    struct timer_base *base = &timer_bases[cpuid()];
+    uint64 tick = rdtime() + CLINT_INTERVAL;
+
+    if (base->next_event > tick) {
+        base->next_event = tick;
+        sbi_legacy_set_timer(tick);
+    }
+}
+
+// run the timers of this cpu that expired
 void clockintr() {
-// static int ctr = 0;
-// printf("hit, clockintr %d, %d\n",++ctr, CLINT_INTERVAL);
-    atomic_inc_return(&ticks);       // 或许可以不用原子操作
-    timer_list_decrease_atomic(&timer_head);
-    cond_signal(&cond_ticks);
-}
\ No newline at end of file
+    struct timer_base *base = &timer_bases[cpuid()];
+    uint64 now = rdtime() / TIMER_JIFFY;
+    LIST_HEAD(expired);
+
+    acquire(&base->lock);
+    while (base->clk <= now) {
+        uint64 next = __next_expiry(base);
+        if (next > base->clk) {
+            // nothing until next, skip the empty jiffies
+            base->clk = MIN(next, now + 1);
+            continue;
+        }
+        __collect_expired(base, &expired);
+        base->clk++;
+    }
+
+    while (!list_empty(&expired)) {
+        struct timer_list *timer = list_first_entry(&expired, struct timer_list, list);
+        timer_expire fn = timer->function;
+        void *data = timer->data;
+        int periodic = timer->count == -1;
+
+        list_del_reinit(&timer->list);
+        // a one-shot timer may be gone once fn returns, e.g. on the stack
+        // of a thread it wakes up, don't touch it after that
+        if (!periodic)
+            timer->expires = 0;
+        base->running = timer;
+        release(&base->lock);
+        fn(data);
+        acquire(&base->lock);
+        base->running = NULL;
+
+        // not deleted or restarted by fn
+        if (periodic && timer->count == -1 && timer->base == base && list_empty(&timer->list)) {
+            // special for pdflush
+            uint64 period = timer->interval == -1 ? timer->expires : timer->interval;
+            uint64 deadline = rdtime() + ns_to_cycles(period);
+            timer->expires_jiffy = (deadline + TIMER_JIFFY - 1) / TIMER_JIFFY;
+            __enqueue_timer(base, timer);
+        }
+    }
+
+    __program_next_event(base);
+    release(&base->lock);
+}
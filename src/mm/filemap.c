@@ -54,6 +54,49 @@ struct page *find_get_page_atomic(struct address_space *mapping, uint64 index, i
     return page;
 }
 
+// get the page cache page of index for mmap, read it (and some pages ahead) from disk if necessary.
+// return NULL if index is beyond the end of file
+struct page *filemap_get_page(struct inode *ip, uint64 index) {
+    struct page *page;
+    uint32 isize = ip->i_size;
+
+    if (isize == 0 || index > ((isize - 1) >> PGSHIFT))
+        return NULL;
+
+    // init the i_mapping
+    if (ip->i_mapping == NULL) {
+        fat32_i_mapping_init(ip);
+    }
+    struct address_space *mapping = ip->i_mapping;
+
+    sema_wait(&ip->i_read_lock);
+    if ((page = find_get_page_atomic(mapping, index, 0)) == NULL) {
+        uint64 cnt = max_sane_readahead(PGSIZE, mapping->read_ahead_cnt, isize - (index << PGSHIFT));
+        if (cnt == 0)
+            cnt = 1;
+        page = pa_to_page(mpage_readpages(ip, index, cnt, 1, 0)); // can't allocate new clusters
+    }
+    sema_signal(&ip->i_read_lock);
+    return page;
+}
+
+// a page mapped by MAP_SHARED is written, it will be written back with the inode
+void filemap_set_page_dirty(struct inode *ip, uint64 index) {
+    struct address_space *mapping = ip->i_mapping;
+    ASSERT(mapping != NULL);
+
+    acquire(&ip->tree_lock);
+    radix_tree_tag_set(&mapping->page_tree, index, PAGECACHE_TAG_DIRTY);
+    release(&ip->tree_lock);
+
+    // add it into dirty list
+    acquire(&ip->i_sb->dirty_lock);
+    if (list_empty(&ip->dirty_list)) {
+        list_add_tail(&ip->dirty_list, &ip->i_sb->s_dirty);
+    }
+    release(&ip->i_sb->dirty_lock);
+}
+
 // read ahead
 uint64 max_sane_readahead(uint64 nr, uint64 read_ahead, uint64 tot_nr) {
     return MIN(MIN(PGROUNDUP(nr) / PGSIZE + read_ahead, DIV_ROUND_UP(FREE_RATE(READ_AHEAD_RATE), PGSIZE)), PGROUNDUP(tot_nr) / PGSIZE);
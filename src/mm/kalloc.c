@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// requests no larger than KMALLOC_MAX_SIZE are served by slab.
 
 #include "common.h"
 #include "param.h"
@@ -9,6 +10,7 @@
 #include "lib/riscv.h"
 #include "memory/allocator.h"
 #include "memory/buddy.h"
+#include "memory/slab.h"
 #include "debug.h"
 #include "kernel/cpu.h"
 #include "atomic/ops.h"
@@ -23,6 +25,22 @@ static inline int get_pages_cpu(struct page *page) {
     return (page - pagemeta_start) / PAGES_PER_CPU;
 }
 
+// the head page of the buddy block which page belongs to.
+// the refcnt of a block lives in its head, so a page in the middle
+// of a block (e.g. page cache read by mpage_readpages) can be shared
+struct page *compound_head(struct page *page) {
+    struct page *base = pagemeta_start + get_pages_cpu(page) * PAGES_PER_CPU;
+    uint64 idx = page - base;
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        uint64 head_idx = idx & ~((1UL << order) - 1);
+        struct page *head = base + head_idx;
+        // only the head of an allocated block has allocated set
+        if (head->allocated && idx - head_idx < (1UL << head->order))
+            return head;
+    }
+    return page;
+}
+
 struct page *steal_mem(int cur_id, uint64 order) {
     struct page *page = NULL;
     for (int i = 0; i < NCPU; i++) {
@@ -63,6 +81,9 @@ uint64 size_to_page_order(uint64 size) {
 
 void *kmalloc(size_t size) {
     uint64 order;
+    if (size <= KMALLOC_MAX_SIZE && kmalloc_slab_ready()) {
+        return kmalloc_slab(size);
+    }
     if (size <= PGSIZE) {
         order = 0;
     } else {
@@ -96,6 +117,7 @@ void *kmalloc(size_t size) {
     if (!atomic_read(&recycling) && atomic_read(&pages_cnt) < PAGES_THRESHOLD) {
         atomic_inc_return(&recycling);
         alloc_fail();
+        kmem_cache_reap();
         atomic_dec_return(&recycling);
     }
     // if(atomic_read(&pages_cnt) < 10000) {
@@ -177,6 +199,7 @@ void *kalloc(void) {
     if (!atomic_read(&recycling) && atomic_read(&pages_cnt) < PAGES_THRESHOLD) {
         atomic_inc_return(&recycling);
         alloc_fail();
+        kmem_cache_reap();
         atomic_dec_return(&recycling);
     }
 
@@ -199,7 +222,11 @@ void *kalloc(void) {
 }
 
 void kfree(void *pa) {
-    struct page *page = pa_to_page((uint64)pa);
+    // objects of slab may not be page-aligned
+    if (kfree_slab(pa)) {
+        return;
+    }
+    struct page *page = compound_head(pa_to_page((uint64)pa));
     acquire(&page->lock);
     // ASSERT(page->count >= 1);
     // ASSERT(atomic_read(&page->refcnt) >= 1);
@@ -234,7 +261,7 @@ void kfree(void *pa) {
 }
 
 void share_page(uint64 pa) {
-    struct page *page = pa_to_page(pa);
+    struct page *page = compound_head(pa_to_page(pa));
     // acquire(&page->lock);
     // ASSERT(page->count >= 1);
     ASSERT(atomic_read(&page->refcnt) >= 1);
@@ -5,6 +5,11 @@
 #include "debug.h"
 #include "proc/pcb_mm.h"
 #include "memory/vma.h"
+#include "atomic/ops.h"
+
+// each mm starts its vmacache_seq in its own range, so a vmacache left over
+// from a freed mm at the same address never matches
+static atomic_t mm_generation;
 
 /* allocate a mm_struct, with root pagetable and head_vma */
 struct mm_struct *alloc_mm() {
@@ -16,6 +21,8 @@ struct mm_struct *alloc_mm() {
     }
 
     INIT_LIST_HEAD(&mm->head_vma);
+    mm->mm_rb = RB_ROOT;
+    mm->vmacache_seq = (uint64)atomic_inc_return(&mm_generation) << 32;
 
     // semaphore
     sema_init(&mm->mmap_sem, 1, "mm_semaphore");
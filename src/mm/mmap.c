@@ -55,6 +55,8 @@ void *do_mmap(vaddr_t addr, size_t length, int prot, int flags, struct file *fp,
         // acquire(&mm->lock);
         mapva = find_mapping_space(mm, addr, length);
         // release(&mm->lock);
+        if (IS_ERR_VALUE(mapva))
+            return MAP_FAILED;
     } else {
         if ((flags & MAP_FIXED) == 0) {
             Warn("mmap: not support");
@@ -95,7 +97,7 @@ void *do_mmap(vaddr_t addr, size_t length, int prot, int flags, struct file *fp,
                 
             }
             if (vma != NULL) {
-                del_vma_from_vmspace(&mm->head_vma, vma);
+                del_vma_from_vmspace(mm, vma);
             }
             mapva = addr;
             // offset = ;
@@ -208,6 +210,9 @@ uint64 sys_mprotect(void) {
     // printfYELLOW("==========================");
     // print_vma(&mm->head_vma);
 
-    vma->perm = prot;
+    vma->perm = (vma->perm & PERM_SHARED) | prot;
+    // the pages mapped already lose what prot takes away, a store needs a load
+    uvmprotect(mm, start, len / PGSIZE, ((prot & (PROT_READ | PROT_WRITE)) ? PTE_R : 0)
+                                            | ((prot & PROT_WRITE) ? PTE_W : 0) | ((prot & PROT_EXEC) ? PTE_X : 0));
     return 0;
 }
\ No newline at end of file
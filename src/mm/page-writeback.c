@@ -3,10 +3,17 @@
 #include "proc/pdflush.h"
 #include "lib/timer.h"
 #include "memory/allocator.h"
+#include "fs/bio.h"
 
 struct timer_list wb_timer;
 
 static void background_writeout(uint64 _min_pages) {
+    // dirty sectors of FAT, and dirty buffers are written back every cycle
+    fat32_fat_bitmap_writeback(ROOTDEV, &fat32_sb);
+    bflush(0);
+    // unlinked inodes left when no pdflush was free
+    fat32_inode_reap_unlinked();
+
     // only valid if the number of rest of pages is less than threshold
     if (get_free_mem() > PAGES_THRESHOLD * PGSIZE) {
         return;
@@ -27,7 +34,7 @@ void wakeup_bdflush(void *nr_pages) {
 void page_writeback_timer_init(void) {
     wb_timer.count = -1;    // not stop it
     wb_timer.interval = -1; // continue forever
-    INIT_LIST_HEAD(&wb_timer.list);
+    timer_list_init(&wb_timer);
     uint64 time_out = S_to_NS(dirty_writeback_cycle);
     add_timer_atomic(&wb_timer, time_out, wakeup_bdflush, 0);
 }
\ No newline at end of file
@@ -9,6 +9,10 @@
 #include "debug.h"
 #include "memory/mm.h"
 #include "memory/pagefault.h"
+#include "memory/filemap.h"
+#include "memory/buddy.h"
+#include "memory/thp.h"
+#include "memory/tlbflush.h"
 
 
 static uint32 perm_vma2pte(uint32 vma_perm) {
@@ -17,7 +21,8 @@ static uint32 perm_vma2pte(uint32 vma_perm) {
         pte_perm |= PTE_R;
     }
     if (vma_perm & PERM_WRITE) {
-        pte_perm |= PTE_W;
+        // W without R is reserved
+        pte_perm |= PTE_R | PTE_W;
     }
     if (vma_perm & PERM_EXEC) {
         pte_perm |= PTE_X;
@@ -40,7 +45,90 @@ int is_a_cow_page(int flags) {
     return 1;
 }
 
-int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
+// map the page cache page of file into user space.
+// MAP_SHARED : all processes share the page cache page, a store marks it dirty.
+// MAP_PRIVATE : share it read-only, the first store copies it (cow).
+static int filemap_fault(uint64 cause, pagetable_t pagetable, struct vma *vma, vaddr_t stval) {
+    struct inode *ip = vma->vm_file->f_tp.f_inode;
+    vaddr_t va = PGROUNDDOWN(stval);
+    uint64 off = vma->offset + va - vma->startva;
+    uint32 perm = perm_vma2pte(vma->perm);
+    int write = (cause == STORE_PAGEFAULT);
+    struct page *page;
+    paddr_t pa;
+
+    fat32_inode_lock(ip);
+    page = filemap_get_page(ip, off >> PGSHIFT);
+    if (page == NULL) {
+        // beyond the end of file, fill it with zero
+        fat32_inode_unlock(ip);
+        if (uvmalloc(pagetable, va, va + PGSIZE, perm) == 0)
+            return -1;
+        return 0;
+    }
+    pa = page_to_pa(page);
+
+    if (!(vma->perm & PERM_SHARED) && write) {
+        // private copy at once
+        void *mem;
+        if ((mem = kmalloc(PGSIZE)) == 0) {
+            fat32_inode_unlock(ip);
+            return -1;
+        }
+        memmove(mem, (void *)pa, PGSIZE);
+        fat32_inode_unlock(ip);
+        if (mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_U | perm, COMMONPAGE) != 0) {
+            kfree(mem);
+            return -1;
+        }
+        return 0;
+    }
+
+    uint64 flags = PTE_R | PTE_U | perm;
+    if (vma->perm & PERM_SHARED) {
+        // the first store makes it writable and dirty
+        if (write)
+            filemap_set_page_dirty(ip, off >> PGSHIFT);
+        else
+            flags &= ~PTE_W;
+    } else {
+        // cow on store
+        flags = (flags & ~PTE_W) | PTE_SHARE;
+    }
+    // the page cache keeps its own reference
+    share_page(pa);
+    fat32_inode_unlock(ip);
+    if (mappages(pagetable, va, PGSIZE, pa, flags, COMMONPAGE) != 0) {
+        kfree((void *)pa);
+        return -1;
+    }
+    return 0;
+}
+
+// a store to a page of MAP_SHARED file mapping that is mapped read-only
+static int filemap_mkwrite(struct vma *vma, pte_t *pte, vaddr_t stval) {
+    struct inode *ip = vma->vm_file->f_tp.f_inode;
+    uint64 off = vma->offset + PGROUNDDOWN(stval) - vma->startva;
+    struct page *page = pa_to_page(PTE2PA(*pte));
+
+    // a zero page beyond the end of file is not in page cache
+    if (ip->i_mapping != NULL && page->mapping == ip->i_mapping && page->index == (off >> PGSHIFT))
+        filemap_set_page_dirty(ip, off >> PGSHIFT);
+    *pte |= PTE_W | PTE_D;
+    return 0;
+}
+
+// the pte already allows the access : another hart fixed it, and this hart
+// faulted on the old entry in its TLB
+static inline int pte_allows(uint64 cause, uint flags) {
+    if (cause == STORE_PAGEFAULT)
+        return flags & PTE_W;
+    if (cause == LOAD_PAGEFAULT)
+        return flags & PTE_R;
+    return flags & PTE_X;
+}
+
+static int do_pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
     /* the va exceed the MAXVA is illegal */
     if (PGROUNDDOWN(stval) >= MAXVA) {
         PAGEFAULT("exceed the MAXVA");
@@ -64,21 +152,44 @@ int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
         int level;
         level = walk(pagetable, stval, 0, 0, &pte);
         if (pte == NULL || (*pte == 0)) {
-            uvmalloc(pagetable, PGROUNDDOWN(stval), PGROUNDUP(stval + 1), perm_vma2pte(vma->perm));
-            if (vma->type == VMA_FILE) {
-                paddr_t pa = walkaddr(pagetable, stval);
-
-                fat32_inode_lock(vma->vm_file->f_tp.f_inode);
-                fat32_inode_read(vma->vm_file->f_tp.f_inode, 0, pa, vma->offset + PGROUNDDOWN(stval) - vma->startva, PGSIZE);
-                fat32_inode_unlock(vma->vm_file->f_tp.f_inode);
+            // mmap files and demand-paged ELF segments
+            if (vma->vm_file != NULL) {
+                return filemap_fault(cause, pagetable, vma, stval);
+            }
+            // no page table for the window yet, try a superpage
+            if (pte == NULL && thp_fault(pagetable, vma, stval) == 0) {
+                return 0;
             }
+            uvmalloc(pagetable, PGROUNDDOWN(stval), PGROUNDUP(stval + 1), perm_vma2pte(vma->perm));
         } else {
             pa = PTE2PA(*pte);
             flags = PTE_FLAGS(*pte);
             ASSERT(flags & PTE_V);
+            if ((flags & PTE_U) == 0) {
+                PAGEFAULT("not a user page");
+                return -1;
+            }
+            if (pte_allows(cause, flags)) {
+                return 0;
+            }
+            /* taken by mprotect, and the vma allows it again. a store goes on for W */
+            if (perm_vma2pte(vma->perm) & (PTE_R | PTE_X) & ~flags) {
+                *pte |= perm_vma2pte(vma->perm) & (PTE_R | PTE_X);
+                flags = PTE_FLAGS(*pte);
+            }
+            if (cause != STORE_PAGEFAULT) {
+                return 0;
+            }
+            if (vma->type == VMA_FILE && (vma->perm & PERM_SHARED) && !(flags & PTE_W)) {
+                return filemap_mkwrite(vma, pte, stval);
+            }
+            if ((flags & PTE_SHARE) == 0) {
+                *pte |= PTE_W | PTE_D;
+                return 0;
+            }
             /* copy-on-write handler */
             if (is_a_cow_page(flags)) {
-                return cow(pte, level, pa, flags);
+                return cow(vma->vm_mm, stval, pte, level, pa, flags);
             } else {
                 return -1;
             }
@@ -93,7 +204,17 @@ int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
     return 0;
 }
 
-int cow(pte_t *pte, int level, paddr_t pa, int flags) {
+// a new mapping or more permissions on stval : only the TLB of this hart
+// may hold the old entry, a fault on another hart ends up here too
+int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
+    int ret = do_pagefault(cause, pagetable, stval);
+
+    if (ret == 0)
+        local_flush_tlb_page(proc_current()->mm, stval);
+    return ret;
+}
+
+int cow(struct mm_struct *mm, vaddr_t va, pte_t *pte, int level, paddr_t pa, int flags) {
     void *mem;
     if (level == SUPERPAGE) {
         // 2MB superpage
@@ -113,6 +234,11 @@ int cow(pte_t *pte, int level, paddr_t pa, int flags) {
     }
 
     *pte = PA2PTE((uint64)mem) | flags | PTE_W;
+    // other threads may still read the old page
+    if (level == SUPERPAGE)
+        flush_tlb_range(mm, SUPERPG_DOWN(va), SUPERPG_DOWN(va) + SUPERPGSIZE);
+    else
+        flush_tlb_page(mm, va);
     kfree((void *)pa);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,341 @@
+#include "memory/slab.h"
+#include "memory/allocator.h"
+#include "memory/buddy.h"
+#include "atomic/spinlock.h"
+#include "kernel/cpu.h"
+#include "lib/list.h"
+#include "lib/riscv.h"
+#include "debug.h"
+#include "common.h"
+
+// the cache of struct kmem_cache
+static struct kmem_cache cache_cache;
+// generic caches for kmalloc, 16B ~ 2KiB
+static struct kmem_cache *kmalloc_caches[KMALLOC_NR_CACHES];
+static char kmalloc_names[KMALLOC_NR_CACHES][SLAB_NAME_LEN];
+
+// global cache chain
+static struct list_head cache_chain;
+static struct spinlock cache_chain_lock;
+static int slab_ready = 0;
+
+static inline struct page *obj_to_slab(void *obj) {
+    return pa_to_page(PGROUNDDOWN((uint64)obj));
+}
+
+static void kmem_cache_setup(struct kmem_cache *cachep, const char *name, size_t size) {
+    memset(cachep, 0, sizeof(struct kmem_cache));
+    safestrcpy(cachep->name, name, SLAB_NAME_LEN);
+    // every free object holds the pointer of next free object
+    cachep->size = ROUND_UP(MAX(size, SLAB_MIN_SIZE), sizeof(void *));
+    ASSERT(cachep->size <= PGSIZE);
+    cachep->objs_per_slab = PGSIZE / cachep->size;
+
+    initlock(&cachep->lock, cachep->name);
+    INIT_LIST_HEAD(&cachep->slabs_partial);
+    INIT_LIST_HEAD(&cachep->slabs_free);
+    cachep->nr_free = 0;
+    cachep->nr_slabs = 0;
+    for (int i = 0; i < NCPU; i++)
+        initlock(&cachep->cpu[i].lock, cachep->name);
+
+    INIT_LIST_HEAD(&cachep->cache_list);
+    acquire(&cache_chain_lock);
+    list_add_tail(&cachep->cache_list, &cache_chain);
+    release(&cache_chain_lock);
+}
+
+// allocate a page from buddy system, and carve it into objects
+// not holding cachep->lock, kalloc may call alloc_fail to recycle memory
+static struct page *slab_page_alloc(struct kmem_cache *cachep) {
+    void *pa = kalloc();
+    if (pa == NULL)
+        return NULL;
+
+    struct page *page = pa_to_page((uint64)pa);
+    set_page_flags(page, PG_slab);
+    page->slab_cache = cachep;
+    page->inuse = 0;
+    INIT_LIST_HEAD(&page->list);
+
+    // build the free list
+    void **obj = NULL;
+    page->freelist = NULL;
+    for (int i = cachep->objs_per_slab - 1; i >= 0; i--) {
+        obj = (void **)((uint64)pa + i * cachep->size);
+        *obj = page->freelist;
+        page->freelist = (void *)obj;
+    }
+    return page;
+}
+
+// give an empty slab back to buddy system, not holding cachep->lock
+static void slab_page_free(struct page *page) {
+    ASSERT(page->inuse == 0);
+    clear_page_flags(page, PG_slab);
+    page->slab_cache = NULL;
+    page->freelist = NULL;
+    kfree((void *)page_to_pa(page));
+}
+
+// holding cachep->lock
+static void *slab_get_obj(struct kmem_cache *cachep, struct page *page) {
+    void *obj = page->freelist;
+    ASSERT(obj != NULL);
+    page->freelist = *(void **)obj;
+    if (page->inuse++ == 0) {
+        cachep->nr_free--;
+    }
+    if (page->freelist == NULL) {
+        // full slab is not linked in any list
+        list_del_reinit(&page->list);
+    } else if (page->inuse == 1) {
+        list_move(&page->list, &cachep->slabs_partial);
+    }
+    return obj;
+}
+
+// holding cachep->lock
+// return 1 if this slab should go back to buddy system
+static int slab_put_obj(struct kmem_cache *cachep, void *obj) {
+    struct page *page = obj_to_slab(obj);
+    ASSERT(PageSlab(page) && page->slab_cache == cachep);
+    ASSERT(page->inuse > 0);
+
+    int was_full = (page->freelist == NULL);
+    *(void **)obj = page->freelist;
+    page->freelist = obj;
+    page->inuse--;
+
+    if (page->inuse == 0) {
+        if (cachep->nr_free >= SLAB_FREE_LIMIT) {
+            list_del_reinit(&page->list);
+            cachep->nr_slabs--;
+            return 1;
+        }
+        list_move(&page->list, &cachep->slabs_free);
+        cachep->nr_free++;
+    } else if (was_full) {
+        list_add(&page->list, &cachep->slabs_partial);
+    }
+    return 0;
+}
+
+// refill the magazine from the slabs of the cache, holding mag->lock
+// the magazine stays empty if the cache has to grow
+static void slab_refill(struct kmem_cache *cachep, struct kmem_cache_cpu *mag) {
+    struct page *page;
+
+    acquire(&cachep->lock);
+    while (mag->avail < SLAB_MAGAZINE_BATCH) {
+        if (!list_empty(&cachep->slabs_partial)) {
+            page = list_first_entry(&cachep->slabs_partial, struct page, list);
+        } else if (!list_empty(&cachep->slabs_free)) {
+            page = list_first_entry(&cachep->slabs_free, struct page, list);
+        } else {
+            break;
+        }
+        mag->objs[mag->avail++] = slab_get_obj(cachep, page);
+    }
+    release(&cachep->lock);
+}
+
+// add a new slab to the cache, holding no lock
+static int slab_grow(struct kmem_cache *cachep) {
+    struct page *page;
+
+    if ((page = slab_page_alloc(cachep)) == NULL)
+        return -1;
+    acquire(&cachep->lock);
+    list_add(&page->list, &cachep->slabs_free);
+    cachep->nr_free++;
+    cachep->nr_slabs++;
+    release(&cachep->lock);
+    return 0;
+}
+
+// move n objects from the magazine back to their slabs, holding mag->lock
+static void slab_flush(struct kmem_cache *cachep, struct kmem_cache_cpu *mag, int n) {
+    struct list_head release_list;
+    struct page *page, *page_tmp;
+    INIT_LIST_HEAD(&release_list);
+
+    acquire(&cachep->lock);
+    while (n-- > 0 && mag->avail > 0) {
+        void *obj = mag->objs[--mag->avail];
+        if (slab_put_obj(cachep, obj)) {
+            list_add(&obj_to_slab(obj)->list, &release_list);
+        }
+    }
+    release(&cachep->lock);
+
+    list_for_each_entry_safe(page, page_tmp, &release_list, list) {
+        list_del_reinit(&page->list);
+        slab_page_free(page);
+    }
+}
+
+// the magazine of current cpu, locked
+static struct kmem_cache_cpu *mag_lock(struct kmem_cache *cachep) {
+    struct kmem_cache_cpu *mag;
+
+    push_off();
+    mag = &cachep->cpu[cpuid()];
+    acquire(&mag->lock);
+    pop_off();
+    return mag;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cachep) {
+    struct kmem_cache_cpu *mag;
+    void *obj;
+
+    for (;;) {
+        mag = mag_lock(cachep);
+        if (mag->avail == 0)
+            slab_refill(cachep, mag);
+        if (mag->avail > 0) {
+            obj = mag->objs[--mag->avail];
+            release(&mag->lock);
+            return obj;
+        }
+        release(&mag->lock);
+
+        // the slab may go to another cpu first, try again
+        if (slab_grow(cachep) < 0)
+            return NULL;
+    }
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *cachep) {
+    void *obj = kmem_cache_alloc(cachep);
+    if (obj != NULL)
+        memset(obj, 0, cachep->size);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cachep, void *obj) {
+    if (obj == NULL)
+        return;
+
+    struct kmem_cache_cpu *mag = mag_lock(cachep);
+    if (mag->avail == SLAB_MAGAZINE_SIZE) {
+        slab_flush(cachep, mag, SLAB_MAGAZINE_BATCH);
+    }
+    mag->objs[mag->avail++] = obj;
+    release(&mag->lock);
+}
+
+// drain the magazine of current cpu and give all empty slabs back to buddy system
+void kmem_cache_shrink(struct kmem_cache *cachep) {
+    struct list_head release_list;
+    struct page *page, *page_tmp;
+
+    struct kmem_cache_cpu *mag = mag_lock(cachep);
+    slab_flush(cachep, mag, mag->avail);
+    release(&mag->lock);
+
+    INIT_LIST_HEAD(&release_list);
+    acquire(&cachep->lock);
+    list_for_each_entry_safe(page, page_tmp, &cachep->slabs_free, list) {
+        list_move(&page->list, &release_list);
+        cachep->nr_free--;
+        cachep->nr_slabs--;
+    }
+    release(&cachep->lock);
+
+    list_for_each_entry_safe(page, page_tmp, &release_list, list) {
+        list_del_reinit(&page->list);
+        slab_page_free(page);
+    }
+}
+
+// shrink all caches, called under memory pressure
+void kmem_cache_reap(void) {
+    struct kmem_cache *cachep;
+    if (!slab_ready)
+        return;
+    acquire(&cache_chain_lock);
+    list_for_each_entry(cachep, &cache_chain, cache_list) {
+        kmem_cache_shrink(cachep);
+    }
+    release(&cache_chain_lock);
+}
+
+// create a named cache for objects of given size
+struct kmem_cache *kmem_cache_create(const char *name, size_t size) {
+    struct kmem_cache *cachep;
+    if (size > KMALLOC_MAX_SIZE) {
+        Warn("kmem_cache_create: %s, object size %d is too large", name, size);
+        return NULL;
+    }
+    if ((cachep = kmem_cache_alloc(&cache_cache)) == NULL) {
+        return NULL;
+    }
+    kmem_cache_setup(cachep, name, size);
+    return cachep;
+}
+
+// all objects of this cache must have been freed
+void kmem_cache_destroy(struct kmem_cache *cachep) {
+    if (cachep == NULL)
+        return;
+
+    acquire(&cache_chain_lock);
+    list_del_reinit(&cachep->cache_list);
+    release(&cache_chain_lock);
+
+    for (int i = 0; i < NCPU; i++) {
+        struct kmem_cache_cpu *mag = &cachep->cpu[i];
+        acquire(&mag->lock);
+        slab_flush(cachep, mag, mag->avail);
+        release(&mag->lock);
+    }
+    kmem_cache_shrink(cachep);
+
+    if (!list_empty(&cachep->slabs_partial)) {
+        Warn("kmem_cache_destroy: %s, objects in use", cachep->name);
+    }
+    kmem_cache_free(&cache_cache, cachep);
+}
+
+int kmalloc_slab_ready(void) {
+    return slab_ready;
+}
+
+static inline int kmalloc_index(size_t size) {
+    int idx = 0;
+    while ((SLAB_MIN_SIZE << idx) < size)
+        idx++;
+    return idx;
+}
+
+void *kmalloc_slab(size_t size) {
+    ASSERT(size <= KMALLOC_MAX_SIZE);
+    return kmem_cache_alloc(kmalloc_caches[kmalloc_index(size)]);
+}
+
+// if obj is allocated by slab, free it and return 1
+int kfree_slab(void *obj) {
+    struct page *page = obj_to_slab(obj);
+    if (!PageSlab(page))
+        return 0;
+    kmem_cache_free(page->slab_cache, obj);
+    return 1;
+}
+
+void kmem_cache_init(void) {
+    INIT_LIST_HEAD(&cache_chain);
+    initlock(&cache_chain_lock, "kmem_cache_chain");
+
+    kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+
+    for (int i = 0; i < KMALLOC_NR_CACHES; i++) {
+        snprintf(kmalloc_names[i], SLAB_NAME_LEN, "kmalloc-%d", SLAB_MIN_SIZE << i);
+        kmalloc_caches[i] = kmem_cache_alloc(&cache_cache);
+        ASSERT(kmalloc_caches[i] != NULL);
+        kmem_cache_setup(kmalloc_caches[i], kmalloc_names[i], SLAB_MIN_SIZE << i);
+    }
+    slab_ready = 1;
+    Info("slab allocator init [ok]\n");
+}
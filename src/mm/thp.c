@@ -0,0 +1,161 @@
+#include "common.h"
+#include "memory/thp.h"
+#include "memory/vma.h"
+#include "memory/vm.h"
+#include "memory/allocator.h"
+#include "memory/buddy.h"
+#include "proc/pcb_life.h"
+#include "proc/tcb_life.h"
+#include "lib/riscv.h"
+#include "lib/timer.h"
+#include "memory/tlbflush.h"
+#include "debug.h"
+
+#define PTRS_PER_PT (PGSIZE / PTESIZE)
+
+static inline uint64 thp_perm(struct vma *vma) {
+    uint64 perm = PTE_R | PTE_U;
+    if (vma->perm & PERM_WRITE)
+        perm |= PTE_W;
+    if (vma->perm & PERM_EXEC)
+        perm |= PTE_X;
+    return perm;
+}
+
+// private anonymous memory only, file pages belong to the page cache
+static inline int thp_vma_suitable(struct vma *vma) {
+    return vma->vm_file == NULL && (vma->type == VMA_HEAP || vma->type == VMA_ANON) && !(vma->perm & PERM_SHARED);
+}
+
+// the 2MB window at start lies in vma
+static inline int thp_window_in_vma(struct vma *vma, vaddr_t start) {
+    return start >= vma->startva && start + SUPERPGSIZE <= vma->startva + vma->size;
+}
+
+// map a zeroed superpage for the window of va, -1 : fall back to a 4KB page
+int thp_fault(pagetable_t pagetable, struct vma *vma, vaddr_t va) {
+    vaddr_t start = SUPERPG_DOWN(va);
+    pte_t *pde;
+    void *mem;
+
+    if (!thp_vma_suitable(vma) || !thp_window_in_vma(vma, start))
+        return -1;
+    // some 4KB pages of the window are mapped already
+    walk(pagetable, start, 0, 1, &pde);
+    if (pde != NULL && (*pde & PTE_V))
+        return -1;
+    if ((mem = kzalloc(SUPERPGSIZE)) == NULL)
+        return -1;
+    if (mappages(pagetable, start, SUPERPGSIZE, (uint64)mem, thp_perm(vma), SUPERPAGE) != 0) {
+        kfree(mem);
+        return -1;
+    }
+    return 0;
+}
+
+// the page of pte is mapped only here : not a cow page, or the last user of one
+static inline int thp_page_exclusive(pte_t pte) {
+    struct page *page;
+
+    if ((pte & PTE_SHARE) == 0)
+        return 1;
+    page = compound_head(pa_to_page(PTE2PA(pte)));
+    return page->order == 0 && atomic_read(&page->refcnt) == 1;
+}
+
+// the page table of a window of vma filled with 4KB pages that are all
+// mapped only here, NULL if it can't be collapsed. holding mm->lock
+static pagetable_t thp_window_table(struct vma *vma, vaddr_t start, pte_t **pdep) {
+    pte_t *pde;
+    pagetable_t table;
+
+    if (!thp_vma_suitable(vma) || !thp_window_in_vma(vma, start))
+        return NULL;
+    if (walk(vma->vm_mm->pagetable, start, 0, 1, &pde) != 0 || pde == NULL)
+        return NULL;
+    // empty, or a superpage already
+    if ((*pde & PTE_V) == 0 || (*pde & (PTE_R | PTE_X)))
+        return NULL;
+    table = (pagetable_t)PTE2PA(*pde);
+    for (int i = 0; i < PTRS_PER_PT; i++) {
+        pte_t pte = table[i];
+        if ((pte & PTE_V) == 0 || (pte & PTE_U) == 0 || !thp_page_exclusive(pte))
+            return NULL;
+    }
+    *pdep = pde;
+    return table;
+}
+
+// look at the next THP_SCAN_WINDOWS windows of mm from where the last scan
+// stopped, until one can be collapsed. holding mm->lock
+// returns 0 and its start in *startp if one is found
+static int thp_collapse_scan(struct mm_struct *mm, vaddr_t *startp) {
+    vaddr_t addr = mm->thp_scan_addr, start;
+    struct vma *vma;
+    pte_t *pde;
+    int ret = -1;
+
+    for (int budget = THP_SCAN_WINDOWS; budget > 0; budget--) {
+        if ((vma = find_vma_from(mm, addr)) == NULL) {
+            // wrap around
+            addr = 0;
+            break;
+        }
+        start = SUPERPG_ROUNDUP(MAX(addr, vma->startva));
+        if (!thp_vma_suitable(vma) || !thp_window_in_vma(vma, start)) {
+            addr = vma->startva + vma->size;
+            continue;
+        }
+        addr = start + SUPERPGSIZE;
+        if (thp_window_table(vma, start, &pde) != NULL) {
+            *startp = start;
+            ret = 0;
+            break;
+        }
+    }
+    mm->thp_scan_addr = addr;
+    return ret;
+}
+
+// called on the timer tick of p, in its own context. the copy of the 4KB
+// pages would race with stores of other threads, so p must have only one.
+// at most one window is collapsed per scan, the superpage is allocated
+// without mm->lock, as kmalloc may sleep
+void thp_collapse_tick(struct proc *p) {
+    struct mm_struct *mm = p->mm;
+    uint64 now = timer_ticks();
+    pagetable_t table = NULL;
+    struct vma *vma;
+    vaddr_t start;
+    pte_t *pde;
+    char *mem;
+
+    if (now < mm->thp_scan_next || atomic_read(&p->tg->thread_cnt) != 1)
+        return;
+    mm->thp_scan_next = now + THP_SCAN_INTERVAL;
+    acquire(&mm->lock);
+    int found = thp_collapse_scan(mm, &start) == 0;
+    release(&mm->lock);
+    if (!found || (mem = kmalloc(SUPERPGSIZE)) == NULL)
+        return;
+
+    acquire(&mm->lock);
+    // look again, the window may have changed without the lock
+    if ((vma = find_vma_for_va(mm, start)) != NULL)
+        table = thp_window_table(vma, start, &pde);
+    if (table == NULL) {
+        release(&mm->lock);
+        kfree(mem);
+        return;
+    }
+    for (int i = 0; i < PTRS_PER_PT; i++)
+        memmove(mem + i * PGSIZE, (void *)PTE2PA(table[i]), PGSIZE);
+    *pde = PA2PTE(mem) | thp_perm(vma) | PTE_V;
+    flush_tlb_range(mm, start, start + SUPERPGSIZE);
+    release(&mm->lock);
+
+    // nothing maps them any more
+    for (int i = 0; i < PTRS_PER_PT; i++)
+        kfree((void *)PTE2PA(table[i]));
+    kfree(table);
+}
@@ -0,0 +1,243 @@
+#include "common.h"
+#include "param.h"
+#include "memory/tlbflush.h"
+#include "memory/mm.h"
+#include "memory/allocator.h"
+#include "atomic/spinlock.h"
+#include "atomic/ops.h"
+#include "kernel/cpu.h"
+#include "lib/riscv.h"
+#include "lib/sbi.h"
+#include "debug.h"
+
+#define ASID_MAP_WORDS ((SATP_ASID_MASK + 1) / 64)
+#define ASID(ctx) ((ctx) & asid_mask)
+#define ALL_CPUS (~0UL >> (64 - NCPU))
+
+extern pagetable_t kernel_pagetable;
+
+static int asid_bits; // 0 : the harts have no ASIDs
+static uint64 asid_mask;
+static uint64 asid_generation; // in the bits above asid_mask, bumped on rollover
+static uint64 asid_map[ASID_MAP_WORDS];
+static uint64 cur_idx = 1;
+static uint64 active_asids[NCPU];   // context_id each hart runs, 0 after a rollover
+static uint64 reserved_asids[NCPU]; // kept across a rollover for the mm a hart runs
+static uint64 tlb_flush_pending;    // harts to flush before they use the new generation
+static struct spinlock asid_lock;
+
+// satp.ASID is WARL, the bits that stick are the ones the hart has
+void asid_init(void) {
+    uint64 satp;
+
+    initlock(&asid_lock, "asid");
+    w_satp(MAKE_SATP_ASID(kernel_pagetable, SATP_ASID_MASK));
+    satp = r_satp();
+    w_satp(MAKE_SATP(kernel_pagetable));
+    sfence_vma();
+
+    asid_bits = __builtin_popcountl((satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK);
+    // too few to go around, every hart would roll over all the time
+    if ((1UL << asid_bits) <= 2 * NCPU)
+        asid_bits = 0;
+    asid_mask = (1UL << asid_bits) - 1;
+    asid_generation = 1UL << asid_bits;
+    // ASID 0 is the kernel
+    asid_map[0] = 1;
+    Info("ASID : %d bits\n", asid_bits);
+}
+
+// the lowest free ASID >= start, asid_mask + 1 if none
+static uint64 asid_find_free(uint64 start) {
+    uint64 nr = asid_mask + 1;
+
+    for (uint64 i = start / 64; i < (nr + 63) / 64; i++) {
+        uint64 used = asid_map[i];
+        if (i == start / 64)
+            used |= (1UL << (start % 64)) - 1;
+        if (~used) {
+            uint64 asid = i * 64 + __builtin_ctzl(~used);
+            return asid < nr ? asid : nr;
+        }
+    }
+    return nr;
+}
+
+// holding asid_lock, start a new generation
+// the ASID running on every hart stays reserved for its mm
+static void flush_context(void) {
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1;
+    for (int i = 0; i < NCPU; i++) {
+        uint64 ctx = __sync_lock_test_and_set(&active_asids[i], 0);
+        // no user code ran on it since the last rollover
+        if (ctx == 0)
+            ctx = reserved_asids[i];
+        set_bit(ASID(ctx), asid_map);
+        reserved_asids[i] = ctx;
+    }
+    tlb_flush_pending = ALL_CPUS;
+}
+
+// holding asid_lock, move a reserved ASID to the new generation
+static int check_update_reserved_asid(uint64 ctx, uint64 newctx) {
+    int hit = 0;
+
+    for (int i = 0; i < NCPU; i++) {
+        if (reserved_asids[i] == ctx) {
+            hit = 1;
+            reserved_asids[i] = newctx;
+        }
+    }
+    return hit;
+}
+
+// holding asid_lock, a context_id of this generation for mm
+static uint64 new_context(struct mm_struct *mm) {
+    uint64 ctx = mm->context_id;
+    uint64 asid;
+
+    if (ctx != 0) {
+        uint64 newctx = asid_generation | ASID(ctx);
+        // it runs on some hart, keep its ASID
+        if (check_update_reserved_asid(ctx, newctx))
+            return newctx;
+        // nobody took its ASID in this generation yet
+        if (!(asid_map[ASID(ctx) / 64] & (1UL << (ASID(ctx) % 64)))) {
+            set_bit(ASID(ctx), asid_map);
+            return newctx;
+        }
+    }
+
+    if ((asid = asid_find_free(cur_idx)) > asid_mask) {
+        asid_generation += asid_mask + 1;
+        flush_context();
+        asid = asid_find_free(1);
+    }
+    set_bit(asid, asid_map);
+    cur_idx = asid;
+    return asid_generation | asid;
+}
+
+// the satp for mm on this hart, on the way back to user. interrupts are off
+uint64 switch_mm_satp(struct mm_struct *mm) {
+    int cpu = cpuid();
+    uint64 ctx, old;
+
+    // a full barrier : a flush that misses this bit sees the pte it changed
+    __sync_fetch_and_or(&mm->cpu_mask, 1UL << cpu);
+    if (asid_bits == 0)
+        return MAKE_SATP(mm->pagetable);
+
+    // fast path : an ASID of this generation, and no rollover since this hart ran it
+    ctx = READ_ONCE(mm->context_id);
+    old = READ_ONCE(active_asids[cpu]);
+    if (old != 0 && ((ctx ^ READ_ONCE(asid_generation)) >> asid_bits) == 0
+        && __sync_bool_compare_and_swap(&active_asids[cpu], old, ctx))
+        return MAKE_SATP_ASID(mm->pagetable, ASID(ctx));
+
+    acquire(&asid_lock);
+    ctx = mm->context_id;
+    if ((ctx ^ asid_generation) >> asid_bits) {
+        ctx = new_context(mm);
+        WRITE_ONCE(mm->context_id, ctx);
+    }
+    if (tlb_flush_pending & (1UL << cpu)) {
+        tlb_flush_pending &= ~(1UL << cpu);
+        sfence_vma();
+    }
+    WRITE_ONCE(active_asids[cpu], ctx);
+    release(&asid_lock);
+    return MAKE_SATP_ASID(mm->pagetable, ASID(ctx));
+}
+
+// flush [start, start + size) of mm from every hart that may cache it,
+// size -1 for all of mm
+static void __flush_tlb(struct mm_struct *mm, vaddr_t start, uint64 size) {
+    uint64 mask, asid;
+    int cpu;
+
+    // the pte stores before the read of cpu_mask, pairs with switch_mm_satp
+    __sync_synchronize();
+    if ((mask = READ_ONCE(mm->cpu_mask)) == 0)
+        return;
+
+    push_off();
+    cpu = cpuid();
+    mask &= ~(1UL << cpu);
+    if (asid_bits == 0) {
+        // this hart flushes all on the way back to user
+        if (mask)
+            sbi_remote_sfence_vma(mask, 0, start, size);
+    } else {
+        asid = ASID(READ_ONCE(mm->context_id));
+        if (size == -1) {
+            sfence_vma_asid(asid);
+        } else {
+            for (vaddr_t va = start; va < start + size; va += PGSIZE)
+                sfence_vma_page(va, asid);
+        }
+        if (mask)
+            sbi_remote_sfence_vma_asid(mask, 0, start, size, asid);
+    }
+    pop_off();
+}
+
+void flush_tlb_mm(struct mm_struct *mm) {
+    __flush_tlb(mm, 0, -1);
+}
+
+void flush_tlb_range(struct mm_struct *mm, vaddr_t start, vaddr_t end) {
+    start = PGROUNDDOWN(start);
+    end = PGROUNDUP(end);
+    if ((end - start) / PGSIZE > TLB_FLUSH_THRESHOLD)
+        __flush_tlb(mm, 0, -1);
+    else
+        __flush_tlb(mm, start, end - start);
+}
+
+void flush_tlb_page(struct mm_struct *mm, vaddr_t va) {
+    __flush_tlb(mm, PGROUNDDOWN(va), PGSIZE);
+}
+
+// va of mm gained permissions, only this hart may cache the old pte :
+// other harts fault on it and come here themselves
+void local_flush_tlb_page(struct mm_struct *mm, vaddr_t va) {
+    uint64 ctx = READ_ONCE(mm->context_id);
+
+    if (asid_bits != 0 && ctx != 0)
+        sfence_vma_page(PGROUNDDOWN(va), ASID(ctx));
+}
+
+void tlb_batch_init(struct tlb_batch *tlb, struct mm_struct *mm) {
+    tlb->mm = mm;
+    tlb->start = tlb->end = 0;
+    tlb->nr_pages = 0;
+}
+
+// [va, va + size) of tlb->mm changed, the range grows to cover it
+void tlb_batch_add(struct tlb_batch *tlb, vaddr_t va, uint64 size) {
+    if (tlb->start == tlb->end) {
+        tlb->start = va;
+        tlb->end = va + size;
+    } else {
+        tlb->start = MIN(tlb->start, va);
+        tlb->end = MAX(tlb->end, va + size);
+    }
+}
+
+// free pa once no hart can reach it, its mapping is in the range already
+void tlb_batch_free(struct tlb_batch *tlb, paddr_t pa) {
+    if (tlb->nr_pages == TLB_BATCH_PAGES)
+        tlb_batch_flush(tlb);
+    tlb->pages[tlb->nr_pages++] = pa;
+}
+
+void tlb_batch_flush(struct tlb_batch *tlb) {
+    if (tlb->start != tlb->end)
+        flush_tlb_range(tlb->mm, tlb->start, tlb->end);
+    tlb->start = tlb->end = 0;
+    for (int i = 0; i < tlb->nr_pages; i++)
+        kfree((void *)tlb->pages[i]);
+    tlb->nr_pages = 0;
+}
@@ -12,6 +12,8 @@
 #include "memory/buddy.h"
 #include "memory/pagefault.h"
 #include "kernel/cpu.h"
+#include "memory/tlbflush.h"
+#include "errno.h"
 #include "platform/hifive/uart_hifive.h"
 #include "platform/hifive/dma_hifive.h"
 
@@ -242,12 +244,31 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm,
     return 0;
 }
 
+// split the 2MB leaf *pde into 512 4KB ptes of the same memory,
+// each of them holds a reference of the block
+static int demote_superpage(pte_t *pde) {
+    paddr_t pa = PTE2PA(*pde);
+    uint64 flags = PTE_FLAGS(*pde);
+    struct page *head = compound_head(pa_to_page(pa));
+    pagetable_t table;
+
+    if ((table = (pagetable_t)kzalloc(PGSIZE)) == 0)
+        return -1;
+    for (int i = 0; i < PGSIZE / PTESIZE; i++)
+        table[i] = PA2PTE(pa + i * PGSIZE) | flags;
+    atomic_add_return(&head->refcnt, PGSIZE / PTESIZE - 1);
+    *pde = PA2PTE(table) | PTE_V;
+    return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. The mappings must exist.
 // Optionally free the physical memory.
 /* on_demand option: use for on-demand mapping, only unmap the mapping pages
                      and skip the unmapping pages */
-void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int on_demand) {
+/* tlb : gathers the ranges to flush and the pages to free after it, NULL
+         for a page table that no hart runs on */
+static void __uvmunmap(struct tlb_batch *tlb, pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int on_demand) {
     uint64 a;
     pte_t *pte;
 
@@ -277,23 +298,82 @@ void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int
 
         ASSERT(level <= 1);
 
-        if (do_free) {
-            uint64 pa = PTE2PA(*pte);
-            kfree((void *)pa);
+        if (level == SUPERPAGE && (a != SUPERPG_DOWN(a) || a + SUPERPGSIZE > endva)) {
+            // unmap part of a superpage, keep the rest
+            if (demote_superpage(pte) < 0)
+                panic("uvmunmap: demote");
+            a -= PGSIZE;
+            continue;
         }
-        uint64 pte_flags = PTE_FLAGS(*pte);
+
+        uint64 pa = PTE2PA(*pte);
         *pte = 0;
+        if (tlb != NULL)
+            tlb_batch_add(tlb, a, level == SUPERPAGE ? SUPERPGSIZE : PGSIZE);
+        if (do_free) {
+            if (tlb != NULL)
+                tlb_batch_free(tlb, pa);
+            else
+                kfree((void *)pa);
+        }
 
         if (level == SUPERPAGE) {
-            if (a != SUPERPG_DOWN(a) && a == va) {
-                uvmalloc(pagetable, SUPERPG_DOWN(a), a, pte_flags);
-                // vmprint(pagetable, 1, 0, 0, 0);
-            }
             a += (SUPERPGSIZE - PGSIZE);
         }
     }
 }
 
+// for a page table that no hart runs on : being built or torn down
+void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int on_demand) {
+    __uvmunmap(NULL, pagetable, va, npages, do_free, on_demand);
+}
+
+// uvmunmap for the page table of a live mm, the harts running mm
+// drop the mappings before the pages are freed
+void mm_unmap(struct mm_struct *mm, uint64 va, uint64 npages, int do_free, int on_demand) {
+    struct tlb_batch tlb;
+
+    tlb_batch_init(&tlb, mm);
+    __uvmunmap(&tlb, mm->pagetable, va, npages, do_free, on_demand);
+    tlb_batch_flush(&tlb);
+}
+
+// take the permissions pte_perm lacks from the mapped pages of
+// [va, va + npages * PGSIZE), for mprotect. W without R is reserved, so
+// W goes with R. a last level pte left with none of R, W, X faults on any
+// access, a superpage is split first, as it would point to a table then.
+// pagefault() gives them back when the vma allows it again
+void uvmprotect(struct mm_struct *mm, uint64 va, uint64 npages, int pte_perm) {
+    uint64 clear = (PTE_R | PTE_W | PTE_X) & ~pte_perm;
+    uint64 endva = va + npages * PGSIZE;
+    struct tlb_batch tlb;
+    pte_t *pte;
+
+    if (clear & PTE_R)
+        clear |= PTE_W;
+    if (clear == 0)
+        return;
+    tlb_batch_init(&tlb, mm);
+    for (uint64 a = va; a < endva; a += PGSIZE) {
+        int level = walk(mm->pagetable, a, 0, 0, &pte);
+        if (pte == NULL || (*pte & PTE_V) == 0 || (*pte & clear) == 0)
+            continue;
+        if (level == SUPERPAGE && (a != SUPERPG_DOWN(a) || a + SUPERPGSIZE > endva
+                                   || (*pte & (PTE_R | PTE_X) & ~clear) == 0)) {
+            // a part of the superpage only, or no leaf is left
+            if (demote_superpage(pte) < 0)
+                panic("uvmprotect: demote");
+            a -= PGSIZE;
+            continue;
+        }
+        *pte &= ~clear;
+        tlb_batch_add(&tlb, a, level == SUPERPAGE ? SUPERPGSIZE : PGSIZE);
+        if (level == SUPERPAGE)
+            a += SUPERPGSIZE - PGSIZE;
+    }
+    tlb_batch_flush(&tlb);
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t uvmcreate() {
@@ -420,94 +500,93 @@ void uvmfree(struct mm_struct *mm) {
     freewalk(mm->pagetable, 0);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// mark a user pte of parent copy-on-write, unless it is a MAP_SHARED file page
+static inline pte_t cow_pte(struct vma *vma, pte_t *pte) {
+    if (vma->type != VMA_FILE || !(vma->perm & PERM_SHARED)) {
+        if ((*pte & PTE_W) == 0 && (*pte & PTE_SHARE) == 0) {
+            *pte = *pte | PTE_READONLY;
+        }
+        *pte = *pte | PTE_SHARE;
+        *pte = *pte & ~PTE_W;
+    }
+    return *pte;
+}
+
+// Given a parent process's page table, share
+// its memory with a child's page table (copy-on-write),
+// the stack included.
+// Walks the page table instead of every page of vmas :
+// holes of 1GB / 2MB are skipped at once, and the leaf
+// ptes of a 2MB window are copied into one child table.
 // returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
 int uvmcopy(struct mm_struct *srcmm, struct mm_struct *dstmm) {
     struct vma *pos;
     list_for_each_entry(pos, &srcmm->head_vma, node) {
-        vaddr_t startva, endva;
+        vaddr_t va, endva, winend;
+        pte_t *pde, *dpde;
+        pagetable_t src0, dst0;
         paddr_t pa;
-        pte_t *pte;
-        uint flags;
         int level;
 
-        /* for STACK VMA, copy both the pagetable and the physical memory */
-        if (pos->type == VMA_STACK) {
-            // ASSERT(pos->size == USTACK_PAGE * PGSIZE);
-            // Log("stack size is %d", pos->size / PGSIZE);
-            for (uint64 offset = 0; offset < pos->size; offset += PGSIZE) {
-                level = walk(srcmm->pagetable, pos->startva + offset, 0, 0, &pte);
-                // ASSERT(level <= 1 && level >= 0);
-                if (!(level <= 1 && level >= 0)) {
-                    panic("uvmcopy : level error\n");
-                }
-                pa = PTE2PA(*pte);
-
-                paddr_t new = (paddr_t)kzalloc(PGSIZE);
-                if (new == 0) {
-                    Warn("uvmcopy: no free mem");
-                    return -1;
-                }
-                memmove((void *)new, (void *)pa, PGSIZE);
-                if (mappages(dstmm->pagetable, pos->startva + offset, PGSIZE, new, PTE_W | PTE_R | PTE_U, COMMONPAGE) != 0) {
-                    panic("uvmcopy: map failed");
-                    return -1;
-                }
-                // Log("stack %p", pos->startva + offset);
-            }
-            continue;
-        }
-
-        /* for other vmas, copy pagetable only */
-        startva = pos->startva;
-        endva = startva + pos->size;
-        ASSERT(startva % PGSIZE == 0 && endva % PGSIZE == 0);
-        for (vaddr_t i = startva; i < endva; i += PGSIZE) {
-            level = walk(srcmm->pagetable, i, 0, 0, &pte);
-            if (pte == NULL || *pte == 0) {
+        va = pos->startva;
+        endva = va + pos->size;
+        ASSERT(va % PGSIZE == 0 && endva % PGSIZE == 0);
+        while (va < endva) {
+            winend = MIN(SUPERPG_DOWN(va) + SUPERPGSIZE, endva);
+            level = walk(srcmm->pagetable, va, 0, 1, &pde);
+            if (pde == NULL) {
+                // no page table for this 1GB
+                va = MIN((va | ((1L << PNSHIFT(2)) - 1)) + 1, endva);
                 continue;
             }
-            if (!(level <= 1 && level >= 0)) {
-                panic("uvmcopy : level error\n");
+            if ((*pde & PTE_V) == 0) {
+                va = winend;
+                continue;
             }
 
-            if (pos->type != VMA_FILE || !(pos->perm & PERM_SHARED)) {
-                // if (pos->type != VMA_FILE) {
-                if ((*pte & PTE_W) == 0 && (*pte & PTE_SHARE) == 0) {
-                    *pte = *pte | PTE_READONLY;
-                }
-                /* shared page */
-                if ((*pte & PTE_W) == 0 && (*pte & PTE_READONLY) != 0) {
-                    *pte = *pte | PTE_READONLY;
+            if (*pde & (PTE_R | PTE_X)) {
+                /* level == 1 ~ map superpage */
+                ASSERT(level == 1 && va == SUPERPG_DOWN(va));
+                pa = PTE2PA(*pde);
+                if (mappages(dstmm->pagetable, va, SUPERPGSIZE, pa, PTE_FLAGS(cow_pte(pos, pde)), SUPERPAGE) != 0) {
+                    goto err;
                 }
-                *pte = *pte | PTE_SHARE;
-                *pte = *pte & ~PTE_W;
+                /* call share_page after mappages success! */
+                share_page(pa);
+                va = winend;
+                continue;
             }
 
-            pa = PTE2PA(*pte);
-            flags = PTE_FLAGS(*pte);
-
-            if (level == SUPERPAGE) {
-                /* level == 1 ~ map superpage */
-                ASSERT(i == SUPERPG_DOWN(i));
-                if (mappages(dstmm->pagetable, i, SUPERPGSIZE, pa, flags, SUPERPAGE) != 0) {
+            /* level == 0 ~ a table of common pages */
+            src0 = (pagetable_t)PTE2PA(*pde);
+            walk(dstmm->pagetable, va, 1, 1, &dpde);
+            if (dpde == NULL) {
+                goto err;
+            }
+            if ((*dpde & PTE_V) == 0) {
+                if ((dst0 = (pagetable_t)kzalloc(PGSIZE)) == 0) {
                     goto err;
                 }
-                i += (SUPERPGSIZE - PGSIZE);
-            } else if (level == COMMONPAGE) {
-                /* level == 0 ~ map common page */
-                if (mappages(dstmm->pagetable, i, PGSIZE, pa, flags, COMMONPAGE) != 0) {
-                    goto err;
+                *dpde = PA2PTE(dst0) | PTE_V;
+            }
+            ASSERT((*dpde & (PTE_R | PTE_X)) == 0);
+            dst0 = (pagetable_t)PTE2PA(*dpde);
+            for (; va < winend; va += PGSIZE) {
+                pte_t *pte = &src0[PN(0, va)];
+                if (*pte == 0) {
+                    continue;
+                }
+                if (dst0[PN(0, va)] & PTE_V) {
+                    panic("uvmcopy: remap");
                 }
+                dst0[PN(0, va)] = cow_pte(pos, pte);
+                share_page(PTE2PA(*pte));
             }
-            /* call share_page after mappages success! */
-            share_page(pa);
         }
     }
+    // the parent ptes are read-only now, other threads of it may still
+    // write through the old entries
+    flush_tlb_mm(srcmm);
     return 0;
 
 err:
@@ -527,75 +606,118 @@ void uvmclear(pagetable_t pagetable, uint64 va) {
     *pte &= ~PTE_U;
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
-    uint64 n, va0, pa0;
+// Translate the user address va for a copy, walking the page table once.
+// A missing page, or a store to a cow page, goes through pagefault() first,
+// as if the user itself touched it.
+// Return the physical address of va, and the bytes until the end of its leaf
+// page (4KB or 2MB) in *span. Return 0 if va is not accessible.
+static paddr_t uaccess_translate(pagetable_t pagetable, vaddr_t va, int write, uint64 *span) {
+    pte_t *pte;
+    int level;
 
-    while (len > 0) {
-        va0 = PGROUNDDOWN(dstva);
-        // kernel has the right to write all RAM without PAGE FAULT
-        // so need to check if this write is legal(PTE_W == 1 in PTE)
-        // if not, call pagefault
-        pte_t *pte;
-        int flags;
-        /* since walk will panic if va0 > maxva, so we have to handle this error before walk */
-        if (va0 >= MAXVA) {
-            return -1;
-        }
-        walk(pagetable, va0, 0, 0, &pte);
-        if (pte == NULL || (*pte == 0)) {
-            if (pagefault(STORE_PAGEFAULT, pagetable, dstva) < 0) {
-                return -1;
-            }
-        }
-        flags = PTE_FLAGS(*pte);
-        if ((flags & PTE_W) == 0 && is_a_cow_page(flags)) {
-            if (pagefault(STORE_PAGEFAULT, pagetable, dstva) < 0) {
-                return -1;
-            }
-        }
+    if (va >= MAXVA)
+        return 0;
+    for (int retry = 0;; retry++) {
+        level = walk(pagetable, va, 0, 0, &pte);
+        if (pte != NULL && (*pte & PTE_V) && (*pte & PTE_U) && (*pte & PTE_R) && (!write || (*pte & PTE_W)))
+            break;
+        // kernel has the right to write all RAM without PAGE FAULT,
+        // so check the permission of user here
+        if (retry || pagefault(write ? STORE_PAGEFAULT : LOAD_PAGEFAULT, pagetable, va) < 0)
+            return 0;
+    }
 
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
-            return -1;
-        n = PGSIZE - (dstva - va0);
-        if (n > len)
-            n = len;
-        memmove((void *)(pa0 + (dstva - va0)), src, n);
+    if (level == SUPERPAGE) {
+        *span = SUPERPGSIZE - (va - SUPERPG_DOWN(va));
+        return PTE2PA(*pte) + (va - SUPERPG_DOWN(va));
+    }
+    *span = PGSIZE - (va - PGROUNDDOWN(va));
+    return PTE2PA(*pte) + (va - PGROUNDDOWN(va));
+}
+
+// Copy len bytes between kernel address kaddr and user address uaddr,
+// one walk and one memmove for each leaf page.
+// Return the number of bytes not copied.
+static uint64 __copy_user(pagetable_t pagetable, char *kaddr, vaddr_t uaddr, uint64 len, int to_user) {
+    uint64 n, span;
+    paddr_t pa;
 
+    while (len > 0) {
+        if ((pa = uaccess_translate(pagetable, uaddr, to_user, &span)) == 0)
+            break;
+        n = MIN(span, len);
+        if (to_user)
+            memmove((void *)pa, kaddr, n);
+        else
+            memmove(kaddr, (void *)pa, n);
         len -= n;
-        src += n;
-        dstva = va0 + PGSIZE;
+        kaddr += n;
+        uaddr += n;
     }
-    return 0;
+    return len;
+}
+
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// Return 0 on success, -1 on error.
+int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
+    return __copy_user(pagetable, src, dstva, len, 1) == 0 ? 0 : -1;
 }
 
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
 int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
-    uint64 n, va0, pa0;
+    return __copy_user(pagetable, dst, srcva, len, 0) == 0 ? 0 : -1;
+}
 
-    while (len > 0) {
-        va0 = PGROUNDDOWN(srcva);
-        // if (va0 == 0x32407000) {
-        //     vmprint(pagetable, 1, 0, 0x32406000, 0);
-        // }
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
-            return -1;
-        n = PGSIZE - (srcva - va0);
-        if (n > len)
-            n = len;
-        memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+#define ONES (~0UL / 0xff)
+#define HIGHS (ONES * 0x80)
+#define HASZERO(x) (((x) - ONES) & ~(x) & HIGHS)
 
-        len -= n;
+// the length of the string at s, no more than max, a word at a time
+static uint64 strnlen_word(const char *s, uint64 max) {
+    const char *p = s;
+    const char *end = s + max;
+
+    while (p < end && ((uint64)p & (sizeof(uint64) - 1))) {
+        if (*p == '\0')
+            return p - s;
+        p++;
+    }
+    // an aligned word never crosses a page, it is safe to read all of it
+    while (p + sizeof(uint64) <= end && !HASZERO(*(const uint64 *)p))
+        p += sizeof(uint64);
+    while (p < end && *p != '\0')
+        p++;
+    return p - s;
+}
+
+// Copy a null-terminated string from user to kernel, no more than max bytes
+// including the '\0'. Scan a leaf page a word at a time, then copy it at once.
+// Return the length of the string, max if there is no '\0' in max bytes,
+// or -1 if it is not accessible.
+static long __strncpy_user(pagetable_t pagetable, char *dst, vaddr_t srcva, uint64 max) {
+    uint64 n, len, span;
+    long copied = 0;
+    paddr_t pa;
+
+    while (max > 0) {
+        if ((pa = uaccess_translate(pagetable, srcva, 0, &span)) == 0)
+            return -1;
+        n = MIN(span, max);
+        len = strnlen_word((const char *)pa, n);
+        if (len < n) {
+            memmove(dst, (void *)pa, len + 1);
+            return copied + len;
+        }
+        memmove(dst, (void *)pa, n);
+        copied += n;
         dst += n;
-        srcva = va0 + PGSIZE;
+        srcva += n;
+        max -= n;
     }
-    return 0;
+    return copied;
 }
 
 // Copy a null-terminated string from user to kernel.
@@ -603,40 +725,45 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
 // until a '\0', or max.
 // Return 0 on success, -1 on error.
 int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
-    uint64 n, va0, pa0;
-    int got_null = 0;
+    long len = __strncpy_user(pagetable, dst, srcva, max);
+    return len < 0 || len == max ? -1 : 0;
+}
 
-    while (got_null == 0 && max > 0) {
-        va0 = PGROUNDDOWN(srcva);
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
-            return -1;
-        n = PGSIZE - (srcva - va0);
-        if (n > max)
-            n = max;
-
-        char *p = (char *)(pa0 + (srcva - va0));
-        while (n > 0) {
-            if (*p == '\0') {
-                *dst = '\0';
-                got_null = 1;
-                break;
-            } else {
-                *dst = *p;
-            }
-            --n;
-            --max;
-            p++;
-            dst++;
-        }
+// uaccess of the current process, with the return values of linux
 
-        srcva = va0 + PGSIZE;
-    }
-    if (got_null) {
-        return 0;
-    } else {
-        return -1;
-    }
+// Return the number of bytes not copied.
+uint64 copy_to_user(uint64 dstva, const void *src, uint64 len) {
+    if (dstva >= MAXVA || dstva + len > MAXVA || dstva + len < dstva)
+        return len;
+    return __copy_user(proc_current()->mm->pagetable, (char *)src, dstva, len, 1);
+}
+
+// Return the number of bytes not copied.
+uint64 copy_from_user(void *dst, uint64 srcva, uint64 len) {
+    uint64 left;
+
+    if (srcva >= MAXVA || srcva + len > MAXVA || srcva + len < srcva)
+        left = len;
+    else
+        left = __copy_user(proc_current()->mm->pagetable, dst, srcva, len, 0);
+    // never leave stale kernel data in dst
+    if (left)
+        memset((char *)dst + len - left, 0, left);
+    return left;
+}
+
+// The physical address of uaddr, faulting its page in, 0 if it is not accessible.
+// Nothing pins the page, another thread may unmap it.
+uint64 get_user_pa(uint64 uaddr, int write) {
+    uint64 span;
+    return uaccess_translate(proc_current()->mm->pagetable, uaddr, write, &span);
+}
+
+// Return the length of the string, max if it is too long (dst is not
+// terminated then), or -EFAULT.
+long strncpy_from_user(char *dst, uint64 srcva, uint64 max) {
+    long len = __strncpy_user(proc_current()->mm->pagetable, dst, srcva, max);
+    return len < 0 ? -EFAULT : len;
 }
 
 /* vpn ~ virtual page number */
@@ -695,6 +822,10 @@ void vmprint(pagetable_t pagetable, int isroot, int level, uint64 start, uint64
                         PTE("TRAMPOLINE");
                     } else if (curva == TRAPFRAME) {
                         PTE("TRAPFRAME0");
+                    } else if (curva == VDSO) {
+                        PTE("VDSO");
+                    } else if (curva == VVAR) {
+                        PTE("VVAR");
                     }
                     printf("\n");
                 }
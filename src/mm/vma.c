@@ -12,92 +12,134 @@
 #include "fs/fat/fat32_file.h"
 #include "fs/vfs/fs.h"
 #include "fs/vfs/ops.h"
+#include "memory/buddy.h"
+#include "memory/slab.h"
+#include "memory/filemap.h"
+#include "memory/tlbflush.h"
 
-struct vma vmas[NVMA];
-struct spinlock vmas_lock;
+/*
+ * The vmas of a mm are both in mm->head_vma, sorted by address, and in the
+ * red-black tree mm->mm_rb keyed by startva. Every node of the tree caches
+ * the largest hole before a vma in its subtree (rb_subtree_gap), so mmap
+ * finds a hole without walking all the vmas.
+ */
+static struct kmem_cache *vma_cachep;
 
 static struct vma *vma_map_range(struct mm_struct *mm, uint64 va, size_t len, uint64 perm, uint64 type);
 void vmas_init() {
-    initlock(&vmas_lock, "vmas_lock");
-    memset(vmas, 0, sizeof(vmas));
+    vma_cachep = kmem_cache_create("vma", sizeof(struct vma));
+    ASSERT(vma_cachep != NULL);
     Info("vma init [ok]\n");
 }
 
 static struct vma *alloc_vma(void) {
-    // 1. slab allocator
-    // 2. fine grained lock
-    acquire(&vmas_lock);
-    for (int i = 0; i < NVMA; i++) {
-        if (vmas[i].used == 0) {
-            vmas[i].used = 1;
-            release(&vmas_lock);
-            return &vmas[i];
-        }
-    }
-    release(&vmas_lock);
-    return 0;
+    return kmem_cache_zalloc(vma_cachep);
 }
 
 void free_vma(struct vma *vma) {
-    acquire(&vmas_lock);
-    vma->used = 0;
-    release(&vmas_lock);
+    if (vma->vm_file) {
+        generic_fileclose(vma->vm_file);
+        vma->vm_file = NULL;
+    }
+    kmem_cache_free(vma_cachep, vma);
 }
 
-/*
- * Returns 0 when no intersection detected.
- */
-static int check_vma_intersect(struct list_head *vma_head, struct vma *checked_vma) {
-    vaddr_t checked_start, start;
-    vaddr_t checked_end, end;
-    struct vma *pos;
+static inline struct vma *vma_prev(struct vma *vma) {
+    if (vma->node.prev == &vma->vm_mm->head_vma)
+        return NULL;
+    return list_entry(vma->node.prev, struct vma, node);
+}
 
-    checked_start = checked_vma->startva;
-    checked_end = checked_start + checked_vma->size - 1;
+static inline struct vma *vma_next(struct vma *vma) {
+    if (vma->node.next == &vma->vm_mm->head_vma)
+        return NULL;
+    return list_entry(vma->node.next, struct vma, node);
+}
+
+// the hole between vma and the vma before it
+static inline vaddr_t vma_gap(struct vma *vma) {
+    struct vma *prev = vma_prev(vma);
+    return prev ? vma->startva - (prev->startva + prev->size) : vma->startva;
+}
+
+static void vma_gap_augment(struct rb_node *rb) {
+    struct vma *vma = rb_entry(rb, struct vma, rb);
+    vaddr_t max = vma_gap(vma);
+    if (rb->rb_left)
+        max = MAX(max, rb_entry(rb->rb_left, struct vma, rb)->rb_subtree_gap);
+    if (rb->rb_right)
+        max = MAX(max, rb_entry(rb->rb_right, struct vma, rb)->rb_subtree_gap);
+    vma->rb_subtree_gap = max;
+}
 
-    list_for_each_entry(pos, vma_head, node) {
-        start = pos->startva;
-        end = pos->startva + pos->size;
-        if ((checked_start >= start && checked_start < end) || (checked_end >= start && checked_end < end)) {
-            return 1;
+static inline void vma_gap_update(struct vma *vma) {
+    rb_augment_path(&vma->rb, vma_gap_augment);
+}
+
+static int add_vma_to_vmspace(struct mm_struct *mm, struct vma *vma) {
+    struct rb_node **link = &mm->mm_rb.rb_node, *parent = NULL;
+    struct vma *pos, *prev = NULL, *next;
+
+    while (*link) {
+        parent = *link;
+        pos = rb_entry(parent, struct vma, rb);
+        if (vma->startva < pos->startva) {
+            link = &parent->rb_left;
+        } else {
+            prev = pos;
+            link = &parent->rb_right;
         }
     }
-    return 0;
-}
+    if (prev) {
+        next = vma_next(prev);
+    } else {
+        next = list_empty(&mm->head_vma) ? NULL : list_first_entry(&mm->head_vma, struct vma, node);
+    }
 
-static int add_vma_to_vmspace(struct list_head *head, struct vma *vma) {
-    // printfYELLOW("===============\n");
-    // print_vma(head);
-    if (check_vma_intersect(head, vma) != 0) {
-        // print_vma(head);
+    if ((prev && prev->startva + prev->size > vma->startva) || (next && vma->startva + vma->size > next->startva)) {
+        // print_vma(&mm->head_vma);
         Log("add_vma_to_vmspace: vma overlap\n");
         ASSERT(0);
         return -1;
     }
 
-    list_add(&vma->node, head);
+    vma->vm_mm = mm;
+    list_add(&vma->node, prev ? &prev->node : &mm->head_vma);
+    rb_link_node(&vma->rb, parent, link);
+    rb_insert_color(&vma->rb, &mm->mm_rb, vma_gap_augment);
+    // the hole before next is smaller now
+    if (next)
+        vma_gap_update(next);
     return 0;
 }
 
-static int is_vma_in_vmspace(struct list_head *vma_head, struct vma *vma) {
-    struct vma *pos;
-
-    list_for_each_entry(pos, vma_head, node) {
-        if (pos == vma) {
-            return 1;
-        }
-    }
-
-    return 0;
+void del_vma_from_vmspace(struct mm_struct *mm, struct vma *vma) {
+    struct vma *next;
+
+    ASSERT(vma->vm_mm == mm);
+    // before vma can be reused, stale the vmacache of all threads
+    mm->vmacache_seq++;
+    next = vma_next(vma);
+    list_del(&(vma->node));
+    rb_erase(&vma->rb, &mm->mm_rb, vma_gap_augment);
+    if (next)
+        vma_gap_update(next);
+    free_vma(vma);
 }
 
-void del_vma_from_vmspace(struct list_head *vma_head, struct vma *vma) {
-    if (is_vma_in_vmspace(vma_head, vma)) {
-        list_del(&(vma->node));
-    } else {
-        ASSERT(0);
+// move or resize vma in place, -1 if it would run into its neighbours
+int vma_adjust(struct vma *vma, vaddr_t start, size_t size) {
+    struct vma *prev = vma_prev(vma), *next = vma_next(vma);
+
+    if ((prev && prev->startva + prev->size > start) || (next && start + size > next->startva)) {
+        return -1;
     }
-    free_vma(vma);
+    vma->startva = start;
+    vma->size = size;
+    vma_gap_update(vma);
+    if (next)
+        vma_gap_update(next);
+    return 0;
 }
 
 void print_rawfile(struct file *f, int fd, int printdir);
@@ -150,8 +192,10 @@ static struct vma *vma_map_range(struct mm_struct *mm, uint64 va, size_t len, ui
     vma->size = PGROUNDUP(len);
     vma->perm = perm;
     vma->type = type;
+    vma->offset = 0;
+    vma->vm_file = NULL;
 
-    if (add_vma_to_vmspace(&mm->head_vma, vma) < 0) {
+    if (add_vma_to_vmspace(mm, vma) < 0) {
         goto free;
     }
     return vma;
@@ -166,12 +210,20 @@ static void writeback(pagetable_t pagetable, struct file *fp, vaddr_t start, siz
     ASSERT(fp != NULL);
 
     pte_t *pte;
+    struct inode *ip = fp->f_tp.f_inode;
     vaddr_t endva = start + len;
     for (vaddr_t addr = start; addr < endva; addr += PGSIZE) {
         walk(pagetable, addr, 0, 0, &pte);
         if (pte == NULL || (*pte & PTE_V) == 0) {
             continue;
         }
+        /* pages in page cache : pdflush writes them back, dirty them again if stored to */
+        struct page *page = pa_to_page(PTE2PA(*pte));
+        if (ip->i_mapping != NULL && page->mapping == ip->i_mapping) {
+            if (*pte & PTE_W)
+                filemap_set_page_dirty(ip, page->index);
+            continue;
+        }
         /* only writeback dirty pages(pages with PTE_D) */
         if (PTE_FLAGS(*pte) & PTE_D) {
             fat32_filewrite(fp, addr, (PGSIZE > (endva - addr) ? (endva - addr) : PGSIZE));
@@ -179,6 +231,42 @@ static void writeback(pagetable_t pagetable, struct file *fp, vaddr_t start, siz
     }
 }
 
+// msync : pages of MAP_SHARED mappings in [va, va + len) stored to since
+// they became writable are dirtied in page cache again, and made read-only,
+// so a store after pdflush cleans them faults in filemap_mkwrite once more
+int vmspace_msync(struct mm_struct *mm, vaddr_t va, size_t len) {
+    vaddr_t end = PGROUNDUP(va + len);
+    int changed = 0;
+    pte_t *pte;
+
+    if (va % PGSIZE != 0)
+        return -1;
+    for (vaddr_t addr = va; addr < end;) {
+        struct vma *vma = find_vma_for_va(mm, addr);
+        if (vma == NULL)
+            return -1;
+        vaddr_t vend = MIN(end, vma->startva + vma->size);
+        if (vma->type == VMA_FILE && (vma->perm & PERM_SHARED) && (vma->perm & PERM_WRITE)) {
+            struct inode *ip = vma->vm_file->f_tp.f_inode;
+            for (; addr < vend; addr += PGSIZE) {
+                walk(mm->pagetable, addr, 0, 0, &pte);
+                if (pte == NULL || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0)
+                    continue;
+                struct page *page = pa_to_page(PTE2PA(*pte));
+                if (ip->i_mapping == NULL || page->mapping != ip->i_mapping)
+                    continue;
+                filemap_set_page_dirty(ip, page->index);
+                *pte &= ~(PTE_W | PTE_D);
+                changed = 1;
+            }
+        }
+        addr = vend;
+    }
+    if (changed)
+        flush_tlb_range(mm, va, end);
+    return 0;
+}
+
 int vmspace_unmap(struct mm_struct *mm, vaddr_t va, size_t len) {
     struct vma *vma;
     vaddr_t start;
@@ -215,16 +303,16 @@ int vmspace_unmap(struct mm_struct *mm, vaddr_t va, size_t len) {
 
     if (size > len) {
         /* unmap part of the vma */
-        vma->startva += len;
-        vma->size -= len;
-        uvmunmap(mm->pagetable, start, PGROUNDUP(size) / PGSIZE, 1, 1);
+        vma_adjust(vma, vma->startva + len, vma->size - len);
+        vma->offset += len;
+        mm_unmap(mm, start, PGROUNDUP(size) / PGSIZE, 1, 1);
         return 0;
     }
 
-    del_vma_from_vmspace(&mm->head_vma, vma);
+    del_vma_from_vmspace(mm, vma);
 
     // Note: non-leaf pte still not recycle
-    uvmunmap(mm->pagetable, start, PGROUNDUP(size) / PGSIZE, 1, 1);
+    mm_unmap(mm, start, PGROUNDUP(size) / PGSIZE, 1, 1);
 
     if (size < len) {
         // print_vma(&mm->head_vma);
@@ -235,34 +323,104 @@ int vmspace_unmap(struct mm_struct *mm, vaddr_t va, size_t len) {
     return 0;
 }
 
+// the vmacache of a thread holds vmas of one mm at a time, seq tells which
+static struct vma *vmacache_find(struct tcb *t, struct mm_struct *mm, vaddr_t addr) {
+    if (t->vmacache_seq != mm->vmacache_seq)
+        return NULL;
+    for (int i = 0; i < VMACACHE_SIZE; i++) {
+        struct vma *vma = t->vmacache[i];
+        if (vma && addr >= vma->startva && addr < vma->startva + vma->size)
+            return vma;
+    }
+    return NULL;
+}
+
+static void vmacache_update(struct tcb *t, uint64 seq, vaddr_t addr, struct vma *vma) {
+    if (t->vmacache_seq != seq) {
+        memset(t->vmacache, 0, sizeof(t->vmacache));
+        t->vmacache_seq = seq;
+    }
+    t->vmacache[VMACACHE_HASH(addr)] = vma;
+}
+
 struct vma *find_vma_for_va(struct mm_struct *mm, vaddr_t addr) {
-    struct vma *pos;
-    vaddr_t start, end;
-    list_for_each_entry(pos, &mm->head_vma, node) {
-        start = pos->startva;
-        end = pos->startva + pos->size;
-        if (addr >= start && addr < end) {
-            return pos;
+    struct tcb *t = thread_current();
+    struct rb_node *rb;
+    struct vma *vma;
+    uint64 seq = mm->vmacache_seq;
+
+    if (t && (vma = vmacache_find(t, mm, addr)) != NULL) {
+        return vma;
+    }
+
+    rb = mm->mm_rb.rb_node;
+    while (rb) {
+        vma = rb_entry(rb, struct vma, rb);
+        if (addr < vma->startva) {
+            rb = rb->rb_left;
+        } else if (addr >= vma->startva + vma->size) {
+            rb = rb->rb_right;
+        } else {
+            if (t)
+                vmacache_update(t, seq, addr, vma);
+            return vma;
         }
     }
     return NULL;
 }
 
+// the first vma that ends above addr
+struct vma *find_vma_from(struct mm_struct *mm, vaddr_t addr) {
+    struct rb_node *rb = mm->mm_rb.rb_node;
+    struct vma *vma, *found = NULL;
+
+    while (rb) {
+        vma = rb_entry(rb, struct vma, rb);
+        if (addr < vma->startva + vma->size) {
+            found = vma;
+            if (addr >= vma->startva)
+                break;
+            rb = rb->rb_left;
+        } else {
+            rb = rb->rb_right;
+        }
+    }
+    return found;
+}
+
+// the lowest vma in the subtree with a hole of size bytes before it, above low
+static struct vma *find_gap(struct rb_node *rb, size_t size, vaddr_t low) {
+    struct vma *vma, *found;
+    vaddr_t gap_start;
+
+    if (rb == NULL)
+        return NULL;
+    vma = rb_entry(rb, struct vma, rb);
+    if (vma->rb_subtree_gap < size)
+        return NULL;
+    // the holes on the left all end below vma
+    if (vma->startva > low && (found = find_gap(rb->rb_left, size, low)) != NULL)
+        return found;
+    gap_start = MAX(vma->startva - vma_gap(vma), low);
+    if (vma->startva > gap_start && vma->startva - gap_start >= size)
+        return vma;
+    return find_gap(rb->rb_right, size, low);
+}
+
 #define MMAP_START 0x30000000
+// the lowest hole above MMAP_START, -ENOMEM if none is large enough.
+// the last vma is the stack, pages above it (VVAR) are not in any vma
 vaddr_t find_mapping_space(struct mm_struct *mm, vaddr_t start, size_t size) {
-    struct vma *pos;
-    vaddr_t max = MMAP_START;
-    list_for_each_entry(pos, &mm->head_vma, node) {
-        if (pos->type == VMA_INTERP) {
-            continue;
-        }
-        if (pos->type == VMA_STACK) {
-            continue;
-        }
-        vaddr_t endva = pos->startva + pos->size;
-        if (max < endva) {
-            max = endva;
-        }
+    struct vma *vma;
+    vaddr_t max;
+
+    size = PGROUNDUP(MAX(size, PGSIZE));
+    if ((vma = find_gap(mm->mm_rb.rb_node, size, MMAP_START)) != NULL) {
+        max = MAX(vma->startva - vma_gap(vma), MMAP_START);
+    } else if (list_empty(&mm->head_vma)) {
+        max = MMAP_START;
+    } else {
+        return -ENOMEM;
     }
     ASSERT(max % PGSIZE == 0);
 
@@ -331,7 +489,7 @@ void print_vma(struct list_head *head_vma) {
 int vmacopy(struct mm_struct *srcmm, struct mm_struct *dstmm) {
     struct vma *pos;
     list_for_each_entry(pos, &srcmm->head_vma, node) {
-        if (pos->type == VMA_FILE) {
+        if (pos->vm_file != NULL) {
             // int vma_map_file(struct proc *p, uint64 va, size_t len, uint64 perm, uint64 type,
             //                  int fd, off_t offset, struct file *fp) {
             if (vma_map_file(dstmm, pos->startva, pos->size, pos->perm, pos->type,
@@ -361,7 +519,7 @@ void free_all_vmas(struct mm_struct *mm) {
         //     continue;
         // }
         if (pos_cur->type == VMA_HEAP && pos_cur->size == 0) {
-            del_vma_from_vmspace(&mm->head_vma, pos_cur);
+            del_vma_from_vmspace(mm, pos_cur);
             continue;
         }
         if (vmspace_unmap(mm, pos_cur->startva, pos_cur->size) < 0) {
@@ -388,14 +546,13 @@ int split_vma(struct mm_struct *mm, struct vma *vma, unsigned long addr, int new
     *new = *vma;
 
     if (new_below) {
-        vma->size = vma->startva + vma->size - addr;
-        vma->startva = addr;
+        vma_adjust(vma, addr, vma->startva + vma->size - addr);
         vma->offset += (addr - new->startva);
         new->size = addr - new->startva;
     } else {
         new->startva = addr;
         new->size = vma->startva + vma->size - addr;
-        vma->size = addr - vma->startva;
+        vma_adjust(vma, vma->startva, addr - vma->startva);
         new->offset += (addr - vma->startva);
     }
     // Log("%p %p", new->startva, new->startva + new->size);
@@ -404,7 +561,7 @@ int split_vma(struct mm_struct *mm, struct vma *vma, unsigned long addr, int new
     if (new->vm_file)
         fat32_filedup(new->vm_file);
 
-    if (add_vma_to_vmspace(&mm->head_vma, new) < 0) {
+    if (add_vma_to_vmspace(mm, new) < 0) {
         free_vma(new);
         Warn("split_vma: add_vma_to_vmspace failed");
         return -1;
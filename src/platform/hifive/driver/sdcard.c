@@ -4,6 +4,7 @@
 #include "driver/crc.h"
 #include "atomic/semaphore.h"
 #include "fs/bio.h"
+#include "fs/blk_queue.h"
 #include "debug.h"
 #include "memory/allocator.h"
 #include "memory/memlayout.h"
@@ -911,6 +912,19 @@ inline void disk_rw(void *bio_vec, int write, int type) {
     sdcard_disk_rw((struct bio_vec *)bio_vec, write);
 }
 
+// the sd card is driven by polling, so every request is done before we return
+int disk_submit(struct request *rq) {
+    struct bio_vec *vec_cur = NULL;
+    list_for_each_entry(vec_cur, &rq->vecs, rq_list) {
+        sdcard_disk_rw(vec_cur, rq->rw);
+    }
+    blk_end_request(rq);
+    return 0;
+}
+
+void disk_kick() {
+}
+
 void disk_init() {
     sdcard_disk_init();
 }
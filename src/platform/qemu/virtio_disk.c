@@ -13,6 +13,7 @@
 #include "atomic/spinlock.h"
 
 #include "fs/bio.h"
+#include "fs/blk_queue.h"
 #include "platform/qemu/virtio.h"
 #include "memory/allocator.h"
 #include "proc/pcb_life.h"
@@ -62,8 +63,7 @@ static struct disk {
     // for use when completion interrupt arrives.
     // indexed by first descriptor index of chain.
     struct {
-        struct buffer_head *b_old;
-        struct bio_vec *b_new;
+        struct request *rq;
         char status;
     } info[NUM];
 
@@ -183,11 +183,12 @@ free_chain(int i) {
     }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a disk transfer uses one descriptor for the header, one for
+// each data segment, and one for the status.
 static int
-alloc3_desc(int *idx) {
-    for (int i = 0; i < 3; i++) {
+alloc_n_desc(int *idx, int n) {
+    for (int i = 0; i < n; i++) {
         idx[i] = alloc_desc();
         if (idx[i] < 0) {
             for (int j = 0; j < i; j++)
@@ -198,91 +199,59 @@ alloc3_desc(int *idx) {
     return 0;
 }
 
-// b is a pointer to struct bio_vec
-void virtio_disk_rw(void *b, int write, int type) {
-    uint64 sector;
-    struct buffer_head *b_old = NULL;
-    struct bio_vec *b_new = NULL;
-    if (type == BLOCK_OLD) {
-        // we don't use this
-        b_old = (struct buffer_head *)b;
-        sector = b_old->blockno * (BSIZE / 512);
-    } else if (type == BLOCK_NEW) {
-        b_new = (struct bio_vec *)b;
-        sector = b_new->blockno_start * (BSIZE / 512);
-    } else {
-        panic("error\n");
-    }
-
-    acquire(&disk.vdisk_lock);
-    // the spec's Section 5.2 says that legacy block operations use
-    // three descriptors: one for type/reserved/sector, one for the
-    // data, one for a 1-byte status result.
-
-    // allocate the three descriptors.
-    int idx[3];
-    while (1) {
-        if (alloc3_desc(idx) == 0) {
-            break;
-        }
-        release(&disk.vdisk_lock);
-        sema_wait(&disk.sem_disk);
-        acquire(&disk.vdisk_lock);
-    }
-
-    // format the three descriptors.
+// queue one request, holding vdisk_lock.
+// the spec's Section 5.2 says that legacy block operations use
+// a descriptor for type/reserved/sector, descriptors for the
+// data, and a descriptor for a 1-byte status result.
+// the device does not look at it until we notify it.
+static int
+queue_request(struct request *rq) {
+    int idx[BLK_MAX_SEGMENTS + 2];
+    int n = rq->nr_vecs + 2;
+    ASSERT(rq->nr_vecs > 0 && rq->nr_vecs <= BLK_MAX_SEGMENTS);
+    if (alloc_n_desc(idx, n) != 0)
+        return -1;
+
+    // format the descriptors.
     // qemu's virtio-blk.c reads them.
-
     struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
-    if (write)
+    if (rq->rw == DISK_WRITE)
         buf0->type = VIRTIO_BLK_T_OUT; // write the disk
     else
         buf0->type = VIRTIO_BLK_T_IN; // read the disk
     buf0->reserved = 0;
-    buf0->sector = sector;
+    buf0->sector = (uint64)rq->blockno_start * (BSIZE / 512);
 
     disk.desc[idx[0]].addr = (uint64)buf0;
     disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
     disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
     disk.desc[idx[0]].next = idx[1];
 
-    if (type == BLOCK_OLD) {
-        // we don't use this
-        disk.desc[idx[1]].addr = (uint64)b_old->data;
-        disk.desc[idx[1]].len = BSIZE;
-    } else if (type == BLOCK_NEW) {
-        disk.desc[idx[1]].addr = (uint64)b_new->data;
-        disk.desc[idx[1]].len = BSIZE * (b_new->block_len);
-    } else {
-        panic("error\n");
+    // one data descriptor for each bio_vec
+    struct bio_vec *b = NULL;
+    int i = 1;
+    list_for_each_entry(b, &rq->vecs, rq_list) {
+        disk.desc[idx[i]].addr = (uint64)b->data;
+        disk.desc[idx[i]].len = BSIZE * b->block_len;
+        if (rq->rw == DISK_WRITE)
+            disk.desc[idx[i]].flags = 0; // device reads b->data
+        else
+            disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+        disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+        disk.desc[idx[i]].next = idx[i + 1];
+        b->disk = 1;
+        i++;
     }
 
-    if (write)
-        disk.desc[idx[1]].flags = 0; // device reads b->data
-    else
-        disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-    disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-    disk.desc[idx[1]].next = idx[2];
-
     disk.info[idx[0]].status = 0xff; // device writes 0 on success
-    disk.desc[idx[2]].addr = (uint64)&disk.info[idx[0]].status;
-    disk.desc[idx[2]].len = 1;
-    disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-    disk.desc[idx[2]].next = 0;
-
-    // record struct buffer_head for virtio_disk_intr().
+    disk.desc[idx[n - 1]].addr = (uint64)&disk.info[idx[0]].status;
+    disk.desc[idx[n - 1]].len = 1;
+    disk.desc[idx[n - 1]].flags = VRING_DESC_F_WRITE; // device writes the status
+    disk.desc[idx[n - 1]].next = 0;
 
-    if (type == BLOCK_OLD) {
-        // we don't use this
-        b_old->disk = 1;
-        disk.info[idx[0]].b_old = b_old;
-    } else if (type == BLOCK_NEW) {
-        b_new->disk = 1;
-        disk.info[idx[0]].b_new = b_new;
-    } else {
-        panic("error\n");
-    }
+    // record struct request for virtio_disk_intr().
+    disk.info[idx[0]].rq = rq;
 
     // tell the device the first index in our chain of descriptors.
     disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -293,36 +262,74 @@ void virtio_disk_rw(void *b, int write, int type) {
     disk.avail->idx += 1; // not % NUM ...
 
     __sync_synchronize();
+    return 0;
+}
+
+// queue a request without waiting, return -1 if the ring is full.
+// virtio_disk_intr() reports the completion by blk_end_request().
+int virtio_disk_submit(struct request *rq) {
+    acquire(&disk.vdisk_lock);
+    int ret = queue_request(rq);
+    release(&disk.vdisk_lock);
+    return ret;
+}
 
+// tell the device about the requests queued by virtio_disk_submit().
+void virtio_disk_kick(void) {
+    __sync_synchronize();
     *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
 
-    // Wait for virtio_disk_intr() to say request has finished.
+// b is a pointer to struct bio_vec
+// synchronous read/write, not through the request queue
+void virtio_disk_rw(void *b, int write, int type) {
+    struct request rq;
+    struct bio_vec *b_new = NULL;
+    struct buffer_head *b_old = NULL;
+    struct bio_vec vec_old;
 
     if (type == BLOCK_OLD) {
-        while (b_old->disk == 1) {
-            // we don't use this
-            release(&disk.vdisk_lock);
-            sema_wait(&b_old->sem_disk_done);
-            acquire(&disk.vdisk_lock);
-        }
-        disk.info[idx[0]].b_old = 0;
+        // we don't use this
+        b_old = (struct buffer_head *)b;
+        b_new = &vec_old;
+        sema_init(&b_new->sem_disk_done, 0, "bio_disk_done");
+        b_new->blockno_start = b_old->blockno;
+        b_new->block_len = 1;
+        b_new->data = b_old->data;
     } else if (type == BLOCK_NEW) {
-        while (b_new->disk == 1) {
-            release(&disk.vdisk_lock);
-            sema_wait(&b_new->sem_disk_done);
-            acquire(&disk.vdisk_lock);
-        }
-        disk.info[idx[0]].b_new = 0;
+        b_new = (struct bio_vec *)b;
     } else {
         panic("error\n");
     }
+    b_new->bi_end_io = NULL;
+    blk_rq_init(&rq, write);
+    blk_rq_add_vec(&rq, b_new);
 
-    free_chain(idx[0]);
+    acquire(&disk.vdisk_lock);
+    while (queue_request(&rq) != 0) {
+        release(&disk.vdisk_lock);
+        sema_wait(&disk.sem_disk);
+        acquire(&disk.vdisk_lock);
+    }
+    virtio_disk_kick();
+
+    // Wait for virtio_disk_intr() to say request has finished.
+    while (b_new->disk == 1) {
+        release(&disk.vdisk_lock);
+        sema_wait(&b_new->sem_disk_done);
+        acquire(&disk.vdisk_lock);
+    }
 
     release(&disk.vdisk_lock);
 }
 
 void virtio_disk_intr() {
+    // requests done in this interrupt, linked by rq->sort_list
+    struct list_head done;
+    struct request *rq = NULL;
+    struct request *rq_tmp = NULL;
+    INIT_LIST_HEAD(&done);
+
     acquire(&disk.vdisk_lock);
 
     // the device won't raise another interrupt until we tell it
@@ -345,29 +352,37 @@ void virtio_disk_intr() {
         if (disk.info[id].status != 0)
             panic("virtio_disk_intr status");
 
-        if (BLOCK_SEL == BLOCK_OLD) {
-            // we don't use this
-            struct buffer_head *b_old = disk.info[id].b_old;
-            b_old->disk = 0; // disk is done with buf
-            sema_signal(&b_old->sem_disk_done);
-        } else if (BLOCK_SEL == BLOCK_NEW) {
-            struct bio_vec *b_new = disk.info[id].b_new;
-            b_new->disk = 0; // disk is done with buf
-            sema_signal(&b_new->sem_disk_done);
-        } else {
-            panic("error\n");
-        }
+        rq = disk.info[id].rq;
+        ASSERT(rq != NULL);
+        disk.info[id].rq = NULL;
+        // the chain can be reused by the waiters of sem_disk now
+        free_chain(id);
+        list_add_tail(&rq->sort_list, &done);
 
         disk.used_idx += 1;
     }
 
     release(&disk.vdisk_lock);
+
+    // blk_end_request may dispatch more requests to us
+    list_for_each_entry_safe(rq, rq_tmp, &done, sort_list) {
+        list_del_reinit(&rq->sort_list);
+        blk_end_request(rq);
+    }
 }
 
 inline void disk_rw(void *b, int write, int type) {
     virtio_disk_rw(b, write, type);
 }
 
+inline int disk_submit(struct request *rq) {
+    return virtio_disk_submit(rq);
+}
+
+inline void disk_kick() {
+    virtio_disk_kick();
+}
+
 inline void disk_intr() {
     virtio_disk_intr();
 }
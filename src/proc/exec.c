@@ -17,12 +17,15 @@
 #include "memory/vma.h"
 #include "lib/elf.h"
 #include "memory/binfmt.h"
+#include "fs/fcntl.h"
+#include "fs/fdtable.h"
 
 static int map_interpreter(struct mm_struct *mm);
 static int load_elf_interp(char *path);
 static Elf64_Ehdr *load_elf_ehdr(struct binprm *bprm);
 static Elf64_Phdr *load_elf_phdrs(const Elf64_Ehdr *elf_ex, struct inode *ip);
 static int load_program(struct binprm *bprm, Elf64_Phdr *elf_phdata);
+static int map_segment(struct binprm *bprm, Elf64_Phdr *elf_phpnt, uint64 done);
 static uint64 START = 0;
 
 struct interpreter ldso;
@@ -99,6 +102,8 @@ static int load_elf_interp(char *path) {
     Elf64_Phdr *elf_phdata; /* ph poiner */
     struct inode *ip = NULL;
 
+    /* map_interpreter copies every pte of ldso, load it eagerly */
+    memset(&bprm, 0, sizeof(bprm));
     struct mm_struct *mm;
     mm = ldso.mm = bprm.mm = alloc_mm();
     if (mm == NULL) {
@@ -336,6 +341,9 @@ static int ustack_init(struct proc *p, pagetable_t pagetable, struct binprm *bpr
     // uint64 random[2] = {0xea0dad5a44586952, 0x5a1fa5497a4a283d};
     // memmove((void *)&auxv[AT_RANDOM * 2 - 1], random, 16);
     auxv[AT_RANDOM * 2 - 1] = SPP2SP;
+    // the entry after AT_RANDOM is free
+    auxv[AT_RANDOM * 2] = AT_SYSINFO_EHDR;
+    auxv[AT_RANDOM * 2 + 1] = VDSO;
 
     // char *s = "RISC-V64";
     // memmove((void *)&auxv[AT_PLATFORM * 2 - 1], (void *)s, sizeof(s));
@@ -473,6 +481,62 @@ out:
     return NULL;
 }
 
+/*
+ * Map the rest of a PT_LOAD segment after its misaligned head page (done = bytes loaded):
+ * the whole file pages fault in from page cache (text is shared, data is cow),
+ * the partial last file page is loaded now, and the bss is left to anonymous faults.
+ * the partial page is in the anonymous vma too : faulted in again, e.g. after munmap,
+ * it must be zeros, not the bytes of the file after p_filesz.
+ * p_offset and p_vaddr must be congruent modulo PGSIZE.
+ */
+static int map_segment(struct binprm *bprm, Elf64_Phdr *elf_phpnt, uint64 done) {
+    struct mm_struct *mm = bprm->mm;
+    struct inode *ip = bprm->ip;
+    int perm = flags2vmaperm(elf_phpnt->p_flags);
+    vaddr_t vaddrdown = PGROUNDDOWN(elf_phpnt->p_vaddr);
+    vaddr_t fileend = elf_phpnt->p_vaddr + elf_phpnt->p_filesz;
+    vaddr_t filedown = PGROUNDDOWN(fileend); // the end of the whole file pages
+    vaddr_t vaddrup = PGROUNDUP(elf_phpnt->p_vaddr + elf_phpnt->p_memsz);
+
+    if (filedown >= elf_phpnt->p_vaddr + done && fileend % PGSIZE != 0) {
+        // file and bss share the last page, it must not be the page cache page
+        vaddr_t va = filedown;
+        paddr_t pa = (paddr_t)kzalloc(PGSIZE);
+        if (pa == 0)
+            return -1;
+        if (mappages(mm->pagetable, va, PGSIZE, pa, flags2perm(elf_phpnt->p_flags) | PTE_U, COMMONPAGE) < 0) {
+            kfree((void *)pa);
+            return -1;
+        }
+        uint64 n = fileend - va;
+        if (ip->i_op->iread(ip, 0, pa, elf_phpnt->p_offset + (va - elf_phpnt->p_vaddr), n) != n)
+            return -1;
+    }
+
+    if (filedown > vaddrdown) {
+        struct file *f = filealloc(FAT32);
+        if (f == NULL)
+            return -1;
+        f->f_type = FD_INODE;
+        f->f_tp.f_inode = ip->i_op->idup(ip);
+        f->f_flags = O_RDONLY;
+        f->f_pos = 0;
+        int ret = vma_map_file(mm, vaddrdown, filedown - vaddrdown, perm, VMA_TEXT,
+                               PGROUNDDOWN(elf_phpnt->p_offset), f);
+        // the vma holds its own reference
+        generic_fileclose(f);
+        if (ret < 0)
+            return -1;
+    }
+
+    // the partial last file page, if any, and the bss
+    if (vaddrup > filedown) {
+        if (vma_map(mm, filedown, vaddrup - filedown, perm, VMA_TEXT) < 0)
+            return -1;
+    }
+    return 0;
+}
+
 /* support misaligned va load */
 static int load_program(struct binprm *bprm, Elf64_Phdr *elf_phdata) {
     Elf64_Ehdr *elf_ex = bprm->elf_ex;
@@ -498,7 +562,7 @@ static int load_program(struct binprm *bprm, Elf64_Phdr *elf_phdata) {
         vaddr_t vaddrdown = PGROUNDDOWN(elf_phpnt->p_vaddr);
         if (elf_phpnt->p_vaddr % PGSIZE != 0) {
             // Warn("%p", vaddrdown);
-            paddr_t pa = (paddr_t)kmalloc(PGSIZE);
+            paddr_t pa = (paddr_t)kzalloc(PGSIZE);
 #ifdef __DEBUG_LDSO__
             if (mappages(mm->pagetable, START + vaddrdown, PGSIZE, pa, flags2perm(elf_phpnt->p_flags) | PTE_U, COMMONPAGE) < 0) {
 #else
@@ -510,15 +574,23 @@ static int load_program(struct binprm *bprm, Elf64_Phdr *elf_phdata) {
             }
             offset = elf_phpnt->p_vaddr - vaddrdown;
             size = PGROUNDUP(elf_phpnt->p_vaddr) - elf_phpnt->p_vaddr;
-            if (ip->i_op->iread(ip, 0, (uint64)pa + offset, elf_phpnt->p_offset, size) != size) {
+            uint64 n = MIN(size, elf_phpnt->p_filesz);
+            if (ip->i_op->iread(ip, 0, (uint64)pa + offset, elf_phpnt->p_offset, n) != n) {
                 return -1;
             }
             // Log("entry is %p", elf.entry);
         } else {
             ASSERT(vaddrdown == elf_phpnt->p_vaddr);
         }
-        uint64 sz1;
         ASSERT((elf_phpnt->p_vaddr + size) % PGSIZE == 0);
+        if (bprm->demand && elf_phpnt->p_offset % PGSIZE == elf_phpnt->p_vaddr % PGSIZE) {
+            if (map_segment(bprm, elf_phpnt, size) < 0)
+                return -1;
+            sz = elf_phpnt->p_vaddr + elf_phpnt->p_memsz;
+            goto next;
+        }
+
+        uint64 sz1;
         // Log("\nstart end:%p %p", ph.vaddr + size, ph.vaddr + ph.memsz);
 #ifdef __DEBUG_LDSO__
         if ((sz1 = uvmalloc(mm->pagetable, START + elf_phpnt->p_vaddr + size, START + elf_phpnt->p_vaddr + elf_phpnt->p_memsz, flags2perm(elf_phpnt->p_flags))) == 0)
@@ -545,6 +617,7 @@ static int load_program(struct binprm *bprm, Elf64_Phdr *elf_phdata) {
             return -1;
         }
 
+    next:;
         uint64 tmp;
         /*
          * Find the end of the file mapping for this phdr, and
@@ -602,6 +675,10 @@ static int load_elf_binary(struct binprm *bprm) {
         }
     }
 
+    bprm->demand = 1;
+#ifdef __DEBUG_LDSO__
+    bprm->demand = 0;
+#endif
     if (load_program(bprm, elf_phdata) < 0) {
         goto bad;
     }
@@ -726,12 +803,20 @@ int do_execve(char *path, struct binprm *bprm) {
     }
     // uvm_thread_trapframe(mm->pagetable, 0);
 
+    /* a vfork child gives the mm back to its parent */
+    vfork_release(p);
+    oldmm = p->mm;
+
     /* free the old pagetable */
     free_mm(oldmm, atomic_read(&p->tg->thread_cnt));
 
     /* commit new mm */
     p->mm = mm;
 
+    /* a table shared with CLONE_FILES is copied first */
+    if (fdtable_unshare(&p->files) == 0)
+        fdtable_close_on_exec(p->files);
+
     kfree(bprm->elf_ex);
 
     if (bprm->interp) {
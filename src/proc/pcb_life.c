@@ -7,6 +7,7 @@
 #include "memory/vm.h"
 #include "memory/vma.h"
 #include "memory/binfmt.h"
+#include "memory/tlbflush.h"
 #include "kernel/trap.h"
 #include "kernel/cpu.h"
 #include "proc/pcb_life.h"
@@ -14,11 +15,13 @@
 #include "proc/pcb_life.h"
 #include "proc/pcb_mm.h"
 #include "proc/pdflush.h"
+#include "memory/writeback.h"
 #include "proc/options.h"
 #include "ipc/signal.h"
 #include "fs/stat.h"
 #include "fs/vfs/fs.h"
 #include "fs/vfs/ops.h"
+#include "fs/fdtable.h"
 #include "fs/fat/fat32_file.h"
 #include "lib/hash.h"
 #include "lib/queue.h"
@@ -30,7 +33,7 @@
 #include "test.h"
 
 extern Queue_t unused_p_q, used_p_q, zombie_p_q;
-extern Queue_t unused_t_q, runnable_t_q, sleeping_t_q;
+extern Queue_t unused_t_q, sleeping_t_q;
 extern Queue_t *STATES[PCB_STATEMAX];
 extern struct tcb thread[NTCB];
 extern struct hash_table pid_map;
@@ -53,7 +56,6 @@ void proc_init(void) {
         p = proc + i;
         sprintf(proc_lock_name[i], "proc_%d", i);
         initlock(&p->lock, proc_lock_name[i]);
-        sema_init(&p->tlock, 1, "sem_ofile");
         p->state = PCB_UNUSED;
         Queue_push_back_atomic(&unused_p_q, p);
     }
@@ -118,6 +120,13 @@ struct proc *alloc_proc(void) {
         return 0;
     }
 
+    // open files
+    if ((p->files = fdtable_alloc()) == NULL) {
+        free_proc(p);
+        release(&p->lock);
+        return 0;
+    }
+
     // thread group (list head) sets to NULL
     if ((p->tg = (struct thread_group *)kalloc()) == 0) {
         free_proc(p);
@@ -147,7 +156,7 @@ struct proc *alloc_proc(void) {
     p->stime = 0;
 
     // bug!!!
-    INIT_LIST_HEAD(&p->real_timer.list);
+    timer_list_init(&p->real_timer);
 
     // bug!!!
     INIT_LIST_HEAD(&p->sysvshm.shm_clist);
@@ -159,6 +168,11 @@ struct proc *alloc_proc(void) {
     sema_init(&p->sem_wait_chan_parent, 0, "wait_parent");
     sema_init(&p->sem_wait_chan_self, 0, "wait_self");
 
+    // vfork
+    p->vfork = 0;
+    p->vfork_mm = NULL;
+    sema_init(&p->vfork_done, 0, "vfork_done");
+
     // map <pid, p>
     hash_insert(&pid_map, (void *)&(p->pid), (void *)p, 0); // not holding it
     return p;
@@ -190,6 +204,10 @@ void free_proc(struct proc *p) {
     // free_mm will write back, must release the lock of p?
     release(&p->lock); // bug for iozone
     free_mm(p->mm, p->tg->thread_idx);
+    // left by a failed clone, exit_process puts it otherwise
+    if (p->files)
+        fdtable_put(p->files);
+    p->files = NULL;
     acquire(&p->lock); // bug for iozone
 
     if (p->tg)
@@ -249,6 +267,9 @@ void userinit(void) {
 void init_ret(void) {
     extern struct _superblock fat32_sb;
     fat32_fs_mount(ROOTDEV, &fat32_sb); // initialize fat32 superblock obj and root inode obj.
+    // pdflush needs initproc, write back FAT and buffers in background from now on
+    pdflush_init();
+    page_writeback_timer_init();
     proc_current()->cwd = fat32_sb.root->i_op->idup(fat32_sb.root);
 #ifdef SUBMIT
     Info("======== submit-init return ========\n");
@@ -283,6 +304,40 @@ void thread_forkret(void) {
     thread_usertrapret();
 }
 
+// point the TRAPFRAME of mm to tf, the trapframe of thread 0
+static void vfork_set_trapframe(struct mm_struct *mm, struct trapframe *tf) {
+    pte_t *pte;
+    acquire(&mm->lock);
+    walk(mm->pagetable, TRAPFRAME, 0, 0, &pte);
+    ASSERT(pte != NULL && (*pte & PTE_V));
+    *pte = PA2PTE(tf) | PTE_FLAGS(*pte);
+    release(&mm->lock);
+    // the entry of the old trapframe is tagged with the same ASID
+    flush_tlb_page(mm, TRAPFRAME);
+}
+
+// vfork : the child borrows the mm of parent instead of copying it.
+// the parent is the only thread of its group and sleeps until the child
+// calls exec or exit, so the child can take over its TRAPFRAME slot.
+static void vfork_borrow_mm(struct proc *p, struct proc *np) {
+    np->vfork_mm = np->mm;
+    np->mm = p->mm;
+    vfork_set_trapframe(p->mm, np->tg->group_leader->trapframe);
+}
+
+// a vfork child is leaving the mm of parent (exec or exit), wake up the parent
+void vfork_release(struct proc *p) {
+    if (p->vfork_mm != NULL) {
+        vfork_set_trapframe(p->mm, p->parent->tg->group_leader->trapframe);
+        p->mm = p->vfork_mm;
+        p->vfork_mm = NULL;
+    }
+    if (p->vfork) {
+        p->vfork = 0;
+        sema_signal(&p->vfork_done);
+    }
+}
+
 int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid) {
     // printfGreen("clone start, mm: %d pages\n", get_free_mem()/4096);
     int pid;
@@ -316,6 +371,7 @@ int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid)
         }
         t = np->tg->group_leader; // !!!
     }
+    sched_fork(t, thread_current());
 
     // print_clone_flags(flags);
     // ==============create thread for proc=======================
@@ -370,19 +426,21 @@ int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid)
 
     // ==============create proc with group leader=======================
     acquire(&p->lock);
-    /* Copy vma */
-    // print_vma(&p->mm->head_vma);
-    if (vmacopy(p->mm, np->mm) < 0) {
-        free_proc(np);
-        release(&p->lock);
-        release(&np->lock);
-        return -1;
-    }
-
-    // Copy user memory from parent to child.
-    if (flags & CLONE_VM) {
-        np->mm->pagetable = p->mm->pagetable;
+    if ((flags & CLONE_VM) && (flags & CLONE_VFORK) && atomic_read(&p->tg->thread_cnt) == 1 && thread_current()->tidx == 0) {
+        // vfork fast path, nothing to copy
+        vfork_borrow_mm(p, np);
     } else {
+        /* Copy vma */
+        // print_vma(&p->mm->head_vma);
+        if (vmacopy(p->mm, np->mm) < 0) {
+            free_proc(np);
+            release(&p->lock);
+            release(&np->lock);
+            return -1;
+        }
+
+        // Copy user memory from parent to child (cow).
+        // two processes cannot share one page table (TRAPFRAME), so CLONE_VM is cow too
         if (uvmcopy(p->mm, np->mm) < 0) {
             free_proc(np);
             release(&p->lock);
@@ -396,14 +454,12 @@ int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid)
     release(&p->lock);
     // increment reference counts on open file descriptors.
     if (flags & CLONE_FILES) {
-    } else {
-        for (int i = 0; i < NOFILE; i++)
-            if (p->ofile[i])
-                // np->ofile[i] = fat32_filedup(p->ofile[i]);
-                np->ofile[i] = p->ofile[i]->f_op->dup(p->ofile[i]);
-        // else
-        //     break;// to speed up?
-        // TODO : clone a completely same fdtable   >> not necessary
+        fdtable_put(np->files);
+        np->files = fdtable_get(p->files);
+    } else if (fdtable_copy(np->files, p->files) < 0) {
+        free_proc(np);
+        release(&np->lock);
+        return -1;
     }
 
     // if (flags & CLONE_NEWIPC) {
@@ -428,11 +484,18 @@ int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid)
     printfRed("clone : %d -> %d\n", p->pid, np->pid); // debug
 #endif
 
+    if (flags & CLONE_VFORK)
+        np->vfork = 1;
+
     // printfGreen("clone end, mm: %d pages\n", get_free_mem()/4096);
     acquire(&t->lock);
     TCB_Q_changeState(t, TCB_RUNNABLE);
     release(&t->lock);
 
+    // the child runs in our mm, or the parent of vfork waits anyway
+    if (flags & CLONE_VFORK)
+        sema_wait(&np->vfork_done);
+
     return pid;
 }
 
@@ -441,14 +504,9 @@ int exit_process(int status) {
     if (p == initproc)
         panic("init exiting");
 
-    // private to proc, no need to acquire
-    for (int fd = 0; fd < NOFILE; fd++) {
-        if (p->ofile[fd]) {
-            struct file *f = p->ofile[fd];
-            generic_fileclose(f);
-            p->ofile[fd] = 0;
-        }
-    }
+    // the files are closed by the last proc sharing the table
+    fdtable_put(p->files);
+    p->files = NULL;
     fat32_inode_put(p->cwd);
     p->cwd = 0;
 
@@ -458,6 +516,9 @@ int exit_process(int status) {
     // Give any children to init.
     reparent(p);
 
+    // give the mm back to the parent of vfork
+    vfork_release(p);
+
     acquire(&p->lock);
     PCB_Q_changeState(p, PCB_ZOMBIE);
     p->exit_state = status << 8;
@@ -8,6 +8,7 @@
 #include "memory/vm.h"
 #include "debug.h"
 #include "proc/tcb_life.h"
+#include "kernel/vdso.h"
 #include "proc/pcb_mm.h"
 #include "memory/vma.h"
 
@@ -35,7 +36,7 @@ void tcb_mapstacks(pagetable_t kpgtbl) {
 }
 
 /* Create a user page table, with no user memory,
-   but with trampoline and sigreturn pages.
+   but with trampoline, sigreturn and vdso pages.
 */
 pagetable_t proc_pagetable() {
     pagetable_t pagetable;
@@ -61,6 +62,13 @@ pagetable_t proc_pagetable() {
         return 0;
     }
 
+    if (vdso_map(pagetable) < 0) {
+        uvmunmap(pagetable, SIGRETURN, 1, 0, 0);
+        uvmunmap(pagetable, TRAMPOLINE, 1, 0, 0);
+        freewalk(pagetable, 0);
+        return 0;
+    }
+
     return pagetable;
 }
 
@@ -72,6 +80,7 @@ void proc_freepagetable(struct mm_struct *mm, int thread_cnt) {
     // printfYELLOW("================");
     uvmunmap(mm->pagetable, TRAMPOLINE, 1, 0, 0);
     uvmunmap(mm->pagetable, SIGRETURN, 1, 0, 0);
+    vdso_unmap(mm->pagetable);
     uvmunmap(mm->pagetable, USTACK_GURAD_PAGE, 1, 0, 1);
     // vmprint(mm->pagetable, 1, 0, 0, 0);
     acquire(&mm->lock);
@@ -86,13 +95,12 @@ void proc_freepagetable(struct mm_struct *mm, int thread_cnt) {
 }
 
 // Grow or shrink user memory by n bytes.
+// Only the heap vma grows, pages are faulted in on the first touch.
 // Return 0 on success, -1 on failure.
 int growheap(int n) {
-    uint64 oldsz, newsz, sz;
+    uint64 oldsz, newsz;
     struct proc *p = proc_current();
     struct mm_struct *mm = p->mm;
-    // struct mm_struct *mm = proc_current()->mm;
-    sz = mm->brk;
     oldsz = mm->brk;
     newsz = mm->brk + n;
 
@@ -101,41 +109,19 @@ int growheap(int n) {
         do_exit(-1);
     }
 
-    if (n > 0) {
-        pte_t *pte;
-        int level = walk(mm->pagetable, oldsz, 0, 0, &pte);
-        if (pte == NULL && level != -1) {
-            panic("growheap: wrong");
-        }
-        ASSERT(level <= 1);
-        if (level == COMMONPAGE) {
-            if (PGROUNDUP(oldsz) >= newsz) {
-                mm->brk = newsz;
-                return 0;
-            }
-        } else if (level == SUPERPAGE) {
-            if (SUPERPG_ROUNDUP(oldsz) >= newsz) {
-                mm->brk = newsz;
-                return 0;
-            }
-        } else if (level != -1) {
-            panic("growheap: wrong level");
-        }
-
-        if ((sz = uvmalloc(mm->pagetable, oldsz, newsz, PTE_W | PTE_R)) == 0) {
+    if (mm->heapvma == NULL) {
+        if (vma_map(mm, mm->start_brk, newsz - mm->start_brk, PERM_READ | PERM_WRITE, VMA_HEAP) < 0) {
             return -1;
         }
-    } else if (n < 0) {
-        sz = uvmdealloc(mm->pagetable, oldsz, newsz);
     }
-
-    if (mm->heapvma == NULL) {
-        if (vma_map(mm, mm->start_brk, sz - mm->start_brk, PERM_READ | PERM_WRITE, VMA_HEAP) < 0) {
-            panic("TODO: ERROR HANDLER");
-        }
+    if (vma_adjust(mm->heapvma, mm->start_brk, PGROUNDUP(newsz) - mm->start_brk) < 0) {
+        // runs into a mapping above the heap
+        return -1;
     }
-    mm->brk = sz;
-    mm->heapvma->size = PGROUNDUP(sz) - mm->start_brk;
+    if (PGROUNDUP(newsz) < PGROUNDUP(oldsz)) {
+        mm_unmap(mm, PGROUNDUP(newsz), (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE, 1, 1);
+    }
+    mm->brk = newsz;
     // p->rlim[RLIMIT_STACK].rlim_cur = mm->heapvma->size;
     return 0;
 }
@@ -144,9 +130,8 @@ int growheap(int n) {
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
 int either_copyout(int user_dst, uint64 dst, void *src, uint64 len) {
-    struct proc *p = proc_current();
     if (user_dst) {
-        return copyout(p->mm->pagetable, dst, src, len);
+        return copy_to_user(dst, src, len) == 0 ? 0 : -1;
     } else {
         memmove((char *)dst, src, len);
         return 0;
@@ -157,9 +142,8 @@ int either_copyout(int user_dst, uint64 dst, void *src, uint64 len) {
 // depending on usr_src.
 // Returns 0 on success, -1 on error.
 int either_copyin(void *dst, int user_src, uint64 src, uint64 len) {
-    struct proc *p = proc_current();
     if (user_src) {
-        return copyin(p->mm->pagetable, dst, src, len);
+        return copy_from_user(dst, src, len) == 0 ? 0 : -1;
     } else {
         memmove(dst, (char *)src, len);
         return 0;
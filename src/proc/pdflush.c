@@ -100,6 +100,9 @@ static int __pdflush(struct pdflush_work *my_work) {
 static void pdflush(void) {
     // similar to thread_forkret
     release(&thread_current()->lock);
+    // write back is not latency sensitive
+    sched_setscheduler(thread_current(), SCHED_BATCH, 0);
+    sched_setnice(thread_current(), PDFLUSH_NICE);
     struct pdflush_work my_work;
     __pdflush(&my_work);
 }
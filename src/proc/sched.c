@@ -9,6 +9,7 @@
 #include "debug.h"
 #include "common.h"
 #include "lib/timer.h"
+#include "lib/sbi.h"
 
 Queue_t unused_p_q, used_p_q, zombie_p_q;
 Queue_t *STATES[PCB_STATEMAX] = {
@@ -16,16 +17,34 @@ Queue_t *STATES[PCB_STATEMAX] = {
     [PCB_USED] & used_p_q,
     [PCB_ZOMBIE] & zombie_p_q};
 
-Queue_t unused_t_q, used_t_q, runnable_t_q, sleeping_t_q, zombie_t_q;
+// runnable threads live in the run queue of each cpu (t_cpus[i].runq)
+Queue_t unused_t_q, used_t_q, sleeping_t_q, zombie_t_q;
 Queue_t *T_STATES[TCB_STATEMAX] = {
     [TCB_UNUSED] & unused_t_q,
     [TCB_USED] & used_t_q,
-    [TCB_RUNNABLE] & runnable_t_q,
     [TCB_SLEEPING] & sleeping_t_q};
+char runq_name[NCPU][30];
 
 extern struct proc proc[NPROC];
 extern struct tcb thread[NTCB];
 
+/*
+ * nice value to weight, a thread gets cpu time in proportion to its weight,
+ * every nice level differs by ~10% of cpu time (the same as Linux)
+ */
+static const int sched_prio_to_weight[NICE_WIDTH] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548, 7620, 6100, 4904, 3906,
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+    /*   0 */ 1024, 820, 655, 526, 423,
+    /*   5 */ 335, 272, 215, 172, 137,
+    /*  10 */ 110, 87, 70, 56, 45,
+    /*  15 */ 36, 29, 23, 18, 15,
+};
+#define NICE_0_LOAD 1024
+#define WEIGHT_IDLEPRIO 3
+
 void PCB_Q_ALL_INIT() {
     Queue_init(&unused_p_q, "PCB_UNUSED", PCB_STATE_QUEUE);
     Queue_init(&used_p_q, "PCB_USED", PCB_STATE_QUEUE);
@@ -35,8 +54,212 @@ void PCB_Q_ALL_INIT() {
 void TCB_Q_ALL_INIT() {
     Queue_init(&unused_t_q, "TCB_UNUSED", TCB_STATE_QUEUE);
     Queue_init(&used_t_q, "TCB_USED", TCB_STATE_QUEUE);
-    Queue_init(&runnable_t_q, "TCB_RUNNABLE", TCB_STATE_QUEUE);
     Queue_init(&sleeping_t_q, "TCB_SLEEPING", TCB_STATE_QUEUE);
+    for (int i = 0; i < NCPU; i++) {
+        struct run_queue *rq = &t_cpus[i].rq;
+        snprintf(runq_name[i], 30, "TCB_RUNNABLE_%d", i);
+        initlock(&rq->lock, runq_name[i]);
+        INIT_LIST_HEAD(&rq->rt_list);
+        INIT_LIST_HEAD(&rq->fair_list);
+        rq->nr_running = 0;
+        rq->min_vruntime = 0;
+    }
+}
+
+static inline int thread_weight(struct tcb *t) {
+    if (t->policy == SCHED_IDLE)
+        return WEIGHT_IDLEPRIO;
+    return sched_prio_to_weight[t->nice - MIN_NICE];
+}
+
+// scale real runtime to virtual runtime
+static inline uint64 calc_delta_fair(uint64 delta_ns, struct tcb *t) {
+    int weight = thread_weight(t);
+    if (weight == NICE_0_LOAD)
+        return delta_ns;
+    return delta_ns * NICE_0_LOAD / weight;
+}
+
+// charge the running thread for the time since it was scheduled in
+static void update_curr(struct tcb *t) {
+    uint64 now = rdtime();
+    uint64 delta_ns = TIME2NS(now - t->exec_start);
+    t->exec_start = now;
+    t->sum_exec_runtime += delta_ns;
+    if (fair_policy(t->policy))
+        t->vruntime += calc_delta_fair(delta_ns, t);
+}
+
+// the load of cpu : running thread and runnable threads
+static inline int cpu_load(int cpu) {
+    struct thread_cpu *c = &t_cpus[cpu];
+    return READ_ONCE(c->rq.nr_running) + (READ_ONCE(c->thread) != NULL);
+}
+
+// choose the run queue for a runnable thread
+// 1. never scheduled : the cpu with the lightest load
+// 2. prefer the cpu it ran on last time (cache hot), unless the waker's cpu is lighter
+static int select_task_cpu(struct tcb *t) {
+    push_off();
+    int this_cpu = cpuid();
+    pop_off();
+
+    int prev_cpu = t->last_cpu;
+    if (prev_cpu < 0) {
+        int target = this_cpu;
+        for (int i = 0; i < NCPU; i++) {
+            if (cpu_load(i) < cpu_load(target))
+                target = i;
+        }
+        return target;
+    }
+    if (prev_cpu == this_cpu || cpu_load(prev_cpu) <= cpu_load(this_cpu))
+        return prev_cpu;
+    return this_cpu;
+}
+
+// holding rq->lock
+static void __enqueue_thread(struct run_queue *rq, struct tcb *t) {
+    struct tcb *pos;
+    struct list_head *head;
+    if (rt_policy(t->policy)) {
+        // FIFO within the same priority
+        head = &rq->rt_list;
+        list_for_each_entry(pos, head, state_list) {
+            if (pos->rt_priority < t->rt_priority)
+                break;
+        }
+    } else {
+        head = &rq->fair_list;
+        list_for_each_entry(pos, head, state_list) {
+            if (pos->vruntime > t->vruntime)
+                break;
+        }
+    }
+    // insert before pos (or at the tail of head)
+    list_add_tail(&t->state_list, &pos->state_list);
+}
+
+// holding rq->lock, the next thread to run
+static struct tcb *__pick_next_thread(struct run_queue *rq) {
+    if (!list_empty(&rq->rt_list))
+        return list_first_entry(&rq->rt_list, struct tcb, state_list);
+    if (!list_empty(&rq->fair_list))
+        return list_first_entry(&rq->fair_list, struct tcb, state_list);
+    return NULL;
+}
+
+// wake cpu if it is sleeping in the idle loop
+static inline void kick_cpu(int cpu) {
+    // pairs with the barrier in cpu_idle, either it sees our thread or we see it idle
+    __sync_synchronize();
+    if (READ_ONCE(t_cpus[cpu].idle)) {
+        push_off();
+        if (cpu != cpuid())
+            sbi_send_ipi(1UL << cpu, 0);
+        pop_off();
+    }
+}
+
+// a thread was queued on cpu : wake cpu, or an idle cpu to steal it if cpu is busy
+static void kick_idle_cpu(int cpu) {
+    if (READ_ONCE(t_cpus[cpu].idle) || READ_ONCE(t_cpus[cpu].thread) == NULL) {
+        kick_cpu(cpu);
+        return;
+    }
+    for (int i = 0; i < NCPU; i++) {
+        if (i != cpu && READ_ONCE(t_cpus[i].idle)) {
+            kick_cpu(i);
+            return;
+        }
+    }
+}
+
+// join the run queue of cpu
+// wakeup : it was sleeping or it is a new thread
+static void runq_enqueue(struct tcb *t, int cpu, int wakeup) {
+    struct run_queue *rq = &t_cpus[cpu].rq;
+    acquire(&rq->lock);
+    if (fair_policy(t->policy)) {
+        if (t->last_cpu < 0) {
+            // new thread starts from the floor of this cpu
+            t->vruntime = rq->min_vruntime;
+        } else if (t->last_cpu != cpu) {
+            // migrate : keep the distance to min_vruntime
+            uint64 src_min = READ_ONCE(t_cpus[t->last_cpu].rq.min_vruntime);
+            t->vruntime = t->vruntime > src_min ? t->vruntime - src_min : 0;
+            t->vruntime += rq->min_vruntime;
+        }
+        if (wakeup) {
+            // a sleeper gets at most half of a latency period of credit
+            uint64 floor = rq->min_vruntime > SCHED_LATENCY_NS / 2 ? rq->min_vruntime - SCHED_LATENCY_NS / 2 : 0;
+            t->vruntime = MAX(t->vruntime, floor);
+        }
+    }
+    __enqueue_thread(rq, t);
+    t->rq_cpu = cpu;
+    rq->nr_running++;
+    release(&rq->lock);
+    kick_idle_cpu(cpu);
+}
+
+// leave the run queue, if it is still queued
+// return 1 if it was removed, 0 if a cpu has taken it already
+static int runq_dequeue(struct tcb *t) {
+    int cpu = READ_ONCE(t->rq_cpu), removed = 0;
+    if (cpu < 0)
+        return 0;
+    struct run_queue *rq = &t_cpus[cpu].rq;
+    acquire(&rq->lock);
+    // it may be stolen before we get the lock
+    if (t->rq_cpu == cpu) {
+        list_del_reinit(&t->state_list);
+        t->rq_cpu = -1;
+        rq->nr_running--;
+        removed = 1;
+    }
+    release(&rq->lock);
+    return removed;
+}
+
+// pop the next runnable thread of cpu
+static struct tcb *runq_pop(int cpu) {
+    struct run_queue *rq = &t_cpus[cpu].rq;
+    struct tcb *t;
+    acquire(&rq->lock);
+    if ((t = __pick_next_thread(rq)) != NULL) {
+        list_del_reinit(&t->state_list);
+        t->rq_cpu = -1;
+        rq->nr_running--;
+        if (fair_policy(t->policy))
+            rq->min_vruntime = MAX(rq->min_vruntime, t->vruntime);
+    }
+    release(&rq->lock);
+    return t;
+}
+
+// steal a runnable thread from the busiest cpu
+static struct tcb *runq_steal(int this_cpu) {
+    int busiest = -1;
+    int max_nr = 0;
+    for (int i = 0; i < NCPU; i++) {
+        int nr = READ_ONCE(t_cpus[i].rq.nr_running);
+        if (i != this_cpu && nr > max_nr) {
+            max_nr = nr;
+            busiest = i;
+        }
+    }
+    if (busiest < 0)
+        return NULL;
+
+    struct tcb *t = runq_pop(busiest);
+    if (t != NULL && fair_policy(t->policy)) {
+        // migrate : keep the distance to min_vruntime
+        struct run_queue *rq = &t_cpus[this_cpu].rq;
+        uint64 src_min = READ_ONCE(t_cpus[busiest].rq.min_vruntime);
+        t->vruntime = (t->vruntime > src_min ? t->vruntime - src_min : 0) + rq->min_vruntime;
+    }
+    return t;
 }
 
 void PCB_Q_changeState(struct proc *p, enum procstate state_new) {
@@ -54,12 +277,20 @@ void TCB_Q_changeState(struct tcb *t, enum thread_state state_new) {
     Queue_t *tcb_q_new = T_STATES[state_new];
     Queue_t *tcb_q_old = T_STATES[t->state];
 
-    if (t->state != TCB_RUNNING) {
+    if (t->state == TCB_RUNNABLE) {
+        runq_dequeue(t);
+    } else if (t->state != TCB_RUNNING) {
         Queue_remove_atomic(tcb_q_old, (void *)t);
     } else {
+        update_curr(t);
         Queue_remove((void *)t, TCB_STATE_QUEUE);
     }
-    Queue_push_back_atomic(tcb_q_new, (void *)t);
+
+    if (state_new == TCB_RUNNABLE) {
+        runq_enqueue(t, select_task_cpu(t), t->state != TCB_RUNNING);
+    } else {
+        Queue_push_back_atomic(tcb_q_new, (void *)t);
+    }
 
     // if (t->tid == 4 && state_new == TCB_SLEEPING) {
     //     printfGreen("4 ready\n");
@@ -82,11 +313,100 @@ void thread_yield(void) {
     release(&t->lock);
 }
 
+// should the running thread give up the cpu? (checked on clock interrupt)
+// 1. SCHED_FIFO : only for a real-time thread with higher priority
+// 2. SCHED_RR : also when its time slice is used up
+// 3. fair : for any real-time thread, or when it has run for its slice and
+//    a thread with smaller vruntime is waiting
+int thread_need_resched(void) {
+    struct tcb *t = thread_current();
+    if (t == NULL || t->state != TCB_RUNNING)
+        return 0;
+
+    push_off();
+    struct run_queue *rq = &t_mycpu()->rq;
+    pop_off();
+
+    int resched = 0;
+    uint64 ran_ns = TIME2NS(rdtime() - t->exec_start);
+    acquire(&rq->lock);
+    struct tcb *next = __pick_next_thread(rq);
+    if (next == NULL) {
+        resched = 0;
+    } else if (rt_policy(t->policy)) {
+        if (rt_policy(next->policy) && next->rt_priority > t->rt_priority)
+            resched = 1;
+        else if (t->policy == SCHED_RR && ran_ns >= SCHED_RR_TIMESLICE_NS)
+            resched = rt_policy(next->policy) && next->rt_priority == t->rt_priority;
+    } else if (rt_policy(next->policy)) {
+        resched = 1;
+    } else {
+        uint64 slice = MAX(SCHED_LATENCY_NS / (rq->nr_running + 1), SCHED_MIN_GRANULARITY_NS);
+        uint64 curr_vruntime = t->vruntime + calc_delta_fair(ran_ns, t);
+        resched = ran_ns >= slice && next->vruntime < curr_vruntime;
+    }
+    release(&rq->lock);
+
+    // SCHED_RR : a new slice, even if nobody is waiting
+    if (t->policy == SCHED_RR && ran_ns >= SCHED_RR_TIMESLICE_NS && !resched)
+        update_curr(t);
+    return resched;
+}
+
+// child inherits the scheduling attributes of parent
+void sched_fork(struct tcb *t, struct tcb *parent) {
+    t->policy = parent ? parent->policy : SCHED_NORMAL;
+    t->rt_priority = parent ? parent->rt_priority : 0;
+    t->nice = parent ? parent->nice : 0;
+    t->vruntime = 0;
+    t->sum_exec_runtime = 0;
+    t->exec_start = 0;
+}
+
+// change the policy of thread, requeue it if it is runnable
+// a thread popped by some cpu meanwhile is about to run, not requeued
+static void sched_change(struct tcb *t, int policy, int rt_priority, int nice) {
+    acquire(&t->lock);
+    int queued = t->state == TCB_RUNNABLE && runq_dequeue(t);
+    t->policy = policy;
+    t->rt_priority = rt_priority;
+    t->nice = nice;
+    if (queued)
+        runq_enqueue(t, select_task_cpu(t), 0);
+    release(&t->lock);
+}
+
+int sched_setscheduler(struct tcb *t, int policy, int rt_priority) {
+    if (rt_policy(policy)) {
+        if (rt_priority < MIN_RT_PRIO || rt_priority > MAX_RT_PRIO)
+            return -1;
+    } else if (fair_policy(policy)) {
+        if (rt_priority != 0)
+            return -1;
+    } else {
+        return -1;
+    }
+    sched_change(t, policy, rt_priority, t->nice);
+    return 0;
+}
+
+int sched_setnice(struct tcb *t, int nice) {
+    nice = MIN(MAX(nice, MIN_NICE), MAX_NICE);
+    sched_change(t, t->policy, t->rt_priority, nice);
+    return 0;
+}
+
 // holding lock
 void thread_wakeup(struct tcb *t) {
-    ASSERT(t->wait_chan_entry != NULL);
-    Queue_remove_atomic(t->wait_chan_entry, (void *)t);
     ASSERT(t->state == TCB_SLEEPING);
+    if (t->wait_chan_entry == NULL) {
+        // a futex waiter, it unlinks its futex_q under the bucket lock
+        // and returns -EINTR. none : being freed, see futex_exit
+        if (t->futex_q != NULL)
+            TCB_Q_changeState(t, TCB_RUNNABLE);
+        return;
+    }
+    Queue_remove_atomic(t->wait_chan_entry, (void *)t);
     t->wait_chan_entry = NULL;
     TCB_Q_changeState(t, TCB_RUNNABLE);
 }
@@ -99,7 +419,11 @@ void thread_wakeup_atomic(void *t) {
 #endif
 
     acquire(&thread->lock);
-    ASSERT(thread->wait_chan_entry != NULL);
+    if (thread->wait_chan_entry == NULL) {
+        // woken up by someone else before the timer fired
+        release(&thread->lock);
+        return;
+    }
     Queue_remove_atomic(thread->wait_chan_entry, (void *)thread);
     ASSERT(thread->state == TCB_SLEEPING);
     thread->wait_chan_entry = NULL;
@@ -107,7 +431,29 @@ void thread_wakeup_atomic(void *t) {
     release(&thread->lock);
 }
 
-// return the rest of expires of timer
+// the time_out of a sleep in thread_sched is over
+// a late call of a timer deleted already is for an earlier sleep, ignored
+static void thread_sleep_timeout(void *t) {
+    struct tcb *thread = (struct tcb *)t;
+
+    acquire(&thread->lock);
+    // clockintr zeros expires of a one-shot timer before calling us,
+    // a sleep_timer not fired yet is armed for a later sleep
+    if (thread->sleep_timer == NULL || thread->sleep_timer->expires != 0) {
+        release(&thread->lock);
+        return;
+    }
+    thread->sleep_timer = NULL;
+    if (thread->wait_chan_entry != NULL) {
+        Queue_remove_atomic(thread->wait_chan_entry, (void *)thread);
+        ASSERT(thread->state == TCB_SLEEPING);
+        thread->wait_chan_entry = NULL;
+        TCB_Q_changeState(thread, TCB_RUNNABLE);
+    }
+    release(&thread->lock);
+}
+
+// 0 if woken up before the time_out, 1 otherwise (or no time_out)
 int thread_sched(void) {
     int intena;
     struct tcb *thread = thread_current();
@@ -124,41 +470,81 @@ int thread_sched(void) {
     intena = t_mycpu()->intena;
 
     // set timer for thread
-    int set_timer = thread->time_out; // !!!
+    int set_timer = thread->time_out != 0;
+    int timed_out = 1;
     struct timer_list timer;
-    timer.expires = 0;
-    timer.count = 1;                 // only once
-    if (set_timer != 0) {
-        INIT_LIST_HEAD(&timer.list); // bug!!!
-        add_timer_atomic(&timer, thread->time_out, thread_wakeup_atomic, (void *)thread);
+    timer.count = 1; // only once
+    if (set_timer) {
+        timer_list_init(&timer);
+        thread->sleep_timer = &timer;
+        add_timer_atomic(&timer, thread->time_out, thread_sleep_timeout, (void *)thread);
     }
 
     swtch(&thread->context, &t_mycpu()->context);
     t_mycpu()->intena = intena;
 
-    if (set_timer != 0) {
-        thread->time_out = 0; // bug !!!
-        delete_timer_atomic(&timer);
+    if (set_timer) {
+        thread->time_out = 0;
+        // cleared by thread_sleep_timeout if it woke us up
+        timed_out = thread->sleep_timer == NULL;
+        thread->sleep_timer = NULL;
+        // we hold thread->lock, which thread_sleep_timeout takes, so it
+        // can't be waited for. a call still to come sees sleep_timer
+        // of another sleep, or NULL, and does nothing
+        delete_timer_async(&timer);
+    }
+
+    return timed_out;
+}
+
+// any thread queued on some cpu, which this cpu can run or steal
+static int runq_has_work(void) {
+    for (int i = 0; i < NCPU; i++) {
+        if (READ_ONCE(t_cpus[i].rq.nr_running) > 0)
+            return 1;
     }
+    return 0;
+}
 
-    return timer.expires == 0; // if it is 0, is is reasonable
+// nothing to run : sleep on wfi until an interrupt, a timer or an IPI from
+// kick_cpu. the timer tick is already stopped since c->thread is NULL
+static void cpu_idle(struct thread_cpu *c) {
+    intr_off();
+    WRITE_ONCE(c->idle, 1);
+    // pairs with the barrier in kick_cpu
+    __sync_synchronize();
+    if (!runq_has_work()) {
+        c->idle_start = rdtime();
+        // a pending interrupt still ends wfi with interrupts off,
+        // it is taken by intr_on below
+        wfi();
+        c->idle_time += rdtime() - c->idle_start;
+    }
+    WRITE_ONCE(c->idle, 0);
+    intr_on();
 }
 
 void thread_scheduler(void) {
     struct tcb *t;
     struct thread_cpu *c = t_mycpu();
+    int id = cpuid();
 
     c->thread = 0;
     for (;;) {
         // Avoid deadlock by ensuring that devices can interrupt.
         intr_on();
-        t = (struct tcb *)Queue_provide_atomic(&runnable_t_q, 1); // remove it
-        if (t == NULL)
+        t = runq_pop(id); // remove it, real-time first, then the smallest vruntime
+        if (t == NULL && (t = runq_steal(id)) == NULL) {
+            cpu_idle(c);
             continue;
+        }
 
         acquire(&t->lock);
         t->state = TCB_RUNNING;
+        t->last_cpu = id;
+        t->exec_start = rdtime();
         c->thread = t;
+        timer_tick_resume();
         swtch(&c->context, &t->context);
         c->thread = 0;
         release(&t->lock);
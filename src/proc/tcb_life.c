@@ -7,10 +7,11 @@
 #include "lib/hash.h"
 #include "lib/queue.h"
 #include "lib/timer.h"
+#include "atomic/futex.h"
 #include "proc/options.h"
 #include "memory/vm.h"
 
-extern Queue_t unused_t_q, runnable_t_q, sleeping_t_q, zombie_t_q;
+extern Queue_t unused_t_q, sleeping_t_q, zombie_t_q;
 extern Queue_t *STATES[TCB_STATEMAX];
 extern struct hash_table tid_map;
 extern struct proc *initproc;
@@ -34,6 +35,8 @@ void tcb_init(void) {
         initlock(&t->lock, tcb_lock_name[i]); // init its spinlock
 
         t->state = TCB_UNUSED;
+        t->rq_cpu = -1;
+        t->last_cpu = -1;
         t->kstack = KSTACK((int)(t - thread));
         Queue_push_back(&unused_t_q, t);
     }
@@ -65,6 +68,10 @@ struct tcb *alloc_thread(thread_callback callback) {
     t->tid = alloc_tid;
     cnt_tid_inc;
 
+    // not scheduled yet
+    t->last_cpu = -1;
+    sched_fork(t, NULL);
+
     // signal
     t->sig_pending_cnt = 0;
     sig_empty_set(&t->blocked);
@@ -83,6 +90,11 @@ struct tcb *alloc_thread(thread_callback callback) {
 
     // timeout for timer
     t->time_out = 0;
+    t->sleep_timer = NULL;
+    t->futex_q = NULL;
+    memset(t->vmacache, 0, sizeof(t->vmacache));
+    t->vmacache_seq = 0;
+    t->nr_fd_held = 0;
 
     // for clone
     t->set_child_tid = 0;
@@ -95,11 +107,14 @@ void free_thread(struct tcb *t) {
     // free & unmap tramframe
     acquire(&t->p->mm->lock);
     if (t->trapframe)
-        uvmunmap(t->p->mm->pagetable, THREAD_TRAPFRAME(t->tidx), 1, 1, 1);
+        mm_unmap(t->p->mm, THREAD_TRAPFRAME(t->tidx), 1, 1, 1);
     else
-        uvmunmap(t->p->mm->pagetable, THREAD_TRAPFRAME(t->tidx), 1, 0, 1);
+        mm_unmap(t->p->mm, THREAD_TRAPFRAME(t->tidx), 1, 0, 1);
     release(&t->p->mm->lock);
 
+    // drops t->lock for a while
+    if (t->futex_q != NULL)
+        futex_exit(t);
     // bug!
     if (t->wait_chan_entry != NULL) {
         // Queue_remove_atomic(thread->wait_chan_entry, (void *)thread);
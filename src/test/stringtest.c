@@ -0,0 +1,140 @@
+#include "common.h"
+#include "lib/riscv.h"
+#include "memory/allocator.h"
+#include "debug.h"
+#include "test.h"
+
+// build with STRING_BENCH=1, run at boot after paging is on
+
+#define STR_TEST_SIZE 640
+#define STR_BENCH_MAX (64 * 1024)
+#define STR_BENCH_BYTES (8 * 1024 * 1024) // bytes moved per size class
+
+// byte by byte, the reference and the baseline
+static void ref_memmove(uchar *d, const uchar *s, uint n) {
+    volatile uchar *vd = d;
+    if (s < d && s + n > d) {
+        while (n-- > 0)
+            vd[n] = s[n];
+    } else {
+        for (uint i = 0; i < n; i++)
+            vd[i] = s[i];
+    }
+}
+
+static void ref_memset(uchar *d, int c, uint n) {
+    volatile uchar *vd = d;
+    for (uint i = 0; i < n; i++)
+        vd[i] = c;
+}
+
+static int ref_memcmp(const uchar *s1, const uchar *s2, uint n) {
+    for (uint i = 0; i < n; i++)
+        if (s1[i] != s2[i])
+            return s1[i] - s2[i];
+    return 0;
+}
+
+static uint64 rand_next = 1;
+static uint str_rand(void) {
+    rand_next = rand_next * 6364136223846793005UL + 1442695040888963407UL;
+    return rand_next >> 33;
+}
+
+static int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+// every alignment of dst and src, every length around the word and block sizes
+void string_test(void) {
+    uchar *a = kmalloc(STR_TEST_SIZE), *r = kmalloc(STR_TEST_SIZE), *b = kmalloc(STR_TEST_SIZE);
+    ASSERT(a && r && b);
+
+    for (int it = 0; it < 20000; it++) {
+        for (int i = 0; i < STR_TEST_SIZE; i++)
+            a[i] = r[i] = b[i] = str_rand();
+        uint d = str_rand() % 300, s = str_rand() % 300, n = str_rand() % 300;
+
+        switch (it % 3) {
+        case 0:
+            memmove(a + d, a + s, n);
+            ref_memmove(r + d, r + s, n);
+            break;
+        case 1:
+            memset(a + d, s, n);
+            ref_memset(r + d, s, n);
+            break;
+        case 2:
+            if (n > 0 && it % 2)
+                ref_memmove(b + s, a + d, n - 1);
+            if (sign(memcmp(a + d, b + s, n)) != sign(ref_memcmp(a + d, b + s, n)))
+                panic("string_test : memcmp\n");
+            break;
+        }
+        if (ref_memcmp(a, r, STR_TEST_SIZE) != 0) {
+            printf("string_test : case %d, d %d, s %d, n %d\n", it % 3, d, s, n);
+            panic("string_test : memmove or memset\n");
+        }
+    }
+
+    kfree(a);
+    kfree(r);
+    kfree(b);
+    Info("string test [ok]\n");
+}
+
+// bytes per 100 cycles, printf has no float
+static uint64 bench_rate(uint64 bytes, uint64 cycles) {
+    return cycles ? bytes * 100 / cycles : 0;
+}
+
+// bytes/cycle of every kernel per size class
+void string_bench(void) {
+    static const uint sizes[] = {16, 64, 256, 1024, 4096, 16384, STR_BENCH_MAX};
+    uchar *src = kmalloc(STR_BENCH_MAX + 64), *dst = kmalloc(STR_BENCH_MAX + 64);
+    ASSERT(src && dst);
+    memset(src, 0x5a, STR_BENCH_MAX + 64);
+    memset(dst, 0x5a, STR_BENCH_MAX + 64);
+
+    printf("string bench (bytes/cycle x100) :\n");
+    printf("%8s %8s %8s %8s %8s %8s\n", "size", "memset", "memcpy", "unalign", "memcmp", "bytecpy");
+    for (int i = 0; i < NELEM(sizes); i++) {
+        uint n = sizes[i];
+        uint iters = STR_BENCH_BYTES / n;
+        uint64 t0, c[5];
+
+        t0 = rdcycle();
+        for (uint k = 0; k < iters; k++)
+            memset(dst, k, n);
+        c[0] = rdcycle() - t0;
+
+        t0 = rdcycle();
+        for (uint k = 0; k < iters; k++)
+            memmove(dst, src, n);
+        c[1] = rdcycle() - t0;
+
+        t0 = rdcycle();
+        for (uint k = 0; k < iters; k++)
+            memmove(dst + 1, src + 3, n);
+        c[2] = rdcycle() - t0;
+
+        memmove(dst, src, STR_BENCH_MAX + 64);
+        t0 = rdcycle();
+        for (uint k = 0; k < iters; k++)
+            if (memcmp(dst + 64, src + 64, n - 1) != 0)
+                panic("string_bench : memcmp\n");
+        c[3] = rdcycle() - t0;
+
+        t0 = rdcycle();
+        for (uint k = 0; k < iters; k++)
+            ref_memmove(dst, src, n);
+        c[4] = rdcycle() - t0;
+
+        uint64 bytes = (uint64)iters * n;
+        printf("%8d %8ld %8ld %8ld %8ld %8ld\n", n, bench_rate(bytes, c[0]), bench_rate(bytes, c[1]),
+               bench_rate(bytes, c[2]), bench_rate(bytes, c[3]), bench_rate(bytes, c[4]));
+    }
+
+    kfree(src);
+    kfree(dst);
+}